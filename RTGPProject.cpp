@@ -1,5 +1,8 @@
 // Std. Includes
 #include <string>
+#include <future>
+#include <mutex>
+#include <random>
 
 #ifdef _WIN32
     #define APIENTRY __stdcall
@@ -20,6 +23,26 @@
 // classes developed during lab lectures to manage shaders and to load models
 #include <utils/shader.h>
 #include <utils/model.h>
+#include <utils/instancing.h>
+#include <utils/ringbuffer.h>
+#include <utils/geometrybuffer.h>
+#include <utils/scene.h>
+#include <utils/culling.h>
+#include <utils/occlusion.h>
+#include <utils/framegraph.h>
+#include <utils/jobsystem.h>
+#include <utils/views.h>
+#include <utils/simulation.h>
+#include <utils/framepacing.h>
+#include <utils/shadowcube.h>
+#include <utils/shadowcache.h>
+#include <utils/shadowpool.h>
+#include <utils/momentshadows.h>
+#include <utils/clusters.h>
+#include <utils/gputimer.h>
+#include <utils/brdflut.h>
+#include <utils/noisetextures.h>
+#include <utils/aobaker.h>
 
 // we load the GLM classes used in the application
 #include <glm/glm.hpp>
@@ -46,8 +69,15 @@ const GLuint SHADOW_WIDTH = 1024, SHADOW_HEIGHT = 1024;
 // callback functions for keyboard events
 void key_callback(GLFWwindow* window, int key, int scancode, int action, int mode);
 
-// function to move the camera by pressing w,a,s,d
-void Do_Movement();
+// state of the simulation (camera, light and content of the portals), and the input it receives from the GL thread
+struct SimulationState;
+struct SimulationInput;
+
+// function to move the camera by pressing w,a,s,d (step is the length of a simulation step, in seconds)
+void Do_Movement(SimulationState& state, const SimulationInput& input, GLfloat step);
+
+// one fixed step of the simulation thread: it updates the state and it publishes a snapshot for the GL thread
+void SimulationStep(double time);
 
 // here we do camera tilting, as well as saving mouse position that gets drawn in the paint texture
 void mouse_callback(GLFWwindow* window, double xPos, double yPos);
@@ -61,27 +91,94 @@ GLuint SetupPortal();
 // Function for rendering Objects
 void RenderObjects(Shader &mainShader, GLint shaderIndex, GLint modelType, int render_pass);
 
+// we select the material of the next draws: the subroutine, or (when filling the G-buffer) its stencil ID
+void UseMaterial(Shader &program, GLint shaderIndex, int render_pass);
+
+// stencil value of a material in a view of the G-buffer
+GLint StencilID(GLint shaderIndex, GLint view);
+
+// we bind the shadow maps (and the moments) of a model, for the shaders which run the subroutines
+void BindShadowMaps(Shader &program, GLint modelType);
+
+// we clear the faces in the mask of the cubemap in a slot of the shadow pool (the other slots of the array belong to other shadows)
+void ClearShadowFaces(const ShadowSlot& slot, GLuint faces);
+
+// we render the shadow casters only in the faces of the shadow cubemap they overlap (without the geometry shader).
+// Only the faces in the mask are rendered, the other ones keep their content
+// The casters are the model (if modelType is not -1) and the cylinders
+void RenderShadowCasters(Shader &shadowShader, GLint modelType, const vector<GLuint>& cylinders, const ShadowSlot& slot, GLuint faces);
+
+// size on the screen (pixels) of the shadow of a model: the diameter of the bounding sphere of the model,
+// reduced if the model is outside of the view frustum (it is seen only through the portals, or not at all)
+GLfloat ShadowImportance(GLint modelType, int viewportHeight);
+
 // Function dealing with the Rendering of the 4 Portals
 void PortalRenderLoop(Shader &mainShader,GLint shaderIndex[], GLint modelType[], GLuint VAO, std::vector<GLuint> shortestIndices, int render_pass);
 
 // manage the Shader and Modelindices that gets rendering in each Portal
-void ManagePortalContent(GLint &currentProgramBackLeft, GLint &currentProgramFrontRight, GLint &currentModelBackLeft, GLint &currentModelFrontRight);
+void ManagePortalContent(SimulationState& state);
 
 // print on console the name of current shader
 void PrintCurrentShader(int shader);
 void PrintCurrentModel(int model);
 
 // set the Shader for Model rendered inside the Portals
-void setInsideShader(GLuint rightFrontShader, GLuint leftBackShader, GLint &currentProgramInside, GLint &currentModelInside, GLint &currentModelFrontRight, GLint &currentModelBackLeft);
+void setInsideShader(SimulationState& state);
+
+// setup VAO for the paint strokes (their vertices are written in the dynamic ring buffer)
+GLuint SetupLines();
 
-// Function for creating VAO and VBO in order to draw a point
+// Function for drawing the paint strokes
 void drawLines(GLuint framebuffer);
 
+// we sample the mouse position right before the paint strokes are submitted, and we add it to the stroke
+void LatchMousePosition(GLFWwindow* window);
+
 // calculate the nearest two portals
 std::vector<GLuint> nearestPortals(glm::vec3 cameraPos);
 
 // we load the textures and them up as opengl textures
 GLint LoadTexture(const char* path);
+
+// we load several textures in the layers of a single texture array (all the layers are resampled to size x size)
+GLuint LoadTextureArray(const std::vector<std::string>& paths, GLsizei size);
+
+// we load the scene description, and we find the objects rendered by RenderObjects and PortalRenderLoop
+bool SetupScene(const char* path);
+
+// we set up the instance buffers for the enviroment geometry which is rendered many times in each view (floors, walls, ceiling and pillars)
+void SetupEnvironmentInstances();
+
+// true if the object is visible in the view currently rendered (always true if the view is not culled)
+bool IsObjectVisible(GLint object);
+
+// we build (or load from the cache) the triangle BVHs of all the models, in parallel
+void BuildModelBVHs();
+
+// we bake (or load from the caches next to the models) the ambient occlusion of the vertices of all the models, on the worker threads
+void BakeModelOcclusion();
+
+// we start the jobs which prepare the inside view and the views through the given portals (culling, LOD selection, sort keys, matrix gathering)
+void PrepareViews(const std::vector<GLuint>& portals, int viewportHeight);
+
+// we measure the time to prepare many views of a bigger scene, with 0, 1, ... worker threads
+void BenchmarkViewPreparation();
+
+// closest object under the mouse (in NDC), among the ones shown in the inside view
+RayHit PickObject(float x, float y, GLint modelInside);
+
+// we move the point lights of the clustered shading (generated again if their number changed)
+void UpdatePointLights(int count, float time);
+
+// one frame of the benchmark of the clustered lights: the assignment and render times of the frame are accumulated,
+// and after enough frames we move to the next number of lights
+void StepLightBenchmark();
+
+// we move the render scale of the dynamic resolution by one step, if the GPU time of the scene is far from the target
+void UpdateRenderScale();
+
+// index-th element (from 1) of the Halton sequence in base, in [0, 1)
+float Halton(GLuint index, GLuint base);
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 /////////////////////////////SOME GLOBAL VARIABLES///////////////////////////////////////////////////////////////////////
@@ -103,9 +200,12 @@ GLboolean spinning = GL_TRUE;
 GLboolean wireframe = GL_FALSE;
 
 // the different Render passes
-enum render_passes{ SHADOWMAP, RENDER, BAKE};
+enum render_passes{ SHADOWMAP, RENDER, BAKE, GBUFFER};
 
+// the layers of the enviroment texture array
 enum textureIDs {WOOD, MARPLE, WALL, CONCRETE};
+// size of each layer of the enviroment texture array
+const GLsizei ENV_TEXTURE_SIZE = 1024;
 
 // enum data structure to manage indices for shaders swapping
 enum available_ShaderPrograms{LambertianPlusShadow, PhongPlusShadow, BlinnPhongPlusShadow, GGXPlusShadow, AnimatedCellsPlusGGX, AnimatedColorsPlusGGX, StripesSmoothstepPlusGGX, CirclesSmoothstepPlusGGX, FULLCOLOR, Bloom, Texture };
@@ -125,7 +225,248 @@ const char * print_availabe_Models[] = {"Bunny", "Cube", "Sphere"};
 vector<std::string> shader;
 vector<Model> models;
 vector<Model> envModels;
-vector<GLint> textureId;
+// texture array with the textures of the enviroment (one layer for each textureIDs)
+GLuint environmentTextures;
+// per-instance data of the floors, walls and ceiling (all rendered with envModels[Plane]) and of the pillars (envModels[Cylinder])
+InstanceBuffer planeInstances;
+InstanceBuffer pillarInstances;
+
+// placement of all the objects, with the world and normal matrices computed once per frame
+Scene scene;
+// scene objects of the models (one for each availabe_Models), of the lightbulb and its cord, and of the 4 portals
+GLint modelObjects[NumModel];
+GLint lightbulbObject, lightCordObject;
+GLint portalObjects[4];
+// objects which follow the light, and their offset from the light position
+vector<GLuint> lightObjects;
+vector<glm::vec3> lightOffsets;
+// scene objects in planeInstances and pillarInstances (in the same order)
+vector<GLuint> planeObjects;
+vector<GLuint> pillarObjects;
+
+// frustum culling: the prepared inside view, the prepared view through each portal,
+// and the view used by RenderObjects (NULL if the current view is not culled, e.g. in the shadow and bake passes)
+bool useCulling = true;
+Frustum viewFrustum;
+PreparedView insideView;
+PreparedView portalViews[4];
+const PreparedView* activeView = NULL;
+// statistics of the last frame for the main view and for each portal (a portal outside the main view is skipped)
+CullStats insideCullStats;
+CullStats portalCullStats[4];
+bool portalSkipped[4];
+// instances of an instanced group, gathered for the draw list in the views which are not prepared (shadow pass)
+vector<InstanceData> visibleInstances;
+
+// the views are prepared by jobs on the worker threads, while the GL thread renders the shadow maps
+JobSystem jobSystem;
+JobCounter viewJobs;
+int workerThreads = 0;
+// the objects drawn with an instanced draw in each view: the planes (floors, walls and ceiling) and the cylinders (pillars and cord of the lightbulb)
+enum instanceGroupIDs { PLANE_GROUP, CYLINDER_GROUP };
+vector<vector<GLuint>> instanceGroups;
+// LOD selection: the objects smaller than this on the screen (in pixels) are not drawn
+float minObjectPixels = 1.0f;
+// result of the last benchmark of the view preparation: milliseconds per frame with 0, 1, 2, ... workers
+vector<float> viewBenchmark;
+
+// BVH over the objects of the scene (refitted when objects move), and the triangle BVH of the model of each object (NULL if it has no model)
+SceneBVH sceneBVH;
+vector<const TriangleBVH*> objectBVHs;
+bool useBVHCulling = false;
+// object under the brush in draw Mode
+RayHit brushHit;
+
+// occlusion queries of the portal quads: the content of a portal is not rendered if no sample of its quad passed,
+// using conditional rendering (result of this frame, the GPU skips the draws) or the result of the last frame (the CPU skips them)
+enum occlusionModes { OCCLUSION_OFF, OCCLUSION_CONDITIONAL, OCCLUSION_LAST_FRAME };
+const char * print_occlusionModes[] = { "Off", "Conditional rendering", "Last frame result" };
+int occlusionMode = OCCLUSION_CONDITIONAL;
+OcclusionQueries portalQueries;
+// portals whose content was skipped in the last frame because of the query of the previous frame
+bool portalOccluded[4];
+
+// ring buffer for the dynamic data of each frame (vertices of the paint strokes, per-draw data and commands of the draw lists)
+RingBuffer dynamicBuffer;
+const GLsizeiptr DYNAMIC_BUFFER_SIZE = 1 << 20;
+// VAO of the paint strokes
+GLuint linesVAO;
+
+// unified geometry buffer with all the models, and the draw list used to submit whole passes with a single multi-draw indirect
+GeometryBuffer geometryBuffer;
+IndirectDrawList drawList;
+// if false, every model is rendered with its own draw call (or instanced draw)
+bool useIndirectDraws = true;
+
+// how the shadow casters reach the faces of the cubemaps: emitted in all six faces by the geometry shader,
+// rendered with one submission for each face they overlap, or with one submission for all the faces (gl_Layer from the vertex shader)
+enum shadowModes { SHADOW_GEOMETRY_SHADER, SHADOW_PER_FACE, SHADOW_VERTEX_LAYER };
+const char* print_shadowModes[] = { "Geometry shader (all faces)", "Per-face draws", "Layered (gl_Layer from the vertex shader)" };
+int shadowMode = SHADOW_PER_FACE;
+// faces overlapped by each object, and the framebuffer where we attach one face at a time
+ShadowCubeCuller shadowCuller;
+GLuint shadowFaceFBO;
+// per-draw data of the casters of a face (or of all the faces, in the layered mode)
+vector<InstanceData> shadowModelFaces;
+vector<InstanceData> shadowCylinderFaces;
+
+// the shadow cubemaps (one for each model) are slots of the shadow pool, with a resolution chosen by their size on the screen:
+// the tiers are imported in the frame graph in every frame, and a cubemap is rendered again only in the faces where the light,
+// a caster or its slot changed
+ShadowPool shadowPool;
+// slots of each tier (256, 512, 1024 and 2048 pixels): at most about 190 MB, if all the tiers are used
+const GLuint shadowTierCapacities[ShadowPool::NUM_TIERS] = {4, 4, 2, 1};
+ShadowSlot shadowSlots[NumModel];
+GLuint shadowResources[NumModel];
+ShadowCache shadowCache;
+bool useShadowCache = true;
+
+// the static casters (the pillars) can be rendered in a separate map, shared by all the models (key STATIC_SHADOW in the pool and in the cache):
+// it is rendered again only when the light moves, and the main shader combines it with the map of the model with min()
+bool useStaticShadows = true;
+const GLuint STATIC_SHADOW = NumModel;
+ShadowSlot staticShadowSlot;
+GLuint staticShadowResource;
+const GLuint STATIC_SHADOW_UNIT = 8, STATIC_SHADOW_COMPARE_UNIT = 9;
+
+// filtering of the shadows in the main shader (see Shadow() in fragmentShader.frag), chosen separately for the inside view
+// and for the views through the portals, which cover less of the screen and can use a cheaper filter
+enum shadowFilters { SHADOW_HARD, SHADOW_PCF, SHADOW_PCF_GRID, SHADOW_PCF_POISSON, SHADOW_VSM };
+const char* print_shadowFilters[] = { "Hard (1 tap)", "Hardware PCF (1 tap)", "Rotated grid (4 taps)", "Poisson disk + blocker search (16 taps)",
+                                      "Variance shadow map (1 filtered tap)" };
+int shadowFilterInside = SHADOW_PCF_POISSON;
+int shadowFilterPortals = SHADOW_VSM;
+// the variance shadow maps: moments of the distance of each model (cube i for the model i), blurred and mipmapped.
+// They are computed again only when the depth cubemaps they come from have been rendered
+MomentShadowMaps momentMaps;
+const GLsizei MOMENT_MAP_SIZE = 256;
+const GLuint MOMENT_MAP_UNIT = 10;
+GLuint momentResource;
+GLint momentBlurRadius = 3;
+GLfloat lightBleeding = 0.2f;
+// radius of the light (world units) for the size of the penumbra
+GLfloat lightSize = 0.3f;
+// the shadow cubemaps are sampled also with this sampler object, which compares the depth in hardware, on its own texture unit
+GLuint shadowCompareSampler;
+const GLuint SHADOW_COMPARE_UNIT = 7;
+// casters of the cubemap of each model (the model, and the cylinders which are not in the static map) and of the static map
+vector<GLint> shadowCasters[NumModel + 1];
+// position of the light used for the last shadowTransforms
+glm::vec3 shadowTransformsLight = glm::vec3(-1.0f);
+
+// clustered forward shading: the point lights of the room are assigned to the clusters of the view by jobs on the worker threads
+// (with the view preparation, while the GL thread renders the shadow maps). The views through the portals use the camera
+// and the projection of the inside view, so one grid serves all of them
+ClusteredLights clusteredLights;
+// the three texture buffers of the clusters use this unit and the next two
+const GLuint CLUSTER_UNIT = 11;
+// far plane of the grid: the room is 28 units wide, and farther depths go in the last slice
+const GLfloat CLUSTER_FAR = 40.0f;
+const int pointLightCounts[] = { 0, 1, 64, 256, 1024 };
+const char* print_pointLightCounts[] = { "Off", "1", "64", "256", "1024" };
+int pointLightSetting = 0;
+// orbit of each point light around the center of the room: radius, phase, height, angular speed
+vector<glm::vec4> pointLightOrbits;
+// GPU time of the render pass (and of the deferred resolve). It starts after the waits on the CPU for the views and the clusters,
+// so the dynamic resolution does not lower the scale when the frame is bound by the CPU
+GPUTimer renderTimer;
+// benchmark of the clustered lights with 1, 64, 256 and 1024 lights: current step (index in pointLightCounts, -1 if not running),
+// frames of the step, and accumulated times
+int lightBenchmarkStep = -1;
+int lightBenchmarkFrames = 0;
+double lightBenchmarkAssign = 0.0, lightBenchmarkRender = 0.0;
+// milliseconds per frame of the assignment and of the render pass, for each number of lights
+struct LightBenchmarkResult {
+    int lights;
+    float assignTime;
+    float renderTime;
+};
+vector<LightBenchmarkResult> lightBenchmark;
+
+// deferred shading: the render pass only fills a G-buffer, and the lighting (the subroutines) runs once for each pixel in a resolve pass,
+// instead of once for each fragment of each portal. The stencil of the G-buffer keeps the material (subroutine + 1) of each pixel
+// in the high bits and the view (0 inside, i + 1 for portal i) in the low bits: the resolve draws a full screen triangle
+// for each material of each view, and the stencil test keeps only its pixels
+bool useDeferred = false;
+const GLuint STENCIL_VIEW_BITS = 3;
+const GLuint STENCIL_VIEW_MASK = (1 << STENCIL_VIEW_BITS) - 1;
+// view of the draws which fill the G-buffer
+GLint gbufferView = 0;
+// the three textures of the G-buffer use this unit and the next two
+const GLuint GBUFFER_UNIT = 14;
+// VAO of the full screen triangle of the resolve and of the post processing
+GLuint fullscreenVAO;
+
+// the scene is rendered in a RGBA16F target: the bloom chain and the tonemapping write the backbuffer.
+// The bloom is a chain of BLOOM_LEVELS textures, each one half the size of the one above, downsampled from the HDR image
+// and then upsampled back (each level is added to the one above, so the tonemapping divides the sum by BLOOM_LEVELS).
+// There is no threshold: the bloom replaces a fraction (bloomStrength) of the image, so only the very bright pixels
+// (e.g. the emissive light) bleed visibly
+bool useBloom = true;
+const GLuint BLOOM_LEVELS = 6;
+float bloomStrength = 0.24f;
+// radius of the upsampling tent, in texels of the smaller level
+float bloomRadius = 1.0f;
+float exposure = 1.0f;
+// radiance of the Bloom subroutine (the light source), much higher than the one of the lit surfaces
+float emission = 20.0f;
+enum tonemappers { TONEMAP_CLAMP, TONEMAP_REINHARD, TONEMAP_ACES };
+const char* print_tonemappers[] = { "Clamp", "Reinhard", "ACES" };
+int tonemapper = TONEMAP_ACES;
+// GPU time of the bloom chain and of the tonemapping (and of the temporal upsampling)
+GPUTimer postTimer;
+
+// dynamic resolution: the scene (render pass, G-buffer and resolve) is rendered at renderScale of the size of the window.
+// With useDynamicResolution the scale follows the GPU time of the scene: the render pass, whose cost is proportional
+// to the number of pixels, and the post processing, at the window resolution, should fit in targetFrameTime.
+// The scale moves by RENDER_SCALE_STEP at most once every RENDER_SCALE_INTERVAL frames: each step reallocates the textures of the scene,
+// and the GPU timers need a few frames to measure the new cost
+bool useDynamicResolution = false;
+float renderScale = 1.0f;
+float targetFrameTime = 16.6f;
+const float MIN_RENDER_SCALE = 0.5f;
+const float RENDER_SCALE_STEP = 0.05f;
+const int RENDER_SCALE_INTERVAL = 15;
+int framesSinceScaleChange = 0;
+// temporal upsampling: the projection is moved by a different sub-pixel jitter in each frame (TEMPORAL_PHASES points of the
+// Halton sequence), and temporal.frag accumulates the samples of the frames in a history at the window resolution,
+// reprojected with the motion of the camera. The two histories are persistent textures, written in turns
+bool useTemporalUpsampling = true;
+const GLuint TEMPORAL_PHASES = 16;
+float temporalBlend = 0.1f;
+GLuint historyResources[2];
+GLuint historyIndex = 0;
+GLuint temporalFrame = 0;
+// the history is not valid in the first frame, after a resize (its texture is reallocated) and after a frame without upsampling
+bool historyValid = false;
+int historyWidth = 0, historyHeight = 0;
+
+// the specular terms of Phong, Blinn-Phong and GGX precomputed in lookup tables at startup (on the worker threads, or loaded from the cache).
+// The shader reads them, or it evaluates the analytic functions, or it shows the difference between the two
+BRDFLookupTables brdfTables;
+const char* BRDF_CACHE_PATH = "textures/brdf.lut";
+// the two tables use this unit and the next one
+const GLuint BRDF_LUT_UNIT = 17;
+enum brdfModes { BRDF_ANALYTIC, BRDF_TABLES, BRDF_DIFFERENCE };
+const char* print_brdfModes[] = { "Analytic", "Lookup tables", "Difference (x10)" };
+int brdfMode = BRDF_ANALYTIC;
+
+// the Voronoi patterns of AnimatedCellsPlusGGX and AnimatedColorsPlusGGX baked at startup (on the worker threads)
+// in a tileable 3D texture over one period of the animation: the shader can read them instead of running the cell search
+NoiseTextures noiseTextures;
+const GLuint NOISE_UNIT = 19;
+bool useBakedNoise = false;
+
+// the ambient occlusion of the vertices of the models, of the room and of the lightbulb, baked offline with rays against their BVHs
+// (see include/utils/aobaker.h), and how much it darkens the ambient light
+OcclusionBaker occlusionBaker;
+float occlusionStrength = 1.0f;
+
+// frame graph with the passes of each frame (shadow maps, main rendering, paint strokes, baking):
+// it culls the passes whose results are not needed, and it manages their textures and framebuffers
+FrameGraph frameGraph;
+// persistent resources of the graph: the paint strokes (in screen coordinates) and the texture where they are baked (in UV coordinates)
+GLuint paintResource, bakeResource;
 // Uniforms to pass to shaders
 // color to be passed to Fullcolor and Flatten shaders
 GLfloat myColor[] = {1.0f,0.0f,0.0f};
@@ -140,10 +481,11 @@ bool keys[1024] = {0};
 
 // position of the Light
 glm::vec3 lightPos = glm::vec3(0.0f,6.0f,4.0f);
+// height of the Light, set in the ImGui window and sent to the simulation
+GLfloat lightHeight = 6.0f;
 
 // initialise the camera 
 glm::vec3 cameraPos;
-glm::vec3 lastCameraPos;
 glm::vec3 cameraView;
 glm::vec3 cameraRight;
 glm::vec3 cameraUp;
@@ -153,7 +495,11 @@ float verticalAngle;
 
 
 // Projection matrix: FOV angle, aspect ratio, near and far planes
-glm::mat4 projection = glm::perspective(45.0f, (float)screenWidth/(float)screenHeight, 0.1f, 10000.0f);
+glm::mat4 cameraProjection = glm::perspective(45.0f, (float)screenWidth/(float)screenHeight, 0.1f, 10000.0f);
+// the projection used by the draws of the frame: the one of the camera, with the jitter of the temporal upsampling
+glm::mat4 projection = cameraProjection;
+// the view-projection (without jitter) of the last frame, for the motion vectors of the temporal upsampling
+glm::mat4 previousViewProjection;
 // Orthogonal Projection: we use this in baking Shader to get UV coordinates in screencoords
 glm::mat4 OrthoProj = glm::ortho(0,1,0,1,-1,1);
 
@@ -173,7 +519,6 @@ std::vector<float> mouseHist;
 GLint numMousePoints;
 
 //initialise unsigned ints for the different Textures we use
-GLuint depthCubemap[3];
 GLuint bakeTexture;
 GLuint paintTexture;
 GLuint bakeDepthMap;
@@ -191,6 +536,61 @@ GLfloat power = 2.5;
 // number of harmonics (used in the turbulence-based subroutine)
 GLfloat harmonics = 1.0;
 GLfloat timer;
+
+// statistics of the OpenGL state cache in the last frame
+GLuint lastIssuedGLCalls = 0;
+GLuint lastElidedGLCalls = 0;
+
+/////////////////// SIMULATION ///////////////////////
+// the camera, the light and the content of the portals are updated by a thread with a fixed timestep,
+// independently from the frame rate. The GL thread interpolates between the last two steps, published in a snapshot
+const double SIMULATION_RATE = 60.0;
+// radians per pixel of mouse movement (the camera used to turn by 0.1 * deltaTime per pixel, at about 60 frames per second)
+const GLfloat MOUSE_SENSITIVITY = 0.1f / 60.0f;
+
+struct SimulationState {
+    glm::vec3 cameraPos;
+    glm::vec3 lastCameraPos;
+    float horizontalAngle;
+    float verticalAngle;
+    glm::vec3 lightPos;
+    GLint programFrontRight, programBackLeft, programInside;
+    GLint modelFrontRight, modelBackLeft, modelInside;
+};
+
+// the input of the simulation, written by the callbacks on the GL thread (which is the only one allowed to poll the events)
+struct SimulationInput {
+    bool forward = false, left = false, back = false, right = false;
+    bool drawMode = false;
+    bool spinning = true;
+    GLfloat spinspeed = 0.5f;
+    GLfloat lightHeight = 6.0f;
+    // mouse movement (in pixels) accumulated since the last step
+    glm::vec2 mouseDelta = glm::vec2(0.0f);
+};
+
+// the state of the last two steps, and the time of the last one
+struct SimulationSnapshot {
+    SimulationState previous;
+    SimulationState current;
+    double time = 0.0;
+};
+
+FixedTimestepThread simulationThread;
+TripleBuffer<SimulationSnapshot> simulationSnapshots;
+// owned by the simulation thread
+SimulationState simulationState;
+// written by the GL thread, read (and the mouse movement consumed) by the simulation thread
+SimulationInput simulationInput;
+std::mutex simulationInputMutex;
+// interpolation factor between the two states of the snapshot used in the last frame
+float simulationAlpha = 0.0f;
+
+// swap interval, frame rate cap and input latency measurement
+FramePacer framePacer;
+const char* print_swapModes[] = { "Off (immediate)", "Vsync", "Adaptive vsync", "Vsync, half rate" };
+// if true, the mouse position is sampled again right before the paint strokes are drawn
+bool lateLatchMouse = true;
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 
@@ -205,7 +605,7 @@ int main()
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
     glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
     // we set if the window is resizable
-    glfwWindowHint(GLFW_RESIZABLE, GL_FALSE);
+    glfwWindowHint(GLFW_RESIZABLE, GL_TRUE);
 
     // we create the application's window
     GLFWwindow* window = glfwCreateWindow(screenWidth, screenHeight, "RTGPProject", nullptr, nullptr);
@@ -233,6 +633,13 @@ int main()
         return -1;
     }
 
+    // we initialize the OpenGL state cache (it checks if direct state access is available)
+    GLState().Init((GLADloadproc) glfwGetProcAddress);
+
+    // we present the frames with vsync (the swap interval can be changed in the ImGui window)
+    framePacer.Init(FramePacer::SWAP_VSYNC);
+    cout << "Adaptive vsync: " << (framePacer.adaptiveSupported ? "available" : "not available, vsync is used instead") << endl;
+
     // we define the viewport dimensions
     int width, height;
     glfwGetFramebufferSize(window, &width, &height);
@@ -247,10 +654,10 @@ int main()
     ImGui_ImplOpenGL3_Init("#version 410");
 
     // we enable Z test
-    glEnable(GL_DEPTH_TEST);
+    GLState().Enable(GL_DEPTH_TEST);
 
     // we enable face culling, so we dont see the backside of the portals
-    glEnable(GL_CULL_FACE);
+    GLState().Enable(GL_CULL_FACE);
 
     //the "clear" color for the frame buffer
     glClearColor(0.05f, 0.05f, 0.05f, 1.0f);
@@ -258,8 +665,21 @@ int main()
     // we create the Shader Programs used in the application
     Shader mainShader("shaders/vertexShader.vert", "shaders/fragmentSHader.frag");
     Shader shadowShader("shaders/shadowmap.vert", "shaders/shadowmap.frag", "shaders/shadow.geo");
+    Shader shadowFaceShader("shaders/shadowface.vert", "shaders/shadowmap.frag");
+    // the two passes of the moment shadow maps (conversion with the horizontal blur, vertical blur)
+    Shader momentShader("shaders/fullscreen.vert", "shaders/shadowmoments.frag");
+    Shader momentBlurShader("shaders/fullscreen.vert", "shaders/momentblur.frag");
     Shader drawingShader("shaders/Drawing.vert", "shaders/Drawing.frag");
     Shader bakeShader("shaders/bakeShader.vert", "shaders/bakeShader.frag");
+    // the two versions of the main shader for deferred shading (see fragmentShader.frag)
+    Shader gbufferShader("shaders/vertexShader.vert", "shaders/fragmentShader.frag", NULL, "#define GBUFFER\n");
+    Shader deferredShader("shaders/fullscreen.vert", "shaders/fragmentShader.frag", NULL, "#define DEFERRED_RESOLVE\n");
+    // the post processing: the two steps of the bloom chain, and the tonemapping
+    Shader bloomDownShader("shaders/fullscreen.vert", "shaders/bloomdown.frag");
+    Shader bloomUpShader("shaders/fullscreen.vert", "shaders/bloomup.frag");
+    Shader tonemapShader("shaders/fullscreen.vert", "shaders/tonemap.frag");
+    // the temporal upsampling of the dynamic resolution
+    Shader temporalShader("shaders/fullscreen.vert", "shaders/temporal.frag");
     SetupShaders(mainShader.Program);
 
     // we load the model(s) (code of Model class is in include/utils/model.h)
@@ -281,15 +701,114 @@ int main()
     envModels.push_back(std::move(roomModel));
     envModels.push_back(std::move(lightbulbModel));
 
-    textureId.push_back(LoadTexture("textures/darkWood.png"));
-    textureId.push_back(LoadTexture("textures/marple.jpg"));
-    textureId.push_back(LoadTexture("textures/brickWall.jpg"));
-    textureId.push_back(LoadTexture("textures/crackedConcrete.png"));
+    // the worker threads of the view preparation and of the baking at startup
+    workerThreads = JobSystem::DefaultWorkerCount();
+    jobSystem.SetWorkerCount(workerThreads);
+
+    // we build the triangle BVHs of the models, for the ray queries, and we bake the occlusion of the vertices with them
+    BuildModelBVHs();
+    BakeModelOcclusion();
+
+    // the order of the textures must follow the textureIDs enum (the scene file refers to the layers by number)
+    environmentTextures = LoadTextureArray({"textures/darkWood.png", "textures/marple.jpg", "textures/brickWall.jpg", "textures/crackedConcrete.png"}, ENV_TEXTURE_SIZE);
+
+    // we load the placement of the objects
+    if (!SetupScene("scenes/room.scene"))
+    {
+        glfwTerminate();
+        return -1;
+    }
+
+    // we set up the instance buffers of the repeated enviroment geometry
+    SetupEnvironmentInstances();
+
+    // we create the ring buffer for the dynamic data (DYNAMIC_BUFFER_SIZE bytes for each frame)
+    dynamicBuffer.Init(DYNAMIC_BUFFER_SIZE);
+
+    // we copy all the models in the unified geometry buffer
+    for (GLuint i = 0; i < models.size(); i++)
+        geometryBuffer.Add(models[i]);
+    for (GLuint i = 0; i < envModels.size(); i++)
+        geometryBuffer.Add(envModels[i]);
+    geometryBuffer.Build(dynamicBuffer);
+    // the VAOs without the baked occlusion (e.g. the portals) read this value of the attribute: not occluded
+    glVertexAttrib1f(OCCLUSION_ATTRIB_LOCATION, 1.0f);
+
+    // we set up the VAO of the paint strokes
+    linesVAO = SetupLines();
 
 
     // we set up the Portalmesh
     GLuint PortalVAO = SetupPortal();
 
+    // one occlusion query for each portal
+    portalQueries.Init(4);
+
+    // the comparison sampler of the shadow cubemaps: with linear filtering, each tap compares and blends the 2x2 texels around it
+    glGenSamplers(1, &shadowCompareSampler);
+    glSamplerParameteri(shadowCompareSampler, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+    glSamplerParameteri(shadowCompareSampler, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+    glSamplerParameteri(shadowCompareSampler, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glSamplerParameteri(shadowCompareSampler, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glSamplerParameteri(shadowCompareSampler, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glSamplerParameteri(shadowCompareSampler, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glSamplerParameteri(shadowCompareSampler, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    // a shadow sampler and a normal sampler must never refer to the same unit, not even before the first frame
+    mainShader.Use();
+    glUniform1i(glGetUniformLocation(mainShader.Program, "shadowMapCompare"), SHADOW_COMPARE_UNIT);
+    glUniform1i(glGetUniformLocation(mainShader.Program, "staticShadowMap"), STATIC_SHADOW_UNIT);
+    glUniform1i(glGetUniformLocation(mainShader.Program, "staticShadowMapCompare"), STATIC_SHADOW_COMPARE_UNIT);
+    glUniform1i(glGetUniformLocation(mainShader.Program, "momentMap"), MOMENT_MAP_UNIT);
+    glUniform1i(glGetUniformLocation(mainShader.Program, "clusterLights"), CLUSTER_UNIT);
+    glUniform1i(glGetUniformLocation(mainShader.Program, "clusterTable"), CLUSTER_UNIT + 1);
+    glUniform1i(glGetUniformLocation(mainShader.Program, "clusterIndices"), CLUSTER_UNIT + 2);
+    glUniform1i(glGetUniformLocation(mainShader.Program, "brdfLobe"), BRDF_LUT_UNIT);
+    glUniform1i(glGetUniformLocation(mainShader.Program, "brdfGeometry"), BRDF_LUT_UNIT + 1);
+    glUniform1i(glGetUniformLocation(mainShader.Program, "noiseTexture"), NOISE_UNIT);
+    deferredShader.Use();
+    glUniform1i(glGetUniformLocation(deferredShader.Program, "shadowMapCompare"), SHADOW_COMPARE_UNIT);
+    glUniform1i(glGetUniformLocation(deferredShader.Program, "staticShadowMap"), STATIC_SHADOW_UNIT);
+    glUniform1i(glGetUniformLocation(deferredShader.Program, "staticShadowMapCompare"), STATIC_SHADOW_COMPARE_UNIT);
+    glUniform1i(glGetUniformLocation(deferredShader.Program, "momentMap"), MOMENT_MAP_UNIT);
+    glUniform1i(glGetUniformLocation(deferredShader.Program, "clusterLights"), CLUSTER_UNIT);
+    glUniform1i(glGetUniformLocation(deferredShader.Program, "clusterTable"), CLUSTER_UNIT + 1);
+    glUniform1i(glGetUniformLocation(deferredShader.Program, "clusterIndices"), CLUSTER_UNIT + 2);
+    glUniform1i(glGetUniformLocation(deferredShader.Program, "gNormal"), GBUFFER_UNIT);
+    glUniform1i(glGetUniformLocation(deferredShader.Program, "gSurface"), GBUFFER_UNIT + 1);
+    glUniform1i(glGetUniformLocation(deferredShader.Program, "gColor"), GBUFFER_UNIT + 2);
+    glUniform1i(glGetUniformLocation(deferredShader.Program, "brdfLobe"), BRDF_LUT_UNIT);
+    glUniform1i(glGetUniformLocation(deferredShader.Program, "brdfGeometry"), BRDF_LUT_UNIT + 1);
+    glUniform1i(glGetUniformLocation(deferredShader.Program, "noiseTexture"), NOISE_UNIT);
+    momentMaps.Init(MOMENT_MAP_SIZE, NumModel);
+
+    // the texture buffers of the clustered lights, and the timers of the render pass and of the post processing
+    clusteredLights.Init();
+    renderTimer.Init();
+    postTimer.Init();
+
+    // the full screen triangle of the deferred resolve and of the post processing has no vertex data
+    glGenVertexArrays(1, &fullscreenVAO);
+
+    // the framebuffer of the per-face shadow draws has only a depth attachment (a face of the cubemap, attached in each draw)
+    glGenFramebuffers(1, &shadowFaceFBO);
+    glBindFramebuffer(GL_FRAMEBUFFER, shadowFaceFBO);
+    glDrawBuffer(GL_NONE);
+    glReadBuffer(GL_NONE);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    // with gl_Layer in the vertex shader all the faces are rendered with one submission
+    if (GLState().hasVertexLayer)
+        shadowMode = SHADOW_VERTEX_LAYER;
+
+    // the BRDF lookup tables and the noise texture: the GL thread computes rows and slices too while it waits, then it uploads them
+    JobCounter startupJobs;
+    brdfTables.Start(jobSystem, startupJobs, BRDF_CACHE_PATH);
+    noiseTextures.Start(jobSystem, startupJobs);
+    jobSystem.Wait(startupJobs);
+    brdfTables.Finish(BRDF_CACHE_PATH);
+    noiseTextures.Finish();
+    cout << "BRDF lookup tables: " << (brdfTables.cached ? "loaded from " : "computed and saved in ") << BRDF_CACHE_PATH << ", " << brdfTables.buildTime << " ms" << endl;
+    cout << "Noise texture: " << NoiseTextures::SLICES << " slices baked in " << noiseTextures.bakeTime << " ms" << endl;
+
     // we set the initial indices for the shaders and models shown in the FRONT/RIGHT, BACK/LEFT portal and what is inside
     GLint currentProgramFrontRight = LambertianPlusShadow;
     GLint currentProgramBackLeft = StripesSmoothstepPlusGGX;
@@ -301,7 +820,6 @@ int main()
     
     // View matrix (=camera): position, view direction, camera "up" vector
     cameraPos = glm::vec3(0.0f,0.0f,7.0f);
-    lastCameraPos = cameraPos;
     horizontalAngle = 3.14f;
     verticalAngle = 0.0f;
     firstMouse = true;
@@ -341,135 +859,100 @@ int main()
     // Fresnel reflectance at 0 degree (Schlik's approximation)
     GLfloat F0 = 0.45f;
 
-    /////////////////// CREATION OF BUFFER FOR THE  DEPTH MAP ///////////////////////////////////////////////////////
-    GLuint depthCubemapFBO[3];
-    for (int i =0 ;  i < 3; i++) 
-    {
-        glGenFramebuffers(1, &depthCubemapFBO[i]);
-        
-        glGenTextures(1, &depthCubemap[i]);
-        glBindTexture(GL_TEXTURE_CUBE_MAP, depthCubemap[i]);
-      
-        for (unsigned int i = 0; i < 6; ++i)
-        {
-            glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_DEPTH_COMPONENT, SHADOW_WIDTH, SHADOW_HEIGHT, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
-            glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-            glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-            glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-            glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-            glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE); 
-            GLfloat borderColor[] = {1.0f,1.0f,1.0f,1.0f} ;
-            glTexParameterfv(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_BORDER_COLOR, borderColor);
-        }
-        glBindFramebuffer(GL_FRAMEBUFFER, depthCubemapFBO[i]);
-        glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, depthCubemap[i], 0);
-        glDrawBuffer(GL_NONE);
-        glReadBuffer(GL_NONE);
-        glBindFramebuffer(GL_FRAMEBUFFER, 0); 
-    }
+    /////////////////// RESOURCES OF THE FRAME GRAPH ///////////////////////////////////////////////////////////////
+    // the shadow cubemaps and the depth map for the texture baking are transient: they are declared in every frame,
+    // and they get a texture only if a pass which uses them is not culled.
+    // The paint texture (strokes in screen coordinates) follows the size of the window, while the bake texture
+    // (strokes baked in UV coordinates) keeps the size of the window at startup, so the baked paint survives a resize
+    paintResource = frameGraph.AddPersistentTexture("Paint", FrameTextureDesc::Relative(GL_RGB8, 1.0f, GL_NEAREST, GL_CLAMP_TO_BORDER));
+    bakeResource = frameGraph.AddPersistentTexture("Bake", FrameTextureDesc(GL_TEXTURE_2D, GL_RGB8, width, height, GL_LINEAR, GL_CLAMP_TO_BORDER));
+    // the two histories of the temporal upsampling, at the size of the window
+    historyResources[0] = frameGraph.AddPersistentTexture("Temporal history 0", FrameTextureDesc::Relative(GL_RGBA16F, 1.0f));
+    historyResources[1] = frameGraph.AddPersistentTexture("Temporal history 1", FrameTextureDesc::Relative(GL_RGBA16F, 1.0f));
+    // the shadow cubemaps are owned by the shadow pool, and the cache decides when they must be rendered again
+    shadowPool.Init(GL_DEPTH_COMPONENT24, shadowTierCapacities);
+    shadowCache.Init(NumModel + 1);
     ///////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-    
-    //////////////////Creation of the drawing Buffer and the texture to be drawn in///////////////////////////////
-    GLuint paintTextureFBO;
-    
-    glGenFramebuffers(1, &paintTextureFBO);
-
-    glGenTextures(1, &paintTexture);
-    glBindTexture(GL_TEXTURE_2D, paintTexture);
-
-    
-    glTexImage2D(GL_TEXTURE_2D, 0,GL_RGB,  width,  height, 0,GL_RGB, GL_UNSIGNED_BYTE, NULL);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
-
-    glBindFramebuffer(GL_FRAMEBUFFER, paintTextureFBO);
-    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, paintTexture, 0);
-    
-    glDrawBuffer(GL_FRONT_AND_BACK);
-    glReadBuffer(GL_FRONT_AND_BACK);
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
-    //////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
-    /////////////create the Framebuffer and texture to bake the paint texture to the Mesh/////////////////////////
-    GLuint bakeTextureFBO;
-
-    glGenFramebuffers(1, &bakeTextureFBO);
-    //// and the bake Texture
-    glGenTextures(1, &bakeTexture);
-    glBindTexture(GL_TEXTURE_2D, bakeTexture);
-
-    std::vector<GLubyte> whiteTextureData( 4 *screenWidth *  screenHeight * 3, 255);
-    glTexImage2D(GL_TEXTURE_2D, 0,GL_RGB, width, height, 0,GL_RGB, GL_UNSIGNED_BYTE, NULL);
-
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
-
-    glBindFramebuffer(GL_FRAMEBUFFER, bakeTextureFBO);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, bakeTexture, 0);
-
-    glDrawBuffer(GL_FRONT_AND_BACK);
-    glReadBuffer(GL_FRONT_AND_BACK);
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
-    //////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
-    //////////////create a Depth Map for the texture baking///////////////////////////////////////////////////////
-    // We use this to not draw on both sides of the mesh or draw "through" the mesh 
-
-    GLuint bakeDepthMapFBO;
-
-    glGenFramebuffers(1, &bakeDepthMapFBO);
-    glGenTextures(1, &bakeDepthMap);
-    glBindTexture(GL_TEXTURE_2D, bakeDepthMap);
-
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT,  width, height, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
-
-
-    glBindFramebuffer(GL_FRAMEBUFFER, bakeDepthMapFBO);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, bakeDepthMap, 0);
-
-    glDrawBuffer(GL_NONE);
-    glReadBuffer(GL_NONE);
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
-    ///////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    // the setup code above binds textures and framebuffers directly, so we let the state cache forget what it knows
+    GLState().Invalidate();
+
+    // the simulation starts from the initial camera, light and portal content, and from here on it owns them
+    simulationState.cameraPos = cameraPos;
+    simulationState.lastCameraPos = cameraPos;
+    simulationState.horizontalAngle = horizontalAngle;
+    simulationState.verticalAngle = verticalAngle;
+    simulationState.lightPos = lightPos;
+    simulationState.programFrontRight = currentProgramFrontRight;
+    simulationState.programBackLeft = currentProgramBackLeft;
+    simulationState.programInside = currentProgramInside;
+    simulationState.modelFrontRight = currentModelFrontRight;
+    simulationState.modelBackLeft = currentModelBackLeft;
+    simulationState.modelInside = currentModelInside;
+    SimulationSnapshot firstSnapshot;
+    firstSnapshot.previous = simulationState;
+    firstSnapshot.current = simulationState;
+    firstSnapshot.time = simulationThread.Now();
+    simulationSnapshots.Init(firstSnapshot);
+    simulationThread.Start(SIMULATION_RATE, SimulationStep);
 
     // Rendering loop
     while(!glfwWindowShouldClose(window))
     {
+        // with a frame rate cap we wait here, before sampling the input, and not in glfwSwapBuffers after rendering with old input
+        framePacer.WaitForNextFrame();
+
         // we determine the time passed from the beginning
         // and we calculate time difference between current frame rendering and the previous one
         GLfloat currentFrame = glfwGetTime();
         deltaTime = currentFrame - lastFrame;
         lastFrame = currentFrame;
 
+        // we keep the state cache statistics of the last frame for the Performance window, and we start counting again
+        lastIssuedGLCalls = GLState().issuedCalls;
+        lastElidedGLCalls = GLState().elidedCalls;
+        GLState().ResetStats();
+
+        // we move to the section of the ring buffer of this frame
+        dynamicBuffer.BeginFrame();
+
         // Check is an I/O event is happening
         glfwPollEvents();
+        framePacer.MarkInput();
 
-        // when not in draw Mode do movements
-        if (!keys[GLFW_KEY_SPACE])
-            Do_Movement();
-        
-        // Manage the Model and Shader that are rendered in each Portal
-        ManagePortalContent(currentProgramBackLeft, currentProgramFrontRight, currentModelBackLeft, currentModelFrontRight);
-
-        // set the Model and Shader that gets renedered inside the Portalcube
-        // the Model in the front and right portal is the same (the same holds for the left portal and the one in the back)
-        setInsideShader(currentProgramFrontRight, currentProgramBackLeft, currentProgramInside, currentModelInside, currentModelFrontRight, currentModelBackLeft);
+        // we send the keys and the options of the ImGui window to the simulation (the mouse movement is sent by the callback)
+        {
+            std::lock_guard<std::mutex> lock(simulationInputMutex);
+            simulationInput.forward = keys[GLFW_KEY_W];
+            simulationInput.left = keys[GLFW_KEY_A];
+            simulationInput.back = keys[GLFW_KEY_S];
+            simulationInput.right = keys[GLFW_KEY_D];
+            simulationInput.drawMode = keys[GLFW_KEY_SPACE];
+            simulationInput.spinning = spinning;
+            simulationInput.spinspeed = spinspeed;
+            simulationInput.lightHeight = lightHeight;
+        }
 
+        // we take the last snapshot of the simulation: we render the time one step in the past, between its two states,
+        // so the movement is smooth at any frame rate. The content of the portals is the one of the last step
+        const SimulationSnapshot& snapshot = simulationSnapshots.Front();
+        simulationAlpha = glm::clamp(float((simulationThread.Now() - snapshot.time) / simulationThread.StepLength()), 0.0f, 1.0f);
+        cameraPos = glm::mix(snapshot.previous.cameraPos, snapshot.current.cameraPos, simulationAlpha);
+        horizontalAngle = glm::mix(snapshot.previous.horizontalAngle, snapshot.current.horizontalAngle, simulationAlpha);
+        verticalAngle = glm::mix(snapshot.previous.verticalAngle, snapshot.current.verticalAngle, simulationAlpha);
+        // the light moves on a circle, but in a step it rotates by less than a degree, so the chord is close enough to the arc
+        lightPos = glm::mix(snapshot.previous.lightPos, snapshot.current.lightPos, simulationAlpha);
+        currentProgramFrontRight = snapshot.current.programFrontRight;
+        currentProgramBackLeft = snapshot.current.programBackLeft;
+        currentProgramInside = snapshot.current.programInside;
+        currentModelFrontRight = snapshot.current.modelFrontRight;
+        currentModelBackLeft = snapshot.current.modelBackLeft;
+        currentModelInside = snapshot.current.modelInside;
 
         //Update view Matrix
+        cameraView = glm::normalize(glm::vec3(cos(verticalAngle) * sin(horizontalAngle), sin(verticalAngle), cos(verticalAngle)*cos(horizontalAngle)));
+        cameraRight = glm::normalize(glm::vec3(sin(horizontalAngle - 3.14f/2.0f), 0, cos(horizontalAngle - 3.14f/2.0f)));
+        cameraUp = glm::cross(cameraRight, cameraView);
         view = glm::lookAt(cameraPos, cameraPos + cameraView, cameraUp); 
         
         // we set the rendering mode
@@ -480,10 +963,10 @@ int main()
             glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
 
 
-        // if animated rotation is activated, we rotate the light source around mesh 
-        if (spinning && !keys[GLFW_KEY_SPACE])
+        // the light is rotated around the mesh by the simulation: the matrices of the faces change only if it moved
+        if (lightPos != shadowTransformsLight)
         {
-            lightPos = glm::mat3(glm::rotate(glm::mat4(1.0f), glm::radians(spinspeed), glm::vec3(0.0f,1.0f,0.0f))) * lightPos;
+            shadowTransformsLight = lightPos;
             shadowTransforms[0] = (shadowProj * 
                  glm::lookAt(lightPos, lightPos + glm::vec3( 1.0, 0.0, 0.0), glm::vec3(0.0,-1.0, 0.0)));
             shadowTransforms[1] = (shadowProj * 
@@ -498,124 +981,602 @@ int main()
                  glm::lookAt(lightPos, lightPos + glm::vec3( 0.0, 0.0,-1.0), glm::vec3(0.0,-1.0, 0.0)));
         }
 
-        //////////////////////////////////////////////////// STEP 1 - SHADOW MAPPING ////////////////////////////////////////////////
-        /// We "install" the  Shader Program for the shadow mapping creation
-        shadowShader.Use();
-
-        // we pass the transformation matrix as uniform
-        glUniformMatrix4fv(glGetUniformLocation(shadowShader.Program, "shadowMatrices"), 6, GL_FALSE, glm::value_ptr(shadowTransforms[0]));
-        glUniform3fv(glGetUniformLocation(shadowShader.Program, "lightPos"), 1, glm::value_ptr(lightPos));
-        glUniform1f(glGetUniformLocation(shadowShader.Program,"far_plane"), far);
+        // the objects attached to the light follow it, and we update the matrices of the objects which changed.
+        // From here on, all the views and passes of the frame use the cached matrices
+        for (GLuint i = 0; i < lightObjects.size(); i++)
+            scene.SetPosition(lightObjects[i], lightPos + lightOffsets[i]);
+        // the tree is refitted only if some object moved (e.g. the lightbulb)
+        if (scene.UpdateTransforms() > 0)
+            sceneBVH.Refit(scene);
+
+        // we find the faces of the shadow cubemaps overlapped by each object (the light is the same for all the cubemaps)
+        shadowCuller.Cull(scene, shadowTransforms.data());
+        shadowCuller.ResetStats();
+        shadowCache.ResetStats();
+        if (!useShadowCache)
+            shadowCache.Invalidate();
+
+        // the size of the framebuffer changes when the window is resized: the projection follows the new aspect ratio,
+        // and the frame graph reallocates the textures with a size relative to the window
+        glfwGetFramebufferSize(window, &width, &height);
+        int windowWidth, windowHeight;
+        glfwGetWindowSize(window, &windowWidth, &windowHeight);
+        if (windowWidth > 0 && windowHeight > 0 && (windowWidth != (int)screenWidth || windowHeight != (int)screenHeight))
+        {
+            screenWidth = windowWidth;
+            screenHeight = windowHeight;
+            cameraProjection = glm::perspective(45.0f, (float)screenWidth/(float)screenHeight, 0.1f, 10000.0f);
+        }
+        frameGraph.BeginFrame(width, height);
+
+        // dynamic resolution: the size of the scene in this frame, and the jitter of its projection (in pixels of the scene)
+        if (useDynamicResolution)
+            UpdateRenderScale();
+        GLfloat sceneScale = renderScale;
+        GLsizei renderWidth = glm::max(GLsizei(width * sceneScale), 1);
+        GLsizei renderHeight = glm::max(GLsizei(height * sceneScale), 1);
+        bool temporal = useTemporalUpsampling;
+        glm::vec2 jitter(0.0f);
+        projection = cameraProjection;
+        if (temporal)
+        {
+            temporalFrame = (temporalFrame + 1) % TEMPORAL_PHASES;
+            jitter = glm::vec2(Halton(temporalFrame + 1, 2), Halton(temporalFrame + 1, 3)) - 0.5f;
+            // the image moves by +jitter pixels
+            projection[2][0] -= 2.0f * jitter.x / renderWidth;
+            projection[2][1] -= 2.0f * jitter.y / renderHeight;
+        }
+        if (!temporal || width != historyWidth || height != historyHeight)
+            historyValid = false;
+        historyWidth = width;
+        historyHeight = height;
 
+        // the inside view and the views through the two nearest portals are prepared by jobs on the worker threads:
+        // they run while the GL thread renders the shadow maps, and the render pass waits for them before drawing
+        std::vector<GLuint> shortestIndices = nearestPortals(cameraPos);
+        PrepareViews(shortestIndices, height);
 
-        // we set the viewport for the first rendering step = dimensions of the depth texture
-        glViewport(0, 0, SHADOW_WIDTH, SHADOW_HEIGHT);
+        // the point lights move, and their jobs assign them to the clusters of the view (near plane of the projection, far plane of the grid).
+        // During the benchmark, the number of lights is the one of the step
+        UpdatePointLights(pointLightCounts[lightBenchmarkStep >= 0 ? lightBenchmarkStep : pointLightSetting], currentFrame);
+        if (clusteredLights.Size() > 0)
+            clusteredLights.Start(jobSystem, viewJobs, view, projection, 0.1f, CLUSTER_FAR);
 
-        // we calculate the shadow map for the Models currently loaded in the Portals
-        for (int i:{currentModelFrontRight, currentModelBackLeft})
+        //////////////////////////////////////////////////// STEP 1 - SHADOW MAPPING ////////////////////////////////////////////////
+        // we calculate the shadow map for the Models currently loaded in the Portals and inside the Portalcube, each one in its slot
+        // of the shadow pool. The graph binds the framebuffer of the whole array of the tier, and it sets the viewport to its size.
+        // If the light, the casters and the slot did not change, the cubemap of the last frame is used, and the pass is not declared at all.
+        // With the split, the static casters (the pillars) are rendered only in the static map, shared by all the models and rendered again
+        // only when the light moves, while the map of each model has only the dynamic casters (the model and the cord of the lightbulb)
+        bool splitShadows = useStaticShadows && shadowMode != SHADOW_GEOMETRY_SHADER;
+        vector<GLuint> dynamicCylinders = splitShadows ? vector<GLuint>(1, lightCordObject) : instanceGroups[CYLINDER_GROUP];
+        // resource of each tier of the pool, imported when the first of its slots is used in this frame
+        GLint tierResources[ShadowPool::NUM_TIERS] = {-1, -1, -1, -1};
+        // the maps whose pass has been declared in this frame
+        bool shadowRendered[NumModel + 1] = {false, false, false, false};
+        // we give a slot to a map, and we declare its pass if some of its faces must be rendered again. It returns the resource of the slot
+        auto AddShadowMap = [&](GLuint key, const string& name, GLint modelType, const vector<GLuint>& cylinders, const ShadowSlot& slot) -> GLuint
         {
-            // we activate the FBO for the depth map rendering
-            glBindFramebuffer(GL_FRAMEBUFFER, depthCubemapFBO[i]);
-            glClear(GL_DEPTH_BUFFER_BIT);
-
-            // we render the scene, using the shadow shader
+            if (tierResources[slot.tier] < 0)
+                tierResources[slot.tier] = frameGraph.ImportTexture(string("Shadow pool ") + to_string(slot.size), slot.texture,
+                    FrameTextureDesc(GL_TEXTURE_CUBE_MAP_ARRAY, GL_DEPTH_COMPONENT24, slot.size, slot.size, GL_LINEAR, GL_CLAMP_TO_EDGE));
+            shadowCasters[key].clear();
+            if (modelType >= 0)
+                shadowCasters[key].push_back(modelObjects[modelType]);
+            shadowCasters[key].insert(shadowCasters[key].end(), cylinders.begin(), cylinders.end());
+            GLuint faces = shadowCache.DirtyFaces(key, slot.id, lightPos, shadowCasters[key], scene, shadowCuller);
+            if (!faces)
+                return tierResources[slot.tier];
+            // the geometry shader renders all the faces
+            if (shadowMode == SHADOW_GEOMETRY_SHADER)
+                faces = ShadowCache::ALL_FACES;
+            shadowRendered[key] = true;
+            GLuint shadowPass = frameGraph.AddPass("Shadow map " + name, [&, key, modelType, cylinders, faces, slot]()
+            {
+                /// We "install" the  Shader Program for the shadow mapping creation
+                Shader& program = shadowMode == SHADOW_GEOMETRY_SHADER ? shadowShader : shadowFaceShader;
+                program.Use();
+
+                // we pass the transformation matrix as uniform
+                glUniformMatrix4fv(glGetUniformLocation(program.Program, "shadowMatrices"), 6, GL_FALSE, glm::value_ptr(shadowTransforms[0]));
+                glUniform3fv(glGetUniformLocation(program.Program, "lightPos"), 1, glm::value_ptr(lightPos));
+                glUniform1f(glGetUniformLocation(program.Program,"far_plane"), far);
+                glUniform1i(glGetUniformLocation(program.Program, "layerBase"), slot.LayerBase());
+
+                // the faces to render are cleared, also where nothing is drawn (glClear would clear the whole array, with the other slots)
+                ClearShadowFaces(slot, faces);
+
+                // Render the Inside of the Portalcube (without the split, the geometry shader renders the model and all the cylinders)
+                if (shadowMode == SHADOW_GEOMETRY_SHADER)
+                {
+                    RenderObjects(shadowShader, 0, modelType, SHADOWMAP);
+                    shadowCuller.stats.faceDraws += 6 * (1 + instanceGroups[CYLINDER_GROUP].size());
+                    shadowCuller.stats.allFaceDraws += 6 * (1 + instanceGroups[CYLINDER_GROUP].size());
+                }
+                else
+                    RenderShadowCasters(shadowFaceShader, modelType, cylinders, slot, faces);
+                shadowCache.Store(key, slot.id, lightPos, shadowCasters[key], scene, shadowCuller);
+            });
+            frameGraph.Write(shadowPass, tierResources[slot.tier]);
+            return tierResources[slot.tier];
+        };
+
+        bool shadowed[NumModel] = {false, false, false};
+        GLfloat maxImportance = 0.0f;
+        shadowPool.BeginFrame();
+        for (int i = 0; i < NumModel; i++)
+            shadowSlots[i] = ShadowSlot();
+        for (int i:{currentModelFrontRight, currentModelBackLeft, currentModelInside})
+        {
+            if (shadowed[i])
+                continue;
+            GLfloat importance = ShadowImportance(i, height);
+            maxImportance = glm::max(maxImportance, importance);
+            ShadowSlot slot = shadowPool.Request(i, importance);
+            shadowSlots[i] = slot;
+            if (slot.tier < 0)
+                continue;
+            shadowed[i] = true;
+            shadowResources[i] = AddShadowMap(i, print_availabe_Models[i], i, dynamicCylinders, slot);
+        }
+        // the static map is seen around all the models, so it gets the resolution of the most important one
+        staticShadowSlot = ShadowSlot();
+        if (splitShadows)
+        {
+            staticShadowSlot = shadowPool.Request(STATIC_SHADOW, maxImportance);
+            if (staticShadowSlot.tier >= 0)
+                staticShadowResource = AddShadowMap(STATIC_SHADOW, "Static", -1, pillarObjects, staticShadowSlot);
+        }
 
-            // Render the Inside of the Portalcube
-            RenderObjects(shadowShader, 0, i, SHADOWMAP);
+        // the variance shadow maps, if a view uses them: the moments of a model are computed again only if its depth cubemap,
+        // or the static one, has been rendered in this frame
+        bool useMoments = shadowFilterInside == SHADOW_VSM || shadowFilterPortals == SHADOW_VSM;
+        if (useMoments)
+        {
+            momentResource = frameGraph.ImportTexture("Shadow moments", momentMaps.Texture(),
+                FrameTextureDesc(GL_TEXTURE_CUBE_MAP_ARRAY, GL_RG32F, MOMENT_MAP_SIZE, MOMENT_MAP_SIZE, GL_LINEAR, GL_CLAMP_TO_EDGE));
+            vector<GLint> momentUpdates;
+            for (int i = 0; i < NumModel; i++)
+                if (shadowed[i] && (!momentMaps.IsValid(i) || shadowRendered[i] || shadowRendered[STATIC_SHADOW]))
+                    momentUpdates.push_back(i);
+            if (!momentUpdates.empty())
+            {
+                // the pass binds its own framebuffer, with one face at a time
+                GLuint momentPass = frameGraph.AddPass("Shadow moments", [&, momentUpdates]()
+                {
+                    for (GLint i : momentUpdates)
+                        momentMaps.Update(momentShader.Program, momentBlurShader.Program, i, shadowSlots[i], staticShadowSlot, momentBlurRadius);
+                    momentMaps.GenerateMipmaps();
+                });
+                frameGraph.Write(momentPass, momentResource, FRAME_WRITE_TRANSFER);
+                for (GLint i : momentUpdates)
+                    frameGraph.Read(momentPass, shadowResources[i]);
+                if (staticShadowSlot.tier >= 0)
+                    frameGraph.Read(momentPass, staticShadowResource);
+            }
+        }
+        else
+        {
+            // no view uses the moments: the cubes whose depth changed in this frame are computed again when one of them does
+            for (int i = 0; i < NumModel; i++)
+                if (shadowRendered[i] || shadowRendered[STATIC_SHADOW])
+                    momentMaps.Invalidate(i);
         }
-        glBindFramebuffer(GL_FRAMEBUFFER, 0);
-        glViewport(0, 0, width, height);
+        // the shadows of the models which are not shown anymore give back their slots
+        shadowPool.EndFrame();
         ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
         //////////////////////////////////////// STEP 2 - MAIN RENDERING LOOP /////////////////////////////////////////////////////
         // In this Step we render the 2 nearest portals in reference to the camera and the Model inside
+        // the uniforms of the lighting and of the patterns, for the program which runs the subroutines (the main shader, or the deferred resolve)
+        auto SetShadingUniforms = [&](Shader& program)
+        {
+            // Send the uniforms containing the light information
+            glUniform3fv(glGetUniformLocation(program.Program, "lightPos"), 1, glm::value_ptr(lightPos));    
+            glUniform1f(glGetUniformLocation(program.Program, "far_plane"), far);
+            glUniform3fv(glGetUniformLocation(program.Program, "ambientColor"), 1, ambientColor);
+            glUniform3fv(glGetUniformLocation(program.Program, "specularColor"), 1, specularColor);
+            glUniform1f(glGetUniformLocation(program.Program, "shininess"), shininess);
+            glUniform1f(glGetUniformLocation(program.Program, "alpha"), alpha);
+            glUniform1f(glGetUniformLocation(program.Program, "F0"), F0);
+            glUniform1f(glGetUniformLocation(program.Program, "lightSize"), lightSize);
+            glUniform1f(glGetUniformLocation(program.Program, "lightBleeding"), lightBleeding);
+            glUniform1f(glGetUniformLocation(program.Program, "Ka"), Ka);
+            glUniform1f(glGetUniformLocation(program.Program, "Kd"), Kd);
+            glUniform1f(glGetUniformLocation(program.Program, "Ks"), Ks);
+            glUniform1f(glGetUniformLocation(program.Program, "emission"), emission);
+            glUniform1f(glGetUniformLocation(program.Program, "occlusionStrength"), occlusionStrength);
+
+            // send the uniforms containing informations for the random patterns
+            glUniform1f(glGetUniformLocation(program.Program, "frequency"), frequency);
+            glUniform1f(glGetUniformLocation(program.Program, "power"), power);
+            glUniform1f(glGetUniformLocation(program.Program, "timer"), currentFrame);
+            glUniform1f(glGetUniformLocation(program.Program, "harmonics"), harmonics);
+            glUniform1f(glGetUniformLocation(program.Program, "uvRep"), uvRep);
+            glUniform1i(glGetUniformLocation(program.Program, "bakedNoise"), useBakedNoise);
+            GLState().BindTexture(NOISE_UNIT, GL_TEXTURE_3D, noiseTextures.Texture());
+
+            // the specular terms, and their tables
+            glUniform1i(glGetUniformLocation(program.Program, "brdfMode"), brdfMode);
+            GLState().BindTexture(BRDF_LUT_UNIT, GL_TEXTURE_2D, brdfTables.LobeTexture());
+            GLState().BindTexture(BRDF_LUT_UNIT + 1, GL_TEXTURE_2D, brdfTables.GeometryTexture());
+        };
 
-        // we "clear" the frame and z buffer
-        glEnable(GL_STENCIL_TEST);
-        glStencilMask(0xFF);
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
-
-
-        // activate the main Shader
-        mainShader.Use();
-
-        // Send the uniforms containing the light information
-        glUniform3fv(glGetUniformLocation(mainShader.Program, "lightPos"), 1, glm::value_ptr(lightPos));    
-        glUniform1f(glGetUniformLocation(mainShader.Program, "far_plane"), far);
-        glUniform3fv(glGetUniformLocation(mainShader.Program, "ambientColor"), 1, ambientColor);
-        glUniform3fv(glGetUniformLocation(mainShader.Program, "specularColor"), 1, specularColor);
-        glUniform1f(glGetUniformLocation(mainShader.Program, "shininess"), shininess);
-        glUniform1f(glGetUniformLocation(mainShader.Program, "alpha"), alpha);
-        glUniform1f(glGetUniformLocation(mainShader.Program, "F0"), F0);
-        glUniform1f(glGetUniformLocation(mainShader.Program, "Ka"), Ka);
-        glUniform1f(glGetUniformLocation(mainShader.Program, "Kd"), Kd);
-        glUniform1f(glGetUniformLocation(mainShader.Program, "Ks"), Ks);
-
-        // send the uniforms containing informations for the random patterns
-        glUniform1f(glGetUniformLocation(mainShader.Program, "frequency"), frequency);
-        glUniform1f(glGetUniformLocation(mainShader.Program, "power"), power);
-        glUniform1f(glGetUniformLocation(mainShader.Program, "timer"), currentFrame);
-        glUniform1f(glGetUniformLocation(mainShader.Program, "harmonics"), harmonics);
-
-        
         GLint portalShader[] = {currentProgramFrontRight, currentProgramBackLeft};
         GLint portalModel[] = {currentModelFrontRight,currentModelBackLeft};
 
-        // find the two nearest portals
-        std::vector<GLuint> shortestIndices = nearestPortals(cameraPos);
+        // the scene (forward, or resolved from the G-buffer) is written in the HDR target, which the post processing maps to the backbuffer.
+        // All the textures of the scene have the size of the dynamic resolution
+        GLuint hdrResource = frameGraph.CreateTexture("HDR color", FrameTextureDesc::Relative(GL_RGBA16F, sceneScale));
+        GLuint sceneDepth = 0;
+
+        // with the deferred path this pass fills the G-buffer (with the same draws), and the lighting is done by the resolve pass
+        bool deferred = useDeferred;
+        GLuint gbufferNormal = 0, gbufferSurface = 0, gbufferColor = 0, gbufferDepth = 0;
+        if (deferred)
+        {
+            gbufferNormal = frameGraph.CreateTexture("G-buffer normal", FrameTextureDesc::Relative(GL_RGBA16F, sceneScale, GL_NEAREST));
+            gbufferSurface = frameGraph.CreateTexture("G-buffer surface", FrameTextureDesc::Relative(GL_RGBA32F, sceneScale, GL_NEAREST));
+            gbufferColor = frameGraph.CreateTexture("G-buffer color", FrameTextureDesc::Relative(GL_RGBA8, sceneScale, GL_NEAREST));
+            gbufferDepth = frameGraph.CreateTexture("G-buffer depth", FrameTextureDesc::Relative(GL_DEPTH24_STENCIL8, sceneScale, GL_NEAREST));
+            sceneDepth = gbufferDepth;
+        }
+        GLuint renderPass = frameGraph.AddPass(deferred ? "G-buffer" : "Render", [&]()
+        {
+            // we wait for the prepared views (the GL thread executes the jobs which have not started yet).
+            // The portals outside of the inside view are skipped, together with their content
+            jobSystem.Wait(viewJobs);
+            insideCullStats = insideView.stats;
+
+            // the lists of the clusters are merged and uploaded
+            if (clusteredLights.Size() > 0)
+                clusteredLights.Finish();
+            else
+                clusteredLights.stats = ClusterStats();
+
+            for (int i = 0; i < 4; i++)
+            {
+                portalCullStats[i] = CullStats();
+                portalSkipped[i] = false;
+                portalOccluded[i] = false;
+            }
+            portalQueries.BeginFrame();
+
+            // in draw Mode we cast a ray through the mouse position, to know which object is under the brush
+            if (keys[GLFW_KEY_SPACE])
+                brushHit = PickObject(mouseX, mouseY, currentModelInside);
+
+            // the timer starts after the waits on the CPU, so it measures only the draws
+            renderTimer.Begin();
+
+            // we "clear" the frame and z buffer
+            GLState().Enable(GL_STENCIL_TEST);
+            GLState().StencilMask(0xFF);
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
 
-        // Render Portals plus what's inside of them
-        PortalRenderLoop(mainShader, portalShader, portalModel, PortalVAO, shortestIndices, RENDER);
+
+            // activate the main Shader (or the G-buffer version of it)
+            Shader& program = deferred ? gbufferShader : mainShader;
+            int pass = deferred ? GBUFFER : RENDER;
+            program.Use();
+            if (!deferred)
+            {
+                SetShadingUniforms(mainShader);
+                clusteredLights.Bind(mainShader.Program, CLUSTER_UNIT, renderWidth, renderHeight);
+            }
+
+            // Render Portals plus what's inside of them
+            glUniform1i(glGetUniformLocation(program.Program, "shadowFilter"), shadowFilterPortals);
+            PortalRenderLoop(program, portalShader, portalModel, PortalVAO, shortestIndices, pass);
         
 
-        // Render the Inside of the Portalcube
-        RenderObjects(mainShader, currentProgramInside, currentModelInside, RENDER);
+            // Render the Inside of the Portalcube. In the G-buffer it replaces the whole stencil ID of its pixels (view 0)
+            glUniform1i(glGetUniformLocation(program.Program, "shadowFilter"), shadowFilterInside);
+            if (deferred)
+            {
+                GLState().Enable(GL_STENCIL_TEST);
+                GLState().StencilMask(0xFF);
+                GLState().StencilOp(GL_KEEP, GL_KEEP, GL_REPLACE);
+                gbufferView = 0;
+            }
+            activeView = &insideView;
+            RenderObjects(program, currentProgramInside, currentModelInside, pass);
+            activeView = NULL;
+            GLState().Disable(GL_STENCIL_TEST);
+
+            if (!deferred)
+                renderTimer.End();
+        });
+        if (deferred)
+        {
+            frameGraph.Write(renderPass, gbufferNormal);
+            frameGraph.Write(renderPass, gbufferSurface);
+            frameGraph.Write(renderPass, gbufferColor);
+            frameGraph.Write(renderPass, gbufferDepth);
+        }
+        else
+        {
+            sceneDepth = frameGraph.CreateTexture("Scene depth", FrameTextureDesc::Relative(GL_DEPTH24_STENCIL8, sceneScale, GL_NEAREST));
+            frameGraph.Write(renderPass, hdrResource);
+            frameGraph.Write(renderPass, sceneDepth);
+        }
+        // (the Lambertian subroutine reads the bake texture already in the G-buffer)
+        frameGraph.Read(renderPass, bakeResource);
+
+        // the pass which reads the shadows runs the subroutines: the render pass, or the deferred resolve
+        GLuint shadingPass = renderPass;
+        if (deferred)
+        {
+            shadingPass = frameGraph.AddPass("Deferred resolve", [&, gbufferNormal, gbufferSurface, gbufferColor]()
+            {
+                // the depth and the stencil IDs are the ones of the G-buffer, attached to the framebuffer of the pass
+                // (the full screen triangles are filled also in wireframe mode: the tonemapping restores it)
+                glClear(GL_COLOR_BUFFER_BIT);
+                glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+                deferredShader.Use();
+                SetShadingUniforms(deferredShader);
+                clusteredLights.Bind(deferredShader.Program, CLUSTER_UNIT, renderWidth, renderHeight);
+                const char* names[] = {"gNormal", "gSurface", "gColor"};
+                GLuint textures[] = {gbufferNormal, gbufferSurface, gbufferColor};
+                for (GLuint i = 0; i < 3; i++)
+                {
+                    GLState().BindTexture(GBUFFER_UNIT + i, GL_TEXTURE_2D, frameGraph.Texture(textures[i]));
+                    glUniform1i(glGetUniformLocation(deferredShader.Program, names[i]), GBUFFER_UNIT + i);
+                }
+                glm::mat4 inverseView = glm::inverse(view);
+                glUniformMatrix4fv(glGetUniformLocation(deferredShader.Program, "viewMatrix"), 1, GL_FALSE, glm::value_ptr(view));
+                glUniformMatrix4fv(glGetUniformLocation(deferredShader.Program, "inverseViewMatrix"), 1, GL_FALSE, glm::value_ptr(inverseView));
+                glUniformMatrix4fv(glGetUniformLocation(deferredShader.Program, "projectionMatrix"), 1, GL_FALSE, glm::value_ptr(projection));
+                glUniform2f(glGetUniformLocation(deferredShader.Program, "viewportSize"), (GLfloat)renderWidth, (GLfloat)renderHeight);
+                // the textures of the Texture subroutine and of the paint
+                GLState().BindTexture(6, GL_TEXTURE_2D_ARRAY, environmentTextures);
+                glUniform1i(glGetUniformLocation(deferredShader.Program, "environmentTextures"), 6);
+                GLState().BindTexture(4, GL_TEXTURE_2D, bakeTexture);
+                glUniform1i(glGetUniformLocation(deferredShader.Program, "bakeTexture"), 4);
+
+                // one full screen triangle for each material of each view: the stencil test keeps only the pixels with its ID
+                GLState().Disable(GL_DEPTH_TEST);
+                GLState().Enable(GL_STENCIL_TEST);
+                GLState().StencilMask(0x00);
+                GLState().StencilOp(GL_KEEP, GL_KEEP, GL_KEEP);
+                GLState().BindVertexArray(fullscreenVAO);
+                auto ResolveView = [&](GLint viewID, GLint program, GLint modelType, int filter)
+                {
+                    BindShadowMaps(deferredShader, modelType);
+                    glUniform1i(glGetUniformLocation(deferredShader.Program, "shadowFilter"), filter);
+                    for (GLint material : {program, (GLint)FULLCOLOR, (GLint)Bloom, (GLint)Texture})
+                    {
+                        GLState().StencilFunc(GL_EQUAL, StencilID(material, viewID), 0xFF);
+                        UseMaterial(deferredShader, material, RENDER);
+                        glDrawArrays(GL_TRIANGLES, 0, 3);
+                    }
+                };
+                for (GLuint i : shortestIndices)
+                    if (!portalSkipped[i] && !portalOccluded[i])
+                        ResolveView(i + 1, portalShader[i < 2 ? 0 : 1] + (i % 2), portalModel[i < 2 ? 0 : 1], shadowFilterPortals);
+                ResolveView(0, currentProgramInside, currentModelInside, shadowFilterInside);
+                GLState().Disable(GL_STENCIL_TEST);
+                GLState().Enable(GL_DEPTH_TEST);
+
+                renderTimer.End();
+            });
+            frameGraph.Write(shadingPass, hdrResource);
+            frameGraph.Write(shadingPass, gbufferDepth);
+            frameGraph.Read(shadingPass, gbufferNormal);
+            frameGraph.Read(shadingPass, gbufferSurface);
+            frameGraph.Read(shadingPass, gbufferColor);
+            frameGraph.Read(shadingPass, bakeResource);
+        }
+        for (int i = 0; i < NumModel; i++)
+            if (shadowed[i])
+                frameGraph.Read(shadingPass, shadowResources[i]);
+        if (staticShadowSlot.tier >= 0)
+            frameGraph.Read(shadingPass, staticShadowResource);
+        if (useMoments)
+            frameGraph.Read(shadingPass, momentResource);
+
+        // the post processing: the full screen triangles of the bloom chain and of the tonemapping,
+        // filled also in wireframe mode (the tonemapping restores the polygon mode of the scene)
+        auto FullscreenPass = [&](Shader& program, GLfloat scale)
+        {
+            program.Use();
+            glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+            GLState().Disable(GL_DEPTH_TEST);
+            GLState().BindVertexArray(fullscreenVAO);
+            // the size of the texels of the target, with the same rounding of the textures of the frame graph
+            glUniform2f(glGetUniformLocation(program.Program, "targetTexelSize"),
+                        1.0f / glm::max(GLsizei(width * scale), 1), 1.0f / glm::max(GLsizei(height * scale), 1));
+        };
+
+        // the temporal upsampling adds the scene to the history at the window resolution, and the post processing reads the history.
+        // Without it, the tonemapping scales the scene to the window with a bilinear filter
+        GLuint postInput = hdrResource;
+        glm::mat4 viewProjection = cameraProjection * view;
+        if (temporal)
+        {
+            GLuint currentHistory = historyResources[historyIndex];
+            GLuint lastHistory = historyResources[1 - historyIndex];
+            glm::mat4 reprojection = previousViewProjection * glm::inverse(viewProjection);
+            bool valid = historyValid;
+            GLuint temporalPass = frameGraph.AddPass("Temporal upsampling", [&, lastHistory, reprojection, valid]()
+            {
+                postTimer.Begin();
+                FullscreenPass(temporalShader, 1.0f);
+                GLState().BindTexture(0, GL_TEXTURE_2D, frameGraph.Texture(hdrResource));
+                glUniform1i(glGetUniformLocation(temporalShader.Program, "currentColor"), 0);
+                GLState().BindTexture(1, GL_TEXTURE_2D, frameGraph.Texture(sceneDepth));
+                glUniform1i(glGetUniformLocation(temporalShader.Program, "currentDepth"), 1);
+                glUniform2f(glGetUniformLocation(temporalShader.Program, "depthProjection"), cameraProjection[2][2], cameraProjection[3][2]);
+                GLState().BindTexture(2, GL_TEXTURE_2D, frameGraph.Texture(lastHistory));
+                glUniform1i(glGetUniformLocation(temporalShader.Program, "history"), 2);
+                glUniform1i(glGetUniformLocation(temporalShader.Program, "historyValid"), valid);
+                glUniform2fv(glGetUniformLocation(temporalShader.Program, "jitter"), 1, glm::value_ptr(jitter));
+                glUniformMatrix4fv(glGetUniformLocation(temporalShader.Program, "reprojection"), 1, GL_FALSE, glm::value_ptr(reprojection));
+                glUniform1f(glGetUniformLocation(temporalShader.Program, "blendFactor"), temporalBlend);
+                glDrawArrays(GL_TRIANGLES, 0, 3);
+            });
+            frameGraph.Read(temporalPass, hdrResource);
+            frameGraph.Read(temporalPass, sceneDepth);
+            frameGraph.Read(temporalPass, lastHistory);
+            frameGraph.Write(temporalPass, currentHistory);
+            postInput = currentHistory;
+            historyIndex = 1 - historyIndex;
+            historyValid = true;
+        }
+        previousViewProjection = viewProjection;
+
+        // the bloom chain: each level is downsampled from the one above (the first one from the HDR image),
+        // then from the smallest level each one is upsampled and added to the level above.
+        // All the passes run at half resolution or less, and the levels are R11F_G11F_B10F (half the bytes of RGBA16F)
+        bool bloom = useBloom;
+        GLuint bloomLevels[BLOOM_LEVELS];
+        if (bloom)
+        {
+            for (GLuint level = 0; level < BLOOM_LEVELS; level++)
+            {
+                GLfloat scale = 1.0f / (2 << level);
+                bloomLevels[level] = frameGraph.CreateTexture("Bloom level " + to_string(level + 1), FrameTextureDesc::Relative(GL_R11F_G11F_B10F, scale));
+                GLuint source = level == 0 ? postInput : bloomLevels[level - 1];
+                GLuint downPass = frameGraph.AddPass("Bloom downsample", [&, level, source, scale]()
+                {
+                    if (level == 0 && !temporal)
+                        postTimer.Begin();
+                    FullscreenPass(bloomDownShader, scale);
+                    GLState().BindTexture(0, GL_TEXTURE_2D, frameGraph.Texture(source));
+                    glUniform1i(glGetUniformLocation(bloomDownShader.Program, "source"), 0);
+                    glUniform1i(glGetUniformLocation(bloomDownShader.Program, "firstLevel"), level == 0);
+                    glDrawArrays(GL_TRIANGLES, 0, 3);
+                });
+                frameGraph.Read(downPass, source);
+                frameGraph.Write(downPass, bloomLevels[level]);
+            }
+            for (GLint level = BLOOM_LEVELS - 2; level >= 0; level--)
+            {
+                GLfloat scale = 1.0f / (2 << level);
+                GLuint source = bloomLevels[level + 1];
+                GLuint upPass = frameGraph.AddPass("Bloom upsample", [&, source, scale]()
+                {
+                    FullscreenPass(bloomUpShader, scale);
+                    GLState().BindTexture(0, GL_TEXTURE_2D, frameGraph.Texture(source));
+                    glUniform1i(glGetUniformLocation(bloomUpShader.Program, "source"), 0);
+                    glUniform1f(glGetUniformLocation(bloomUpShader.Program, "radius"), bloomRadius);
+                    // the level keeps its downsample, and the upsampled level is added to it
+                    GLState().Enable(GL_BLEND);
+                    glBlendFunc(GL_ONE, GL_ONE);
+                    glDrawArrays(GL_TRIANGLES, 0, 3);
+                    GLState().Disable(GL_BLEND);
+                });
+                frameGraph.Read(upPass, source);
+                frameGraph.Read(upPass, bloomLevels[level]);
+                frameGraph.Write(upPass, bloomLevels[level]);
+            }
+        }
+
+        // the tonemapping mixes the bloom with the HDR image, and it writes the backbuffer
+        GLuint tonemapPass = frameGraph.AddPass("Tonemapping", [&]()
+        {
+            if (!bloom && !temporal)
+                postTimer.Begin();
+            FullscreenPass(tonemapShader, 1.0f);
+            GLState().BindTexture(0, GL_TEXTURE_2D, frameGraph.Texture(postInput));
+            glUniform1i(glGetUniformLocation(tonemapShader.Program, "hdrColor"), 0);
+            GLState().BindTexture(1, GL_TEXTURE_2D, frameGraph.Texture(bloom ? bloomLevels[0] : postInput));
+            glUniform1i(glGetUniformLocation(tonemapShader.Program, "bloom"), 1);
+            glUniform1f(glGetUniformLocation(tonemapShader.Program, "bloomLevels"), (GLfloat)BLOOM_LEVELS);
+            glUniform1f(glGetUniformLocation(tonemapShader.Program, "bloomStrength"), bloom ? bloomStrength : 0.0f);
+            glUniform1f(glGetUniformLocation(tonemapShader.Program, "exposure"), exposure);
+            glUniform1i(glGetUniformLocation(tonemapShader.Program, "tonemapper"), tonemapper);
+            glDrawArrays(GL_TRIANGLES, 0, 3);
+            // the depth of the scene is in its own texture: the paint strokes drawn on the backbuffer find a cleared depth
+            glClear(GL_DEPTH_BUFFER_BIT);
+            GLState().Enable(GL_DEPTH_TEST);
+            if (wireframe)
+                glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+            postTimer.End();
+        });
+        frameGraph.Read(tonemapPass, postInput);
+        if (bloom)
+            frameGraph.Read(tonemapPass, bloomLevels[0]);
+        frameGraph.Write(tonemapPass, frameGraph.Backbuffer());
         //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
         ////////////////////////////////////////////// STEP 3 - DRAW THE TEXTURE//////////////////////////////////////////////////////
         // when we are in drawing Mode (by pressing SPACE), we first draw in a framebuffer/texture and when we are done drawing that framebuffer/texture that texture gets baked on the mesh.
         // This happens in the bake Shader. There we check for every vertex (in screencoordinates) of the mesh if there is a color stored in the texture where that vertex is drawn on the screen. Then we draw this color in the UV coordinates of the mesh. 
         // Hence we can look up the right color with the UV coordinates of the mesh.
-        if (keys[GLFW_KEY_SPACE]) 
+
+        // First we draw in the paint texture (and on the screen, so the user can see the strokes)
+        if (keys[GLFW_KEY_SPACE] && keys[GLFW_KEY_E])
         {
-            // First we draw in the first framebuffer/texture 
-            if (keys[GLFW_KEY_E])
+            GLuint paintPass = frameGraph.AddPass("Paint strokes", [&]()
             {
                 drawingShader.Use();
                 glUniform1fv(glGetUniformLocation(drawingShader.Program, "colorIn"), 3 , brushColor);
-                drawLines(paintTextureFBO);
+                // the stroke ends where the mouse is now, not where it was at the start of the frame
+                if (lateLatchMouse)
+                    LatchMousePosition(window);
+                drawLines(frameGraph.CurrentFramebuffer());
                 bake = true;
-            }
-            // then we bake that texture in UV coordinates
-            else if (bake)
-            {
-                glBindFramebuffer(GL_FRAMEBUFFER, bakeDepthMapFBO);
-                glClear(GL_DEPTH_BUFFER_BIT);
-                // we need depth testing, so we dont draw through the texture 
-                // so we draw the scene from cameras perspektive to get a depthmap 
-                glEnable(GL_DEPTH_TEST);
-                mainShader.Use();
-                RenderObjects(mainShader, FULLCOLOR, currentModelInside, SHADOWMAP);
-
-                // then we bake using the bakeShader
-                glBindFramebuffer(GL_FRAMEBUFFER, bakeTextureFBO);
-                bakeShader.Use();
-                glUniformMatrix4fv(glGetUniformLocation(bakeShader.Program, "OrthoProj"), 1, GL_FALSE, glm::value_ptr(OrthoProj));
-                
-                // we have to disable face culling so we dont accidentally discard left facing triangles in UV coordinates
-                glDisable(GL_CULL_FACE);
-                RenderObjects(bakeShader, currentProgramInside, currentModelInside, BAKE);
-                glEnable(GL_CULL_FACE);
-
-                // we bind the first framebuffer to clear its color buffer bit
-                glBindFramebuffer(GL_FRAMEBUFFER, paintTextureFBO);
-                glClear(GL_COLOR_BUFFER_BIT);
-                glBindFramebuffer(GL_FRAMEBUFFER, 0);
-                // set bake to false so we dont bake every frame
-                bake = false;
-            }
-            
+            });
+            frameGraph.Write(paintPass, paintResource);
+            frameGraph.Write(paintPass, frameGraph.Backbuffer());
         }
+
+        // then we bake that texture in UV coordinates. The bake passes are declared in every frame,
+        // but they are culled unless the bake texture is requested, once the user has finished drawing
+        GLuint bakeDepthResource = frameGraph.CreateTexture("Bake depth map", FrameTextureDesc::Relative(GL_DEPTH_COMPONENT24, 1.0f, GL_NEAREST, GL_CLAMP_TO_BORDER));
+        GLuint bakeDepthPass = frameGraph.AddPass("Bake depth map", [&]()
+        {
+            glClear(GL_DEPTH_BUFFER_BIT);
+            // we need depth testing, so we dont draw through the texture 
+            // so we draw the scene from cameras perspektive to get a depthmap 
+            GLState().Enable(GL_DEPTH_TEST);
+            mainShader.Use();
+            RenderObjects(mainShader, FULLCOLOR, currentModelInside, SHADOWMAP);
+        });
+        frameGraph.Write(bakeDepthPass, bakeDepthResource);
+
+        GLuint bakePass = frameGraph.AddPass("Bake", [&]()
+        {
+            // then we bake using the bakeShader
+            bakeShader.Use();
+            glUniformMatrix4fv(glGetUniformLocation(bakeShader.Program, "OrthoProj"), 1, GL_FALSE, glm::value_ptr(OrthoProj));
+            
+            // we have to disable face culling so we dont accidentally discard left facing triangles in UV coordinates
+            GLState().Disable(GL_CULL_FACE);
+            RenderObjects(bakeShader, currentProgramInside, currentModelInside, BAKE);
+            GLState().Enable(GL_CULL_FACE);
+
+            // we clear the paint texture, so the same strokes are not baked again
+            frameGraph.Clear(paintResource);
+            // set bake to false so we dont bake every frame
+            bake = false;
+        });
+        // the bake shader blends the strokes with the content of the bake texture, which is also its render target
+        frameGraph.Read(bakePass, paintResource);
+        frameGraph.Read(bakePass, bakeDepthResource);
+        frameGraph.Read(bakePass, bakeResource);
+        frameGraph.Write(bakePass, bakeResource);
+        frameGraph.Write(bakePass, paintResource, FRAME_WRITE_TRANSFER);
+        /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+        /////////////////////////////////////// EXECUTION OF THE FRAME GRAPH ////////////////////////////////////////////////////////////
+        // the frame is always shown, while the bake texture is needed only when there are strokes to bake
+        frameGraph.MarkOutput(frameGraph.Backbuffer());
+        if (keys[GLFW_KEY_SPACE] && !keys[GLFW_KEY_E] && bake)
+            frameGraph.MarkOutput(bakeResource);
+        frameGraph.Compile();
+
+        // the textures used by RenderObjects (0 if the passes which use them have been culled)
+        paintTexture = frameGraph.Texture(paintResource);
+        bakeTexture = frameGraph.Texture(bakeResource);
+        bakeDepthMap = frameGraph.Texture(bakeDepthResource);
+
+        frameGraph.Execute();
+        // (the render pass has already waited for them, unless it has been culled)
+        jobSystem.Wait(viewJobs);
+        if (lightBenchmarkStep >= 0)
+            StepLightBenchmark();
         /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
         /////////////////////////////////// IMGUI INTERFACE /////////////////////////////////////////////////////////////////////////////
@@ -631,7 +1592,115 @@ int main()
 
         
             ImGui::Text("Mouse position: (%.5f, %.5f)", mouseX, mouseY);
+            if (brushHit.object >= 0)
+                ImGui::Text("Brush over: %s, triangle %u, UV (%.3f, %.3f)", scene.names[brushHit.object].c_str(), brushHit.triangle, brushHit.uv.x, brushHit.uv.y);
+            else
+                ImGui::Text("Brush over: nothing");
             ImGui::Text("Width, height: (%.0f, %.0f)", float(screenWidth), float(screenHeight));
+            ImGui::Text("Render scale: %.2f (%d x %d)", renderScale, renderWidth, renderHeight);
+            ImGui::Checkbox("Dynamic resolution", &useDynamicResolution);
+            ImGui::SameLine();
+            ImGui::Checkbox("Temporal upsampling", &useTemporalUpsampling);
+            if (useDynamicResolution)
+                ImGui::SliderFloat("Target GPU time (ms)", &targetFrameTime, 4.0f, 33.3f);
+            else
+                ImGui::SliderFloat("Render scale", &renderScale, MIN_RENDER_SCALE, 1.0f);
+            ImGui::SliderFloat("Temporal blend", &temporalBlend, 0.02f, 0.5f);
+            ImGui::Text("GL state calls: %u issued, %u elided", lastIssuedGLCalls, lastElidedGLCalls);
+            ImGui::Text("Scene: %u objects, %u transforms updated", scene.Size(), scene.updatedTransforms);
+            ImGui::Checkbox("Frustum culling", &useCulling);
+            ImGui::SameLine();
+            ImGui::Text("(SIMD width %d)", CULLING_SIMD_WIDTH);
+            ImGui::Checkbox("Cull with the scene BVH", &useBVHCulling);
+            ImGui::SameLine();
+            ImGui::Text("(%u nodes)", (GLuint)sceneBVH.bvh.nodes.size());
+            ImGui::SliderFloat("Small object culling (pixels)", &minObjectPixels, 0.0f, 20.0f);
+            if (ImGui::SliderInt("Worker threads", &workerThreads, 0, glm::max(JobSystem::DefaultWorkerCount(), 1u)))
+                jobSystem.SetWorkerCount(workerThreads);
+            ImGui::Text("View preparation: inside %.3f ms, %u too small", insideView.prepareTime, insideView.lodCulled);
+            if (ImGui::Button("Benchmark view preparation"))
+                BenchmarkViewPreparation();
+            for (GLuint i = 0; i < viewBenchmark.size(); i++)
+                ImGui::Text("  %u workers: %.3f ms/frame (x%.2f)", i, viewBenchmark[i], viewBenchmark[0] / viewBenchmark[i]);
+            if (useCulling)
+            {
+                ImGui::Text("  inside: %u visible, %u culled", insideCullStats.visible, insideCullStats.culled);
+                for (int i = 0; i < 4; i++)
+                {
+                    if (portalSkipped[i])
+                        ImGui::Text("  portal %d: outside the view, skipped", i);
+                    else if (portalOccluded[i])
+                        ImGui::Text("  portal %d: occluded in the last frame, skipped", i);
+                    else if (portalCullStats[i].visible + portalCullStats[i].culled > 0)
+                        ImGui::Text("  portal %d: %u visible, %u culled", i, portalCullStats[i].visible, portalCullStats[i].culled);
+                }
+            }
+            ImGui::Combo("Portal occlusion queries", &occlusionMode, print_occlusionModes, IM_ARRAYSIZE(print_occlusionModes));
+            ImGui::Checkbox("Multi-draw indirect submission", &useIndirectDraws);
+            if (ImGui::Combo("Shadow cube faces", &shadowMode, print_shadowModes, IM_ARRAYSIZE(print_shadowModes)) && shadowMode == SHADOW_VERTEX_LAYER && !GLState().hasVertexLayer)
+                shadowMode = SHADOW_PER_FACE;
+            ImGui::Text("Shadow face draws: %u of %u", shadowCuller.stats.faceDraws, shadowCuller.stats.allFaceDraws);
+            ImGui::Checkbox("Cache shadow maps", &useShadowCache);
+            ImGui::SameLine();
+            ImGui::Text("(%u faces rendered, %u reused)", shadowCache.stats.renderedFaces, shadowCache.stats.cachedFaces);
+            ImGui::Checkbox("Static shadow map (not with the geometry shader)", &useStaticShadows);
+            ImGui::SliderFloat("Shadow quality", &shadowPool.qualityScale, 0.25f, 4.0f);
+            ImGui::Text("Shadow pool: %.1f MB, %u shadows (256: %u, 512: %u, 1024: %u, 2048: %u), %u reassigned",
+                        shadowPool.stats.bytes / (1024.0f * 1024.0f), shadowPool.stats.shadows, shadowPool.stats.tierShadows[0], shadowPool.stats.tierShadows[1],
+                        shadowPool.stats.tierShadows[2], shadowPool.stats.tierShadows[3], shadowPool.stats.reassigned);
+            for (int i = 0; i < NumModel; i++)
+                if (shadowSlots[i].tier >= 0)
+                    ImGui::Text("  %s: %u x %u, slot %d", print_availabe_Models[i], shadowSlots[i].size, shadowSlots[i].size, shadowSlots[i].slot);
+            if (staticShadowSlot.tier >= 0)
+                ImGui::Text("  Static: %u x %u, slot %d", staticShadowSlot.size, staticShadowSlot.size, staticShadowSlot.slot);
+            ImGui::Combo("Shadow filter (inside)", &shadowFilterInside, print_shadowFilters, IM_ARRAYSIZE(print_shadowFilters));
+            ImGui::Combo("Shadow filter (portals)", &shadowFilterPortals, print_shadowFilters, IM_ARRAYSIZE(print_shadowFilters));
+            ImGui::SliderFloat("Light size", &lightSize, 0.0f, 1.0f);
+            if (ImGui::SliderInt("Variance shadow blur radius", &momentBlurRadius, 0, 8))
+                momentMaps.Invalidate();
+            ImGui::SliderFloat("Light bleeding reduction", &lightBleeding, 0.0f, 0.9f);
+            ImGui::Combo("Clustered point lights", &pointLightSetting, print_pointLightCounts, IM_ARRAYSIZE(print_pointLightCounts));
+            ImGui::Text("Clusters (%u x %u x %u): %u lights, %u visible, %u clusters used, %u indices, at most %u in a cluster, assigned in %.3f ms",
+                        ClusteredLights::GRID_X, ClusteredLights::GRID_Y, ClusteredLights::GRID_Z, clusteredLights.stats.lights,
+                        clusteredLights.stats.visibleLights, clusteredLights.stats.usedClusters, clusteredLights.stats.indices,
+                        clusteredLights.stats.maxPerCluster, clusteredLights.stats.assignTime);
+            ImGui::Combo("Specular terms", &brdfMode, print_brdfModes, IM_ARRAYSIZE(print_brdfModes));
+            ImGui::SameLine();
+            ImGui::Text("(tables %s in %.1f ms)", brdfTables.cached ? "loaded" : "computed", brdfTables.buildTime);
+            ImGui::Checkbox("Deferred shading", &useDeferred);
+            ImGui::SameLine();
+            ImGui::Text("Render pass (GPU%s): %.3f ms", useDeferred ? ", G-buffer and resolve" : "", renderTimer.averageTime);
+            ImGui::Checkbox("Bloom", &useBloom);
+            ImGui::SameLine();
+            ImGui::Text("Post processing (GPU): %.3f ms", postTimer.averageTime);
+            ImGui::SliderFloat("Bloom strength", &bloomStrength, 0.0f, 1.0f);
+            ImGui::SliderFloat("Bloom radius", &bloomRadius, 0.5f, 3.0f);
+            ImGui::SliderFloat("Light emission", &emission, 1.0f, 100.0f);
+            ImGui::SliderFloat("Exposure", &exposure, 0.1f, 4.0f);
+            ImGui::Combo("Tonemapping", &tonemapper, print_tonemappers, IM_ARRAYSIZE(print_tonemappers));
+            if (ImGui::Button("Benchmark clustered lights") && lightBenchmarkStep < 0)
+            {
+                cout << "Clustered lights benchmark: " << ClusteredLights::NUM_CLUSTERS << " clusters, " << jobSystem.WorkerCount() << " workers" << endl;
+                lightBenchmark.clear();
+                lightBenchmarkStep = 1;
+                lightBenchmarkFrames = 0;
+                lightBenchmarkAssign = lightBenchmarkRender = 0.0;
+            }
+            if (lightBenchmarkStep >= 0)
+                ImGui::Text("  running (%d lights)...", pointLightCounts[lightBenchmarkStep]);
+            for (GLuint i = 0; i < lightBenchmark.size(); i++)
+                ImGui::Text("  %d lights: assignment %.3f ms, render pass %.3f ms", lightBenchmark[i].lights, lightBenchmark[i].assignTime, lightBenchmark[i].renderTime);
+            ImGui::Text("Frame graph: %u passes, %u culled, %u textures (%.1f MB), %u of %u transients aliased, %u barriers, %u reallocations",
+                        frameGraph.stats.passes, frameGraph.stats.culledPasses, frameGraph.stats.textures, frameGraph.stats.textureBytes / (1024.0f * 1024.0f),
+                        frameGraph.stats.aliasedResources, frameGraph.stats.transientResources, frameGraph.stats.barriers, frameGraph.stats.reallocations);
+            ImGui::Text("Dynamic buffer: %.1f KB/frame (%s), %u fence waits", dynamicBuffer.usedBytes / 1024.0f, dynamicBuffer.IsPersistent() ? "persistent" : "orphaned", dynamicBuffer.fenceWaits);
+            ImGui::Text("Simulation: %.0f Hz, %lu steps, %lu skipped, interpolation %.2f", SIMULATION_RATE, simulationThread.ticks.load(), simulationThread.skippedTicks.load(), simulationAlpha);
+            if (ImGui::Combo("Swap interval", &framePacer.swapMode, print_swapModes, IM_ARRAYSIZE(print_swapModes)))
+                framePacer.SetSwapMode(framePacer.swapMode);
+            ImGui::SliderInt("Frame rate cap (0 = off)", &framePacer.fpsCap, 0, 240);
+            ImGui::Checkbox("Late-latched mouse for the strokes", &lateLatchMouse);
+            ImGui::Text("Input to swap latency: %.2f ms (average %.2f, max %.2f), %.2f ms slept by the cap",
+                        framePacer.lastLatency, framePacer.averageLatency, framePacer.maxLatency, framePacer.sleptTime);
            
             ImGui::Separator();
             ImGui::Text("Paintint Options: ");
@@ -642,19 +1711,26 @@ int main()
 
             ImGui::Separator();
             ImGui::Text("Lightning Options: ");
-            ImGui::SliderFloat("Light Height: ", &lightPos.y, 1.0f, 7.0f);
+            ImGui::SliderFloat("Light Height: ", &lightHeight, 1.0f, 7.0f);
             ImGui::SliderFloat("Kd: ", &Kd, 0.0f, 1.0f);
             ImGui::SliderFloat("Ks: ", &Ks, 0.0f, 1.0f);
             ImGui::SliderFloat("Ka: ", &Ka, 0.0f, 1.0f);
             ImGui::SliderFloat("Shininess: ", &shininess, 10.0f, 100.0f);
             ImGui::SliderFloat("Roughness Index: ", &alpha, 0.0f, 1.0f);
             ImGui::SliderFloat("Fresnel: ", &F0, 0.0f, 1.0f);
+            ImGui::SliderFloat("Baked ambient occlusion", &occlusionStrength, 0.0f, 1.0f);
+            ImGui::SameLine();
+            ImGui::Text("(%u vertices, %u models baked, %u loaded, %.1f ms)", occlusionBaker.vertices, occlusionBaker.bakedModels,
+                        occlusionBaker.cachedModels, occlusionBaker.bakeTime);
 
             ImGui::Separator();
             ImGui::Text("Patterns: ");
             ImGui::SliderFloat("Power: ", &power, 0.0f, 5.0f);
             ImGui::SliderFloat("Frequency: ", &frequency, 1.0f, 20.0f);
             ImGui::SliderFloat("Harmonics: ", &harmonics, 1.0f, 7.0f);
+            ImGui::Checkbox("Baked noise texture", &useBakedNoise);
+            ImGui::SameLine();
+            ImGui::Text("(%u slices, baked in %.1f ms)", NoiseTextures::SLICES, noiseTextures.bakeTime);
         
 
             // Ends of imgui
@@ -667,28 +1743,48 @@ int main()
         
         /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+        // the GPU is done with the section of this frame when it has executed all the commands above
+        dynamicBuffer.EndFrame();
+
         // Swapping back and front buffers
         glfwSwapBuffers(window);
-        lastCameraPos = cameraPos;
+        framePacer.MarkSwapped();
 
     }
 
+    // we stop the simulation before destroying what it uses
+    simulationThread.Stop();
+
     // when I exit from the graphics loop, it is because the application is closing
     // we delete the Shader Programs
     mainShader.Delete();
+    gbufferShader.Delete();
+    deferredShader.Delete();
+    bloomDownShader.Delete();
+    bloomUpShader.Delete();
+    tonemapShader.Delete();
+    temporalShader.Delete();
     bakeShader.Delete();
     drawingShader.Delete();
+    shadowFaceShader.Delete();
+    momentShader.Delete();
+    momentBlurShader.Delete();
 
     //Delete the IMGui context
     ImGui_ImplOpenGL3_Shutdown();
     ImGui_ImplGlfw_Shutdown();
     ImGui::DestroyContext();
 
-    // Delete the framebuffer
-    glDeleteFramebuffers(3, depthCubemapFBO);
-    glDeleteFramebuffers(1, &paintTextureFBO);
-    glDeleteFramebuffers(1, &bakeTextureFBO);
-    glDeleteFramebuffers(1, &bakeDepthMapFBO);
+    // Delete the VAO of the paint strokes
+    glDeleteVertexArrays(1, &linesVAO);
+    // and the framebuffer of the per-face shadow draws
+    glDeleteFramebuffers(1, &shadowFaceFBO);
+    // and the ones of the deferred resolve
+    glDeleteVertexArrays(1, &fullscreenVAO);
+    GLState().OnDeleteVertexArray(fullscreenVAO);
+    // and the comparison sampler of the shadows
+    glDeleteSamplers(1, &shadowCompareSampler);
+    GLState().OnDeleteSampler(shadowCompareSampler);
 
 
     // we close and delete the created context
@@ -831,7 +1927,7 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
 void mouse_callback(GLFWwindow* window, double xPos, double yPos)
 {   
     glfwGetCursorPos(window, &xPos, &yPos);
-    // when not in draw Mode we adjust the angle of the camera by the differene of mouse positions from the last frame to the current frame
+    // when not in draw Mode we send the differene of mouse positions to the simulation, which adjusts the angle of the camera in the next step
     if (!keys[GLFW_KEY_SPACE])
     {
 
@@ -842,25 +1938,12 @@ void mouse_callback(GLFWwindow* window, double xPos, double yPos)
             firstMouse = false;
         }
         
-        int height, width;
-        glfwGetWindowSize(window, &height, &width);
-        horizontalAngle = horizontalAngle + 0.1f * deltaTime * float(lastxPos - xPos);
-        verticalAngle = verticalAngle + 0.1f * deltaTime * float(lastyPos - yPos);
-        lastxPos = xPos;
-        lastyPos = yPos;
-
-        if (verticalAngle > 1.57f)
         {
-            verticalAngle = 1.57f;
+            std::lock_guard<std::mutex> lock(simulationInputMutex);
+            simulationInput.mouseDelta += glm::vec2(float(lastxPos - xPos), float(lastyPos - yPos));
         }
-        if (verticalAngle < -1.57f)
-        {
-            verticalAngle = -1.57f;
-        }
-
-        cameraView = glm::normalize(glm::vec3(cos(verticalAngle) * sin(horizontalAngle), sin(verticalAngle), cos(verticalAngle)*cos(horizontalAngle)));
-        cameraRight = glm::normalize(glm::vec3(sin(horizontalAngle - 3.14f/2.0f), 0, cos(horizontalAngle - 3.14f/2.0f)));
-        cameraUp = glm::cross(cameraRight, cameraView);
+        lastxPos = xPos;
+        lastyPos = yPos;
     }
     mouseX = (float)(2 * xPos) / screenWidth - 1.0f;
     mouseY = 1.0f - (float)(2 * yPos) / screenHeight;
@@ -875,52 +1958,101 @@ void mouse_callback(GLFWwindow* window, double xPos, double yPos)
     
 }
 
-void Do_Movement()
+void Do_Movement(SimulationState& state, const SimulationInput& input, GLfloat step)
 {
+    // the directions of the camera in this step
+    glm::vec3 cameraView = glm::vec3(sin(state.horizontalAngle), 0, cos(state.horizontalAngle));
+    glm::vec3 cameraRight = glm::vec3(sin(state.horizontalAngle - 3.14f/2.0f), 0, cos(state.horizontalAngle - 3.14f/2.0f));
+
      // Let the camara "walk" using w,a,s,d
      // we stop the camera movement when the new camera position is outside the outer walls
-    if(keys[GLFW_KEY_W] == true)
+    if(input.forward)
     {
-        glm::vec3 newCameraPos = cameraPos + glm::normalize(glm::vec3(cameraView.x,0,cameraView.z)) * 3.0f * deltaTime;
+        glm::vec3 newCameraPos = state.cameraPos + glm::normalize(glm::vec3(cameraView.x,0,cameraView.z)) * 3.0f * step;
         if (std::abs(newCameraPos.x) < 13.8f && std::abs(newCameraPos.z) < 13.8f)
         {
-            cameraPos = newCameraPos;
+            state.cameraPos = newCameraPos;
         }
     }
-    if(keys[GLFW_KEY_A] == true)
+    if(input.left)
     {
-        glm::vec3 newCameraPos = cameraPos - glm::normalize(glm::vec3(cameraRight.x,0,cameraRight.z)) * 3.0f * deltaTime;
+        glm::vec3 newCameraPos = state.cameraPos - glm::normalize(glm::vec3(cameraRight.x,0,cameraRight.z)) * 3.0f * step;
         if (std::abs(newCameraPos.x) < 13.8f && std::abs(newCameraPos.z) < 13.8f)
         {
-            cameraPos = newCameraPos;
+            state.cameraPos = newCameraPos;
         }
 
     }
-    if(keys[GLFW_KEY_S] == true)
+    if(input.back)
     {
-        glm::vec3 newCameraPos = cameraPos - glm::normalize(glm::vec3(cameraView.x,0,cameraView.z)) * 3.0f * deltaTime;
+        glm::vec3 newCameraPos = state.cameraPos - glm::normalize(glm::vec3(cameraView.x,0,cameraView.z)) * 3.0f * step;
         if (std::abs(newCameraPos.x) < 13.8f && std::abs(newCameraPos.z) < 13.8f)
         {
-            cameraPos = newCameraPos;
+            state.cameraPos = newCameraPos;
         }
 
     }
-    if(keys[GLFW_KEY_D] == true)
+    if(input.right)
     {
-        glm::vec3 newCameraPos = cameraPos + glm::normalize(glm::vec3(cameraRight.x,0,cameraRight.z)) * 3.0f * deltaTime;
+        glm::vec3 newCameraPos = state.cameraPos + glm::normalize(glm::vec3(cameraRight.x,0,cameraRight.z)) * 3.0f * step;
         if (std::abs(newCameraPos.x) < 13.8f && std::abs(newCameraPos.z) < 13.8f)
         {
-            cameraPos = newCameraPos;
+            state.cameraPos = newCameraPos;
         }
 
     }
 }
 
-void ManagePortalContent(GLint &currentProgramBackLeft, GLint &currentProgramFrontRight, GLint &currentModelBackLeft, GLint &currentModelFrontRight) 
+void SimulationStep(double time)
 {
+    // we take the input of the GL thread, and we consume the mouse movement
+    SimulationInput input;
+    {
+        std::lock_guard<std::mutex> lock(simulationInputMutex);
+        input = simulationInput;
+        simulationInput.mouseDelta = glm::vec2(0.0f);
+    }
+
+    SimulationSnapshot& snapshot = simulationSnapshots.Back();
+    snapshot.previous = simulationState;
+
+    SimulationState& state = simulationState;
+    state.lastCameraPos = state.cameraPos;
+    // when not in draw Mode we turn and move the camera
+    if (!input.drawMode)
+    {
+        state.horizontalAngle += MOUSE_SENSITIVITY * input.mouseDelta.x;
+        state.verticalAngle = glm::clamp(state.verticalAngle + MOUSE_SENSITIVITY * input.mouseDelta.y, -1.57f, 1.57f);
+        Do_Movement(state, input, GLfloat(simulationThread.StepLength()));
+    }
+
+    // Manage the Model and Shader that are rendered in each Portal
+    ManagePortalContent(state);
+
+    // set the Model and Shader that gets renedered inside the Portalcube
+    // the Model in the front and right portal is the same (the same holds for the left portal and the one in the back)
+    setInsideShader(state);
+
+    // if animated rotation is activated, we rotate the light source around mesh (spinspeed degrees in each step)
+    state.lightPos.y = input.lightHeight;
+    if (input.spinning && !input.drawMode)
+        state.lightPos = glm::mat3(glm::rotate(glm::mat4(1.0f), glm::radians(input.spinspeed), glm::vec3(0.0f,1.0f,0.0f))) * state.lightPos;
+
+    snapshot.current = state;
+    snapshot.time = time;
+    simulationSnapshots.Publish();
+}
+
+void ManagePortalContent(SimulationState& state) 
+{
+    GLint& currentProgramBackLeft = state.programBackLeft;
+    GLint& currentProgramFrontRight = state.programFrontRight;
+    GLint& currentModelBackLeft = state.modelBackLeft;
+    GLint& currentModelFrontRight = state.modelFrontRight;
+
     // we rotate the camera, such that checking if we walk around the front-right and back-left corners is equal to checking if we cross the x - Axis
-    glm::vec3 tempRotatetCameraPos = glm::rotate(glm::mat4(1.0f), glm::radians(45.0f), glm::vec3(0.0f,1.0f,0.0f)) * glm::vec4(cameraPos,1.0f);
-    glm::vec3 lasttempRotatetCameraPos = glm::rotate(glm::mat4(1.0f), glm::radians(45.0f), glm::vec3(0.0f,1.0f,0.0f)) * glm::vec4(lastCameraPos,1.0f);
+    glm::vec3 tempRotatetCameraPos = glm::rotate(glm::mat4(1.0f), glm::radians(45.0f), glm::vec3(0.0f,1.0f,0.0f)) * glm::vec4(state.cameraPos,1.0f);
+    glm::vec3 lasttempRotatetCameraPos = glm::rotate(glm::mat4(1.0f), glm::radians(45.0f), glm::vec3(0.0f,1.0f,0.0f)) * glm::vec4(state.lastCameraPos,1.0f);
 
     // when crossing the x - Axis on the right side and walking from negativ to positiv we increase the shader program in the back left corner
     if (7.0f < tempRotatetCameraPos.x && tempRotatetCameraPos.x < 19.8f && tempRotatetCameraPos.z < 0.0f && lasttempRotatetCameraPos.z >= 0.0f)
@@ -985,83 +2117,114 @@ void ManagePortalContent(GLint &currentProgramBackLeft, GLint &currentProgramFro
 
 void PortalRenderLoop(Shader &mainShader, GLint shaderIndex[], GLint modelType[], GLuint VAO, std::vector<GLuint> shortestIndices, int render_pass)
 {
-    // set up Position and Rotationaxis for the Portals
-    vector<glm::vec3> PortalPos = {glm::vec3(0.0f,0.0f,5.0f), glm::vec3(5.0f,0.0f,0.0f), glm::vec3(0.0f,0.0f,-5.0f), glm::vec3(-5.0f,0.0f,0.0f)};
-    vector<glm::vec3> PortalRotationAxis = {glm::vec3(-1.0f,0.0f,0.0f),glm::vec3(0.0f,0.0f,1.0f), glm::vec3(1.0f,0.0f,0.0f),glm::vec3(0.0f,0.0f,-1.0f)};
-
     for (int i :shortestIndices)
     {
+        // the portal is outside the main view, so nothing of it (or inside of it) can be seen
+        bool mainView = render_pass == RENDER || render_pass == GBUFFER;
+        if (mainView && useCulling && !insideView.IsVisible(portalObjects[i]))
+        {
+            portalSkipped[i] = true;
+            continue;
+        }
+
         // Lets do Portals 
-        // Step One: Disable Color and Depth Buffer. Enable Stencil Buffer
-        glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
-        glDisable(GL_DEPTH_TEST);
-        glEnable(GL_STENCIL_TEST);
-        glStencilMask(0xFF);
+        // Step One: Disable Color and Depth writes. Enable Stencil Buffer
+        // We keep the depth test, so the parts of the quad hidden by the portals already rendered do not pass:
+        // they would be hidden anyway, and the occlusion query counts only the samples which can actually be seen
+        GLState().ColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+        GLState().Enable(GL_DEPTH_TEST);
+        GLState().DepthMask(GL_FALSE);
+        GLState().Enable(GL_STENCIL_TEST);
+        GLState().StencilMask(0xFF);
 
 
         // Step Two: Set Stecnil Opereation for front facing triangles to Replace when Stencil test and depth test are succesful
-        glStencilOp(GL_KEEP, GL_KEEP, GL_REPLACE);
+        GLState().StencilOp(GL_KEEP, GL_KEEP, GL_REPLACE);
         //glStencilOpSeparate(GL_FRONT, GL_KEEP, GL_KEEP, GL_REPLACE);
         //glStencilOpSeparate(GL_BACK, GL_KEEP, GL_KEEP, GL_KEEP);
     
 
         // Step Three: Set Stencil Test to ALWAYS, therefore it will always pass and replace the stencil value with i+1
-        glStencilFunc(GL_ALWAYS, i+1, 0xFF);
+        GLState().StencilFunc(GL_ALWAYS, i+1, 0xFF);
         //glStencilFuncSeparate(GL_FRONT, GL_ALWAYS, i+1, 0xFF);
         //glStencilFuncSeparate(GL_BACK, GL_NEVER, 0, 0xFF);
 
 
         // Step Four: Draw Portal Frame in the stencil Buffer
         // Note that every Portal has its own stencil value 
-        GLuint index = glGetSubroutineIndex(mainShader.Program, GL_FRAGMENT_SHADER, shader[FULLCOLOR].c_str());
-        glUniformSubroutinesuiv(GL_FRAGMENT_SHADER, 1, &index);
-
-        // Set up ModelMatrix and Normalmatrix for the PortalFrame
-        glm::mat4 planeModelMatrix = glm::mat4(1.0f);
-        planeModelMatrix = glm::translate(planeModelMatrix, PortalPos[i]);
-        planeModelMatrix = glm::rotate(planeModelMatrix, glm::radians(90.0f), PortalRotationAxis[i]);
-        planeModelMatrix = glm::scale(planeModelMatrix, glm::vec3(5.0f,10.0f,5.0f));
+        // (the G-buffer shader has no subroutines: the quad writes only the stencil, and the depth in step nine)
+        if (render_pass != GBUFFER)
+        {
+            GLuint index = glGetSubroutineIndex(mainShader.Program, GL_FRAGMENT_SHADER, shader[FULLCOLOR].c_str());
+            glUniformSubroutinesuiv(GL_FRAGMENT_SHADER, 1, &index);
+        }
+
+        // the ModelMatrix of the PortalFrame is cached in the scene
+        const glm::mat4& planeModelMatrix = scene.worldMatrices[portalObjects[i]];
         
         //Send the Matrizes and the color Uniform to our mainShader
         glUniformMatrix4fv(glGetUniformLocation(mainShader.Program, "modelMatrix"), 1, GL_FALSE, glm::value_ptr(planeModelMatrix));
         glUniformMatrix4fv(glGetUniformLocation(mainShader.Program, "viewMatrix"), 1, GL_FALSE, glm::value_ptr(view));
         glUniformMatrix4fv(glGetUniformLocation(mainShader.Program, "projectionMatrix"), 1, GL_FALSE, glm::value_ptr(projection));
 
-        // Draw the Portal
-        glBindVertexArray(VAO);
+        // Draw the Portal, counting its visible samples in the occlusion query of the portal
+        bool occlusion = mainView && occlusionMode != OCCLUSION_OFF;
+        if (occlusion)
+            portalQueries.Begin(i);
+        GLState().BindVertexArray(VAO);
         glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
-        glBindVertexArray(0);
+        if (occlusion)
+            portalQueries.End();
 
         
         // Step Five: Disable writing to the Stencil Buffer and Enable Color and Depth Buffer
-        glStencilMask(0x00);
-        glEnable(GL_DEPTH_TEST);
-        glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+        // (in the G-buffer the content writes its material in the high bits of the stencil, and the view i+1 stays in the low bits)
+        GLState().StencilMask(render_pass == GBUFFER ? 0xFF & ~STENCIL_VIEW_MASK : 0x00);
+        gbufferView = i + 1;
+        GLState().DepthMask(GL_TRUE);
+        GLState().ColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
 
 
         // Step Six: Set the stencil Function for front facing triangles such that we only draw if the value in the stencil buffer is i+1
-        glStencilFunc(GL_EQUAL, i+1, 0xFF);
+        GLState().StencilFunc(GL_EQUAL, i+1, 0xFF);
         //glStencilFuncSeparate(GL_FRONT, GL_EQUAL, i+1, 0xFF);
         
 
         // Step Seven: Draw what is inside of the Portal
-        RenderObjects(mainShader, shaderIndex[i < 2 ? 0 : 1] + (i % 2), modelType[i < 2 ? 0 : 1], render_pass);
+        // with the result of the last frame, the CPU does not even submit the content of a portal which was not visible
+        // (the query of this frame has been issued anyway, so the content comes back as soon as the portal is visible again)
+        bool skipContent = occlusion && occlusionMode == OCCLUSION_LAST_FRAME && !portalQueries.WasVisible(i);
+        portalOccluded[i] = skipContent;
+
+        // the content is rendered with the view prepared for the portal (culled with the frustum restricted to the portal)
+        if (mainView && !skipContent)
+        {
+            portalCullStats[i] = portalViews[i].stats;
+            activeView = &portalViews[i];
+        }
+        // with conditional rendering, the GPU discards the draws of the content if no sample of the quad passed
+        bool conditional = occlusion && occlusionMode == OCCLUSION_CONDITIONAL;
+        if (conditional)
+            portalQueries.BeginConditional(i);
+        if (!skipContent)
+            RenderObjects(mainShader, shaderIndex[i < 2 ? 0 : 1] + (i % 2), modelType[i < 2 ? 0 : 1], render_pass);
+        if (conditional)
+            portalQueries.EndConditional();
+        activeView = NULL;
+        gbufferView = 0;
 
         // Step Eight: Disable Color Buffer and Stencil Test but enable writing to the depth buffer
-        glDisable(GL_STENCIL_TEST);
-        glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
-        glDepthMask(GL_TRUE);
+        GLState().Disable(GL_STENCIL_TEST);
+        GLState().ColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+        GLState().DepthMask(GL_TRUE);
 
 
         // Step Nine: Draw our Portal again. This time only in the Depth Buffer
-        index = glGetSubroutineIndex(mainShader.Program, GL_FRAGMENT_SHADER, shader[FULLCOLOR].c_str());
-        glUniformSubroutinesuiv(GL_FRAGMENT_SHADER, 1, &index);
-
-        //Set up ModelMatrix for the first Plane
-        planeModelMatrix = glm::mat4(1.0f);
-        planeModelMatrix = glm::translate(planeModelMatrix, PortalPos[i]);
-        planeModelMatrix = glm::rotate(planeModelMatrix, glm::radians(90.0f), PortalRotationAxis[i]);
-        planeModelMatrix = glm::scale(planeModelMatrix, glm::vec3(5.0f,10.0f,5.0f));
+        if (render_pass != GBUFFER)
+        {
+            GLuint index = glGetSubroutineIndex(mainShader.Program, GL_FRAGMENT_SHADER, shader[FULLCOLOR].c_str());
+            glUniformSubroutinesuiv(GL_FRAGMENT_SHADER, 1, &index);
+        }
 
         //Send the Matrizes and the color Uniform to our mainSHader
         glUniformMatrix4fv(glGetUniformLocation(mainShader.Program, "modelMatrix"), 1, GL_FALSE, glm::value_ptr(planeModelMatrix));
@@ -1069,11 +2232,10 @@ void PortalRenderLoop(Shader &mainShader, GLint shaderIndex[], GLint modelType[]
         glUniformMatrix4fv(glGetUniformLocation(mainShader.Program, "projectionMatrix"), 1, GL_FALSE, glm::value_ptr(projection));
         glUniform3fv(glGetUniformLocation(mainShader.Program, "colorIn"), 1, colorDarkRed);
 
-        glBindVertexArray(VAO);
+        GLState().BindVertexArray(VAO);
         glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
-        glBindVertexArray(0);
     }
-    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    GLState().ColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
 }
 
 GLuint SetupPortal()
@@ -1096,7 +2258,7 @@ GLuint SetupPortal()
     glGenBuffers(1, &VBO);
     glGenBuffers(1, &EBO);
 
-    glBindVertexArray(VAO); 
+    GLState().BindVertexArray(VAO); 
     glBindBuffer(GL_ARRAY_BUFFER, VBO);
     glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW); 
 
@@ -1108,13 +2270,22 @@ GLuint SetupPortal()
 
     glBindBuffer(GL_ARRAY_BUFFER, 0); 
 
-    glBindVertexArray(0); 
+    GLState().BindVertexArray(0); 
 
     return VAO;
 }
 
-void setInsideShader(GLuint rightFrontShader, GLuint leftBackShader, GLint &currentProgramInside, GLint &currentModelInside, GLint &currentModelFrontRight, GLint &currentModelBackLeft)
+void setInsideShader(SimulationState& state)
 {
+    const glm::vec3& cameraPos = state.cameraPos;
+    const glm::vec3& lastCameraPos = state.lastCameraPos;
+    GLint rightFrontShader = state.programFrontRight;
+    GLint leftBackShader = state.programBackLeft;
+    GLint& currentProgramInside = state.programInside;
+    GLint& currentModelInside = state.modelInside;
+    GLint currentModelFrontRight = state.modelFrontRight;
+    GLint currentModelBackLeft = state.modelBackLeft;
+
     // set Inside Model and Shader equal to the FRONT FACING PORTAL, if we step through it (more precisely if we step through a barrier slietly infront of the portal)
     if(cameraPos.z < 5.2f && std::abs(cameraPos.x) <= 5.2f && lastCameraPos.z > 5.2f)
     {
@@ -1157,160 +2328,83 @@ void RenderObjects(Shader &mainShader, GLint shaderIndex, GLint modelType, int r
     // when baking we only set up the paintTexture, bakeTexture and the bakeDepthMap and afterwards render the Model
     if (render_pass == BAKE)
     {   
-        glActiveTexture(GL_TEXTURE3);
-        glBindTexture(GL_TEXTURE_2D, paintTexture);
+        GLState().BindTexture(3, GL_TEXTURE_2D, paintTexture);
         GLint paintTextureLoc = glGetUniformLocation(mainShader.Program, "paintTexture");
         glUniform1i(paintTextureLoc, 3); 
 
-        glActiveTexture(GL_TEXTURE4);
-        glBindTexture(GL_TEXTURE_2D, bakeTexture);
+        GLState().BindTexture(4, GL_TEXTURE_2D, bakeTexture);
         GLint bakeTextureLoc = glGetUniformLocation(mainShader.Program, "bakeTexture");
         glUniform1i(bakeTextureLoc, 4);
 
-        glActiveTexture(GL_TEXTURE5);
-        glBindTexture(GL_TEXTURE_2D, bakeDepthMap);
+        GLState().BindTexture(5, GL_TEXTURE_2D, bakeDepthMap);
         GLint bakeDepthMapLoc = glGetUniformLocation(mainShader.Program, "bakeDepthMap");
         glUniform1i(bakeDepthMapLoc, 5);
 
 
     }
 
-    // in the render pass, we also set up and render every enviroment Model
-    if (render_pass==RENDER)
+    // in the render pass (and in the G-buffer), we also set up and render every enviroment Model
+    if (render_pass == RENDER || render_pass == GBUFFER)
     {
-        // pass the shadowMap texture to the shader
-        glActiveTexture(GL_TEXTURE0 + modelType);
-        glBindTexture(GL_TEXTURE_CUBE_MAP, depthCubemap[modelType]);
-        GLint shadowLocation = glGetUniformLocation(mainShader.Program, "shadowMap");
-        glUniform1i(shadowLocation, modelType);
+        // the G-buffer does not need the shadows: the resolve binds them for each view
+        if (render_pass == RENDER)
+            BindShadowMaps(mainShader, modelType);
 
         ////////////////////////////////// RENDER THE LIGHTBULB ////////////////////////////////////////////////////////////////////////
-        GLuint index = glGetSubroutineIndex(mainShader.Program, GL_FRAGMENT_SHADER, shader[Bloom].c_str());
-        glUniformSubroutinesuiv(GL_FRAGMENT_SHADER, 1, &index);
-
-        glm::mat4 lightbulbModelMatrix = glm::mat4(1.0f);
-        lightbulbModelMatrix = glm::translate(lightbulbModelMatrix, lightPos);
-        lightbulbModelMatrix = glm::scale(lightbulbModelMatrix, glm::vec3(0.1f,0.13f,0.1f));
+        UseMaterial(mainShader, Bloom, render_pass);
 
-        glUniformMatrix4fv(glGetUniformLocation(mainShader.Program, "modelMatrix"), 1, GL_FALSE, glm::value_ptr(lightbulbModelMatrix));
-        models[Sphere].Draw();
+        glUniformMatrix4fv(glGetUniformLocation(mainShader.Program, "modelMatrix"), 1, GL_FALSE, glm::value_ptr(scene.worldMatrices[lightbulbObject]));
+        if (IsObjectVisible(lightbulbObject))
+            models[Sphere].Draw();
         ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
         
-        // set the subroutine to Texture for the FLoorplanes
-        index = glGetSubroutineIndex(mainShader.Program, GL_FRAGMENT_SHADER, shader[Texture].c_str());
-        glUniformSubroutinesuiv(GL_FRAGMENT_SHADER, 1, &index);
-
-        /////////////////////////////////// RENDER THE LARGER FLOOR PLANE //////////////////////////////////////////////////////////////
-        glActiveTexture(GL_TEXTURE6);
-        glBindTexture(GL_TEXTURE_2D, textureId[WOOD]);
-        GLint textureLocation = glGetUniformLocation(mainShader.Program, "textureID");
-        glUniform1i(textureLocation, 6);
-
-        // we set the Modelmatrix and Normalmatrix for the larger Floorplane
-        glm::mat4 planeModelMatrix = glm::mat4(1.0f);
-        glm::mat3 planeNormalMatrix = glm::mat3(1.0f);
-        planeModelMatrix = glm::translate(planeModelMatrix, glm::vec3(0.0f,-1.0f,0.0f));
-        planeModelMatrix = glm::scale(planeModelMatrix, glm::vec3(2.8f,1.0f,2.8f));
-        planeNormalMatrix = glm::inverseTranspose(glm::mat3(view*planeModelMatrix));
-
-        //Send the Matrizes and the color Uniform to our mainShader
-        glUniformMatrix4fv(glGetUniformLocation(mainShader.Program, "modelMatrix"), 1, GL_FALSE, glm::value_ptr(planeModelMatrix));
-        glUniformMatrix3fv(glGetUniformLocation(mainShader.Program, "normalMatrix"), 1, GL_FALSE, glm::value_ptr(planeNormalMatrix));
-        glUniformMatrix4fv(glGetUniformLocation(mainShader.Program, "viewMatrix"), 1, GL_FALSE, glm::value_ptr(view));
-        glUniformMatrix4fv(glGetUniformLocation(mainShader.Program, "projectionMatrix"), 1, GL_FALSE, glm::value_ptr(projection));
-        glUniform1f(glGetUniformLocation(mainShader.Program, "texRep"), 15.0);
-        envModels[Plane].Draw();
-        ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
+        ////////////////////////// RENDER THE FLOOR PLANES, THE WALLS AND THE CEILING ////////////////////////////////////////////////
+        // they are all instances of the same plane, so we render them with a single instanced draw.
+        // The model matrix, the layer of the texture array and the UV repetition of each of them are in planeInstances
+        UseMaterial(mainShader, Texture, render_pass);
 
-        ////////////////////////////////// RENDER THE SMALLER FLOOR PLANE //////////////////////////////////////////////////////////////
-        glActiveTexture(GL_TEXTURE7);
-        glBindTexture(GL_TEXTURE_2D, textureId[MARPLE]);
-        textureLocation = glGetUniformLocation(mainShader.Program, "textureID");
-        glUniform1i(textureLocation, 7);
+        GLState().BindTexture(6, GL_TEXTURE_2D_ARRAY, environmentTextures);
+        glUniform1i(glGetUniformLocation(mainShader.Program, "environmentTextures"), 6);
 
-        // we set the Model and Normalmatrix for the smaller Floorplane
-        planeModelMatrix = glm::mat4(1.0f);
-        planeNormalMatrix = glm::mat3(1.0f);
-        planeModelMatrix = glm::translate(planeModelMatrix, glm::vec3(0.0f,-0.999f,0.0f));
-        planeModelMatrix = glm::scale(planeModelMatrix, glm::vec3(1.0f,1.0f,1.0f));
-        planeNormalMatrix = glm::inverseTranspose(glm::mat3(view*planeModelMatrix));
-
-        //Send the Matrizes and the color Uniform to our mainShader
-        glUniformMatrix4fv(glGetUniformLocation(mainShader.Program, "modelMatrix"), 1, GL_FALSE, glm::value_ptr(planeModelMatrix));
-        glUniformMatrix3fv(glGetUniformLocation(mainShader.Program, "normalMatrix"), 1, GL_FALSE, glm::value_ptr(planeNormalMatrix));
         glUniformMatrix4fv(glGetUniformLocation(mainShader.Program, "viewMatrix"), 1, GL_FALSE, glm::value_ptr(view));
         glUniformMatrix4fv(glGetUniformLocation(mainShader.Program, "projectionMatrix"), 1, GL_FALSE, glm::value_ptr(projection));
-        glUniform1f(glGetUniformLocation(mainShader.Program, "texRep"), 3.0);
-        envModels[Plane].Draw();
-        ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
-
-        ///////////////////////////////// RENDER THE WALLS /////////////////////////////////////////////////////////////////////////////
-        glActiveTexture(GL_TEXTURE8);
-        glBindTexture(GL_TEXTURE_2D, textureId[WALL]);
-        textureLocation = glGetUniformLocation(mainShader.Program, "textureID");
-        glUniform1i(textureLocation, 8);
-
-        //set up wall position, rotation axis and angle 
-        glm::vec3 wallPos[] = {glm::vec3(14.0f,0.0f,0.0f), glm::vec3(0.0f,0.0f,14.0f), glm::vec3(-14.0f,0.0f,0.0f), glm::vec3(0.0f,0.0f,-14.0f)};
-        glm::vec3 wallRot[] = {glm::vec3(0.0f,0.0f, 1.0f), glm::vec3(0.5773503f, -0.5773503f, 0.5773503f), glm::vec3(0.0f,0.0f, -1.0f), glm::vec3(-0.5773503f, 0.5773503f, 0.5773503f)};
-        float wallRotations[] = {glm::radians(90.0f), glm::radians(240.0f), glm::radians(90.0f), glm::radians(240.0f)};
-
-        // set up and send the Modelmatrix for the Walls to the shader and render them
-        for (int i= 0; i<4; i++)
+        glUniform1i(glGetUniformLocation(mainShader.Program, "instanced"), GL_TRUE);
+        // the visible planes have been gathered (front to back) by the job which prepared the view
+        const vector<InstanceData>& planes = activeView ? activeView->groups[PLANE_GROUP] : planeInstances.instances;
+        if (useIndirectDraws)
         {
-            planeModelMatrix = glm::mat4(1.0f);
-            planeModelMatrix = glm::translate(planeModelMatrix, wallPos[i]);
-            planeModelMatrix = glm::rotate(planeModelMatrix, wallRotations[i], wallRot[i]);
-            planeModelMatrix = glm::scale(planeModelMatrix, glm::vec3(3.0f,1.0f,3.0f));
-
-            glUniformMatrix4fv(glGetUniformLocation(mainShader.Program, "modelMatrix"), 1, GL_FALSE, glm::value_ptr(planeModelMatrix));
-            glUniform1f(glGetUniformLocation(mainShader.Program, "texRep"), 8.0);
-            envModels[Plane].Draw();
+            // with the draw list, only the visible planes are submitted
+            drawList.Clear();
+            if (!planes.empty())
+                drawList.Add(envModels[Plane], planes.data(), planes.size());
+            drawList.Submit(geometryBuffer, dynamicBuffer);
         }
+        else if (!planes.empty())
+            envModels[Plane].DrawInstanced(planeInstances.Count());
+        glUniform1i(glGetUniformLocation(mainShader.Program, "instanced"), GL_FALSE);
         ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-
-        ///////////////////////////////// RENDER THE CEILING //////////// //////////////////////////////////////////////////////////////
-        glActiveTexture(GL_TEXTURE9);
-        glBindTexture(GL_TEXTURE_2D, textureId[CONCRETE]);
-        textureLocation = glGetUniformLocation(mainShader.Program, "textureID");
-        glUniform1i(textureLocation, 9);
-
-        // set up Modelmatrix for the ceiling 
-        planeModelMatrix = glm::mat4(1.0f);
-        planeModelMatrix = glm::translate(planeModelMatrix, glm::vec3(0.0f,10.0f,0.0f));
-        planeModelMatrix = glm::rotate(planeModelMatrix, glm::radians(180.0f), glm::vec3(1.0f,0.0f,0.0f));
-        planeModelMatrix = glm::scale(planeModelMatrix, glm::vec3(2.8f,1.0f,2.8f));
-
-        // send the Modelmatrix to the Shader and render the ceiling
-        glUniformMatrix4fv(glGetUniformLocation(mainShader.Program, "modelMatrix"), 1, GL_FALSE, glm::value_ptr(planeModelMatrix));
-        glUniform1f(glGetUniformLocation(mainShader.Program, "texRep"), 5.0);
-        envModels[Plane].Draw();
-        ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
-        glActiveTexture(GL_TEXTURE4);
-        glBindTexture(GL_TEXTURE_2D, bakeTexture);
+        GLState().BindTexture(4, GL_TEXTURE_2D, bakeTexture);
         GLint bakeTextureLoc = glGetUniformLocation(mainShader.Program, "bakeTexture");
         glUniform1i(bakeTextureLoc, 4);
     }
 
+    // the shadow pass uses the same Shader Program and the same state for all its draws,
+    // so we can collect all of them in the draw list and submit the whole pass with a single multi-draw
+    bool wholePassIndirect = useIndirectDraws && render_pass == SHADOWMAP;
+    if (useIndirectDraws)
+        drawList.Clear();
+
     ////////////////////////////////// RENDER THE MAIN MODEL ///////////////////////////////////////////////////////////////////////////
     // set up the subroutine
-    GLuint index = glGetSubroutineIndex(mainShader.Program, GL_FRAGMENT_SHADER, shader[shaderIndex].c_str());
-    glUniformSubroutinesuiv(GL_FRAGMENT_SHADER, 1, &index);
+    UseMaterial(mainShader, shaderIndex, render_pass);
 
-    // set the Model and Normalmatrix for the model
-    glm::mat4 ModelMatrix = glm::mat4(1.0f);
-    glm::mat3 NormalMatrix = glm::mat3(1.0f);
-    ModelMatrix = glm::translate(ModelMatrix, glm::vec3(0.0f,0.0f,0.0f));
-    if (modelType == Bunny)
-        ModelMatrix = glm::scale(ModelMatrix, glm::vec3(0.4f, 0.4f, 0.4f));
-    else
-        ModelMatrix = glm::scale(ModelMatrix, glm::vec3(0.9f, 0.9f, 0.9f));
-    NormalMatrix = glm::inverseTranspose(glm::mat3(view*ModelMatrix));
+    // the Model and Normalmatrix of the model are cached in the scene (each model has its own object, because they have different scales).
+    // The view matrix is rigid, so the normal matrix in view space is just mat3(view) times the world-space one
+    GLint object = modelObjects[modelType];
+    const glm::mat4& ModelMatrix = scene.worldMatrices[object];
+    glm::mat3 NormalMatrix = glm::mat3(view) * scene.normalMatrices[object];
 
     glUniform1f(glGetUniformLocation(mainShader.Program, "uvRep"), uvRep);
     glUniformMatrix4fv(glGetUniformLocation(mainShader.Program, "modelMatrix"), 1, GL_FALSE, glm::value_ptr(ModelMatrix));
@@ -1318,42 +2412,178 @@ void RenderObjects(Shader &mainShader, GLint shaderIndex, GLint modelType, int r
     glUniformMatrix4fv(glGetUniformLocation(mainShader.Program, "projectionMatrix"), 1, GL_FALSE, glm::value_ptr(projection));
     glUniformMatrix4fv(glGetUniformLocation(mainShader.Program, "viewMatrix"), 1, GL_FALSE, glm::value_ptr(view));
     glUniform3fv(glGetUniformLocation(mainShader.Program, "colorIn"), 1, myColor);
-    models[modelType].Draw();
+    if (wholePassIndirect)
+        drawList.Add(models[modelType], scene.GetInstanceData(object));
+    else if (IsObjectVisible(object))
+        models[modelType].Draw();
     ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 
     ////////////////////////////////////// RENDER THE PILLAR CYLINDERS ////////////////////////////////////////////////////////////////
     // set the subroutine to FULLCOLOR for the cylinders
-    index = glGetSubroutineIndex(mainShader.Program, GL_FRAGMENT_SHADER, shader[FULLCOLOR].c_str());
-    glUniformSubroutinesuiv(GL_FRAGMENT_SHADER, 1, &index);
+    if (!wholePassIndirect)
+        UseMaterial(mainShader, FULLCOLOR, render_pass);
+    glUniform3fv(glGetUniformLocation(mainShader.Program, "colorIn"), 1, colorCylinder);
+
+    // the Modelmatrix of the "coord of the Lightbulb" (the small cylinder above it) is cached in the scene
+    const glm::mat4& cylinderModelMatrix = scene.worldMatrices[lightCordObject];
 
-    // set up the Modelmatrix for every cylinder in each corner, send it to the shader and render
-    glm::vec3 cylinderPos[] = {glm::vec3(-5.0f,-2.0f,-5.0f), glm::vec3(5.0f,-2.0f,-5.0f), glm::vec3(-5.0f,-2.0f,5.0f), glm::vec3(5.0f,-2.0f,5.0f)};
-    for (int i =0; i<4; i++)
+    if (useIndirectDraws)
     {
-        glm::mat4 cylinderModelMatrix = glm::mat4(1.0f);
-        cylinderModelMatrix = glm::translate(cylinderModelMatrix, cylinderPos[i]);
-        cylinderModelMatrix = glm::scale(cylinderModelMatrix, glm::vec3(0.001f, 0.02f, 0.001f));
+        // the cylinders in the corners and the one of the lightbulb are submitted together (with the main model, in the shadow pass).
+        // The per-draw data are read as instance attributes, starting from the baseInstance of each command.
+        // In the prepared views the visible ones have been gathered by the job, in the shadow pass we draw all of them
+        const vector<InstanceData>* cylinders = &visibleInstances;
+        if (activeView)
+            cylinders = &activeView->groups[CYLINDER_GROUP];
+        else
+        {
+            visibleInstances = pillarInstances.instances;
+            visibleInstances.push_back(scene.GetInstanceData(lightCordObject));
+        }
+        if (!cylinders->empty())
+            drawList.Add(envModels[Cylinder], cylinders->data(), cylinders->size());
 
-        glUniformMatrix4fv(glGetUniformLocation(mainShader.Program, "modelMatrix"), 1, GL_FALSE, glm::value_ptr(cylinderModelMatrix));
-        glUniform3fv(glGetUniformLocation(mainShader.Program, "colorIn"), 1, colorCylinder);
-        envModels[Cylinder].Draw();
+        glUniform1i(glGetUniformLocation(mainShader.Program, "instanced"), GL_TRUE);
+        drawList.Submit(geometryBuffer, dynamicBuffer);
+        glUniform1i(glGetUniformLocation(mainShader.Program, "instanced"), GL_FALSE);
+        return;
     }
+
+    // the cylinders in the corners are rendered with a single instanced draw (see pillarInstances), if at least one of them is visible
+    bool anyPillarVisible = false;
+    for (GLuint i = 0; i < pillarObjects.size(); i++)
+        anyPillarVisible = anyPillarVisible || IsObjectVisible(pillarObjects[i]);
+    glUniform1i(glGetUniformLocation(mainShader.Program, "instanced"), GL_TRUE);
+    if (anyPillarVisible)
+        envModels[Cylinder].DrawInstanced(pillarInstances.Count());
+    glUniform1i(glGetUniformLocation(mainShader.Program, "instanced"), GL_FALSE);
     ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
     ///////////////////////////////////// RENDER THE SMALL CYLINDER FOR THE LIGHTBULB /////////////////////////////////////////////////
-    // set the Modelmatrix for the "coord of the Lightbulb", send it to the shader and render
-    glm::mat4 cylinderModelMatrix = glm::mat4(1.0f);
-    cylinderModelMatrix = glm::translate(cylinderModelMatrix, lightPos + glm::vec3(0.0f,0.15f,0.0f));
-    cylinderModelMatrix = glm::scale(cylinderModelMatrix, glm::vec3(0.0001f, 0.01f, 0.0001f));
-
     glUniformMatrix4fv(glGetUniformLocation(mainShader.Program, "modelMatrix"), 1, GL_FALSE, glm::value_ptr(cylinderModelMatrix));
-    glUniform3fv(glGetUniformLocation(mainShader.Program, "colorIn"), 1, colorCylinder);
-    envModels[Cylinder].Draw();
+    if (IsObjectVisible(lightCordObject))
+        envModels[Cylinder].Draw();
     ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
     
 }
 
+void UseMaterial(Shader &program, GLint shaderIndex, int render_pass)
+{
+    if (render_pass == GBUFFER)
+    {
+        // inside we write the whole ID, in a portal only the material bits (the view is the one of the portal quad)
+        if (gbufferView)
+            GLState().StencilFunc(GL_EQUAL, StencilID(shaderIndex, gbufferView), STENCIL_VIEW_MASK);
+        else
+            GLState().StencilFunc(GL_ALWAYS, StencilID(shaderIndex, 0), 0xFF);
+        glUniform1i(glGetUniformLocation(program.Program, "discardUnpainted"), shaderIndex == LambertianPlusShadow);
+        return;
+    }
+    GLuint index = glGetSubroutineIndex(program.Program, GL_FRAGMENT_SHADER, shader[shaderIndex].c_str());
+    glUniformSubroutinesuiv(GL_FRAGMENT_SHADER, 1, &index);
+}
+
+GLint StencilID(GLint shaderIndex, GLint view)
+{
+    return ((shaderIndex + 1) << STENCIL_VIEW_BITS) | view;
+}
+
+void BindShadowMaps(Shader &program, GLint modelType)
+{
+    // pass the shadowMap texture to the shader: the array of the tier of the shadow, and its slot in the array
+    GLState().BindTexture(modelType, GL_TEXTURE_CUBE_MAP_ARRAY, shadowSlots[modelType].texture);
+    GLint shadowLocation = glGetUniformLocation(program.Program, "shadowMap");
+    glUniform1i(shadowLocation, modelType);
+    glUniform1f(glGetUniformLocation(program.Program, "shadowLayer"), shadowSlots[modelType].slot);
+    // the same texture, sampled with hardware comparison
+    GLState().BindTexture(SHADOW_COMPARE_UNIT, GL_TEXTURE_CUBE_MAP_ARRAY, shadowSlots[modelType].texture);
+    GLState().BindSampler(SHADOW_COMPARE_UNIT, shadowCompareSampler);
+    // the static map, if the casters are split
+    glUniform1i(glGetUniformLocation(program.Program, "staticShadows"), staticShadowSlot.tier >= 0);
+    if (staticShadowSlot.tier >= 0)
+    {
+        GLState().BindTexture(STATIC_SHADOW_UNIT, GL_TEXTURE_CUBE_MAP_ARRAY, staticShadowSlot.texture);
+        GLState().BindTexture(STATIC_SHADOW_COMPARE_UNIT, GL_TEXTURE_CUBE_MAP_ARRAY, staticShadowSlot.texture);
+        GLState().BindSampler(STATIC_SHADOW_COMPARE_UNIT, shadowCompareSampler);
+        glUniform1f(glGetUniformLocation(program.Program, "staticShadowLayer"), staticShadowSlot.slot);
+    }
+    // the moments of the model (cube modelType of the moment maps)
+    GLState().BindTexture(MOMENT_MAP_UNIT, GL_TEXTURE_CUBE_MAP_ARRAY, momentMaps.Texture());
+    glUniform1f(glGetUniformLocation(program.Program, "momentLayer"), modelType);
+}
+
+void ClearShadowFaces(const ShadowSlot& slot, GLuint faces)
+{
+    // we attach one layer (face) of the array at a time
+    GLState().BindFramebuffer(shadowFaceFBO);
+    for (int f = 0; f < 6; f++)
+    {
+        if (!(faces & (1u << f)))
+            continue;
+        glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, slot.texture, 0, slot.LayerBase() + f);
+        glClear(GL_DEPTH_BUFFER_BIT);
+    }
+    GLState().BindFramebuffer(frameGraph.CurrentFramebuffer());
+}
+
+void RenderShadowCasters(Shader &shadowShader, GLint modelType, const vector<GLuint>& cylinders, const ShadowSlot& slot, GLuint faces)
+{
+    // the casters are the main model, and the cylinders in the corners and above the lightbulb (or some of them)
+    GLint object = modelType >= 0 ? modelObjects[modelType] : -1;
+
+    // in the layered mode, each caster is added once for each face it overlaps (with the face in TexParams.x),
+    // and all the faces are rendered with one submission. Otherwise we attach one face at a time, with only its casters
+    bool layered = shadowMode == SHADOW_VERTEX_LAYER;
+    glUniform1i(glGetUniformLocation(shadowShader.Program, "layered"), layered);
+    for (int f = 0; f < (layered ? 1 : 6); f++)
+    {
+        if (!layered && !(faces & (1u << f)))
+            continue;
+        shadowModelFaces.clear();
+        shadowCylinderFaces.clear();
+        for (int face = (layered ? 0 : f); face <= (layered ? 5 : f); face++)
+        {
+            if (!(faces & (1u << face)))
+                continue;
+            const FrustumCuller& faceCuller = shadowCuller.faces[face];
+            if (object >= 0 && faceCuller.IsVisible(object))
+            {
+                shadowModelFaces.push_back(scene.GetInstanceData(object));
+                shadowModelFaces.back().TexParams = glm::vec2(face, 0.0f);
+            }
+            for (GLuint cylinder : cylinders)
+            {
+                if (!faceCuller.IsVisible(cylinder))
+                    continue;
+                shadowCylinderFaces.push_back(scene.GetInstanceData(cylinder));
+                shadowCylinderFaces.back().TexParams = glm::vec2(face, 0.0f);
+            }
+        }
+        shadowCuller.stats.faceDraws += shadowModelFaces.size() + shadowCylinderFaces.size();
+        if (shadowModelFaces.empty() && shadowCylinderFaces.empty())
+            continue;
+
+        if (!layered)
+        {
+            GLState().BindFramebuffer(shadowFaceFBO);
+            glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, slot.texture, 0, slot.LayerBase() + f);
+            glUniform1i(glGetUniformLocation(shadowShader.Program, "shadowFace"), f);
+        }
+        drawList.Clear();
+        if (!shadowModelFaces.empty())
+            drawList.Add(models[modelType], shadowModelFaces.data(), shadowModelFaces.size());
+        if (!shadowCylinderFaces.empty())
+            drawList.Add(envModels[Cylinder], shadowCylinderFaces.data(), shadowCylinderFaces.size());
+        drawList.Submit(geometryBuffer, dynamicBuffer);
+    }
+    shadowCuller.stats.allFaceDraws += 6 * ((object >= 0) + cylinders.size());
+
+    // the next passes find the framebuffer of the graph bound, as they expect
+    if (!layered)
+        GLState().BindFramebuffer(frameGraph.CurrentFramebuffer());
+}
+
 void drawLines(GLuint framebuffer) 
 {
     // set up the vertices Array
@@ -1386,32 +2616,62 @@ void drawLines(GLuint framebuffer)
         }
     }
 
-    // then we set up a VBO and VAO to render these vertices as triangle strips
-    GLuint VBO, VAO;
+    // then we write these vertices in the ring buffer, and we render them as triangle strips.
+    // The offset of the allocation is a whole number of vertices, so we use it as first vertex of the draw
+    RingAllocation lines = dynamicBuffer.Allocate(sizeof(vertices), 2 * sizeof(GLfloat));
+    if (!lines.ptr)
+        return;
+    memcpy(lines.ptr, vertices, sizeof(vertices));
+    dynamicBuffer.Flush();
+    GLint first = lines.offset / (2 * sizeof(GLfloat));
+
+    GLState().BindVertexArray(linesVAO);
+    
+    // we render them once in the paint framebuffer
+    GLState().BindFramebuffer(framebuffer);
+    glDrawArrays(GL_TRIANGLE_STRIP, first, 2 * numMousePoints - 2);
+
+    // and once in the normal framebuffer, so the user can see the paint strokes
+    GLState().BindFramebuffer(0);
+    glDrawArrays(GL_TRIANGLE_STRIP, first, 2 * numMousePoints - 2);
+}
+
+void LatchMousePosition(GLFWwindow* window)
+{
+    // glfwGetCursorPos asks the window system for the position, so it is more recent than the last event we processed
+    double xPos, yPos;
+    glfwGetCursorPos(window, &xPos, &yPos);
+    float x = (float)(2 * xPos) / screenWidth - 1.0f;
+    float y = 1.0f - (float)(2 * yPos) / screenHeight;
+    framePacer.MarkInput();
+
+    // we add the point only if the mouse has moved, otherwise the direction of the last segment is not defined
+    if (numMousePoints > 0 && mouseHist[2*numMousePoints-2] == x && mouseHist[2*numMousePoints-1] == y)
+        return;
+    mouseX = x;
+    mouseY = y;
+    mouseHist.push_back(x);
+    mouseHist.push_back(y);
+    numMousePoints++;
+}
+
+GLuint SetupLines()
+{
+    // the VAO is created once: the vertices of each frame are in a different range of the ring buffer
+    GLuint VAO;
     glGenVertexArrays(1, &VAO);
-    glGenBuffers(1, &VBO);
 
-    glBindVertexArray(VAO);
-    glBindBuffer(GL_ARRAY_BUFFER, VBO);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
+    GLState().BindVertexArray(VAO);
+    glBindBuffer(GL_ARRAY_BUFFER, dynamicBuffer.buffer);
 
     glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(GLfloat), (void*)0);
     glEnableVertexAttribArray(0);
-    
-    // we render them once in the paint framebuffer
-    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
-    glDrawArrays(GL_TRIANGLE_STRIP, 0, 2 * numMousePoints - 2);
 
-    // and once in the normal framebuffer, so the user can see the paint strokes
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
-    glDrawArrays(GL_TRIANGLE_STRIP, 0, 2 * numMousePoints - 2);
-    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
 
+    GLState().BindVertexArray(0);
 
-    // Cleanup
-    glDeleteVertexArrays(1, &VAO);
-    glDeleteBuffers(1, &VBO);
- 
+    return VAO;
 }
 
 std::vector<GLuint> nearestPortals(glm::vec3 cameraPos)
@@ -1459,30 +2719,463 @@ GLint LoadTexture(const char* path)
     if (image == nullptr)
         std::cout << "Failed to load texture!" << std::endl;
 
-    glGenTextures(1, &textureImage);
-    glBindTexture(GL_TEXTURE_2D, textureImage);
-
-    // 3 channels = RGB ; 4 channel = RGBA
-    if (channels==3)
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, w, h, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
-    else if (channels==4)
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, image);
-    glGenerateMipmap(GL_TEXTURE_2D);
+    // with direct state access we allocate an immutable storage with the whole mipmap chain, and we fill it without binding the texture
+    if (GLState().hasDSA && image != nullptr)
+    {
+        GLsizei levels = 1 + (GLsizei)std::floor(std::log2((float)std::max(w, h)));
+        glCreateTextures(GL_TEXTURE_2D, 1, &textureImage);
+        glTextureStorage2D(textureImage, levels, GL_RGB8, w, h);
+        // STBI_rgb forces 3 tightly packed channels, whatever is stored in the file
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glTextureSubImage2D(textureImage, 0, 0, 0, w, h, GL_RGB, GL_UNSIGNED_BYTE, image);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glGenerateTextureMipmap(textureImage);
+    }
+    else
+    {
+        glGenTextures(1, &textureImage);
+        GLState().BindTextureForEdit(GL_TEXTURE_2D, textureImage);
+
+        // 3 channels = RGB ; 4 channel = RGBA
+        if (channels==3)
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, w, h, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
+        else if (channels==4)
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, image);
+        glGenerateMipmap(GL_TEXTURE_2D);
+    }
 
     // we set how to consider UVs outside [0,1] range
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    GLState().TextureParameteri(textureImage, GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    GLState().TextureParameteri(textureImage, GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
 
     // we set the filtering for minification and magnification
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+    GLState().TextureParameteri(textureImage, GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    GLState().TextureParameteri(textureImage, GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST_MIPMAP_NEAREST);
 
     // we free the memory once we have created an OpenGL texture
     stbi_image_free(image);
 
     // we set the binding to 0 once we have finished
-    glBindTexture(GL_TEXTURE_2D, 0);
+    if (!GLState().hasDSA)
+        GLState().BindTextureForEdit(GL_TEXTURE_2D, 0);
 
     return textureImage;
 
-}
\ No newline at end of file
+}
+
+GLuint LoadTextureArray(const std::vector<std::string>& paths, GLsizei size)
+{
+    GLsizei layers = paths.size();
+    // RGB data of all the layers, one after the other
+    std::vector<unsigned char> data(3 * size * size * layers, 255);
+
+    for (GLsizei layer = 0; layer < layers; layer++)
+    {
+        int w, h, channels;
+        unsigned char* image = stbi_load(paths[layer].c_str(), &w, &h, &channels, STBI_rgb);
+        if (image == nullptr)
+        {
+            std::cout << "Failed to load texture " << paths[layer] << "!" << std::endl;
+            continue;
+        }
+
+        // the layers of a texture array must have the same size, so we resample each image with bilinear filtering
+        unsigned char* dst = &data[3 * size * size * layer];
+        for (GLsizei y = 0; y < size; y++)
+        {
+            float fy = std::max(0.0f, (y + 0.5f) * h / size - 0.5f);
+            int y0 = std::min((int)fy, h - 1);
+            int y1 = std::min(y0 + 1, h - 1);
+            float ty = fy - y0;
+            for (GLsizei x = 0; x < size; x++)
+            {
+                float fx = std::max(0.0f, (x + 0.5f) * w / size - 0.5f);
+                int x0 = std::min((int)fx, w - 1);
+                int x1 = std::min(x0 + 1, w - 1);
+                float tx = fx - x0;
+                for (int c = 0; c < 3; c++)
+                {
+                    float top = image[3 * (y0 * w + x0) + c] * (1.0f - tx) + image[3 * (y0 * w + x1) + c] * tx;
+                    float bottom = image[3 * (y1 * w + x0) + c] * (1.0f - tx) + image[3 * (y1 * w + x1) + c] * tx;
+                    dst[3 * (y * size + x) + c] = (unsigned char)(top * (1.0f - ty) + bottom * ty + 0.5f);
+                }
+            }
+        }
+        stbi_image_free(image);
+    }
+
+    GLuint textureArray;
+    GLsizei levels = 1 + (GLsizei)std::floor(std::log2((float)size));
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    if (GLState().hasDSA)
+    {
+        glCreateTextures(GL_TEXTURE_2D_ARRAY, 1, &textureArray);
+        glTextureStorage3D(textureArray, levels, GL_RGB8, size, size, layers);
+        glTextureSubImage3D(textureArray, 0, 0, 0, 0, size, size, layers, GL_RGB, GL_UNSIGNED_BYTE, data.data());
+        glGenerateTextureMipmap(textureArray);
+    }
+    else
+    {
+        glGenTextures(1, &textureArray);
+        GLState().BindTextureForEdit(GL_TEXTURE_2D_ARRAY, textureArray);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGB8, size, size, layers, 0, GL_RGB, GL_UNSIGNED_BYTE, data.data());
+        glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+    // we set how to consider UVs outside [0,1] range, and the filtering for minification and magnification
+    GLState().TextureParameteri(textureArray, GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    GLState().TextureParameteri(textureArray, GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    GLState().TextureParameteri(textureArray, GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    GLState().TextureParameteri(textureArray, GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+    if (!GLState().hasDSA)
+        GLState().BindTextureForEdit(GL_TEXTURE_2D_ARRAY, 0);
+
+    return textureArray;
+}
+
+bool SetupScene(const char* path)
+{
+    scene.Load(path);
+
+    // the objects of the models follow the order of the availabe_Models enum.
+    // All of them are needed by the render loop: Find() prints each missing one, and we stop if any is missing
+    const char* modelNames[] = {"bunny", "cube", "sphere"};
+    bool complete = true;
+    for (int i = 0; i < NumModel; i++)
+    {
+        modelObjects[i] = scene.Find(modelNames[i]);
+        complete &= modelObjects[i] >= 0;
+    }
+    lightbulbObject = scene.Find("lightbulb");
+    lightCordObject = scene.Find("lightcord");
+    complete &= lightbulbObject >= 0 && lightCordObject >= 0;
+    for (int i = 0; i < 4; i++)
+    {
+        portalObjects[i] = scene.Find("portal" + std::to_string(i));
+        complete &= portalObjects[i] >= 0;
+    }
+    if (!complete)
+    {
+        cout << "ERROR::SCENE:: " << path << " does not contain all the objects of the application" << endl;
+        return false;
+    }
+
+    // the bounding sphere of each object is the bounding sphere of its mesh
+    for (GLuint i = 0; i < scene.Size(); i++)
+    {
+        const string& mesh = scene.meshes[i];
+        const Model* model = NULL;
+        if (mesh == "bunny") model = &models[Bunny];
+        else if (mesh == "cube") model = &models[Cube];
+        else if (mesh == "sphere") model = &models[Sphere];
+        else if (mesh == "plane") model = &envModels[Plane];
+        else if (mesh == "cylinder") model = &envModels[Cylinder];
+
+        objectBVHs.push_back(model ? &model->bvh : NULL);
+        if (model)
+            scene.SetLocalBounds(i, model->sphereCenter, model->sphereRadius);
+        else if (mesh == "portal")
+            // the portal quad of SetupPortal()
+            scene.SetLocalBounds(i, glm::vec3(0.0f), sqrt(2.0f));
+    }
+    scene.UpdateTransforms();
+    sceneBVH.Build(scene);
+
+    // the position of the objects attached to the light is an offset from the light
+    for (GLuint i = 0; i < scene.Size(); i++)
+    {
+        if (scene.kinds[i] == LIGHT_OBJECT)
+        {
+            lightObjects.push_back(i);
+            lightOffsets.push_back(scene.positions[i]);
+        }
+    }
+    return true;
+}
+
+void SetupEnvironmentInstances()
+{
+    // the static planes (floors, walls and ceiling) and cylinders (the pillars in each corner) of the scene.
+    // They never move, so their instance buffers are uploaded only once
+    planeObjects = scene.FindAll("plane", STATIC_OBJECT);
+    for (GLuint i : planeObjects)
+        planeInstances.Add(scene.GetInstanceData(i));
+
+    pillarObjects = scene.FindAll("cylinder", STATIC_OBJECT);
+    for (GLuint i : pillarObjects)
+        pillarInstances.Add(scene.GetInstanceData(i));
+
+    // the instanced groups of the prepared views (see instanceGroupIDs)
+    instanceGroups.resize(2);
+    instanceGroups[PLANE_GROUP] = planeObjects;
+    instanceGroups[CYLINDER_GROUP] = pillarObjects;
+    instanceGroups[CYLINDER_GROUP].push_back(lightCordObject);
+
+    // we copy the data on the GPU, and we attach the buffers to the VAOs of the models
+    planeInstances.Upload();
+    planeInstances.Attach(envModels[Plane]);
+    pillarInstances.Upload();
+    pillarInstances.Attach(envModels[Cylinder]);
+}
+
+bool IsObjectVisible(GLint object)
+{
+    return !activeView || activeView->IsVisible(object);
+}
+
+void BuildModelBVHs()
+{
+    // the models are independent, so each tree is built by its own thread
+    double start = glfwGetTime();
+    vector<Model*> all;
+    for (GLuint i = 0; i < models.size(); i++)
+        all.push_back(&models[i]);
+    for (GLuint i = 0; i < envModels.size(); i++)
+        all.push_back(&envModels[i]);
+
+    vector<std::future<void>> jobs;
+    for (Model* model : all)
+        jobs.push_back(std::async(std::launch::async, [model]() { model->BuildBVH(); }));
+    for (GLuint i = 0; i < jobs.size(); i++)
+        jobs[i].get();
+
+    GLuint triangles = 0;
+    for (Model* model : all)
+        triangles += model->bvh.TriangleCount();
+    cout << "Triangle BVHs: " << triangles << " triangles in " << all.size() << " models, " << (glfwGetTime() - start) * 1000.0 << " ms" << endl;
+}
+
+void BakeModelOcclusion()
+{
+    // the vertices of all the models are split in jobs: the GL thread bakes them too while it waits, then it uploads the values
+    vector<Model*> all;
+    for (GLuint i = 0; i < models.size(); i++)
+        all.push_back(&models[i]);
+    // the planes and the cylinders cannot occlude themselves (the rays hit only their own model): they are not baked
+    for (GLuint i = 0; i < envModels.size(); i++)
+        if (i != Plane && i != Cylinder)
+            all.push_back(&envModels[i]);
+
+    JobCounter occlusionJobs;
+    occlusionBaker.Start(jobSystem, occlusionJobs, all);
+    jobSystem.Wait(occlusionJobs);
+    occlusionBaker.Finish();
+    cout << "Ambient occlusion: " << occlusionBaker.vertices << " vertices, " << occlusionBaker.bakedModels << " models baked, "
+         << occlusionBaker.cachedModels << " loaded from the caches, " << occlusionBaker.bakeTime << " ms" << endl;
+}
+
+void PrepareViews(const std::vector<GLuint>& portals, int viewportHeight)
+{
+    // the parameters are copied in the jobs, so the GL thread can change them (e.g. from the ImGui window) while the jobs run
+    ViewParams params;
+    viewFrustum = Frustum::FromMatrix(projection * view);
+    params.frustum = viewFrustum;
+    params.eye = cameraPos;
+    params.forward = cameraView;
+    params.pixelScale = projection[1][1] * viewportHeight * 0.5f;
+    params.minPixels = minObjectPixels;
+    params.cull = useCulling;
+    params.bvh = useBVHCulling ? &sceneBVH : NULL;
+    jobSystem.Run(viewJobs, [params]() { insideView.Prepare(scene, instanceGroups, params); });
+
+    // the frustum of a portal is restricted by the planes through the camera and the edges of the portal
+    const glm::vec4 localCorners[] = {glm::vec4(1.0f,0.0f,-1.0f,1.0f), glm::vec4(1.0f,0.0f,1.0f,1.0f), glm::vec4(-1.0f,0.0f,1.0f,1.0f), glm::vec4(-1.0f,0.0f,-1.0f,1.0f)};
+    for (GLuint i : portals)
+    {
+        ViewParams portalParams = params;
+        glm::vec3 corners[4];
+        for (int c = 0; c < 4; c++)
+            corners[c] = glm::vec3(scene.worldMatrices[portalObjects[i]] * localCorners[c]);
+        portalParams.frustum = Frustum::ThroughPortal(viewFrustum, cameraPos, corners);
+        jobSystem.Run(viewJobs, [portalParams, i]() { portalViews[i].Prepare(scene, instanceGroups, portalParams); });
+    }
+}
+
+void BenchmarkViewPreparation()
+{
+    // a bigger scene: GRID x GRID copies of the room, each with its planes and cylinders
+    const int GRID = 16;
+    const int VIEWS = 16;
+    const int FRAMES = 20;
+    Scene bigScene;
+    vector<vector<GLuint>> bigGroups(instanceGroups.size());
+    for (int x = 0; x < GRID; x++)
+    {
+        for (int z = 0; z < GRID; z++)
+        {
+            GLuint first = bigScene.Size();
+            glm::vec3 offset(12.0f * (x - GRID / 2), 0.0f, 12.0f * (z - GRID / 2));
+            for (GLuint i = 0; i < scene.Size(); i++)
+            {
+                GLuint copy = bigScene.Add(scene.kinds[i], scene.names[i], scene.meshes[i], scene.texParams[i], scene.positions[i] + offset, scene.rotations[i], scene.scales[i]);
+                bigScene.SetLocalBounds(copy, glm::vec3(scene.localSpheres[i]), scene.localSpheres[i].w);
+            }
+            for (GLuint g = 0; g < instanceGroups.size(); g++)
+                for (GLuint object : instanceGroups[g])
+                    bigGroups[g].push_back(first + object);
+        }
+    }
+    bigScene.UpdateTransforms();
+
+    // many views (as many portals) looking around from the center, with the projection of the main view
+    vector<ViewParams> params(VIEWS);
+    for (int v = 0; v < VIEWS; v++)
+    {
+        GLfloat angle = 2.0f * 3.14159265f * v / VIEWS;
+        params[v].eye = glm::vec3(0.0f, 2.0f, 0.0f);
+        params[v].forward = glm::vec3(sin(angle), 0.0f, cos(angle));
+        params[v].frustum = Frustum::FromMatrix(projection * glm::lookAt(params[v].eye, params[v].eye + params[v].forward, glm::vec3(0.0f, 1.0f, 0.0f)));
+        params[v].pixelScale = projection[1][1] * screenHeight * 0.5f;
+        params[v].minPixels = minObjectPixels;
+    }
+    vector<PreparedView> views(VIEWS);
+
+    cout << "View preparation benchmark: " << bigScene.Size() << " objects, " << VIEWS << " views" << endl;
+    viewBenchmark.clear();
+    unsigned previousWorkers = jobSystem.WorkerCount();
+    unsigned maxWorkers = glm::max(JobSystem::DefaultWorkerCount(), 1u);
+    for (unsigned workers = 0; workers <= maxWorkers; workers++)
+    {
+        jobSystem.SetWorkerCount(workers);
+        double start = 0.0;
+        // the first frame is not measured (it allocates the vectors of the views)
+        for (int frame = 0; frame <= FRAMES; frame++)
+        {
+            if (frame == 1)
+                start = glfwGetTime();
+            JobCounter counter;
+            for (int v = 0; v < VIEWS; v++)
+                jobSystem.Run(counter, [&, v]() { views[v].Prepare(bigScene, bigGroups, params[v]); });
+            jobSystem.Wait(counter);
+        }
+        float milliseconds = float((glfwGetTime() - start) * 1000.0 / FRAMES);
+        viewBenchmark.push_back(milliseconds);
+        cout << "  " << workers << " workers: " << milliseconds << " ms/frame (x" << viewBenchmark[0] / milliseconds << ")" << endl;
+    }
+    jobSystem.SetWorkerCount(previousWorkers);
+}
+
+void UpdatePointLights(int count, float time)
+{
+    // the orbits are random, but always the same for the same number of lights
+    if ((int)pointLightOrbits.size() != count)
+    {
+        std::mt19937 random(1234);
+        std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+        pointLightOrbits.resize(count);
+        for (int i = 0; i < count; i++)
+        {
+            GLfloat speed = 0.1f + 0.3f * uniform(random);
+            pointLightOrbits[i] = glm::vec4(1.0f + 11.0f * uniform(random), 2.0f * 3.14159265f * uniform(random), -0.8f + 8.0f * uniform(random),
+                                            uniform(random) < 0.5f ? -speed : speed);
+        }
+    }
+
+    // with more lights each one is dimmer, so the room is not overexposed
+    const GLfloat radius = 2.5f;
+    GLfloat intensity = 1.5f * sqrt(64.0f / glm::max((GLfloat)count, 64.0f));
+    clusteredLights.Clear();
+    for (int i = 0; i < count; i++)
+    {
+        const glm::vec4& orbit = pointLightOrbits[i];
+        GLfloat angle = orbit.y + orbit.w * time;
+        glm::vec3 position(orbit.x * cos(angle), orbit.z, orbit.x * sin(angle));
+        // a hue for each light, from the phase of its orbit
+        glm::vec3 color = 0.5f + 0.5f * glm::cos(orbit.y + glm::vec3(0.0f, 2.094f, 4.189f));
+        clusteredLights.Add(position, radius, intensity * color);
+    }
+}
+
+void StepLightBenchmark()
+{
+    // the first frames of a step are not measured: the results of the GPU timer come back a few frames later
+    const int WARMUP_FRAMES = 10;
+    const int FRAMES = 60;
+    lightBenchmarkFrames++;
+    if (lightBenchmarkFrames <= WARMUP_FRAMES)
+        return;
+    lightBenchmarkAssign += clusteredLights.stats.assignTime;
+    lightBenchmarkRender += renderTimer.lastTime;
+    if (lightBenchmarkFrames < WARMUP_FRAMES + FRAMES)
+        return;
+
+    LightBenchmarkResult result;
+    result.lights = pointLightCounts[lightBenchmarkStep];
+    result.assignTime = float(lightBenchmarkAssign / FRAMES);
+    result.renderTime = float(lightBenchmarkRender / FRAMES);
+    lightBenchmark.push_back(result);
+    cout << "  " << result.lights << " lights: assignment " << result.assignTime << " ms/frame, render pass " << result.renderTime << " ms/frame, "
+         << clusteredLights.stats.indices << " indices" << endl;
+
+    lightBenchmarkFrames = 0;
+    lightBenchmarkAssign = lightBenchmarkRender = 0.0;
+    lightBenchmarkStep++;
+    if (lightBenchmarkStep == IM_ARRAYSIZE(pointLightCounts))
+        lightBenchmarkStep = -1;
+}
+
+GLfloat ShadowImportance(GLint modelType, int viewportHeight)
+{
+    GLint object = modelObjects[modelType];
+    glm::vec3 center(scene.sphereX[object], scene.sphereY[object], scene.sphereZ[object]);
+    GLfloat radius = scene.sphereRadius[object];
+    // the camera inside the bounding sphere sees the model at full screen
+    GLfloat distance = glm::max(glm::length(center - cameraPos), radius);
+    GLfloat pixels = 2.0f * radius * projection[1][1] * viewportHeight * 0.5f / distance;
+    for (int p = 0; p < 6; p++)
+        if (glm::dot(glm::vec3(viewFrustum.planes[p]), center) + viewFrustum.planes[p].w < -radius)
+            return 0.25f * pixels;
+    return pixels;
+}
+
+RayHit PickObject(float x, float y, GLint modelInside)
+{
+    // we unproject the mouse position on the near and far planes
+    glm::mat4 inverseProjView = glm::inverse(projection * view);
+    glm::vec4 nearPoint = inverseProjView * glm::vec4(x, y, -1.0f, 1.0f);
+    glm::vec4 farPoint = inverseProjView * glm::vec4(x, y, 1.0f, 1.0f);
+    glm::vec3 origin = glm::vec3(nearPoint) / nearPoint.w;
+    glm::vec3 direction = glm::normalize(glm::vec3(farPoint) / farPoint.w - origin);
+
+    // all the models are in the center of the room: only the one rendered in the inside view can be picked
+    vector<const TriangleBVH*> pickable = objectBVHs;
+    for (int i = 0; i < NumModel; i++)
+        if (i != modelInside && modelObjects[i] >= 0)
+            pickable[modelObjects[i]] = NULL;
+    return sceneBVH.Pick(scene, Ray(origin, direction), pickable);
+}
+
+void UpdateRenderScale()
+{
+    framesSinceScaleChange++;
+    if (framesSinceScaleChange < RENDER_SCALE_INTERVAL || renderTimer.averageTime <= 0.0f)
+        return;
+    // both timers measure only GPU work: the render pass (the draws of the scene, without the waits on the CPU before them),
+    // and the post processing, which runs at the window resolution. The render pass gets what is left of the target.
+    // We go up only if the render pass would still fit with some margin, so the scale does not swing between two steps
+    float budget = targetFrameTime - postTimer.averageTime;
+    float nextScale = renderScale + RENDER_SCALE_STEP;
+    if (renderTimer.averageTime > budget && renderScale > MIN_RENDER_SCALE)
+        renderScale -= RENDER_SCALE_STEP;
+    else if (renderTimer.averageTime * (nextScale * nextScale) / (renderScale * renderScale) < 0.9f * budget && renderScale < 1.0f)
+        renderScale = nextScale;
+    else
+        return;
+    renderScale = glm::clamp(glm::round(renderScale / RENDER_SCALE_STEP) * RENDER_SCALE_STEP, MIN_RENDER_SCALE, 1.0f);
+    framesSinceScaleChange = 0;
+}
+
+float Halton(GLuint index, GLuint base)
+{
+    float result = 0.0f;
+    float fraction = 1.0f;
+    while (index > 0)
+    {
+        fraction /= base;
+        result += fraction * (index % base);
+        index /= base;
+    }
+    return result;
+}
@@ -0,0 +1,258 @@
+/*
+OcclusionBaker class
+- offline ambient occlusion of the models (the objects, the room and the lightbulb), one value for each vertex:
+  SAMPLES rays are cast from the vertex in the hemisphere around its normal (cosine-weighted directions), against the triangle BVH
+  of its model, and the occlusion is the fraction of the rays which do not hit anything closer than RAY_LENGTH
+- the vertices are split in jobs of VERTICES_PER_JOB, executed on the worker threads (Start). Then the values are saved in a binary cache
+  next to the model (e.g. models/bunny_lp.obj.ao, next to the cache of the BVH), and uploaded in a vertex buffer of each mesh (Finish).
+  The next runs only load the cache
+- the main shader reads the value as a vertex attribute (OCCLUSION_ATTRIB_LOCATION, see mesh.h) and darkens the ambient light with it,
+  so the occlusion costs a single attribute fetch, instead of a screen-space pass in each frame
+
+N.B. 1) the rays are tested only against the triangles of the same model, in model coordinates: the occlusion of a model does not depend
+on where its instances are placed, so all of them share the same vertex buffer. The contact shadows between different objects
+(e.g. a pillar on the floor) are not baked: they would need a value for each instance, or a texture in a unique UV layout.
+For the same reason the floor planes (4 vertices) and the pillars (convex) are not baked at all: nothing of their own model can occlude them
+
+N.B. 2) all the vertices use the same directions (Hammersley points), rotated around the normal by a different angle for each vertex,
+so the sampling error does not show as the same pattern on neighbouring vertices
+
+N.B. 3) the cache is valid only for the same geometry (hash of the positions and normals), the same SAMPLES and RAY_LENGTH,
+and the same version of the baker: CACHE_VERSION must change with it
+*/
+
+#pragma once
+
+using namespace std;
+
+// Std. Includes
+#include <vector>
+#include <string>
+#include <fstream>
+#include <iostream>
+#include <cstdint>
+#include <chrono>
+
+#include <glm/glm.hpp>
+
+#include <utils/model.h>
+#include <utils/jobsystem.h>
+
+/////////////////// OCCLUSIONBAKER class ///////////////////////
+class OcclusionBaker
+{
+public:
+    // rays for each vertex, and vertices baked by each job
+    static const GLuint SAMPLES = 128;
+    static const GLuint VERTICES_PER_JOB = 256;
+    // length of the rays, relative to the radius of the bounding sphere of the model
+    static constexpr GLfloat RAY_LENGTH = 0.5f;
+
+    // models baked in this run and models loaded from their cache, and their vertices
+    GLuint bakedModels = 0;
+    GLuint cachedModels = 0;
+    GLuint vertices = 0;
+    // time spent to load or bake all the models (milliseconds)
+    double bakeTime = 0.0;
+
+    OcclusionBaker() = default;
+    OcclusionBaker(const OcclusionBaker& copy) = delete; //disallow copy
+    OcclusionBaker& operator=(const OcclusionBaker&) = delete;
+
+    //////////////////////////////////////////
+
+    // we load the occlusion of each model from its cache, or we start the jobs which bake it (the caller waits for counter before Finish).
+    // The models must not move until Finish
+    void Start(JobSystem& jobs, JobCounter& counter, const vector<Model*>& models)
+    {
+        this->start = chrono::steady_clock::now();
+        this->models = models;
+        this->cached.assign(models.size(), false);
+        this->bakedModels = this->cachedModels = this->vertices = 0;
+        for (GLuint i = 0; i < models.size(); i++)
+        {
+            Model* model = models[i];
+            for (GLuint m = 0; m < model->meshes.size(); m++)
+            {
+                model->meshes[m].occlusion.assign(model->meshes[m].vertices.size(), 1.0f);
+                this->vertices += model->meshes[m].vertices.size();
+            }
+            this->cached[i] = this->loadCache(*model);
+            if (this->cached[i])
+            {
+                this->cachedModels++;
+                continue;
+            }
+            this->bakedModels++;
+            // each job writes only its own range of vertices
+            for (GLuint m = 0; m < model->meshes.size(); m++)
+                for (GLuint first = 0; first < model->meshes[m].vertices.size(); first += VERTICES_PER_JOB)
+                    jobs.Run(counter, [model, m, first]() { BakeVertices(*model, m, first); });
+        }
+    }
+
+    // we save the baked models, and we upload the occlusion of all the meshes
+    void Finish()
+    {
+        for (GLuint i = 0; i < this->models.size(); i++)
+        {
+            if (!this->cached[i])
+                this->saveCache(*this->models[i]);
+            for (GLuint m = 0; m < this->models[i]->meshes.size(); m++)
+                this->models[i]->meshes[m].SetupOcclusion();
+        }
+        this->models.clear();
+        this->bakeTime = chrono::duration<double, milli>(chrono::steady_clock::now() - this->start).count();
+    }
+
+private:
+    static constexpr GLfloat PI = 3.14159265359f;
+    static const uint32_t CACHE_MAGIC = 0x4B424F41; // "AOBK"
+    static const uint32_t CACHE_VERSION = 1;
+
+    vector<Model*> models;
+    vector<bool> cached;
+    chrono::steady_clock::time_point start;
+
+    // i-th of the n points of the Hammersley set, in [0, 1)^2
+    static glm::vec2 Hammersley(GLuint i, GLuint n)
+    {
+        GLuint bits = i;
+        bits = (bits << 16u) | (bits >> 16u);
+        bits = ((bits & 0x55555555u) << 1u) | ((bits & 0xAAAAAAAAu) >> 1u);
+        bits = ((bits & 0x33333333u) << 2u) | ((bits & 0xCCCCCCCCu) >> 2u);
+        bits = ((bits & 0x0F0F0F0Fu) << 4u) | ((bits & 0xF0F0F0F0u) >> 4u);
+        bits = ((bits & 0x00FF00FFu) << 8u) | ((bits & 0xFF00FF00u) >> 8u);
+        return glm::vec2(GLfloat(i) / n, GLfloat(bits) * 2.3283064365386963e-10f);
+    }
+
+    // a pseudo-random angle in [0, 2 PI) for each vertex (integer hash of its index)
+    static GLfloat VertexAngle(GLuint index)
+    {
+        index ^= index >> 16;
+        index *= 0x7FEB352Du;
+        index ^= index >> 15;
+        index *= 0x846CA68Bu;
+        index ^= index >> 16;
+        return 2.0f * PI * (index & 0xFFFFFF) / GLfloat(0x1000000);
+    }
+
+    static void BakeVertices(Model& model, GLuint meshIndex, GLuint first)
+    {
+        Mesh& mesh = model.meshes[meshIndex];
+        GLuint last = glm::min(first + VERTICES_PER_JOB, (GLuint)mesh.vertices.size());
+        GLfloat rayLength = RAY_LENGTH * model.sphereRadius;
+        // the rays start a little above the surface, so they do not hit the triangles of the vertex
+        GLfloat bias = 1e-4f * model.sphereRadius;
+        for (GLuint v = first; v < last; v++)
+        {
+            const Vertex& vertex = mesh.vertices[v];
+            glm::vec3 normal = glm::normalize(vertex.Normal);
+            // orthonormal basis around the normal
+            glm::vec3 up = glm::abs(normal.z) < 0.999f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(1.0f, 0.0f, 0.0f);
+            glm::vec3 tangent = glm::normalize(glm::cross(up, normal));
+            glm::vec3 bitangent = glm::cross(normal, tangent);
+            glm::vec3 origin = vertex.Position + normal * bias;
+            GLfloat rotation = VertexAngle(v + meshIndex * 7919u);
+
+            GLuint hits = 0;
+            for (GLuint s = 0; s < SAMPLES; s++)
+            {
+                // cosine-weighted direction: the fraction of the rays which hit is the occlusion weighted as the diffuse light
+                glm::vec2 u = Hammersley(s, SAMPLES);
+                GLfloat phi = 2.0f * PI * u.x + rotation;
+                GLfloat sinTheta = glm::sqrt(u.y);
+                GLfloat cosTheta = glm::sqrt(1.0f - u.y);
+                glm::vec3 direction = tangent * (sinTheta * glm::cos(phi)) + bitangent * (sinTheta * glm::sin(phi)) + normal * cosTheta;
+                RayHit hit;
+                hit.t = rayLength;
+                if (model.bvh.Intersect(Ray(origin, direction), hit))
+                    hits++;
+            }
+            mesh.occlusion[v] = 1.0f - GLfloat(hits) / SAMPLES;
+        }
+    }
+
+    // FNV-1a hash of the positions and normals of all the meshes
+    static uint64_t GeometryHash(const Model& model)
+    {
+        uint64_t hash = 14695981039346656037ULL;
+        for (GLuint m = 0; m < model.meshes.size(); m++)
+            for (GLuint v = 0; v < model.meshes[m].vertices.size(); v++)
+            {
+                const Vertex& vertex = model.meshes[m].vertices[v];
+                const unsigned char* bytes[] = {(const unsigned char*)&vertex.Position, (const unsigned char*)&vertex.Normal};
+                for (GLuint b = 0; b < 2; b++)
+                    for (size_t i = 0; i < sizeof(glm::vec3); i++)
+                    {
+                        hash ^= bytes[b][i];
+                        hash *= 1099511628211ULL;
+                    }
+            }
+        return hash;
+    }
+
+    static GLuint VertexCount(const Model& model)
+    {
+        GLuint count = 0;
+        for (GLuint m = 0; m < model.meshes.size(); m++)
+            count += model.meshes[m].vertices.size();
+        return count;
+    }
+
+    bool loadCache(Model& model)
+    {
+        ifstream file(model.path + ".ao", ios::binary);
+        if (!file)
+            return false;
+        uint32_t magic = 0, version = 0, samples = 0, count = 0;
+        GLfloat rayLength = 0.0f;
+        uint64_t hash = 0;
+        file.read((char*)&magic, sizeof(magic));
+        file.read((char*)&version, sizeof(version));
+        file.read((char*)&samples, sizeof(samples));
+        file.read((char*)&rayLength, sizeof(rayLength));
+        file.read((char*)&hash, sizeof(hash));
+        file.read((char*)&count, sizeof(count));
+        if (!file || magic != CACHE_MAGIC || version != CACHE_VERSION || samples != SAMPLES || rayLength != RAY_LENGTH ||
+            count != VertexCount(model) || hash != GeometryHash(model))
+            return false;
+        for (GLuint m = 0; m < model.meshes.size(); m++)
+        {
+            vector<GLfloat>& occlusion = model.meshes[m].occlusion;
+            file.read((char*)occlusion.data(), occlusion.size() * sizeof(GLfloat));
+        }
+        if (!file)
+        {
+            // the values read so far are not valid: we bake all of them again
+            for (GLuint m = 0; m < model.meshes.size(); m++)
+                model.meshes[m].occlusion.assign(model.meshes[m].vertices.size(), 1.0f);
+            return false;
+        }
+        return true;
+    }
+
+    void saveCache(const Model& model) const
+    {
+        string path = model.path + ".ao";
+        ofstream file(path, ios::binary);
+        if (!file)
+        {
+            cout << "ERROR::AOBAKER:: cannot write the cache " << path << endl;
+            return;
+        }
+        // the constants are copied: writing them from their address would need a definition outside of the class
+        uint32_t magic = CACHE_MAGIC, version = CACHE_VERSION;
+        uint32_t samples = SAMPLES, count = VertexCount(model);
+        GLfloat rayLength = RAY_LENGTH;
+        uint64_t hash = GeometryHash(model);
+        file.write((const char*)&magic, sizeof(magic));
+        file.write((const char*)&version, sizeof(version));
+        file.write((const char*)&samples, sizeof(samples));
+        file.write((const char*)&rayLength, sizeof(rayLength));
+        file.write((const char*)&hash, sizeof(hash));
+        file.write((const char*)&count, sizeof(count));
+        for (GLuint m = 0; m < model.meshes.size(); m++)
+            file.write((const char*)model.meshes[m].occlusion.data(), model.meshes[m].occlusion.size() * sizeof(GLfloat));
+    }
+};
@@ -0,0 +1,213 @@
+/*
+BRDFLookupTables class
+- the terms of the specular BRDFs of the main shader, precomputed in two 2D tables and sampled by the shader instead of
+  being evaluated for each fragment, for each light and in each portal view:
+  1) lobe table: x = sqrt(1 - cosine), y = parameter of the lobe
+     R = GGX normal distribution D(NdotH) with roughness alpha = y
+     G = Phong lobe pow(cosine, shininess), with shininess = MIN_SHININESS + y * (MAX_SHININESS - MIN_SHININESS)
+     (used with dot(R, V) by Phong and with NdotH by Blinn-Phong)
+  2) geometry table: x = cosine, y = roughness alpha
+     R = Smith-Schlick G1(cosine) / cosine: the visibility term G2 / (4 NdotV NdotL) is the product of two lookups, divided by 4
+     G = Schlick Fresnel weight pow(1 - cosine, 5) (it does not depend on y)
+- the rows of the tables are computed by jobs on the worker threads (Start), then uploaded as textures (Finish).
+  The tables are cached in a binary file: the next runs only load it
+- the tables use the same formulas of the analytic functions of the shader (see GGXLight and G1 in fragmentShader.frag),
+  so the shader can show the difference between the two versions
+
+N.B. 1) the lobes have a narrow peak at cosine = 1 for low roughness (or high shininess): with x = sqrt(1 - cosine)
+the texels are concentrated around the peak, where a linear parameterization would lose it between two texels
+
+N.B. 2) the tables are RG32F: D reaches 1 / (PI * alpha^2), which does not fit a half float for the lowest roughness values
+
+N.B. 3) the cache is valid only for the same sizes and the same version of the formulas: CACHE_VERSION must change with them
+*/
+
+#pragma once
+
+using namespace std;
+
+// Std. Includes
+#include <vector>
+#include <string>
+#include <fstream>
+#include <iostream>
+#include <cmath>
+#include <cstdint>
+#include <chrono>
+
+#include <utils/glstate.h>
+#include <utils/jobsystem.h>
+
+/////////////////// BRDFLOOKUPTABLES class ///////////////////////
+class BRDFLookupTables
+{
+public:
+    // texels along the cosine and along the parameter of the lobe (roughness or shininess)
+    static const GLuint COSINE_SIZE = 256;
+    static const GLuint PARAMETER_SIZE = 64;
+    // rows computed by each job
+    static const GLuint ROWS_PER_JOB = 8;
+    // range of the shininess in the Phong lobe
+    static constexpr GLfloat MIN_SHININESS = 1.0f;
+    static constexpr GLfloat MAX_SHININESS = 128.0f;
+
+    // the tables have been loaded from the cache, instead of being computed
+    bool cached = false;
+    // time spent to load or compute the tables (milliseconds)
+    double buildTime = 0.0;
+
+    BRDFLookupTables() = default;
+    BRDFLookupTables(const BRDFLookupTables& copy) = delete; //disallow copy
+    BRDFLookupTables& operator=(const BRDFLookupTables&) = delete;
+
+    ~BRDFLookupTables() noexcept
+    {
+        if (this->lobeTexture)
+        {
+            glDeleteTextures(1, &this->lobeTexture);
+            GLState().OnDeleteTexture(this->lobeTexture);
+            glDeleteTextures(1, &this->geometryTexture);
+            GLState().OnDeleteTexture(this->geometryTexture);
+        }
+    }
+
+    //////////////////////////////////////////
+
+    // we load the tables from the cache, or we start the jobs which compute them (the caller waits for counter before Finish)
+    void Start(JobSystem& jobs, JobCounter& counter, const string& cachePath)
+    {
+        this->start = chrono::steady_clock::now();
+        this->lobe.assign(2 * COSINE_SIZE * PARAMETER_SIZE, 0.0f);
+        this->geometry.assign(2 * COSINE_SIZE * PARAMETER_SIZE, 0.0f);
+        this->cached = this->loadCache(cachePath);
+        if (this->cached)
+            return;
+        for (GLuint row = 0; row < PARAMETER_SIZE; row += ROWS_PER_JOB)
+            jobs.Run(counter, [this, row]()
+            {
+                for (GLuint y = row; y < row + ROWS_PER_JOB && y < PARAMETER_SIZE; y++)
+                    this->FillRow(y);
+            });
+    }
+
+    // we save the computed tables, and we upload them in the textures
+    void Finish(const string& cachePath)
+    {
+        if (!this->cached)
+            this->saveCache(cachePath);
+        this->lobeTexture = NewTexture(this->lobe);
+        this->geometryTexture = NewTexture(this->geometry);
+        this->buildTime = chrono::duration<double, milli>(chrono::steady_clock::now() - this->start).count();
+        // the tables are on the GPU now
+        this->lobe = vector<GLfloat>();
+        this->geometry = vector<GLfloat>();
+    }
+
+    GLuint LobeTexture() const { return this->lobeTexture; }
+    GLuint GeometryTexture() const { return this->geometryTexture; }
+
+private:
+    static constexpr GLfloat PI = 3.14159265359f;
+    static const uint32_t CACHE_MAGIC = 0x46445242; // "BRDF"
+    static const uint32_t CACHE_VERSION = 1;
+
+    // two channels for each texel, row by row
+    vector<GLfloat> lobe;
+    vector<GLfloat> geometry;
+    GLuint lobeTexture = 0;
+    GLuint geometryTexture = 0;
+    chrono::steady_clock::time_point start;
+
+    // the GGX normal distribution of GGXLight in fragmentShader.frag
+    static GLfloat GGXDistribution(GLfloat NdotH, GLfloat alpha)
+    {
+        GLfloat alphaSquared = alpha * alpha;
+        GLfloat denom = NdotH * NdotH * (alphaSquared - 1.0f) + 1.0f;
+        // with alpha = 0 the lobe is a single direction, with no area
+        if (denom <= 0.0f)
+            return 0.0f;
+        return alphaSquared / (PI * denom * denom);
+    }
+
+    // each row is written by a single job
+    void FillRow(GLuint y)
+    {
+        GLfloat parameter = y / GLfloat(PARAMETER_SIZE - 1);
+        GLfloat shininess = MIN_SHININESS + parameter * (MAX_SHININESS - MIN_SHININESS);
+        for (GLuint x = 0; x < COSINE_SIZE; x++)
+        {
+            GLfloat u = x / GLfloat(COSINE_SIZE - 1);
+            GLuint texel = 2 * (y * COSINE_SIZE + x);
+
+            // x = sqrt(1 - cosine)
+            GLfloat peakCosine = 1.0f - u * u;
+            this->lobe[texel] = GGXDistribution(peakCosine, parameter);
+            this->lobe[texel + 1] = pow(peakCosine, shininess);
+
+            // x = cosine. G1 / cosine (see G1 in fragmentShader.frag) is 1 / (cosine * (1 - k) + k), finite also at cosine = 0
+            GLfloat r = parameter + 1.0f;
+            GLfloat k = (r * r) / 8.0f;
+            this->geometry[texel] = 1.0f / (u * (1.0f - k) + k);
+            this->geometry[texel + 1] = pow(1.0f - u, 5.0f);
+        }
+    }
+
+    static GLuint NewTexture(const vector<GLfloat>& data)
+    {
+        GLuint texture;
+        if (GLState().hasDSA)
+        {
+            glCreateTextures(GL_TEXTURE_2D, 1, &texture);
+            glTextureStorage2D(texture, 1, GL_RG32F, COSINE_SIZE, PARAMETER_SIZE);
+            glTextureSubImage2D(texture, 0, 0, 0, COSINE_SIZE, PARAMETER_SIZE, GL_RG, GL_FLOAT, data.data());
+        }
+        else
+        {
+            glGenTextures(1, &texture);
+            GLState().BindTextureForEdit(GL_TEXTURE_2D, texture);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32F, COSINE_SIZE, PARAMETER_SIZE, 0, GL_RG, GL_FLOAT, data.data());
+            GLState().TextureParameteri(texture, GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+        }
+        GLState().TextureParameteri(texture, GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        GLState().TextureParameteri(texture, GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        GLState().TextureParameteri(texture, GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        GLState().TextureParameteri(texture, GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        return texture;
+    }
+
+    bool loadCache(const string& path)
+    {
+        ifstream file(path, ios::binary);
+        if (!file)
+            return false;
+        uint32_t magic = 0, version = 0, width = 0, height = 0;
+        file.read((char*)&magic, sizeof(magic));
+        file.read((char*)&version, sizeof(version));
+        file.read((char*)&width, sizeof(width));
+        file.read((char*)&height, sizeof(height));
+        if (!file || magic != CACHE_MAGIC || version != CACHE_VERSION || width != COSINE_SIZE || height != PARAMETER_SIZE)
+            return false;
+        file.read((char*)this->lobe.data(), this->lobe.size() * sizeof(GLfloat));
+        file.read((char*)this->geometry.data(), this->geometry.size() * sizeof(GLfloat));
+        return (bool)file;
+    }
+
+    void saveCache(const string& path) const
+    {
+        ofstream file(path, ios::binary);
+        if (!file)
+        {
+            cout << "ERROR::BRDFLUT:: cannot write the cache " << path << endl;
+            return;
+        }
+        // the constants are copied: writing them from their address would need a definition outside of the class
+        uint32_t magic = CACHE_MAGIC, version = CACHE_VERSION;
+        uint32_t width = COSINE_SIZE, height = PARAMETER_SIZE;
+        file.write((const char*)&magic, sizeof(magic));
+        file.write((const char*)&version, sizeof(version));
+        file.write((const char*)&width, sizeof(width));
+        file.write((const char*)&height, sizeof(height));
+        file.write((const char*)this->lobe.data(), this->lobe.size() * sizeof(GLfloat));
+        file.write((const char*)this->geometry.data(), this->geometry.size() * sizeof(GLfloat));
+    }
+};
@@ -0,0 +1,609 @@
+/*
+BVH, TriangleBVH and SceneBVH classes
+- BVH is a bounding volume hierarchy over generic primitives, given their axis-aligned bounding boxes.
+  It is built top-down with the Surface Area Heuristic (SAH), evaluated on BVH_BINS bins along each axis,
+  and it answers frustum queries (culling) and closest-hit ray queries (mouse picking)
+- Refit() updates the boxes of the nodes without changing the tree: it is much cheaper than a new build,
+  and it is enough when only a few objects move a little (e.g. the lightbulb orbiting around the room)
+- TriangleBVH is the BVH over the triangles of a Model, in model coordinates. The tree is cached in a binary file
+  next to the model (e.g. models/bunny_lp.obj.bvh), and it is rebuilt only if the geometry changed
+- SceneBVH is the BVH over the objects of the Scene, using their world-space bounding spheres
+
+N.B. 1) the nodes are stored in a single array, and the children of a node always come after it:
+the left child is in leftFirst, the right one in leftFirst + 1. In a leaf, leftFirst is the first primitive and count the number of primitives
+
+N.B. 2) the ray queries of the scene are done in two levels: the ray is tested against the SceneBVH in world coordinates,
+then it is transformed in the model coordinates of the object, and tested against the TriangleBVH of its model
+*/
+
+#pragma once
+
+using namespace std;
+
+// Std. Includes
+#include <vector>
+#include <string>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+#include <utils/culling.h>
+
+// number of bins used to evaluate the SAH along each axis
+const GLuint BVH_BINS = 12;
+// the nodes at this depth are not subdivided: the traversals visit the tree with a stack of BVH_MAX_DEPTH + 1 entries,
+// which is enough for any tree built with this bound (each level keeps at most one child waiting on the stack)
+const GLuint BVH_MAX_DEPTH = 63;
+
+struct AABB {
+    glm::vec3 min = glm::vec3(numeric_limits<GLfloat>::max());
+    glm::vec3 max = glm::vec3(-numeric_limits<GLfloat>::max());
+
+    void Grow(const glm::vec3& p) { this->min = glm::min(this->min, p); this->max = glm::max(this->max, p); }
+    void Grow(const AABB& b) { this->min = glm::min(this->min, b.min); this->max = glm::max(this->max, b.max); }
+    glm::vec3 Center() const { return 0.5f * (this->min + this->max); }
+    GLfloat Area() const
+    {
+        glm::vec3 e = this->max - this->min;
+        return (e.x < 0.0f) ? 0.0f : e.x * e.y + e.y * e.z + e.z * e.x;
+    }
+};
+
+struct BVHNode {
+    glm::vec3 boundsMin;
+    GLuint leftFirst;
+    glm::vec3 boundsMax;
+    // number of primitives of a leaf (0 for an interior node)
+    GLuint count;
+};
+
+struct Ray {
+    glm::vec3 origin;
+    glm::vec3 direction;
+    glm::vec3 invDirection;
+
+    Ray() = default;
+    Ray(const glm::vec3& origin, const glm::vec3& direction)
+        : origin(origin), direction(direction), invDirection(1.0f / direction) {}
+};
+
+// result of a ray query
+struct RayHit {
+    GLfloat t = numeric_limits<GLfloat>::max();
+    // object of the scene (-1 if nothing was hit), and triangle of its model
+    GLint object = -1;
+    GLuint triangle = 0;
+    // barycentric coordinates of the hit point, and interpolated texture coordinates
+    glm::vec2 barycentric = glm::vec2(0.0f);
+    glm::vec2 uv = glm::vec2(0.0f);
+};
+
+/////////////////// BVH class ///////////////////////
+class BVH
+{
+public:
+    vector<BVHNode> nodes;
+    // primitive indices, in the order of the leaves
+    vector<GLuint> primitives;
+
+    // we build the tree over the boxes of the primitives
+    void Build(const vector<AABB>& boxes)
+    {
+        GLuint n = boxes.size();
+        this->primitives.resize(n);
+        for (GLuint i = 0; i < n; i++)
+            this->primitives[i] = i;
+        this->nodes.clear();
+        if (n == 0)
+            return;
+        this->nodes.reserve(2 * n);
+
+        this->centroids.resize(n);
+        for (GLuint i = 0; i < n; i++)
+            this->centroids[i] = boxes[i].Center();
+
+        BVHNode root;
+        root.leftFirst = 0;
+        root.count = n;
+        this->nodes.push_back(root);
+        this->updateBounds(0, boxes);
+
+        // we subdivide the nodes with an explicit stack of (node, depth) pairs
+        vector<pair<GLuint, GLuint>> stack;
+        stack.push_back(make_pair(0u, 0u));
+        while (!stack.empty())
+        {
+            GLuint node = stack.back().first;
+            GLuint depth = stack.back().second;
+            stack.pop_back();
+            GLuint left;
+            if (depth < BVH_MAX_DEPTH && this->subdivide(node, boxes, left))
+            {
+                stack.push_back(make_pair(left, depth + 1));
+                stack.push_back(make_pair(left + 1, depth + 1));
+            }
+        }
+        this->centroids = vector<glm::vec3>();
+    }
+
+    // we update the boxes of the nodes, bottom-up (the children always come after their parent)
+    void Refit(const vector<AABB>& boxes)
+    {
+        for (GLint i = (GLint)this->nodes.size() - 1; i >= 0; i--)
+        {
+            BVHNode& node = this->nodes[i];
+            if (node.count > 0)
+            {
+                this->updateBounds(i, boxes);
+                continue;
+            }
+            const BVHNode& left = this->nodes[node.leftFirst];
+            const BVHNode& right = this->nodes[node.leftFirst + 1];
+            node.boundsMin = glm::min(left.boundsMin, right.boundsMin);
+            node.boundsMax = glm::max(left.boundsMax, right.boundsMax);
+        }
+    }
+
+    // we check a tree which was not built here (e.g. loaded from a file): the children of each node come after it,
+    // the leaves and the primitive indices stay in range, and no leaf is deeper than BVH_MAX_DEPTH (the size of the traversal stacks)
+    bool IsValid() const
+    {
+        GLuint numNodes = this->nodes.size(), numPrimitives = this->primitives.size();
+        if (numNodes == 0)
+            return numPrimitives == 0;
+        for (GLuint i = 0; i < numPrimitives; i++)
+            if (this->primitives[i] >= numPrimitives)
+                return false;
+        vector<GLuint> depths(numNodes, 0);
+        for (GLuint i = 0; i < numNodes; i++)
+        {
+            const BVHNode& node = this->nodes[i];
+            if (node.count > 0)
+            {
+                if (node.leftFirst >= numPrimitives || node.count > numPrimitives - node.leftFirst)
+                    return false;
+                continue;
+            }
+            if (node.leftFirst <= i || node.leftFirst >= numNodes - 1 || depths[i] >= BVH_MAX_DEPTH)
+                return false;
+            depths[node.leftFirst] = glm::max(depths[node.leftFirst], depths[i] + 1);
+            depths[node.leftFirst + 1] = glm::max(depths[node.leftFirst + 1], depths[i] + 1);
+        }
+        return true;
+    }
+
+    // closest-hit query: intersect(primitive, ray, hit) tests a primitive, and updates hit if it is closer than hit.t
+    template <typename Intersect>
+    void Traverse(const Ray& ray, RayHit& hit, Intersect intersect) const
+    {
+        if (this->nodes.empty())
+            return;
+        GLuint stack[BVH_MAX_DEPTH + 1];
+        GLuint stackSize = 0;
+        stack[stackSize++] = 0;
+        while (stackSize > 0)
+        {
+            const BVHNode& node = this->nodes[stack[--stackSize]];
+            if (IntersectBox(ray, node, hit.t) == numeric_limits<GLfloat>::max())
+                continue;
+            if (node.count > 0)
+            {
+                for (GLuint i = 0; i < node.count; i++)
+                    intersect(this->primitives[node.leftFirst + i], ray, hit);
+                continue;
+            }
+            // we visit first the nearest child, so the farther one is probably culled by the updated hit.t
+            GLuint first = node.leftFirst, second = node.leftFirst + 1;
+            GLfloat tFirst = IntersectBox(ray, this->nodes[first], hit.t);
+            GLfloat tSecond = IntersectBox(ray, this->nodes[second], hit.t);
+            if (tFirst > tSecond)
+            {
+                swap(first, second);
+                swap(tFirst, tSecond);
+            }
+            if (tSecond != numeric_limits<GLfloat>::max())
+                stack[stackSize++] = second;
+            if (tFirst != numeric_limits<GLfloat>::max())
+                stack[stackSize++] = first;
+        }
+    }
+
+    // frustum query: visit(primitive) is called for each primitive whose leaf intersects the frustum.
+    // The subtrees completely outside the frustum are skipped with a single test
+    template <typename Visit>
+    void QueryFrustum(const Frustum& frustum, Visit visit) const
+    {
+        if (this->nodes.empty())
+            return;
+        GLuint stack[BVH_MAX_DEPTH + 1];
+        GLuint stackSize = 0;
+        stack[stackSize++] = 0;
+        while (stackSize > 0)
+        {
+            const BVHNode& node = this->nodes[stack[--stackSize]];
+            if (!BoxInFrustum(frustum, node))
+                continue;
+            if (node.count > 0)
+            {
+                for (GLuint i = 0; i < node.count; i++)
+                    visit(this->primitives[node.leftFirst + i]);
+            }
+            else
+            {
+                stack[stackSize++] = node.leftFirst;
+                stack[stackSize++] = node.leftFirst + 1;
+            }
+        }
+    }
+
+    // slab test: distance of the entry point, or the max float if the box is missed (or farther than tMax)
+    static GLfloat IntersectBox(const Ray& ray, const BVHNode& node, GLfloat tMax)
+    {
+        glm::vec3 t1 = (node.boundsMin - ray.origin) * ray.invDirection;
+        glm::vec3 t2 = (node.boundsMax - ray.origin) * ray.invDirection;
+        glm::vec3 tMin3 = glm::min(t1, t2), tMax3 = glm::max(t1, t2);
+        GLfloat tEnter = glm::max(glm::max(tMin3.x, tMin3.y), glm::max(tMin3.z, 0.0f));
+        GLfloat tExit = glm::min(glm::min(tMax3.x, tMax3.y), glm::min(tMax3.z, tMax));
+        return (tEnter <= tExit) ? tEnter : numeric_limits<GLfloat>::max();
+    }
+
+    // the box is outside if, for at least one plane, its vertex farthest along the normal is behind the plane
+    static bool BoxInFrustum(const Frustum& frustum, const BVHNode& node)
+    {
+        for (int p = 0; p < 6; p++)
+        {
+            const glm::vec4& plane = frustum.planes[p];
+            glm::vec3 positive(plane.x >= 0.0f ? node.boundsMax.x : node.boundsMin.x,
+                               plane.y >= 0.0f ? node.boundsMax.y : node.boundsMin.y,
+                               plane.z >= 0.0f ? node.boundsMax.z : node.boundsMin.z);
+            if (glm::dot(glm::vec3(plane), positive) + plane.w < 0.0f)
+                return false;
+        }
+        return true;
+    }
+
+private:
+    // centroids of the primitives, used only during the build
+    vector<glm::vec3> centroids;
+
+    void updateBounds(GLuint index, const vector<AABB>& boxes)
+    {
+        BVHNode& node = this->nodes[index];
+        AABB bounds;
+        for (GLuint i = 0; i < node.count; i++)
+            bounds.Grow(boxes[this->primitives[node.leftFirst + i]]);
+        node.boundsMin = bounds.min;
+        node.boundsMax = bounds.max;
+    }
+
+    // we look for the best SAH split of the node. If splitting costs less than keeping the leaf,
+    // the primitives are partitioned, the two children are created and we return true
+    bool subdivide(GLuint index, const vector<AABB>& boxes, GLuint& leftChild)
+    {
+        BVHNode node = this->nodes[index];
+        if (node.count <= 2)
+            return false;
+
+        // bounds of the centroids, which define the bins
+        AABB centroidBounds;
+        for (GLuint i = 0; i < node.count; i++)
+            centroidBounds.Grow(this->centroids[this->primitives[node.leftFirst + i]]);
+
+        GLint bestAxis = -1;
+        GLuint bestSplit = 0;
+        GLfloat bestCost = numeric_limits<GLfloat>::max();
+        for (int axis = 0; axis < 3; axis++)
+        {
+            GLfloat minC = centroidBounds.min[axis], maxC = centroidBounds.max[axis];
+            if (minC == maxC)
+                continue;
+            AABB binBounds[BVH_BINS];
+            GLuint binCount[BVH_BINS] = {0};
+            GLfloat scale = BVH_BINS / (maxC - minC);
+            for (GLuint i = 0; i < node.count; i++)
+            {
+                GLuint prim = this->primitives[node.leftFirst + i];
+                GLuint bin = glm::min(BVH_BINS - 1, (GLuint)((this->centroids[prim][axis] - minC) * scale));
+                binCount[bin]++;
+                binBounds[bin].Grow(boxes[prim]);
+            }
+            // areas and counts on the left and on the right of each split plane, with two sweeps
+            GLfloat leftArea[BVH_BINS - 1], rightArea[BVH_BINS - 1];
+            GLuint leftCount[BVH_BINS - 1], rightCount[BVH_BINS - 1];
+            AABB leftBox, rightBox;
+            GLuint leftSum = 0, rightSum = 0;
+            for (GLuint i = 0; i < BVH_BINS - 1; i++)
+            {
+                leftSum += binCount[i];
+                leftCount[i] = leftSum;
+                leftBox.Grow(binBounds[i]);
+                leftArea[i] = leftBox.Area();
+                rightSum += binCount[BVH_BINS - 1 - i];
+                rightCount[BVH_BINS - 2 - i] = rightSum;
+                rightBox.Grow(binBounds[BVH_BINS - 1 - i]);
+                rightArea[BVH_BINS - 2 - i] = rightBox.Area();
+            }
+            for (GLuint i = 0; i < BVH_BINS - 1; i++)
+            {
+                GLfloat cost = leftCount[i] * leftArea[i] + rightCount[i] * rightArea[i];
+                if (leftCount[i] > 0 && rightCount[i] > 0 && cost < bestCost)
+                {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestSplit = i;
+                }
+            }
+        }
+
+        // cost of the leaf: we test all its primitives (the traversal of a node costs about as much as a primitive test)
+        AABB nodeBounds;
+        nodeBounds.min = node.boundsMin;
+        nodeBounds.max = node.boundsMax;
+        GLfloat leafCost = node.count * nodeBounds.Area();
+        if (bestAxis < 0 || bestCost + nodeBounds.Area() >= leafCost)
+            return false;
+
+        // in-place partition of the primitives
+        GLfloat minC = centroidBounds.min[bestAxis];
+        GLfloat scale = BVH_BINS / (centroidBounds.max[bestAxis] - minC);
+        GLuint i = node.leftFirst, j = node.leftFirst + node.count - 1;
+        while (i <= j)
+        {
+            GLuint bin = glm::min(BVH_BINS - 1, (GLuint)((this->centroids[this->primitives[i]][bestAxis] - minC) * scale));
+            if (bin <= bestSplit)
+                i++;
+            else
+            {
+                swap(this->primitives[i], this->primitives[j]);
+                if (j == 0)
+                    break;
+                j--;
+            }
+        }
+        GLuint leftCountFinal = i - node.leftFirst;
+        if (leftCountFinal == 0 || leftCountFinal == node.count)
+            return false;
+
+        leftChild = this->nodes.size();
+        BVHNode left, right;
+        left.leftFirst = node.leftFirst;
+        left.count = leftCountFinal;
+        right.leftFirst = i;
+        right.count = node.count - leftCountFinal;
+        this->nodes.push_back(left);
+        this->nodes.push_back(right);
+        this->updateBounds(leftChild, boxes);
+        this->updateBounds(leftChild + 1, boxes);
+
+        BVHNode& parent = this->nodes[index];
+        parent.leftFirst = leftChild;
+        parent.count = 0;
+        return true;
+    }
+};
+
+/////////////////// TRIANGLEBVH class ///////////////////////
+class TriangleBVH
+{
+public:
+    BVH bvh;
+    // 3 positions and 3 texture coordinates for each triangle, in model coordinates
+    vector<glm::vec3> positions;
+    vector<glm::vec2> texCoords;
+
+    // we collect the triangles of all the meshes. Then we load the tree from the cache, or we build and save it
+    void Build(const vector<Mesh>& meshes, const string& cachePath)
+    {
+        this->positions.clear();
+        this->texCoords.clear();
+        for (GLuint m = 0; m < meshes.size(); m++)
+        {
+            const Mesh& mesh = meshes[m];
+            for (GLuint i = 0; i < mesh.indices.size(); i++)
+            {
+                this->positions.push_back(mesh.vertices[mesh.indices[i]].Position);
+                this->texCoords.push_back(mesh.vertices[mesh.indices[i]].TexCoords);
+            }
+        }
+        uint64_t hash = this->geometryHash();
+        if (this->loadCache(cachePath, hash))
+            return;
+
+        vector<AABB> boxes(this->TriangleCount());
+        for (GLuint t = 0; t < boxes.size(); t++)
+        {
+            boxes[t].Grow(this->positions[3 * t]);
+            boxes[t].Grow(this->positions[3 * t + 1]);
+            boxes[t].Grow(this->positions[3 * t + 2]);
+        }
+        this->bvh.Build(boxes);
+        this->saveCache(cachePath, hash);
+    }
+
+    GLuint TriangleCount() const { return this->positions.size() / 3; }
+
+    // closest hit of a ray in model coordinates (Moller-Trumbore test for each triangle)
+    bool Intersect(const Ray& ray, RayHit& hit) const
+    {
+        GLfloat tBefore = hit.t;
+        this->bvh.Traverse(ray, hit, [this](GLuint t, const Ray& r, RayHit& h)
+        {
+            const glm::vec3& v0 = this->positions[3 * t];
+            glm::vec3 e1 = this->positions[3 * t + 1] - v0, e2 = this->positions[3 * t + 2] - v0;
+            glm::vec3 p = glm::cross(r.direction, e2);
+            GLfloat det = glm::dot(e1, p);
+            if (glm::abs(det) < 1e-9f)
+                return;
+            GLfloat invDet = 1.0f / det;
+            glm::vec3 s = r.origin - v0;
+            GLfloat u = glm::dot(s, p) * invDet;
+            if (u < 0.0f || u > 1.0f)
+                return;
+            glm::vec3 q = glm::cross(s, e1);
+            GLfloat v = glm::dot(r.direction, q) * invDet;
+            if (v < 0.0f || u + v > 1.0f)
+                return;
+            GLfloat dist = glm::dot(e2, q) * invDet;
+            if (dist > 0.0f && dist < h.t)
+            {
+                h.t = dist;
+                h.triangle = t;
+                h.barycentric = glm::vec2(u, v);
+                h.uv = (1.0f - u - v) * this->texCoords[3 * t] + u * this->texCoords[3 * t + 1] + v * this->texCoords[3 * t + 2];
+            }
+        });
+        return hit.t < tBefore;
+    }
+
+private:
+    static const uint32_t CACHE_MAGIC = 0x48564252; // "RBVH"
+    static const uint32_t CACHE_VERSION = 1;
+
+    // FNV-1a hash of the positions: the cache is valid only for the same geometry
+    uint64_t geometryHash() const
+    {
+        uint64_t hash = 14695981039346656037ULL;
+        const unsigned char* bytes = (const unsigned char*)this->positions.data();
+        size_t size = this->positions.size() * sizeof(glm::vec3);
+        for (size_t i = 0; i < size; i++)
+        {
+            hash ^= bytes[i];
+            hash *= 1099511628211ULL;
+        }
+        return hash;
+    }
+
+    bool loadCache(const string& path, uint64_t hash)
+    {
+        ifstream file(path, ios::binary);
+        if (!file)
+            return false;
+        uint32_t magic = 0, version = 0, numNodes = 0, numPrimitives = 0;
+        uint64_t fileHash = 0;
+        file.read((char*)&magic, sizeof(magic));
+        file.read((char*)&version, sizeof(version));
+        file.read((char*)&fileHash, sizeof(fileHash));
+        file.read((char*)&numNodes, sizeof(numNodes));
+        file.read((char*)&numPrimitives, sizeof(numPrimitives));
+        // a tree has at most 2 * primitives - 1 nodes: a bigger count comes from a corrupted file
+        if (!file || magic != CACHE_MAGIC || version != CACHE_VERSION || fileHash != hash || numPrimitives != this->TriangleCount() ||
+            numNodes > 2 * numPrimitives)
+            return false;
+        this->bvh.nodes.resize(numNodes);
+        this->bvh.primitives.resize(numPrimitives);
+        file.read((char*)this->bvh.nodes.data(), numNodes * sizeof(BVHNode));
+        file.read((char*)this->bvh.primitives.data(), numPrimitives * sizeof(GLuint));
+        // a truncated or corrupted file would drive the traversals out of the arrays: we build the tree again
+        if (!file || !this->bvh.IsValid())
+        {
+            this->bvh.nodes.clear();
+            this->bvh.primitives.clear();
+            return false;
+        }
+        return true;
+    }
+
+    void saveCache(const string& path, uint64_t hash) const
+    {
+        ofstream file(path, ios::binary);
+        if (!file)
+        {
+            cout << "ERROR::BVH:: cannot write the cache " << path << endl;
+            return;
+        }
+        // the constants are copied: writing them from their address would need a definition outside of the class
+        uint32_t magic = CACHE_MAGIC, version = CACHE_VERSION;
+        uint32_t numNodes = this->bvh.nodes.size(), numPrimitives = this->bvh.primitives.size();
+        file.write((const char*)&magic, sizeof(magic));
+        file.write((const char*)&version, sizeof(version));
+        file.write((const char*)&hash, sizeof(hash));
+        file.write((const char*)&numNodes, sizeof(numNodes));
+        file.write((const char*)&numPrimitives, sizeof(numPrimitives));
+        file.write((const char*)this->bvh.nodes.data(), numNodes * sizeof(BVHNode));
+        file.write((const char*)this->bvh.primitives.data(), numPrimitives * sizeof(GLuint));
+    }
+};
+
+/////////////////// SCENEBVH class ///////////////////////
+class SceneBVH
+{
+public:
+    BVH bvh;
+
+    // we build the tree over the world-space bounding spheres of the objects
+    void Build(const Scene& scene)
+    {
+        this->computeBoxes(scene);
+        this->bvh.Build(this->boxes);
+    }
+
+    // the objects moved: we only update the boxes of the tree
+    void Refit(const Scene& scene)
+    {
+        if (this->boxes.size() != scene.Size())
+        {
+            this->Build(scene);
+            return;
+        }
+        this->computeBoxes(scene);
+        this->bvh.Refit(this->boxes);
+    }
+
+    // frustum culling with the tree: the result is written in the culler, like FrustumCuller::Cull()
+    CullStats Cull(const Scene& scene, const Frustum& frustum, FrustumCuller& culler) const
+    {
+        culler.visibility.assign(scene.Size(), 0);
+        CullStats stats;
+        this->bvh.QueryFrustum(frustum, [&](GLuint object)
+        {
+            // the leaf intersects the frustum: we test the sphere of the object
+            GLubyte inside = 1;
+            for (int p = 0; p < 6; p++)
+            {
+                const glm::vec4& plane = frustum.planes[p];
+                if (plane.x * scene.sphereX[object] + plane.y * scene.sphereY[object] + plane.z * scene.sphereZ[object] + plane.w < -scene.sphereRadius[object])
+                    inside = 0;
+            }
+            culler.visibility[object] = inside;
+            stats.visible += inside;
+        });
+        stats.culled = scene.Size() - stats.visible;
+        return stats;
+    }
+
+    // closest object hit by a world-space ray. triangleBVHs[i] is the tree of the model of object i (NULL if it cannot be picked)
+    RayHit Pick(const Scene& scene, const Ray& ray, const vector<const TriangleBVH*>& triangleBVHs) const
+    {
+        RayHit hit;
+        this->bvh.Traverse(ray, hit, [&](GLuint object, const Ray& r, RayHit& h)
+        {
+            const TriangleBVH* triangles = triangleBVHs[object];
+            if (!triangles)
+                return;
+            // we test the ray in model coordinates: the distance along the ray is the same,
+            // because we do not normalize the transformed direction
+            glm::mat4 toModel = glm::inverse(scene.worldMatrices[object]);
+            Ray local(glm::vec3(toModel * glm::vec4(r.origin, 1.0f)), glm::vec3(toModel * glm::vec4(r.direction, 0.0f)));
+            if (triangles->Intersect(local, h))
+                h.object = object;
+        });
+        return hit;
+    }
+
+private:
+    vector<AABB> boxes;
+
+    void computeBoxes(const Scene& scene)
+    {
+        this->boxes.resize(scene.Size());
+        for (GLuint i = 0; i < scene.Size(); i++)
+        {
+            glm::vec3 center(scene.sphereX[i], scene.sphereY[i], scene.sphereZ[i]);
+            this->boxes[i].min = center - glm::vec3(scene.sphereRadius[i]);
+            this->boxes[i].max = center + glm::vec3(scene.sphereRadius[i]);
+        }
+    }
+};
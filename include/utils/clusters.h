@@ -0,0 +1,345 @@
+/*
+ClusteredLights class
+- clustered forward shading: the view frustum is split in a 3D grid of clusters (froxels), GRID_X x GRID_Y tiles on the screen
+  and GRID_Z slices in depth. The slices are exponential (slice s starts at near * (far / near)^(s / GRID_Z)), so they are thin
+  near the camera and thick far from it, like the pixels of the perspective
+- in every frame each point light (a sphere of influence) is assigned to all the clusters it overlaps, on the CPU:
+  1) the lights are transformed in view space, and the range of tiles and slices covered by their sphere is computed
+     4 lights at a time (SSE), or one at a time without SIMD
+  2) the slices are split between jobs on the worker threads (see jobsystem.h): each job fills the light lists of the clusters
+     of its slices, so no two jobs write the same list
+  3) on the GL thread the lists are merged and uploaded in three texture buffers: the lights (view space position and radius, color),
+     the offset and count of the list of each cluster, and the light indices of all the lists
+- the fragment shader finds its cluster from gl_FragCoord and from its depth, and it loops only over the lights of its list
+
+N.B. 1) the tiles of a light come from the screen bounds of the box around its sphere, between its nearest and farthest depth:
+they are conservative, so a light can be assigned to clusters near its sphere which it does not touch (the shader attenuates it to 0 there)
+
+N.B. 2) the depths beyond the far plane of the grid belong to the last slice: the far plane of the grid is the size of the scene,
+not the far plane of the projection, or almost all the slices would be wasted on empty space
+
+N.B. 3) texture buffers are core since OpenGL 3.1: shader storage buffers would be simpler to read in the shader, but they need OpenGL 4.3
+*/
+
+#pragma once
+
+using namespace std;
+
+// Std. Includes
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <algorithm>
+
+#include <glm/glm.hpp>
+
+// CULLING_SIMD_WIDTH and the SIMD intrinsics
+#include <utils/culling.h>
+#include <utils/glstate.h>
+#include <utils/jobsystem.h>
+
+// lights, non-empty clusters, total length of the lists and longest list in the last frame, and time of the assignment (milliseconds)
+struct ClusterStats {
+    GLuint lights = 0;
+    GLuint visibleLights = 0;
+    GLuint usedClusters = 0;
+    GLuint indices = 0;
+    GLuint maxPerCluster = 0;
+    double assignTime = 0.0;
+};
+
+/////////////////// CLUSTEREDLIGHTS class ///////////////////////
+class ClusteredLights
+{
+public:
+    static const GLuint GRID_X = 16;
+    static const GLuint GRID_Y = 9;
+    static const GLuint GRID_Z = 24;
+    static const GLuint NUM_CLUSTERS = GRID_X * GRID_Y * GRID_Z;
+    // slices filled by each job
+    static const GLuint SLICES_PER_JOB = 4;
+
+    // the lights in world coordinates (separate arrays, like the spheres of the scene)
+    vector<GLfloat> lightX, lightY, lightZ, lightRadius;
+    vector<glm::vec3> lightColor;
+    ClusterStats stats;
+
+    ClusteredLights() = default;
+    ClusteredLights(const ClusteredLights& copy) = delete; //disallow copy
+    ClusteredLights& operator=(const ClusteredLights&) = delete;
+
+    ~ClusteredLights() noexcept
+    {
+        if (this->textures[0])
+        {
+            glDeleteTextures(NUM_BUFFERS, this->textures);
+            for (GLuint i = 0; i < NUM_BUFFERS; i++)
+                GLState().OnDeleteTexture(this->textures[i]);
+            glDeleteBuffers(NUM_BUFFERS, this->buffers);
+        }
+    }
+
+    //////////////////////////////////////////
+
+    // we create the buffers and the texture buffers which read them
+    void Init()
+    {
+        this->lists.resize(NUM_CLUSTERS);
+        this->table.resize(2 * NUM_CLUSTERS);
+        glGenBuffers(NUM_BUFFERS, this->buffers);
+        glGenTextures(NUM_BUFFERS, this->textures);
+        const GLenum formats[NUM_BUFFERS] = {GL_RGBA32F, GL_RG32UI, GL_R32UI};
+        for (GLuint i = 0; i < NUM_BUFFERS; i++)
+        {
+            // a buffer can't be attached before it has a data store
+            glBindBuffer(GL_TEXTURE_BUFFER, this->buffers[i]);
+            glBufferData(GL_TEXTURE_BUFFER, 16, NULL, GL_STREAM_DRAW);
+            GLState().BindTextureForEdit(GL_TEXTURE_BUFFER, this->textures[i]);
+            glTexBuffer(GL_TEXTURE_BUFFER, formats[i], this->buffers[i]);
+        }
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    }
+
+    void Clear()
+    {
+        this->lightX.clear();
+        this->lightY.clear();
+        this->lightZ.clear();
+        this->lightRadius.clear();
+        this->lightColor.clear();
+    }
+
+    GLuint Add(const glm::vec3& position, GLfloat radius, const glm::vec3& color)
+    {
+        this->lightX.push_back(position.x);
+        this->lightY.push_back(position.y);
+        this->lightZ.push_back(position.z);
+        this->lightRadius.push_back(radius);
+        this->lightColor.push_back(color);
+        return this->lightX.size() - 1;
+    }
+
+    GLuint Size() const { return this->lightX.size(); }
+
+    // the assignment for this view starts on the worker threads (the jobs are added to counter):
+    // the lights must not change until Finish(), after jobs.Wait(counter)
+    void Start(JobSystem& jobs, JobCounter& counter, const glm::mat4& view, const glm::mat4& projection, GLfloat near, GLfloat far)
+    {
+        this->view = view;
+        this->projection = projection;
+        this->near = near;
+        this->far = far;
+        this->start = chrono::high_resolution_clock::now();
+        this->pendingJobs = (GRID_Z + SLICES_PER_JOB - 1) / SLICES_PER_JOB;
+        // the first job computes the bounds of all the lights, then it starts the jobs of the slices, which need all of them
+        jobs.Run(counter, [this, &jobs, &counter]()
+        {
+            this->ComputeBounds();
+            for (GLuint z = 0; z < GRID_Z; z += SLICES_PER_JOB)
+                jobs.Run(counter, [this, z]()
+                {
+                    this->FillSlices(z, min(z + SLICES_PER_JOB, (GLuint)GRID_Z));
+                    // the last job to finish stops the clock
+                    if (--this->pendingJobs == 0)
+                        this->end = chrono::high_resolution_clock::now();
+                });
+        });
+    }
+
+    // after the jobs are done: we merge the lists, and we upload the lights and the lists in the texture buffers
+    void Finish()
+    {
+        this->stats = ClusterStats();
+        this->stats.lights = this->Size();
+        this->stats.assignTime = chrono::duration<double, milli>(this->end - this->start).count();
+        this->indices.clear();
+        for (GLuint c = 0; c < NUM_CLUSTERS; c++)
+        {
+            GLuint count = this->lists[c].size();
+            this->table[2 * c] = this->indices.size();
+            this->table[2 * c + 1] = count;
+            this->indices.insert(this->indices.end(), this->lists[c].begin(), this->lists[c].end());
+            this->stats.usedClusters += count > 0;
+            this->stats.maxPerCluster = max(this->stats.maxPerCluster, count);
+        }
+        this->stats.indices = this->indices.size();
+
+        // two texels for each light: view space position and radius, color and intensity
+        this->lightData.resize(2 * this->Size());
+        for (GLuint i = 0; i < this->Size(); i++)
+        {
+            this->stats.visibleLights += this->ranges[i].visible;
+            this->lightData[2 * i] = glm::vec4(this->viewX[i], this->viewY[i], this->viewZ[i], this->lightRadius[i]);
+            this->lightData[2 * i + 1] = glm::vec4(this->lightColor[i], 0.0f);
+        }
+        Upload(this->buffers[0], this->lightData.data(), this->lightData.size() * sizeof(glm::vec4));
+        Upload(this->buffers[1], this->table.data(), this->table.size() * sizeof(GLuint));
+        Upload(this->buffers[2], this->indices.data(), this->indices.size() * sizeof(GLuint));
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    }
+
+    // we bind the texture buffers to three consecutive units from firstUnit, and we set the uniforms of the grid
+    // for a viewport of width x height pixels
+    void Bind(GLuint program, GLuint firstUnit, GLsizei width, GLsizei height) const
+    {
+        const char* names[NUM_BUFFERS] = {"clusterLights", "clusterTable", "clusterIndices"};
+        for (GLuint i = 0; i < NUM_BUFFERS; i++)
+        {
+            GLState().BindTexture(firstUnit + i, GL_TEXTURE_BUFFER, this->textures[i]);
+            glUniform1i(glGetUniformLocation(program, names[i]), firstUnit + i);
+        }
+        glUniform1i(glGetUniformLocation(program, "clusteredLighting"), this->Size() > 0);
+        glUniform3i(glGetUniformLocation(program, "clusterGrid"), GRID_X, GRID_Y, GRID_Z);
+        glUniform2f(glGetUniformLocation(program, "clusterTileScale"), (GLfloat)GRID_X / width, (GLfloat)GRID_Y / height);
+        // slice = log(depth) * scale + bias
+        GLfloat scale = GRID_Z / log(this->far / this->near);
+        glUniform1f(glGetUniformLocation(program, "clusterSliceScale"), scale);
+        glUniform1f(glGetUniformLocation(program, "clusterSliceBias"), -log(this->near) * scale);
+    }
+
+private:
+    static const GLuint NUM_BUFFERS = 3;
+
+    // tiles and slices covered by a light (inclusive), and if it is in the view at all
+    struct Range {
+        GLubyte x0, x1, y0, y1, z0, z1;
+        bool visible;
+    };
+
+    // lights, cluster table (offset and count of each list), light indices
+    GLuint buffers[NUM_BUFFERS] = {0, 0, 0};
+    GLuint textures[NUM_BUFFERS] = {0, 0, 0};
+
+    glm::mat4 view, projection;
+    GLfloat near = 0.1f, far = 100.0f;
+    chrono::high_resolution_clock::time_point start, end;
+    atomic<int> pendingJobs{0};
+
+    // per light: view space position, and clusters covered
+    vector<GLfloat> viewX, viewY, viewZ;
+    vector<Range> ranges;
+    // light list of each cluster, filled by the jobs
+    vector<vector<GLuint>> lists;
+    // merged lists, and data of the lights for the upload
+    vector<GLuint> table, indices;
+    vector<glm::vec4> lightData;
+
+    // the buffer is orphaned, so the GPU can still read the data of the last frame
+    static void Upload(GLuint buffer, const void* data, GLsizeiptr bytes)
+    {
+        glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+        glBufferData(GL_TEXTURE_BUFFER, max(bytes, (GLsizeiptr)16), NULL, GL_STREAM_DRAW);
+        if (bytes > 0)
+            glBufferSubData(GL_TEXTURE_BUFFER, 0, bytes, data);
+    }
+
+    GLuint Slice(GLfloat depth) const
+    {
+        if (depth <= this->near)
+            return 0;
+        GLint slice = (GLint)floor(log(depth / this->near) / log(this->far / this->near) * GRID_Z);
+        return (GLuint)glm::clamp(slice, 0, (GLint)GRID_Z - 1);
+    }
+
+    static GLubyte Tile(GLfloat ndc, GLuint tiles)
+    {
+        GLint tile = (GLint)floor((ndc * 0.5f + 0.5f) * tiles);
+        return (GLubyte)glm::clamp(tile, 0, (GLint)tiles - 1);
+    }
+
+    // view space positions, and screen bounds (NDC) and depth range of each light
+    void ComputeBounds()
+    {
+        GLuint n = this->Size();
+        this->viewX.resize(n);
+        this->viewY.resize(n);
+        this->viewZ.resize(n);
+        this->ranges.resize(n);
+        vector<GLfloat> minX(n), maxX(n), minY(n), maxY(n), nearZ(n), farZ(n);
+        const GLfloat* X = this->lightX.data();
+        const GLfloat* Y = this->lightY.data();
+        const GLfloat* Z = this->lightZ.data();
+        const GLfloat* R = this->lightRadius.data();
+        // GLM matrices are column-major: element (row, col) is m[col][row]
+        const glm::mat4& V = this->view;
+        GLfloat P00 = this->projection[0][0], P11 = this->projection[1][1];
+        GLuint i = 0;
+
+#if CULLING_SIMD_WIDTH >= 4
+        for (; i + 4 <= n; i += 4)
+        {
+            __m128 x = _mm_loadu_ps(X + i), y = _mm_loadu_ps(Y + i), z = _mm_loadu_ps(Z + i), r = _mm_loadu_ps(R + i);
+            __m128 vx = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(V[0][0])), _mm_mul_ps(y, _mm_set1_ps(V[1][0]))),
+                                   _mm_add_ps(_mm_mul_ps(z, _mm_set1_ps(V[2][0])), _mm_set1_ps(V[3][0])));
+            __m128 vy = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(V[0][1])), _mm_mul_ps(y, _mm_set1_ps(V[1][1]))),
+                                   _mm_add_ps(_mm_mul_ps(z, _mm_set1_ps(V[2][1])), _mm_set1_ps(V[3][1])));
+            __m128 vz = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(V[0][2])), _mm_mul_ps(y, _mm_set1_ps(V[1][2]))),
+                                   _mm_add_ps(_mm_mul_ps(z, _mm_set1_ps(V[2][2])), _mm_set1_ps(V[3][2])));
+            _mm_storeu_ps(&this->viewX[i], vx);
+            _mm_storeu_ps(&this->viewY[i], vy);
+            _mm_storeu_ps(&this->viewZ[i], vz);
+            // the camera looks down -z: the depth is -vz. The box of the sphere is clipped at the near plane
+            __m128 depth = _mm_sub_ps(_mm_setzero_ps(), vz);
+            __m128 zn = _mm_max_ps(_mm_sub_ps(depth, r), _mm_set1_ps(this->near));
+            __m128 zf = _mm_max_ps(_mm_add_ps(depth, r), _mm_set1_ps(this->near));
+            __m128 invN = _mm_div_ps(_mm_set1_ps(1.0f), zn), invF = _mm_div_ps(_mm_set1_ps(1.0f), zf);
+            __m128 px = _mm_set1_ps(P00), py = _mm_set1_ps(P11);
+            __m128 x0 = _mm_sub_ps(vx, r), x1 = _mm_add_ps(vx, r), y0 = _mm_sub_ps(vy, r), y1 = _mm_add_ps(vy, r);
+            _mm_storeu_ps(&minX[i], _mm_mul_ps(_mm_min_ps(_mm_mul_ps(x0, invN), _mm_mul_ps(x0, invF)), px));
+            _mm_storeu_ps(&maxX[i], _mm_mul_ps(_mm_max_ps(_mm_mul_ps(x1, invN), _mm_mul_ps(x1, invF)), px));
+            _mm_storeu_ps(&minY[i], _mm_mul_ps(_mm_min_ps(_mm_mul_ps(y0, invN), _mm_mul_ps(y0, invF)), py));
+            _mm_storeu_ps(&maxY[i], _mm_mul_ps(_mm_max_ps(_mm_mul_ps(y1, invN), _mm_mul_ps(y1, invF)), py));
+            _mm_storeu_ps(&nearZ[i], zn);
+            _mm_storeu_ps(&farZ[i], _mm_add_ps(depth, r));
+        }
+#endif
+        // remaining lights (or all of them, without SIMD)
+        for (; i < n; i++)
+        {
+            glm::vec4 p = V * glm::vec4(X[i], Y[i], Z[i], 1.0f);
+            this->viewX[i] = p.x;
+            this->viewY[i] = p.y;
+            this->viewZ[i] = p.z;
+            GLfloat zn = max(-p.z - R[i], this->near), zf = max(-p.z + R[i], this->near);
+            minX[i] = min((p.x - R[i]) / zn, (p.x - R[i]) / zf) * P00;
+            maxX[i] = max((p.x + R[i]) / zn, (p.x + R[i]) / zf) * P00;
+            minY[i] = min((p.y - R[i]) / zn, (p.y - R[i]) / zf) * P11;
+            maxY[i] = max((p.y + R[i]) / zn, (p.y + R[i]) / zf) * P11;
+            nearZ[i] = zn;
+            farZ[i] = -p.z + R[i];
+        }
+
+        // from the bounds to the tiles and slices (the logarithm of the slices has no SSE instruction)
+        for (i = 0; i < n; i++)
+        {
+            Range& range = this->ranges[i];
+            range.visible = farZ[i] > this->near && maxX[i] >= -1.0f && minX[i] <= 1.0f && maxY[i] >= -1.0f && minY[i] <= 1.0f;
+            if (!range.visible)
+                continue;
+            range.x0 = Tile(minX[i], GRID_X);
+            range.x1 = Tile(maxX[i], GRID_X);
+            range.y0 = Tile(minY[i], GRID_Y);
+            range.y1 = Tile(maxY[i], GRID_Y);
+            range.z0 = this->Slice(nearZ[i]);
+            range.z1 = this->Slice(farZ[i]);
+        }
+    }
+
+    // light lists of the clusters of slices [z0, z1)
+    void FillSlices(GLuint z0, GLuint z1)
+    {
+        for (GLuint c = z0 * GRID_X * GRID_Y; c < z1 * GRID_X * GRID_Y; c++)
+            this->lists[c].clear();
+        for (GLuint i = 0; i < this->ranges.size(); i++)
+        {
+            const Range& range = this->ranges[i];
+            if (!range.visible || range.z1 < z0 || range.z0 >= z1)
+                continue;
+            for (GLuint z = max((GLuint)range.z0, z0); z <= min((GLuint)range.z1, z1 - 1); z++)
+                for (GLuint y = range.y0; y <= range.y1; y++)
+                    for (GLuint x = range.x0; x <= range.x1; x++)
+                        this->lists[(z * GRID_Y + y) * GRID_X + x].push_back(i);
+        }
+    }
+};
@@ -0,0 +1,178 @@
+/*
+Frustum and FrustumCuller classes
+- Frustum is a set of 6 planes (xyz = normal pointing inside, w = distance), extracted from a projection * view matrix,
+  or built from the camera position and the corners of a portal: in that case the 4 side planes pass through the edges of the portal,
+  so only the objects which can be seen through the portal are inside
+- FrustumCuller tests the world-space bounding spheres of all the objects of the scene (see scene.h) against a frustum,
+  before anything reaches OpenGL. The result is a visibility flag for each object, and the number of visible and culled objects
+
+N.B. 1) the spheres are stored as separate x, y, z, radius arrays, so the culler tests 8 (AVX) or 4 (SSE) objects at the same time:
+for each plane, a sphere is outside if dot(normal, center) + distance < -radius.
+Without SSE (e.g. on ARM) the same test is done one object at a time
+
+N.B. 2) the test is conservative: an object outside the frustum, but near a corner of it, can be considered visible
+*/
+
+#pragma once
+
+using namespace std;
+
+// Std. Includes
+#include <vector>
+
+#include <glm/glm.hpp>
+
+// SIMD width of the culling: 8 with AVX, 4 with SSE, 1 otherwise
+#if defined(__AVX__)
+    #include <immintrin.h>
+    #define CULLING_SIMD_WIDTH 8
+#elif defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+    #include <xmmintrin.h>
+    #define CULLING_SIMD_WIDTH 4
+#else
+    #define CULLING_SIMD_WIDTH 1
+#endif
+
+#include <utils/scene.h>
+
+// number of visible and culled objects in a view
+struct CullStats {
+    GLuint visible = 0;
+    GLuint culled = 0;
+};
+
+/////////////////// FRUSTUM class ///////////////////////
+class Frustum
+{
+public:
+    glm::vec4 planes[6];
+
+    // we extract the planes from the rows of the projection * view matrix (Gribb-Hartmann method)
+    static Frustum FromMatrix(const glm::mat4& projView)
+    {
+        Frustum frustum;
+        // GLM matrices are column-major: row i is (m[0][i], m[1][i], m[2][i], m[3][i])
+        glm::vec4 rows[4];
+        for (int i = 0; i < 4; i++)
+            rows[i] = glm::vec4(projView[0][i], projView[1][i], projView[2][i], projView[3][i]);
+        frustum.planes[0] = rows[3] + rows[0]; // left
+        frustum.planes[1] = rows[3] - rows[0]; // right
+        frustum.planes[2] = rows[3] + rows[1]; // bottom
+        frustum.planes[3] = rows[3] - rows[1]; // top
+        frustum.planes[4] = rows[3] + rows[2]; // near
+        frustum.planes[5] = rows[3] - rows[2]; // far
+        for (int i = 0; i < 6; i++)
+            frustum.planes[i] /= glm::length(glm::vec3(frustum.planes[i]));
+        return frustum;
+    }
+
+    // frustum of the view through a portal: the side planes of the view frustum are replaced by the planes through
+    // the eye and the 4 edges of the portal (corners in world coordinates, in order around the portal).
+    // The near and far planes of the view frustum are kept
+    static Frustum ThroughPortal(const Frustum& view, const glm::vec3& eye, const glm::vec3 corners[4])
+    {
+        Frustum frustum = view;
+        glm::vec3 center = 0.25f * (corners[0] + corners[1] + corners[2] + corners[3]);
+        for (int i = 0; i < 4; i++)
+        {
+            glm::vec3 normal = glm::cross(corners[i] - eye, corners[(i + 1) % 4] - eye);
+            GLfloat length = glm::length(normal);
+            // the eye is (almost) on the plane of the portal: we keep the view frustum
+            if (length < 1e-6f)
+                return view;
+            normal /= length;
+            glm::vec4 plane(normal, -glm::dot(normal, eye));
+            // the normal must point to the inside, where the center of the portal is
+            if (glm::dot(glm::vec3(plane), center) + plane.w < 0.0f)
+                plane = -plane;
+            frustum.planes[i] = plane;
+        }
+        return frustum;
+    }
+};
+
+/////////////////// FRUSTUMCULLER class ///////////////////////
+class FrustumCuller
+{
+public:
+    // visibility of each object of the scene in the last culled view
+    vector<GLubyte> visibility;
+
+    // we test all the objects of the scene against the frustum
+    CullStats Cull(const Scene& scene, const Frustum& frustum)
+    {
+        GLuint n = scene.Size();
+        this->visibility.resize(n);
+        const GLfloat* X = scene.sphereX.data();
+        const GLfloat* Y = scene.sphereY.data();
+        const GLfloat* Z = scene.sphereZ.data();
+        const GLfloat* R = scene.sphereRadius.data();
+        GLuint i = 0;
+
+#if CULLING_SIMD_WIDTH == 8
+        for (; i + 8 <= n; i += 8)
+        {
+            __m256 x = _mm256_loadu_ps(X + i), y = _mm256_loadu_ps(Y + i), z = _mm256_loadu_ps(Z + i);
+            __m256 negR = _mm256_sub_ps(_mm256_setzero_ps(), _mm256_loadu_ps(R + i));
+            __m256 inside = _mm256_cmp_ps(negR, negR, _CMP_EQ_OQ);
+            for (int p = 0; p < 6; p++)
+            {
+                const glm::vec4& plane = frustum.planes[p];
+                __m256 d = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(plane.x)), _mm256_mul_ps(y, _mm256_set1_ps(plane.y))),
+                                         _mm256_add_ps(_mm256_mul_ps(z, _mm256_set1_ps(plane.z)), _mm256_set1_ps(plane.w)));
+                inside = _mm256_and_ps(inside, _mm256_cmp_ps(d, negR, _CMP_GE_OQ));
+            }
+            int mask = _mm256_movemask_ps(inside);
+            for (int k = 0; k < 8; k++)
+                this->visibility[i + k] = (mask >> k) & 1;
+        }
+#endif
+#if CULLING_SIMD_WIDTH >= 4
+        for (; i + 4 <= n; i += 4)
+        {
+            __m128 x = _mm_loadu_ps(X + i), y = _mm_loadu_ps(Y + i), z = _mm_loadu_ps(Z + i);
+            __m128 negR = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(R + i));
+            __m128 inside = _mm_cmpeq_ps(negR, negR);
+            for (int p = 0; p < 6; p++)
+            {
+                const glm::vec4& plane = frustum.planes[p];
+                __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(plane.x)), _mm_mul_ps(y, _mm_set1_ps(plane.y))),
+                                      _mm_add_ps(_mm_mul_ps(z, _mm_set1_ps(plane.z)), _mm_set1_ps(plane.w)));
+                inside = _mm_and_ps(inside, _mm_cmpge_ps(d, negR));
+            }
+            int mask = _mm_movemask_ps(inside);
+            for (int k = 0; k < 4; k++)
+                this->visibility[i + k] = (mask >> k) & 1;
+        }
+#endif
+        // remaining objects (or all of them, without SIMD)
+        for (; i < n; i++)
+        {
+            GLubyte inside = 1;
+            for (int p = 0; p < 6; p++)
+            {
+                const glm::vec4& plane = frustum.planes[p];
+                if (plane.x * X[i] + plane.y * Y[i] + plane.z * Z[i] + plane.w < -R[i])
+                    inside = 0;
+            }
+            this->visibility[i] = inside;
+        }
+
+        CullStats stats;
+        for (i = 0; i < n; i++)
+            stats.visible += this->visibility[i];
+        stats.culled = n - stats.visible;
+        return stats;
+    }
+
+    // everything is visible (views which are not culled, e.g. the shadow and bake passes)
+    void AcceptAll(const Scene& scene)
+    {
+        this->visibility.assign(scene.Size(), 1);
+    }
+
+    bool IsVisible(GLint object) const
+    {
+        return object < 0 || object >= (GLint)this->visibility.size() || this->visibility[object];
+    }
+};
@@ -0,0 +1,702 @@
+/*
+FrameGraph class
+- the passes of a frame (shadow maps, main rendering, paint strokes, baking) are declared every frame, together with the
+  textures they read and write. Compile() decides which passes run and which textures they use, Execute() runs them
+- the resources can be transient (the graph gives them a texture only for the passes which use them in the current frame),
+  persistent (allocated by the graph, their content is kept between frames, e.g. the paint and bake textures)
+  or imported (the default framebuffer, or a texture owned by someone else and declared in each frame, e.g. the shadow pool)
+- a pass is culled if nothing it writes is needed: a resource is needed if it is marked as output of the frame (MarkOutput),
+  or if it is read by a later pass which is not culled. E.g. the bake passes run only in the frame in which the bake texture is requested,
+  and in the other frames the depth map used by the baking is not allocated at all
+- the transient textures are taken from a pool: a texture is given to a resource in the first pass which uses it, and it goes back
+  to the pool after the last one, so resources with the same description and disjoint lifetimes share the same texture (aliasing).
+  The textures of the pool which are not used in a frame are deleted
+- the size of a texture can be fixed, or relative to the size of the default framebuffer: when the window is resized,
+  the relative textures are reallocated (the persistent ones lose their content)
+- before each pass the graph issues the barriers needed by its accesses, binds a framebuffer with the textures written
+  by the pass (created once and cached) and sets the viewport to their size
+
+N.B. 1) the passes are executed in the order in which they are added: a pass reads what was written by the passes added before it,
+so the declaration order is always a valid order, and the graph only decides which passes run and what happens between them
+
+N.B. 2) a write does not replace the whole content of a resource: all the passes which write a needed resource are kept
+(e.g. the paint strokes are drawn on top of the main rendering in the default framebuffer)
+
+N.B. 3) OpenGL orders by itself the rendering in a texture and the sampling of the same texture in the following draws.
+Explicit barriers are needed only after image stores (glMemoryBarrier, OpenGL 4.2), and when a pass samples a texture it is rendering to
+(glTextureBarrier, see glstate.h): e.g. the bake pass, which blends the strokes with the content of the bake texture
+
+N.B. 4) the default framebuffer is not a texture: a pass which writes only the backbuffer renders in framebuffer 0,
+while a pass which writes textures and the backbuffer (e.g. the paint strokes, shown also on the screen)
+gets the framebuffer of its textures, and it binds framebuffer 0 by itself
+*/
+
+#pragma once
+
+using namespace std;
+
+// Std. Includes
+#include <string>
+#include <vector>
+#include <functional>
+#include <iostream>
+
+#include <glm/glm.hpp>
+
+#include <utils/glstate.h>
+
+// how the graph manages the texture of a resource
+enum FrameResourceKind { FRAME_TRANSIENT, FRAME_PERSISTENT, FRAME_IMPORTED };
+
+// how a pass accesses a resource
+enum FrameAccess {
+    FRAME_READ_TEXTURE,     // sampled in the shaders
+    FRAME_READ_IMAGE,       // imageLoad
+    FRAME_WRITE_ATTACHMENT, // attached to the framebuffer of the pass
+    FRAME_WRITE_IMAGE,      // imageStore
+    FRAME_WRITE_TRANSFER    // cleared or copied outside the framebuffer of the pass (e.g. with FrameGraph::Clear)
+};
+
+// description of the texture of a resource
+struct FrameTextureDesc {
+    // GL_TEXTURE_2D or GL_TEXTURE_CUBE_MAP (GL_TEXTURE_CUBE_MAP_ARRAY only for imported textures)
+    GLenum target;
+    // sized internal format (e.g. GL_RGB8, GL_DEPTH_COMPONENT24)
+    GLenum internalFormat;
+    // fixed size, used if scale is 0
+    GLsizei width, height;
+    // size relative to the default framebuffer (e.g. 1.0 = same resolution of the window)
+    GLfloat scale;
+    GLenum filter;
+    GLenum wrap;
+
+    FrameTextureDesc(GLenum target = GL_TEXTURE_2D, GLenum internalFormat = GL_RGBA8, GLsizei width = 1, GLsizei height = 1,
+                     GLenum filter = GL_LINEAR, GLenum wrap = GL_CLAMP_TO_EDGE)
+        : target(target), internalFormat(internalFormat), width(width), height(height), scale(0.0f), filter(filter), wrap(wrap) {}
+
+    // a 2D texture with a size relative to the default framebuffer
+    static FrameTextureDesc Relative(GLenum internalFormat, GLfloat scale, GLenum filter = GL_LINEAR, GLenum wrap = GL_CLAMP_TO_EDGE)
+    {
+        FrameTextureDesc desc(GL_TEXTURE_2D, internalFormat, 0, 0, filter, wrap);
+        desc.scale = scale;
+        return desc;
+    }
+};
+
+// statistics of the last compiled frame, shown in the Performance window
+struct FrameGraphStats {
+    GLuint passes = 0;
+    GLuint culledPasses = 0;
+    // textures of the pool and persistent textures, and their (estimated) memory
+    GLuint textures = 0;
+    GLsizeiptr textureBytes = 0;
+    // transient resources which got a texture, and how many of them shared it with another resource
+    GLuint transientResources = 0;
+    GLuint aliasedResources = 0;
+    GLuint barriers = 0;
+    // reallocations of the relative textures since the start (one for each resize)
+    GLuint reallocations = 0;
+};
+
+/////////////////// FRAMEGRAPH class ///////////////////////
+class FrameGraph
+{
+public:
+    FrameGraphStats stats;
+
+    FrameGraph()
+    {
+        // resource 0 is the default framebuffer
+        FrameResource backbuffer;
+        backbuffer.name = "Backbuffer";
+        backbuffer.kind = FRAME_IMPORTED;
+        this->resources.push_back(backbuffer);
+        this->numPersistent = 1;
+    }
+
+    FrameGraph(const FrameGraph& copy) = delete; //disallow copy
+    FrameGraph& operator=(const FrameGraph&) = delete;
+
+    ~FrameGraph() noexcept
+    {
+        for (GLuint i = 0; i < this->framebuffers.size(); i++)
+            glDeleteFramebuffers(1, &this->framebuffers[i].framebuffer);
+        for (GLuint i = 0; i < this->pool.size(); i++)
+            glDeleteTextures(1, &this->pool[i].texture);
+        for (GLuint i = 0; i < this->numPersistent; i++)
+            if (this->resources[i].kind == FRAME_PERSISTENT && this->resources[i].texture)
+                glDeleteTextures(1, &this->resources[i].texture);
+    }
+
+    //////////////////////////////////////////
+    // declaration of the resources
+
+    // the default framebuffer
+    GLuint Backbuffer() const { return 0; }
+
+    // a resource whose content is kept between frames. It must be added once, outside of the frames
+    // (the texture is allocated in the next BeginFrame(), and cleared to 0)
+    GLuint AddPersistentTexture(const string& name, const FrameTextureDesc& desc)
+    {
+        if (this->resources.size() != this->numPersistent)
+        {
+            cout << "ERROR::FRAMEGRAPH:: the persistent texture " << name << " must be added outside of the frames" << endl;
+            return 0;
+        }
+        FrameResource resource;
+        resource.name = name;
+        resource.kind = FRAME_PERSISTENT;
+        resource.desc = desc;
+        this->resources.push_back(resource);
+        return this->numPersistent++;
+    }
+
+    // a transient resource, valid only in the current frame
+    GLuint CreateTexture(const string& name, const FrameTextureDesc& desc)
+    {
+        FrameResource resource;
+        resource.name = name;
+        resource.kind = FRAME_TRANSIENT;
+        resource.desc = desc;
+        this->Resolve(resource);
+        this->resources.push_back(resource);
+        return this->resources.size() - 1;
+    }
+
+    // a texture allocated outside of the graph, valid only in the current frame: the graph does not allocate, clear or delete it,
+    // but the passes which write it get a framebuffer with it attached (all the layers), and a viewport with the size in desc.
+    // The owner must not delete the texture while the graph is alive (the framebuffers which use it are cached)
+    GLuint ImportTexture(const string& name, GLuint texture, const FrameTextureDesc& desc)
+    {
+        FrameResource resource;
+        resource.name = name;
+        resource.kind = FRAME_IMPORTED;
+        resource.desc = desc;
+        resource.texture = texture;
+        this->Resolve(resource);
+        this->resources.push_back(resource);
+        return this->resources.size() - 1;
+    }
+
+    //////////////////////////////////////////
+    // declaration of the passes
+
+    // we start a new frame: the passes and the transient resources of the last frame are forgotten.
+    // If the size of the default framebuffer changed, we reallocate the persistent textures with a relative size
+    void BeginFrame(GLsizei width, GLsizei height)
+    {
+        // a minimized window has a 0 x 0 framebuffer
+        width = glm::max(width, 1);
+        height = glm::max(height, 1);
+        bool firstFrame = this->resources[0].width == 0;
+        bool resized = width != this->resources[0].width || height != this->resources[0].height;
+        this->resources[0].width = width;
+        this->resources[0].height = height;
+        if (resized && !firstFrame)
+            this->stats.reallocations++;
+        this->current = -1;
+
+        this->resources.resize(this->numPersistent);
+        for (GLuint i = 0; i < this->numPersistent; i++)
+        {
+            FrameResource& resource = this->resources[i];
+            resource.output = false;
+            if (resource.kind != FRAME_PERSISTENT || (resource.texture && !(resized && resource.desc.scale > 0.0f)))
+                continue;
+            if (resource.texture)
+                this->DeleteTexture(resource.texture);
+            this->Resolve(resource);
+            resource.texture = this->NewTexture(resource.desc, resource.width, resource.height);
+            this->Clear(i);
+        }
+        this->passes.clear();
+    }
+
+    // a pass, executed by Execute() if it is not culled
+    GLuint AddPass(const string& name, const function<void()>& execute)
+    {
+        FramePass pass;
+        pass.name = name;
+        pass.execute = execute;
+        this->passes.push_back(pass);
+        return this->passes.size() - 1;
+    }
+
+    void Read(GLuint pass, GLuint resource, FrameAccess access = FRAME_READ_TEXTURE)
+    {
+        this->passes[pass].reads.push_back(FramePassAccess(resource, access));
+    }
+
+    void Write(GLuint pass, GLuint resource, FrameAccess access = FRAME_WRITE_ATTACHMENT)
+    {
+        this->passes[pass].writes.push_back(FramePassAccess(resource, access));
+    }
+
+    // the resource is needed at the end of the frame: the passes which write it are not culled
+    void MarkOutput(GLuint resource)
+    {
+        this->resources[resource].output = true;
+    }
+
+    //////////////////////////////////////////
+    // compilation and execution
+
+    // we cull the passes, we give a texture to the transient resources, and we set up the framebuffers of the passes
+    void Compile()
+    {
+        GLuint numPasses = this->passes.size();
+
+        // culling: from the last pass to the first one, a pass is kept if it writes a needed resource,
+        // and then the resources it reads become needed too
+        vector<bool> needed(this->resources.size());
+        for (GLuint r = 0; r < this->resources.size(); r++)
+            needed[r] = this->resources[r].output;
+        for (GLint p = numPasses - 1; p >= 0; p--)
+        {
+            FramePass& pass = this->passes[p];
+            pass.culled = true;
+            for (GLuint i = 0; i < pass.writes.size(); i++)
+                if (needed[pass.writes[i].resource])
+                    pass.culled = false;
+            if (!pass.culled)
+                for (GLuint i = 0; i < pass.reads.size(); i++)
+                    needed[pass.reads[i].resource] = true;
+        }
+
+        // lifetime of each resource: first and last pass (not culled) which use it
+        for (GLuint r = 0; r < this->resources.size(); r++)
+            this->resources[r].firstUse = this->resources[r].lastUse = -1;
+        for (GLuint p = 0; p < numPasses; p++)
+        {
+            if (this->passes[p].culled)
+                continue;
+            this->Use(this->passes[p].reads, p);
+            this->Use(this->passes[p].writes, p);
+        }
+
+        // aliasing: the transient resources get a texture of the pool in their first pass.
+        // The texture can be given to another resource from the pass after the last use of the first one
+        for (GLuint i = 0; i < this->pool.size(); i++)
+        {
+            this->pool[i].availableFrom = 0;
+            this->pool[i].users = 0;
+        }
+        this->stats.transientResources = 0;
+        this->stats.aliasedResources = 0;
+        for (GLuint p = 0; p < numPasses; p++)
+            for (GLuint r = this->numPersistent; r < this->resources.size(); r++)
+                if (this->resources[r].kind == FRAME_TRANSIENT && this->resources[r].firstUse == (GLint)p)
+                    this->Acquire(this->resources[r]);
+
+        // the textures of the pool which have not been used in this frame are released
+        for (GLint i = this->pool.size() - 1; i >= 0; i--)
+            if (this->pool[i].users == 0)
+            {
+                this->DeleteTexture(this->pool[i].texture);
+                this->pool.erase(this->pool.begin() + i);
+            }
+
+        // framebuffers and viewports of the passes
+        for (GLuint p = 0; p < numPasses; p++)
+            if (!this->passes[p].culled)
+                this->SetupFramebuffer(this->passes[p]);
+
+        this->stats.passes = numPasses;
+        this->stats.culledPasses = 0;
+        for (GLuint p = 0; p < numPasses; p++)
+            this->stats.culledPasses += this->passes[p].culled;
+        this->stats.textures = this->pool.size();
+        this->stats.textureBytes = 0;
+        for (GLuint i = 0; i < this->pool.size(); i++)
+            this->stats.textureBytes += TextureBytes(this->pool[i].desc, this->pool[i].width, this->pool[i].height);
+        for (GLuint i = 0; i < this->numPersistent; i++)
+            if (this->resources[i].kind == FRAME_PERSISTENT)
+            {
+                this->stats.textures++;
+                this->stats.textureBytes += TextureBytes(this->resources[i].desc, this->resources[i].width, this->resources[i].height);
+            }
+    }
+
+    // we execute the passes which have not been culled, in the order in which they have been added
+    void Execute()
+    {
+        this->stats.barriers = 0;
+        for (GLuint p = 0; p < this->passes.size(); p++)
+        {
+            FramePass& pass = this->passes[p];
+            if (pass.culled)
+                continue;
+            this->IssueBarriers(pass);
+            this->current = p;
+            GLState().BindFramebuffer(pass.framebuffer);
+            glViewport(0, 0, pass.width, pass.height);
+            pass.execute();
+            for (GLuint i = 0; i < pass.writes.size(); i++)
+                this->resources[pass.writes[i].resource].lastWrite = pass.writes[i].access;
+        }
+        this->current = -1;
+        GLState().BindFramebuffer(0);
+        glViewport(0, 0, this->resources[0].width, this->resources[0].height);
+    }
+
+    //////////////////////////////////////////
+    // access to the resources during the frame
+
+    // texture of the resource (0 for the backbuffer, and for the transient resources used only by culled passes).
+    // It is valid after Compile()
+    GLuint Texture(GLuint resource) const
+    {
+        return this->resources[resource].texture;
+    }
+
+    bool IsCulled(GLuint pass) const
+    {
+        return this->passes[pass].culled;
+    }
+
+    // framebuffer of the pass being executed
+    GLuint CurrentFramebuffer() const
+    {
+        return this->current >= 0 ? this->passes[this->current].framebuffer : 0;
+    }
+
+    // we clear the texture of the resource (color to 0, depth to 1). The pass must declare it with FRAME_WRITE_TRANSFER
+    void Clear(GLuint resource)
+    {
+        const FrameResource& res = this->resources[resource];
+        if (!res.texture)
+            return;
+        vector<GLuint> colors;
+        GLuint depth = 0;
+        if (IsDepthFormat(res.desc.internalFormat))
+            depth = res.texture;
+        else
+            colors.push_back(res.texture);
+        GLState().BindFramebuffer(this->GetFramebuffer(colors, depth, res.desc.internalFormat));
+        // the clear is affected by the write masks and by the scissor test
+        GLState().Disable(GL_SCISSOR_TEST);
+        if (depth)
+        {
+            GLState().DepthMask(GL_TRUE);
+            GLfloat one = 1.0f;
+            glClearBufferfv(GL_DEPTH, 0, &one);
+        }
+        else
+        {
+            GLState().ColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+            GLfloat zero[] = {0.0f, 0.0f, 0.0f, 0.0f};
+            glClearBufferfv(GL_COLOR, 0, zero);
+        }
+        GLState().BindFramebuffer(this->CurrentFramebuffer());
+    }
+
+private:
+    // a resource, and the state of its texture in the current frame
+    struct FrameResource {
+        string name;
+        FrameResourceKind kind = FRAME_TRANSIENT;
+        FrameTextureDesc desc;
+        // size of the texture in this frame (the relative sizes are resolved with the size of the default framebuffer)
+        GLsizei width = 0, height = 0;
+        GLuint texture = 0;
+        bool output = false;
+        // first and last pass which use the resource (-1 if it is not used)
+        GLint firstUse = -1, lastUse = -1;
+        // last write access, to know which barrier is needed before the next access
+        FrameAccess lastWrite = FRAME_WRITE_ATTACHMENT;
+    };
+
+    struct FramePassAccess {
+        GLuint resource;
+        FrameAccess access;
+        FramePassAccess(GLuint resource, FrameAccess access) : resource(resource), access(access) {}
+    };
+
+    struct FramePass {
+        string name;
+        function<void()> execute;
+        vector<FramePassAccess> reads;
+        vector<FramePassAccess> writes;
+        bool culled = false;
+        GLuint framebuffer = 0;
+        // viewport of the pass (size of its attachments)
+        GLsizei width = 0, height = 0;
+    };
+
+    // a texture of the pool, with the pass from which it can be given to another resource in the current frame
+    struct FramePooledTexture {
+        FrameTextureDesc desc;
+        GLsizei width, height;
+        GLuint texture;
+        GLint availableFrom;
+        GLuint users;
+    };
+
+    // a cached framebuffer, with its color attachments and its depth attachment
+    struct FrameFramebuffer {
+        vector<GLuint> colors;
+        GLuint depth;
+        GLuint framebuffer;
+    };
+
+    vector<FrameResource> resources;
+    // the first numPersistent resources (backbuffer and persistent textures) are kept between frames
+    GLuint numPersistent = 0;
+    vector<FramePass> passes;
+    vector<FramePooledTexture> pool;
+    vector<FrameFramebuffer> framebuffers;
+    // pass being executed (-1 outside of Execute())
+    GLint current = -1;
+
+    //////////////////////////////////////////
+
+    // we compute the size of the texture of the resource in this frame
+    void Resolve(FrameResource& resource) const
+    {
+        if (resource.desc.scale > 0.0f)
+        {
+            resource.width = glm::max(GLsizei(this->resources[0].width * resource.desc.scale), 1);
+            resource.height = glm::max(GLsizei(this->resources[0].height * resource.desc.scale), 1);
+        }
+        else
+        {
+            resource.width = resource.desc.width;
+            resource.height = resource.desc.height;
+        }
+    }
+
+    void Use(const vector<FramePassAccess>& accesses, GLint pass)
+    {
+        for (GLuint i = 0; i < accesses.size(); i++)
+        {
+            FrameResource& resource = this->resources[accesses[i].resource];
+            if (resource.firstUse < 0)
+                resource.firstUse = pass;
+            resource.lastUse = pass;
+        }
+    }
+
+    // we give to the resource a texture of the pool with the same description, which is free from its first pass, or a new one
+    void Acquire(FrameResource& resource)
+    {
+        this->stats.transientResources++;
+        for (GLuint i = 0; i < this->pool.size(); i++)
+        {
+            FramePooledTexture& pooled = this->pool[i];
+            if (pooled.availableFrom > resource.firstUse || !SameTexture(pooled.desc, pooled.width, pooled.height, resource))
+                continue;
+            if (pooled.users > 0)
+                this->stats.aliasedResources++;
+            pooled.availableFrom = resource.lastUse + 1;
+            pooled.users++;
+            resource.texture = pooled.texture;
+            resource.lastWrite = FRAME_WRITE_ATTACHMENT;
+            return;
+        }
+        FramePooledTexture pooled;
+        pooled.desc = resource.desc;
+        pooled.width = resource.width;
+        pooled.height = resource.height;
+        pooled.texture = this->NewTexture(resource.desc, resource.width, resource.height);
+        pooled.availableFrom = resource.lastUse + 1;
+        pooled.users = 1;
+        this->pool.push_back(pooled);
+        resource.texture = pooled.texture;
+        resource.lastWrite = FRAME_WRITE_ATTACHMENT;
+    }
+
+    static bool SameTexture(const FrameTextureDesc& desc, GLsizei width, GLsizei height, const FrameResource& resource)
+    {
+        return desc.target == resource.desc.target && desc.internalFormat == resource.desc.internalFormat &&
+               width == resource.width && height == resource.height &&
+               desc.filter == resource.desc.filter && desc.wrap == resource.desc.wrap;
+    }
+
+    // the framebuffer of a pass has all the textures it writes as attachments
+    void SetupFramebuffer(FramePass& pass)
+    {
+        vector<GLuint> colors;
+        GLuint depth = 0;
+        GLenum depthFormat = 0;
+        GLint sizeFrom = -1;
+        for (GLuint i = 0; i < pass.writes.size(); i++)
+        {
+            if (pass.writes[i].access != FRAME_WRITE_ATTACHMENT)
+                continue;
+            const FrameResource& resource = this->resources[pass.writes[i].resource];
+            // the backbuffer gives its size to a pass which renders only in it (see N.B. 4)
+            if (pass.writes[i].resource == this->Backbuffer())
+            {
+                if (sizeFrom < 0)
+                    sizeFrom = pass.writes[i].resource;
+                continue;
+            }
+            if (sizeFrom <= 0)
+                sizeFrom = pass.writes[i].resource;
+            if (IsDepthFormat(resource.desc.internalFormat))
+            {
+                depth = resource.texture;
+                depthFormat = resource.desc.internalFormat;
+            }
+            else
+                colors.push_back(resource.texture);
+        }
+        const FrameResource& sized = this->resources[sizeFrom < 0 ? 0 : sizeFrom];
+        pass.width = sized.width;
+        pass.height = sized.height;
+        pass.framebuffer = (colors.empty() && depth == 0) ? 0 : this->GetFramebuffer(colors, depth, depthFormat);
+    }
+
+    // we look for a framebuffer with the same attachments, or we create it
+    GLuint GetFramebuffer(const vector<GLuint>& colors, GLuint depth, GLenum depthFormat)
+    {
+        for (GLuint i = 0; i < this->framebuffers.size(); i++)
+            if (this->framebuffers[i].colors == colors && this->framebuffers[i].depth == depth)
+                return this->framebuffers[i].framebuffer;
+
+        FrameFramebuffer cached;
+        cached.colors = colors;
+        cached.depth = depth;
+        glGenFramebuffers(1, &cached.framebuffer);
+        GLState().BindFramebuffer(cached.framebuffer);
+        // glFramebufferTexture attaches all the faces of a cubemap (layered rendering, see shadow.geo)
+        vector<GLenum> drawBuffers;
+        for (GLuint i = 0; i < colors.size(); i++)
+        {
+            glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i, colors[i], 0);
+            drawBuffers.push_back(GL_COLOR_ATTACHMENT0 + i);
+        }
+        if (depth)
+            glFramebufferTexture(GL_FRAMEBUFFER, HasStencil(depthFormat) ? GL_DEPTH_STENCIL_ATTACHMENT : GL_DEPTH_ATTACHMENT, depth, 0);
+        if (drawBuffers.empty())
+        {
+            glDrawBuffer(GL_NONE);
+            glReadBuffer(GL_NONE);
+        }
+        else
+            glDrawBuffers(drawBuffers.size(), drawBuffers.data());
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            cout << "ERROR::FRAMEGRAPH:: framebuffer with " << colors.size() << " color attachments is not complete" << endl;
+        GLState().BindFramebuffer(this->CurrentFramebuffer());
+
+        this->framebuffers.push_back(cached);
+        return cached.framebuffer;
+    }
+
+    // barriers needed before the accesses of the pass (see N.B. 3)
+    void IssueBarriers(const FramePass& pass)
+    {
+        GLbitfield bits = 0;
+        bool feedback = false;
+        for (GLuint i = 0; i < pass.reads.size(); i++)
+        {
+            const FramePassAccess& read = pass.reads[i];
+            if (this->resources[read.resource].lastWrite == FRAME_WRITE_IMAGE)
+                bits |= read.access == FRAME_READ_TEXTURE ? GL_TEXTURE_FETCH_BARRIER_BIT : GL_SHADER_IMAGE_ACCESS_BARRIER_BIT;
+            if (read.access == FRAME_READ_TEXTURE)
+                for (GLuint j = 0; j < pass.writes.size(); j++)
+                    if (pass.writes[j].resource == read.resource && pass.writes[j].access == FRAME_WRITE_ATTACHMENT)
+                        feedback = true;
+        }
+        for (GLuint i = 0; i < pass.writes.size(); i++)
+        {
+            const FramePassAccess& write = pass.writes[i];
+            if (this->resources[write.resource].lastWrite != FRAME_WRITE_IMAGE)
+                continue;
+            if (write.access == FRAME_WRITE_IMAGE)
+                bits |= GL_SHADER_IMAGE_ACCESS_BARRIER_BIT;
+            else
+                bits |= GL_FRAMEBUFFER_BARRIER_BIT | GL_TEXTURE_UPDATE_BARRIER_BIT;
+        }
+        // image load/store is not available in our baseline context, and then no resource is ever written with FRAME_WRITE_IMAGE
+        if (bits && glMemoryBarrier)
+        {
+            glMemoryBarrier(bits);
+            this->stats.barriers++;
+        }
+        if (feedback && GLState().hasTextureBarrier)
+        {
+            glTextureBarrier();
+            this->stats.barriers++;
+        }
+    }
+
+    //////////////////////////////////////////
+    // textures
+
+    GLuint NewTexture(const FrameTextureDesc& desc, GLsizei width, GLsizei height)
+    {
+        GLuint texture;
+        if (GLState().hasDSA)
+        {
+            glCreateTextures(desc.target, 1, &texture);
+            glTextureStorage2D(texture, 1, desc.internalFormat, width, height);
+        }
+        else
+        {
+            glGenTextures(1, &texture);
+            GLState().BindTextureForEdit(desc.target, texture);
+            // without storage, the format and type of the (missing) data must still be compatible with the internal format
+            GLenum format = IsDepthFormat(desc.internalFormat) ? (HasStencil(desc.internalFormat) ? GL_DEPTH_STENCIL : GL_DEPTH_COMPONENT) : GL_RGBA;
+            GLenum type = HasStencil(desc.internalFormat) ? GL_UNSIGNED_INT_24_8 : GL_FLOAT;
+            if (desc.target == GL_TEXTURE_CUBE_MAP)
+                for (GLuint face = 0; face < 6; face++)
+                    glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, 0, desc.internalFormat, width, height, 0, format, type, NULL);
+            else
+                glTexImage2D(desc.target, 0, desc.internalFormat, width, height, 0, format, type, NULL);
+            GLState().TextureParameteri(texture, desc.target, GL_TEXTURE_MAX_LEVEL, 0);
+        }
+        GLState().TextureParameteri(texture, desc.target, GL_TEXTURE_MIN_FILTER, desc.filter);
+        GLState().TextureParameteri(texture, desc.target, GL_TEXTURE_MAG_FILTER, desc.filter);
+        GLState().TextureParameteri(texture, desc.target, GL_TEXTURE_WRAP_S, desc.wrap);
+        GLState().TextureParameteri(texture, desc.target, GL_TEXTURE_WRAP_T, desc.wrap);
+        if (desc.target == GL_TEXTURE_CUBE_MAP)
+            GLState().TextureParameteri(texture, desc.target, GL_TEXTURE_WRAP_R, desc.wrap);
+        return texture;
+    }
+
+    // we delete the texture, and the framebuffers which use it
+    void DeleteTexture(GLuint texture)
+    {
+        for (GLint i = this->framebuffers.size() - 1; i >= 0; i--)
+        {
+            FrameFramebuffer& cached = this->framebuffers[i];
+            bool attached = cached.depth == texture;
+            for (GLuint j = 0; j < cached.colors.size(); j++)
+                attached = attached || cached.colors[j] == texture;
+            if (!attached)
+                continue;
+            glDeleteFramebuffers(1, &cached.framebuffer);
+            GLState().OnDeleteFramebuffer(cached.framebuffer);
+            this->framebuffers.erase(this->framebuffers.begin() + i);
+        }
+        glDeleteTextures(1, &texture);
+        GLState().OnDeleteTexture(texture);
+    }
+
+    static bool IsDepthFormat(GLenum internalFormat)
+    {
+        return internalFormat == GL_DEPTH_COMPONENT16 || internalFormat == GL_DEPTH_COMPONENT24 || internalFormat == GL_DEPTH_COMPONENT32 ||
+               internalFormat == GL_DEPTH_COMPONENT32F || HasStencil(internalFormat);
+    }
+
+    static bool HasStencil(GLenum internalFormat)
+    {
+        return internalFormat == GL_DEPTH24_STENCIL8;
+    }
+
+    // estimated memory of a texture (the drivers pad 3-component and 24 bit formats to 4 bytes)
+    static GLsizeiptr TextureBytes(const FrameTextureDesc& desc, GLsizei width, GLsizei height)
+    {
+        GLsizeiptr texel;
+        switch (desc.internalFormat)
+        {
+            case GL_R8: texel = 1; break;
+            case GL_R16F: case GL_RG8: case GL_DEPTH_COMPONENT16: texel = 2; break;
+            case GL_RGBA16F: case GL_RG32F: texel = 8; break;
+            case GL_RGBA32F: texel = 16; break;
+            default: texel = 4; break;
+        }
+        return texel * width * height * (desc.target == GL_TEXTURE_CUBE_MAP ? 6 : 1);
+    }
+};
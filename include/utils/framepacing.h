@@ -0,0 +1,121 @@
+/*
+FramePacer class
+- it controls when a frame starts and how it is presented, to reduce the latency between the input and the display:
+  1) swap interval: no vsync, vsync, adaptive vsync (late frames are presented immediately, with tearing, instead of waiting
+     for the next vertical blank), or vsync at half the refresh rate
+  2) frame rate cap: we sleep before the start of the frame, so the input is sampled as late as possible,
+     instead of sampling it early and then blocking in glfwSwapBuffers
+  3) latency measurement: the time from the last sampling of the input (MarkInput) to the return of glfwSwapBuffers (MarkSwapped)
+
+N.B. 1) adaptive vsync needs WGL_EXT_swap_control_tear or GLX_EXT_swap_control_tear: without them we fall back to vsync
+
+N.B. 2) the return of glfwSwapBuffers is not the moment the frame is shown (the driver can queue it), so the latency
+we measure is a lower bound of the real one. It is still useful to compare the modes
+
+N.B. 3) sleep_for() wakes up late by up to a few milliseconds on some systems, so we sleep until shortly before the deadline,
+and we yield for the rest of the time
+*/
+
+#pragma once
+
+using namespace std;
+
+// Std. Includes
+#include <thread>
+#include <chrono>
+#include <algorithm>
+
+#include <GLFW/glfw3.h>
+
+/////////////////// FRAMEPACER class ///////////////////////
+class FramePacer
+{
+public:
+    enum SwapMode { SWAP_IMMEDIATE, SWAP_VSYNC, SWAP_ADAPTIVE, SWAP_HALF_RATE };
+
+    // current mode, and frame rate cap (0 = no cap)
+    int swapMode = SWAP_VSYNC;
+    int fpsCap = 0;
+    bool adaptiveSupported = false;
+
+    // input to swap latency (milliseconds): last frame, exponential average, and maximum of the last second
+    float lastLatency = 0.0f;
+    float averageLatency = 0.0f;
+    float maxLatency = 0.0f;
+    // milliseconds slept by the frame rate cap in the last frame
+    float sleptTime = 0.0f;
+
+    //////////////////////////////////////////
+
+    // we check if adaptive vsync is supported, and we set the swap interval (the context must be current)
+    void Init(int mode)
+    {
+        this->adaptiveSupported = glfwExtensionSupported("WGL_EXT_swap_control_tear") || glfwExtensionSupported("GLX_EXT_swap_control_tear");
+        this->SetSwapMode(mode);
+        this->nextFrame = glfwGetTime();
+        this->maxWindowStart = this->nextFrame;
+    }
+
+    void SetSwapMode(int mode)
+    {
+        this->swapMode = mode;
+        if (mode == SWAP_ADAPTIVE && this->adaptiveSupported)
+            glfwSwapInterval(-1);
+        else if (mode == SWAP_IMMEDIATE)
+            glfwSwapInterval(0);
+        else if (mode == SWAP_HALF_RATE)
+            glfwSwapInterval(2);
+        else
+            glfwSwapInterval(1);
+    }
+
+    // with a cap, we wait for the start of the next frame
+    void WaitForNextFrame()
+    {
+        double now = glfwGetTime();
+        this->sleptTime = 0.0f;
+        if (this->fpsCap <= 0)
+        {
+            this->nextFrame = now;
+            return;
+        }
+        // if we are late, we don't try to catch up with shorter frames
+        double deadline = max(this->nextFrame, now);
+        if (deadline - now > SPIN_TIME)
+            this_thread::sleep_for(chrono::duration<double>(deadline - now - SPIN_TIME));
+        while (glfwGetTime() < deadline)
+            this_thread::yield();
+        this->sleptTime = float((glfwGetTime() - now) * 1000.0);
+        this->nextFrame = deadline + 1.0 / this->fpsCap;
+    }
+
+    // the input used by the frame has been sampled now (it can be called again, if the input is sampled later)
+    void MarkInput()
+    {
+        this->inputTime = glfwGetTime();
+    }
+
+    // glfwSwapBuffers has returned: we update the latency statistics
+    void MarkSwapped()
+    {
+        double now = glfwGetTime();
+        this->lastLatency = float((now - this->inputTime) * 1000.0);
+        this->averageLatency = this->averageLatency == 0.0f ? this->lastLatency : 0.95f * this->averageLatency + 0.05f * this->lastLatency;
+        if (now - this->maxWindowStart > 1.0)
+        {
+            this->maxLatency = this->windowMax;
+            this->windowMax = 0.0f;
+            this->maxWindowStart = now;
+        }
+        this->windowMax = max(this->windowMax, this->lastLatency);
+    }
+
+private:
+    // the last part of the wait (seconds) is done yielding instead of sleeping
+    static constexpr double SPIN_TIME = 0.002;
+
+    double nextFrame = 0.0;
+    double inputTime = 0.0;
+    double maxWindowStart = 0.0;
+    float windowMax = 0.0f;
+};
@@ -0,0 +1,251 @@
+/*
+GeometryBuffer and IndirectDrawList classes
+- GeometryBuffer is a unified geometry buffer: the vertices and indices of all the meshes of the application are copied
+  in a single VBO and a single EBO, described by a single VAO. Each Mesh remembers where its data are (firstIndex, baseVertex)
+- IndirectDrawList is a list of draw commands (DrawElementsIndirectCommand), built on the CPU every frame, together with the
+  per-draw data (InstanceData, see mesh.h). A whole pass, which uses the same Shader Program and the same state for all its draws,
+  is then submitted with a single glMultiDrawElementsIndirect
+
+N.B. 1) the per-draw data are read by the shaders as instance attributes (divisor = 1). The baseInstance field of each command
+points to the first InstanceData of the draw, so the shaders do not need gl_DrawID (OpenGL 4.6 / ARB_shader_draw_parameters)
+
+N.B. 2) our baseline context is OpenGL 4.1, which has neither multi-draw indirect (4.3) nor base instance (4.2).
+In that case the commands are submitted with a client-side loop, and the instance attributes are re-pointed
+to the first InstanceData of each draw before the draw call
+
+N.B. 3) the meshes keep their own VAO, VBO and EBO for the draws which do not go through a draw list
+
+N.B. 4) the commands and the per-draw data change every frame, so they are written in the dynamic RingBuffer (see ringbuffer.h).
+The instance attributes of the VAO read from the ring buffer, and the offset of the per-draw data of the frame
+is added to the baseInstance of each command
+*/
+
+#pragma once
+
+using namespace std;
+
+// Std. Includes
+#include <vector>
+#include <cstring>
+
+#include <utils/model.h>
+#include <utils/ringbuffer.h>
+
+// layout of the commands read by glMultiDrawElementsIndirect (it is defined by the OpenGL specification)
+struct DrawElementsIndirectCommand {
+    GLuint count;
+    GLuint instanceCount;
+    GLuint firstIndex;
+    GLint baseVertex;
+    GLuint baseInstance;
+};
+
+/////////////////// GEOMETRYBUFFER class ///////////////////////
+class GeometryBuffer
+{
+public:
+    // VAO of the unified buffer
+    GLuint VAO = 0;
+
+    GeometryBuffer() = default;
+    GeometryBuffer(const GeometryBuffer& copy) = delete; //disallow copy
+    GeometryBuffer& operator=(const GeometryBuffer&) = delete;
+
+    ~GeometryBuffer() noexcept
+    {
+        if (this->VAO)
+        {
+            GLState().OnDeleteVertexArray(this->VAO);
+            glDeleteVertexArrays(1, &this->VAO);
+            glDeleteBuffers(1, &this->VBO);
+            glDeleteBuffers(1, &this->EBO);
+            glDeleteBuffers(1, &this->occlusionVBO);
+        }
+    }
+
+    //////////////////////////////////////////
+
+    // we append the data of all the meshes of the model, and we store in each mesh where its data are.
+    // The data are copied on the GPU only by Build(), after all the models have been added
+    void Add(Model& model)
+    {
+        for (GLuint i = 0; i < model.meshes.size(); i++)
+        {
+            Mesh& mesh = model.meshes[i];
+            mesh.firstIndex = this->indices.size();
+            mesh.baseVertex = this->vertices.size();
+            this->vertices.insert(this->vertices.end(), mesh.vertices.begin(), mesh.vertices.end());
+            this->indices.insert(this->indices.end(), mesh.indices.begin(), mesh.indices.end());
+            // the meshes without baked occlusion are not occluded
+            if (mesh.occlusion.size() == mesh.vertices.size())
+                this->occlusion.insert(this->occlusion.end(), mesh.occlusion.begin(), mesh.occlusion.end());
+            else
+                this->occlusion.insert(this->occlusion.end(), mesh.vertices.size(), 1.0f);
+        }
+    }
+
+    // we create the buffers and the VAO, whose per-draw data are read from the dynamic ring buffer.
+    // The CPU-side copy of the data is released afterwards
+    void Build(const RingBuffer& dynamicData)
+    {
+        glGenVertexArrays(1, &this->VAO);
+        glGenBuffers(1, &this->VBO);
+        glGenBuffers(1, &this->EBO);
+        glGenBuffers(1, &this->occlusionVBO);
+
+        GLState().BindVertexArray(this->VAO);
+        glBindBuffer(GL_ARRAY_BUFFER, this->VBO);
+        glBufferData(GL_ARRAY_BUFFER, this->vertices.size() * sizeof(Vertex), this->vertices.data(), GL_STATIC_DRAW);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, this->EBO);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, this->indices.size() * sizeof(GLuint), this->indices.data(), GL_STATIC_DRAW);
+
+        // vertex attributes, with the same locations used by the Mesh class
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)0);
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)offsetof(Vertex, Normal));
+        glEnableVertexAttribArray(2);
+        glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)offsetof(Vertex, TexCoords));
+        glEnableVertexAttribArray(3);
+        glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)offsetof(Vertex, Tangent));
+        glEnableVertexAttribArray(4);
+        glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)offsetof(Vertex, Bitangent));
+        // baked occlusion, in its own buffer like in the Mesh class
+        glBindBuffer(GL_ARRAY_BUFFER, this->occlusionVBO);
+        glBufferData(GL_ARRAY_BUFFER, this->occlusion.size() * sizeof(GLfloat), this->occlusion.data(), GL_STATIC_DRAW);
+        glEnableVertexAttribArray(OCCLUSION_ATTRIB_LOCATION);
+        glVertexAttribPointer(OCCLUSION_ATTRIB_LOCATION, 1, GL_FLOAT, GL_FALSE, sizeof(GLfloat), (GLvoid*)0);
+
+        // per-draw data
+        glBindBuffer(GL_ARRAY_BUFFER, dynamicData.buffer);
+        this->PointInstanceAttributes(0);
+        for (GLuint i = 0; i < 8; i++)
+        {
+            glEnableVertexAttribArray(INSTANCE_ATTRIB_LOCATION + i);
+            glVertexAttribDivisor(INSTANCE_ATTRIB_LOCATION + i, 1);
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        GLState().BindVertexArray(0);
+
+        cout << "Geometry buffer: " << this->vertices.size() << " vertices, " << this->indices.size() << " indices" << endl;
+        this->vertices = vector<Vertex>();
+        this->indices = vector<GLuint>();
+        this->occlusion = vector<GLfloat>();
+    }
+
+    // the instance attributes start from the InstanceData with index "first" of the ring buffer
+    // (the VAO and the ring buffer must be bound)
+    void PointInstanceAttributes(GLuint first)
+    {
+        const GLuint loc = INSTANCE_ATTRIB_LOCATION;
+        const GLint components[] = {4, 4, 4, 4, 3, 3, 3, 2};
+        const size_t offsets[] = {
+            offsetof(InstanceData, ModelMatrix), offsetof(InstanceData, ModelMatrix) + sizeof(glm::vec4),
+            offsetof(InstanceData, ModelMatrix) + 2 * sizeof(glm::vec4), offsetof(InstanceData, ModelMatrix) + 3 * sizeof(glm::vec4),
+            offsetof(InstanceData, NormalMatrix), offsetof(InstanceData, NormalMatrix) + sizeof(glm::vec3),
+            offsetof(InstanceData, NormalMatrix) + 2 * sizeof(glm::vec3), offsetof(InstanceData, TexParams)};
+        size_t base = first * sizeof(InstanceData);
+        for (GLuint i = 0; i < 8; i++)
+            glVertexAttribPointer(loc + i, components[i], GL_FLOAT, GL_FALSE, sizeof(InstanceData), (GLvoid*)(base + offsets[i]));
+    }
+
+private:
+    GLuint VBO = 0;
+    GLuint EBO = 0;
+    GLuint occlusionVBO = 0;
+    // CPU-side data, until Build() is called
+    vector<Vertex> vertices;
+    vector<GLuint> indices;
+    vector<GLfloat> occlusion;
+};
+
+/////////////////// INDIRECTDRAWLIST class ///////////////////////
+class IndirectDrawList
+{
+public:
+    vector<DrawElementsIndirectCommand> commands;
+    vector<InstanceData> instances;
+
+    // we empty the list at the beginning of each pass (the memory is kept)
+    void Clear()
+    {
+        this->commands.clear();
+        this->instances.clear();
+    }
+
+    // we add one command for each mesh of the model: all of them are rendered with the same per-draw data
+    void Add(const Model& model, const InstanceData* drawData, GLuint count = 1)
+    {
+        GLuint baseInstance = this->instances.size();
+        this->instances.insert(this->instances.end(), drawData, drawData + count);
+        for (GLuint i = 0; i < model.meshes.size(); i++)
+        {
+            const Mesh& mesh = model.meshes[i];
+            DrawElementsIndirectCommand command;
+            command.count = mesh.indices.size();
+            command.instanceCount = count;
+            command.firstIndex = mesh.firstIndex;
+            command.baseVertex = mesh.baseVertex;
+            command.baseInstance = baseInstance;
+            this->commands.push_back(command);
+        }
+    }
+
+    // a single draw (the matrices are computed once per frame by the Scene class)
+    void Add(const Model& model, const InstanceData& drawData)
+    {
+        this->Add(model, &drawData, 1);
+    }
+
+    // we write commands and per-draw data in the ring buffer, and we submit all the commands.
+    // The Shader Program of the pass must be active, and its "instanced" uniform must be true
+    void Submit(GeometryBuffer& geometry, RingBuffer& dynamicData)
+    {
+        if (this->commands.empty())
+            return;
+
+        // the per-draw data are aligned to sizeof(InstanceData), so their offset is a whole number of instances
+        RingAllocation drawData = dynamicData.Allocate(this->instances.size() * sizeof(InstanceData), sizeof(InstanceData));
+        RingAllocation commandData = dynamicData.Allocate(this->commands.size() * sizeof(DrawElementsIndirectCommand), sizeof(GLuint));
+        if (!drawData.ptr || !commandData.ptr)
+            return;
+        GLuint firstInstance = drawData.offset / sizeof(InstanceData);
+
+        memcpy(drawData.ptr, this->instances.data(), drawData.size);
+        DrawElementsIndirectCommand* mappedCommands = (DrawElementsIndirectCommand*)commandData.ptr;
+        for (GLuint i = 0; i < this->commands.size(); i++)
+        {
+            mappedCommands[i] = this->commands[i];
+            mappedCommands[i].baseInstance += firstInstance;
+        }
+        dynamicData.Flush();
+
+        GLState().BindVertexArray(geometry.VAO);
+        if (GLState().hasMultiDrawIndirect)
+        {
+            glBindBuffer(GL_DRAW_INDIRECT_BUFFER, dynamicData.buffer);
+            glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (GLvoid*)commandData.offset, this->commands.size(), 0);
+            glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+        }
+        else
+        {
+            // client-side loop over the same commands (we read the CPU-side copy, the mapped memory is write-only)
+            glBindBuffer(GL_ARRAY_BUFFER, dynamicData.buffer);
+            for (GLuint i = 0; i < this->commands.size(); i++)
+            {
+                const DrawElementsIndirectCommand& c = this->commands[i];
+                GLvoid* offset = (GLvoid*)(c.firstIndex * sizeof(GLuint));
+                if (GLState().hasBaseInstance)
+                    glDrawElementsInstancedBaseVertexBaseInstance(GL_TRIANGLES, c.count, GL_UNSIGNED_INT, offset, c.instanceCount, c.baseVertex, firstInstance + c.baseInstance);
+                else
+                {
+                    geometry.PointInstanceAttributes(firstInstance + c.baseInstance);
+                    glDrawElementsInstancedBaseVertex(GL_TRIANGLES, c.count, GL_UNSIGNED_INT, offset, c.instanceCount, c.baseVertex);
+                }
+            }
+            if (!GLState().hasBaseInstance)
+                geometry.PointInstanceAttributes(0);
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+        }
+    }
+};
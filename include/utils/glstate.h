@@ -0,0 +1,451 @@
+/*
+GLStateCache class
+- thin layer between the renderer and glad, which shadows the OpenGL state we touch every frame
+  (program, VAO, texture units and their sampler objects, framebuffer, depth/stencil/color state and a few capabilities)
+- every call is compared with the shadowed value, and it reaches the driver only if the state actually changes.
+  The number of issued and elided calls is counted, so it can be shown in the Performance window
+- where ARB_direct_state_access (core in OpenGL 4.5) is available, objects can be edited without binding them,
+  and textures are bound with glBindTextureUnit without going through the active texture unit
+
+N.B. 1) the cache is valid only if every state change of the renderer goes through it.
+Code that talks to OpenGL directly (e.g. the setup code in main()) must call Invalidate() afterwards,
+so the next call of each type is issued again.
+ImGui backs up and restores the state it changes, so it does not need an invalidation.
+
+N.B. 2) our baseline context is OpenGL 4.1 (macOS), so every DSA path must have a fallback using the classic bind-to-edit calls.
+*/
+
+#pragma once
+
+using namespace std;
+
+// Std. Includes
+#include <cstring>
+
+// returns true if the current OpenGL context exposes the extension (e.g. "GL_ARB_direct_state_access")
+inline bool HasGLExtension(const char* extension)
+{
+    GLint numExtensions = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &numExtensions);
+    for (GLint i = 0; i < numExtensions; i++)
+    {
+        const char* name = (const char*)glGetStringi(GL_EXTENSIONS, i);
+        if (name && strcmp(name, extension) == 0)
+            return true;
+    }
+    return false;
+}
+
+/////////////////// GLSTATECACHE class ///////////////////////
+class GLStateCache
+{
+public:
+    // maximum number of texture units we shadow (the minimum guaranteed by OpenGL 4.1 is 80 combined units, we use far less)
+    static const GLuint MAX_UNITS = 32;
+
+    // true if we can use direct state access
+    bool hasDSA = false;
+    // true if the draw commands can start from a base instance (OpenGL 4.2 or ARB_base_instance)
+    bool hasBaseInstance = false;
+    // true if we can submit many draws with one glMultiDrawElementsIndirect (OpenGL 4.3 or ARB_multi_draw_indirect)
+    bool hasMultiDrawIndirect = false;
+    // true if buffers can be persistently mapped (OpenGL 4.4 or ARB_buffer_storage)
+    bool hasBufferStorage = false;
+    // true if a pass can sample a texture it is rendering to, with a glTextureBarrier between the accesses
+    // (OpenGL 4.5, ARB_texture_barrier or NV_texture_barrier)
+    bool hasTextureBarrier = false;
+    // true if the vertex shader can write gl_Layer (ARB_shader_viewport_layer_array or AMD_vertex_shader_layer)
+    bool hasVertexLayer = false;
+
+    // statistics of the current frame: calls that reached the driver, and calls that were elided because redundant
+    GLuint issuedCalls = 0;
+    GLuint elidedCalls = 0;
+
+    GLStateCache()
+    {
+        this->Invalidate();
+    }
+
+    //////////////////////////////////////////
+    // it must be called once after GLAD has loaded the context.
+    // glad only loads the functions of the core versions supported by the context, so if DSA is
+    // available only as extension we load the few DSA entry points we use with the provided loader
+    void Init(GLADloadproc load)
+    {
+        this->hasDSA = GLAD_GL_VERSION_4_5 != 0;
+        if (!this->hasDSA && HasGLExtension("GL_ARB_direct_state_access"))
+        {
+            glad_glCreateVertexArrays = (PFNGLCREATEVERTEXARRAYSPROC)load("glCreateVertexArrays");
+            glad_glCreateBuffers = (PFNGLCREATEBUFFERSPROC)load("glCreateBuffers");
+            glad_glCreateTextures = (PFNGLCREATETEXTURESPROC)load("glCreateTextures");
+            glad_glNamedBufferData = (PFNGLNAMEDBUFFERDATAPROC)load("glNamedBufferData");
+            glad_glVertexArrayVertexBuffer = (PFNGLVERTEXARRAYVERTEXBUFFERPROC)load("glVertexArrayVertexBuffer");
+            glad_glVertexArrayElementBuffer = (PFNGLVERTEXARRAYELEMENTBUFFERPROC)load("glVertexArrayElementBuffer");
+            glad_glEnableVertexArrayAttrib = (PFNGLENABLEVERTEXARRAYATTRIBPROC)load("glEnableVertexArrayAttrib");
+            glad_glVertexArrayAttribFormat = (PFNGLVERTEXARRAYATTRIBFORMATPROC)load("glVertexArrayAttribFormat");
+            glad_glVertexArrayAttribBinding = (PFNGLVERTEXARRAYATTRIBBINDINGPROC)load("glVertexArrayAttribBinding");
+            glad_glVertexArrayBindingDivisor = (PFNGLVERTEXARRAYBINDINGDIVISORPROC)load("glVertexArrayBindingDivisor");
+            glad_glNamedBufferSubData = (PFNGLNAMEDBUFFERSUBDATAPROC)load("glNamedBufferSubData");
+            glad_glTextureStorage3D = (PFNGLTEXTURESTORAGE3DPROC)load("glTextureStorage3D");
+            glad_glTextureSubImage3D = (PFNGLTEXTURESUBIMAGE3DPROC)load("glTextureSubImage3D");
+            glad_glTextureStorage2D = (PFNGLTEXTURESTORAGE2DPROC)load("glTextureStorage2D");
+            glad_glTextureSubImage2D = (PFNGLTEXTURESUBIMAGE2DPROC)load("glTextureSubImage2D");
+            glad_glTextureParameteri = (PFNGLTEXTUREPARAMETERIPROC)load("glTextureParameteri");
+            glad_glGenerateTextureMipmap = (PFNGLGENERATETEXTUREMIPMAPPROC)load("glGenerateTextureMipmap");
+            glad_glBindTextureUnit = (PFNGLBINDTEXTUREUNITPROC)load("glBindTextureUnit");
+
+            this->hasDSA = glCreateVertexArrays && glCreateBuffers && glCreateTextures && glNamedBufferData &&
+                           glVertexArrayVertexBuffer && glVertexArrayElementBuffer && glEnableVertexArrayAttrib &&
+                           glVertexArrayAttribFormat && glVertexArrayAttribBinding && glVertexArrayBindingDivisor &&
+                           glNamedBufferSubData && glTextureStorage2D && glTextureStorage3D && glTextureSubImage3D &&
+                           glTextureSubImage2D && glTextureParameteri && glGenerateTextureMipmap && glBindTextureUnit;
+        }
+        cout << "Direct State Access: " << (this->hasDSA ? "available" : "not available, using bind-to-edit") << endl;
+
+        // base instance and multi-draw indirect are used by the indirect draw lists (see geometrybuffer.h)
+        this->hasBaseInstance = GLAD_GL_VERSION_4_2 != 0;
+        if (!this->hasBaseInstance && HasGLExtension("GL_ARB_base_instance"))
+        {
+            glad_glDrawElementsInstancedBaseVertexBaseInstance = (PFNGLDRAWELEMENTSINSTANCEDBASEVERTEXBASEINSTANCEPROC)load("glDrawElementsInstancedBaseVertexBaseInstance");
+            this->hasBaseInstance = glDrawElementsInstancedBaseVertexBaseInstance != NULL;
+        }
+        // the indirect commands use their baseInstance field, so multi-draw indirect is useful only together with base instance
+        this->hasMultiDrawIndirect = GLAD_GL_VERSION_4_3 != 0;
+        if (!this->hasMultiDrawIndirect && this->hasBaseInstance && HasGLExtension("GL_ARB_multi_draw_indirect"))
+        {
+            glad_glMultiDrawElementsIndirect = (PFNGLMULTIDRAWELEMENTSINDIRECTPROC)load("glMultiDrawElementsIndirect");
+            this->hasMultiDrawIndirect = glMultiDrawElementsIndirect != NULL;
+        }
+        cout << "Multi-Draw Indirect: " << (this->hasMultiDrawIndirect ? "available" : (this->hasBaseInstance ? "not available, using a client-side loop with base instance" : "not available, using a client-side loop")) << endl;
+
+        this->hasBufferStorage = GLAD_GL_VERSION_4_4 != 0;
+        if (!this->hasBufferStorage && HasGLExtension("GL_ARB_buffer_storage"))
+        {
+            glad_glBufferStorage = (PFNGLBUFFERSTORAGEPROC)load("glBufferStorage");
+            this->hasBufferStorage = glBufferStorage != NULL;
+        }
+        cout << "Buffer Storage: " << (this->hasBufferStorage ? "available" : "not available, dynamic buffers are orphaned") << endl;
+
+        // the NV entry point has the same signature of the ARB one, so we load it in the same pointer
+        this->hasTextureBarrier = GLAD_GL_VERSION_4_5 != 0;
+        if (!this->hasTextureBarrier && HasGLExtension("GL_ARB_texture_barrier"))
+            glad_glTextureBarrier = (PFNGLTEXTUREBARRIERPROC)load("glTextureBarrier");
+        else if (!this->hasTextureBarrier && HasGLExtension("GL_NV_texture_barrier"))
+            glad_glTextureBarrier = (PFNGLTEXTUREBARRIERPROC)load("glTextureBarrierNV");
+        this->hasTextureBarrier = glTextureBarrier != NULL;
+        cout << "Texture Barrier: " << (this->hasTextureBarrier ? "available" : "not available, feedback passes are not synchronized") << endl;
+
+        // only a shader feature: there are no entry points to load
+        this->hasVertexLayer = HasGLExtension("GL_ARB_shader_viewport_layer_array") || HasGLExtension("GL_AMD_vertex_shader_layer");
+        cout << "Vertex Shader Layer: " << (this->hasVertexLayer ? "available" : "not available, shadow faces are rendered one at a time") << endl;
+
+        this->Invalidate();
+    }
+
+    //////////////////////////////////////////
+    // we forget everything we know about the current state: the next call of each type will be issued
+    void Invalidate()
+    {
+        this->program = UNKNOWN;
+        this->vao = UNKNOWN;
+        this->framebuffer = UNKNOWN;
+        this->activeUnit = UNKNOWN;
+        for (GLuint i = 0; i < MAX_UNITS; i++)
+            for (GLuint j = 0; j < NUM_TARGETS; j++)
+                this->textures[i][j] = UNKNOWN;
+        for (GLuint i = 0; i < MAX_UNITS; i++)
+            this->samplers[i] = UNKNOWN;
+        for (GLuint i = 0; i < NUM_CAPS; i++)
+            this->caps[i] = UNKNOWN;
+        this->depthMask = UNKNOWN;
+        this->colorMask = UNKNOWN;
+        this->stencilMask = UNKNOWN;
+        this->stencilFunc[0] = UNKNOWN;
+        this->stencilOp[0] = UNKNOWN;
+    }
+
+    // we reset the statistics at the beginning of every frame
+    void ResetStats()
+    {
+        this->issuedCalls = 0;
+        this->elidedCalls = 0;
+    }
+
+    //////////////////////////////////////////
+    // binding of objects
+
+    void UseProgram(GLuint program)
+    {
+        if (this->Elide(this->program == program))
+            return;
+        this->program = program;
+        glUseProgram(program);
+    }
+
+    void BindVertexArray(GLuint vao)
+    {
+        if (this->Elide(this->vao == vao))
+            return;
+        this->vao = vao;
+        glBindVertexArray(vao);
+    }
+
+    // we always bind the framebuffer to both the draw and read targets, as the renderer does
+    void BindFramebuffer(GLuint framebuffer)
+    {
+        if (this->Elide(this->framebuffer == framebuffer))
+            return;
+        this->framebuffer = framebuffer;
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    }
+
+    void ActiveTexture(GLuint unit)
+    {
+        if (this->Elide(this->activeUnit == unit))
+            return;
+        this->activeUnit = unit;
+        glActiveTexture(GL_TEXTURE0 + unit);
+    }
+
+    // binding of a texture to a texture unit. With DSA we do not need to change the active texture unit
+    void BindTexture(GLuint unit, GLenum target, GLuint texture)
+    {
+        GLuint t = TargetIndex(target);
+        if (unit >= MAX_UNITS || t == NUM_TARGETS)
+        {
+            // not shadowed: we issue the call and we forget the active unit
+            this->activeUnit = UNKNOWN;
+            this->Issue();
+            glActiveTexture(GL_TEXTURE0 + unit);
+            glBindTexture(target, texture);
+            return;
+        }
+        if (this->Elide(this->textures[unit][t] == texture))
+            return;
+        this->textures[unit][t] = texture;
+        if (this->hasDSA && texture != 0)
+        {
+            // glBindTextureUnit binds the texture to the target it was created with
+            glBindTextureUnit(unit, texture);
+        }
+        else
+        {
+            this->ActiveTexture(unit);
+            glBindTexture(target, texture);
+        }
+    }
+
+    // a sampler object overrides the sampling parameters of the texture bound to the unit (0 = the parameters of the texture)
+    void BindSampler(GLuint unit, GLuint sampler)
+    {
+        if (unit >= MAX_UNITS)
+        {
+            this->Issue();
+            glBindSampler(unit, sampler);
+            return;
+        }
+        if (this->Elide(this->samplers[unit] == sampler))
+            return;
+        this->samplers[unit] = sampler;
+        glBindSampler(unit, sampler);
+    }
+
+    //////////////////////////////////////////
+    // capabilities (glEnable/glDisable)
+
+    void Enable(GLenum cap) { this->SetCapability(cap, GL_TRUE); }
+    void Disable(GLenum cap) { this->SetCapability(cap, GL_FALSE); }
+
+    void SetCapability(GLenum cap, GLboolean enabled)
+    {
+        GLuint c = CapIndex(cap);
+        if (c == NUM_CAPS)
+        {
+            this->Issue();
+            enabled ? glEnable(cap) : glDisable(cap);
+            return;
+        }
+        if (this->Elide(this->caps[c] == enabled))
+            return;
+        this->caps[c] = enabled;
+        enabled ? glEnable(cap) : glDisable(cap);
+    }
+
+    //////////////////////////////////////////
+    // depth, color and stencil state
+
+    void DepthMask(GLboolean flag)
+    {
+        if (this->Elide(this->depthMask == flag))
+            return;
+        this->depthMask = flag;
+        glDepthMask(flag);
+    }
+
+    void ColorMask(GLboolean r, GLboolean g, GLboolean b, GLboolean a)
+    {
+        GLuint mask = (r ? 1 : 0) | (g ? 2 : 0) | (b ? 4 : 0) | (a ? 8 : 0);
+        if (this->Elide(this->colorMask == mask))
+            return;
+        this->colorMask = mask;
+        glColorMask(r, g, b, a);
+    }
+
+    void StencilMask(GLuint mask)
+    {
+        if (this->Elide(this->stencilMask == mask))
+            return;
+        this->stencilMask = mask;
+        glStencilMask(mask);
+    }
+
+    void StencilFunc(GLenum func, GLint ref, GLuint mask)
+    {
+        if (this->Elide(this->stencilFunc[0] == func && this->stencilFunc[1] == (GLuint)ref && this->stencilFunc[2] == mask))
+            return;
+        this->stencilFunc[0] = func;
+        this->stencilFunc[1] = (GLuint)ref;
+        this->stencilFunc[2] = mask;
+        glStencilFunc(func, ref, mask);
+    }
+
+    void StencilOp(GLenum sfail, GLenum dpfail, GLenum dppass)
+    {
+        if (this->Elide(this->stencilOp[0] == sfail && this->stencilOp[1] == dpfail && this->stencilOp[2] == dppass))
+            return;
+        this->stencilOp[0] = sfail;
+        this->stencilOp[1] = dpfail;
+        this->stencilOp[2] = dppass;
+        glStencilOp(sfail, dpfail, dppass);
+    }
+
+    //////////////////////////////////////////
+    // when an object is deleted, OpenGL resets the bindings which refer to it to 0, so we do the same in the cache
+
+    void OnDeleteVertexArray(GLuint vao)
+    {
+        if (this->vao == vao)
+            this->vao = 0;
+    }
+
+    void OnDeleteTexture(GLuint texture)
+    {
+        for (GLuint i = 0; i < MAX_UNITS; i++)
+            for (GLuint j = 0; j < NUM_TARGETS; j++)
+                if (this->textures[i][j] == texture)
+                    this->textures[i][j] = 0;
+    }
+
+    void OnDeleteSampler(GLuint sampler)
+    {
+        for (GLuint i = 0; i < MAX_UNITS; i++)
+            if (this->samplers[i] == sampler)
+                this->samplers[i] = 0;
+    }
+
+    void OnDeleteFramebuffer(GLuint framebuffer)
+    {
+        if (this->framebuffer == framebuffer)
+            this->framebuffer = 0;
+    }
+
+    //////////////////////////////////////////
+    // editing of texture parameters: with DSA we do not need to bind the texture
+    void TextureParameteri(GLuint texture, GLenum target, GLenum pname, GLint param)
+    {
+        this->Issue();
+        if (this->hasDSA)
+            glTextureParameteri(texture, pname, param);
+        else
+        {
+            // we edit the texture on the current active unit, so we must keep the shadowed binding updated
+            this->BindTextureForEdit(target, texture);
+            glTexParameteri(target, pname, param);
+        }
+    }
+
+    // binding of a texture on the currently active unit, used by the bind-to-edit paths
+    void BindTextureForEdit(GLenum target, GLuint texture)
+    {
+        if (this->activeUnit == UNKNOWN)
+            this->ActiveTexture(0);
+        GLuint t = TargetIndex(target);
+        if (this->activeUnit < MAX_UNITS && t != NUM_TARGETS)
+        {
+            if (this->Elide(this->textures[this->activeUnit][t] == texture))
+                return;
+            this->textures[this->activeUnit][t] = texture;
+        }
+        else
+            this->Issue();
+        glBindTexture(target, texture);
+    }
+
+private:
+    // sentinel for "we do not know the current value"
+    static const GLuint UNKNOWN = 0xFFFFFFFFu;
+
+    // texture targets we shadow for each unit
+    static const GLuint NUM_TARGETS = 6;
+    // capabilities we shadow
+    static const GLuint NUM_CAPS = 5;
+
+    GLuint program = UNKNOWN;
+    GLuint vao = UNKNOWN;
+    GLuint framebuffer = UNKNOWN;
+    GLuint activeUnit = UNKNOWN;
+    GLuint textures[MAX_UNITS][NUM_TARGETS];
+    GLuint samplers[MAX_UNITS];
+    GLuint caps[NUM_CAPS];
+    GLuint depthMask = UNKNOWN;
+    GLuint colorMask = UNKNOWN;
+    GLuint stencilMask = UNKNOWN;
+    GLuint stencilFunc[3] = {UNKNOWN, UNKNOWN, UNKNOWN};
+    GLuint stencilOp[3] = {UNKNOWN, UNKNOWN, UNKNOWN};
+
+    // it updates the statistics, and it returns true if the call must be elided
+    bool Elide(bool redundant)
+    {
+        if (redundant)
+            this->elidedCalls++;
+        else
+            this->issuedCalls++;
+        return redundant;
+    }
+
+    void Issue() { this->issuedCalls++; }
+
+    static GLuint TargetIndex(GLenum target)
+    {
+        switch (target)
+        {
+            case GL_TEXTURE_2D: return 0;
+            case GL_TEXTURE_CUBE_MAP: return 1;
+            case GL_TEXTURE_2D_ARRAY: return 2;
+            case GL_TEXTURE_CUBE_MAP_ARRAY: return 3;
+            case GL_TEXTURE_3D: return 4;
+            case GL_TEXTURE_BUFFER: return 5;
+            default: return NUM_TARGETS;
+        }
+    }
+
+    static GLuint CapIndex(GLenum cap)
+    {
+        switch (cap)
+        {
+            case GL_DEPTH_TEST: return 0;
+            case GL_STENCIL_TEST: return 1;
+            case GL_CULL_FACE: return 2;
+            case GL_BLEND: return 3;
+            case GL_SCISSOR_TEST: return 4;
+            default: return NUM_CAPS;
+        }
+    }
+};
+
+// the renderer uses a single OpenGL context, so a single state cache is enough
+inline GLStateCache& GLState()
+{
+    static GLStateCache state;
+    return state;
+}
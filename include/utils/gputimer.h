@@ -0,0 +1,94 @@
+/*
+GPUTimer class
+- measures the GPU time of a sequence of commands (e.g. a pass of the frame graph) with GL_TIME_ELAPSED queries
+- the queries are in a small ring: the result of a query is read a few frames later, when it is available,
+  so the CPU never waits for the GPU
+- the last result and an exponential average are kept, in milliseconds
+
+N.B. 1) GL_TIME_ELAPSED queries can't be nested: only one timer at a time can be between Begin() and End()
+
+N.B. 2) the result is the time the GPU spent between the two commands, including the time it waited for something else
+(e.g. a pipeline stall), so it is an upper bound of the cost of the commands
+*/
+
+#pragma once
+
+using namespace std;
+
+// Std. Includes
+#include <vector>
+
+#include <utils/glstate.h>
+
+/////////////////// GPUTIMER class ///////////////////////
+class GPUTimer
+{
+public:
+    // last measured time and exponential average (milliseconds)
+    float lastTime = 0.0f;
+    float averageTime = 0.0f;
+
+    GPUTimer() = default;
+    GPUTimer(const GPUTimer& copy) = delete; //disallow copy
+    GPUTimer& operator=(const GPUTimer&) = delete;
+
+    ~GPUTimer() noexcept
+    {
+        if (this->queries[0])
+            glDeleteQueries(RING_SIZE, this->queries);
+    }
+
+    //////////////////////////////////////////
+
+    void Init()
+    {
+        glGenQueries(RING_SIZE, this->queries);
+    }
+
+    // we read the results which are available, and we start the next query (if its last result has been read)
+    void Begin()
+    {
+        this->ReadResults();
+        this->running = !this->issued[this->next];
+        if (this->running)
+            glBeginQuery(GL_TIME_ELAPSED, this->queries[this->next]);
+    }
+
+    void End()
+    {
+        if (!this->running)
+            return;
+        glEndQuery(GL_TIME_ELAPSED);
+        this->issued[this->next] = true;
+        this->next = (this->next + 1) % RING_SIZE;
+        this->running = false;
+    }
+
+private:
+    static const GLuint RING_SIZE = 4;
+
+    GLuint queries[RING_SIZE] = {0, 0, 0, 0};
+    bool issued[RING_SIZE] = {false, false, false, false};
+    // the query of the next Begin(), and the oldest query not read yet
+    GLuint next = 0;
+    GLuint oldest = 0;
+    bool running = false;
+
+    // the results come back in order, so we stop at the first one which is not available
+    void ReadResults()
+    {
+        while (this->issued[this->oldest])
+        {
+            GLuint available = 0;
+            glGetQueryObjectuiv(this->queries[this->oldest], GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available)
+                return;
+            GLuint64 nanoseconds = 0;
+            glGetQueryObjectui64v(this->queries[this->oldest], GL_QUERY_RESULT, &nanoseconds);
+            this->lastTime = float(nanoseconds / 1.0e6);
+            this->averageTime = this->averageTime == 0.0f ? this->lastTime : 0.95f * this->averageTime + 0.05f * this->lastTime;
+            this->issued[this->oldest] = false;
+            this->oldest = (this->oldest + 1) % RING_SIZE;
+        }
+    }
+};
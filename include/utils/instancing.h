@@ -0,0 +1,112 @@
+/*
+InstanceBuffer class
+- it stores, CPU-side and GPU-side, the per-instance data (see InstanceData in mesh.h) of a mesh which is rendered many times in the same view
+  (e.g. the walls and floors, which are all the same plane, or the four pillars in the corners)
+- the buffer is attached to the VAO of the model with Attach(), then the model is rendered once per view with Model::DrawInstanced()
+
+N.B.) like Mesh, InstanceBuffer is a "move-only" class, responsible of the life cycle of its GPU buffer (RAII)
+*/
+
+#pragma once
+
+using namespace std;
+
+// Std. Includes
+#include <vector>
+
+// we compute the normal matrix of each instance with GLM
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_inverse.hpp>
+
+#include <utils/model.h>
+
+/////////////////// INSTANCEBUFFER class ///////////////////////
+class InstanceBuffer
+{
+public:
+    // per-instance data, CPU-side
+    vector<InstanceData> instances;
+    // VBO with the per-instance data
+    GLuint VBO = 0;
+
+    InstanceBuffer() = default;
+
+    InstanceBuffer(const InstanceBuffer& copy) = delete; //disallow copy
+    InstanceBuffer& operator=(const InstanceBuffer&) = delete;
+
+    InstanceBuffer(InstanceBuffer&& move) noexcept
+        : instances(std::move(move.instances)), VBO(move.VBO)
+    {
+        move.VBO = 0;
+    }
+
+    InstanceBuffer& operator=(InstanceBuffer&& move) noexcept
+    {
+        freeGPUresources();
+        instances = std::move(move.instances);
+        VBO = move.VBO;
+        move.VBO = 0;
+        return *this;
+    }
+
+    ~InstanceBuffer() noexcept
+    {
+        freeGPUresources();
+    }
+
+    //////////////////////////////////////////
+
+    // we add an instance, given its model matrix, the layer of the texture array and the repetition of the UV coordinates.
+    // The normal matrix is computed here once, and not for every draw
+    void Add(const glm::mat4& modelMatrix, GLfloat textureLayer = 0.0f, GLfloat texRep = 1.0f)
+    {
+        InstanceData instance;
+        instance.ModelMatrix = modelMatrix;
+        instance.NormalMatrix = glm::inverseTranspose(glm::mat3(modelMatrix));
+        instance.TexParams = glm::vec2(textureLayer, texRep);
+        this->instances.push_back(instance);
+    }
+
+    // we add an instance whose matrices have already been computed (e.g. by the Scene class)
+    void Add(const InstanceData& instance)
+    {
+        this->instances.push_back(instance);
+    }
+
+    // number of instances
+    GLsizei Count() const { return (GLsizei)this->instances.size(); }
+
+    // we copy the CPU-side data in the VBO (the VBO is created at the first call)
+    void Upload()
+    {
+        GLsizeiptr size = this->instances.size() * sizeof(InstanceData);
+        if (GLState().hasDSA)
+        {
+            if (!this->VBO)
+                glCreateBuffers(1, &this->VBO);
+            glNamedBufferData(this->VBO, size, this->instances.data(), GL_STATIC_DRAW);
+            return;
+        }
+        if (!this->VBO)
+            glGenBuffers(1, &this->VBO);
+        glBindBuffer(GL_ARRAY_BUFFER, this->VBO);
+        glBufferData(GL_ARRAY_BUFFER, size, this->instances.data(), GL_STATIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+    // the model will read its per-instance attributes from this buffer
+    void Attach(Model& model)
+    {
+        model.SetupInstanceAttributes(this->VBO);
+    }
+
+private:
+    void freeGPUresources()
+    {
+        if (this->VBO)
+        {
+            glDeleteBuffers(1, &this->VBO);
+            this->VBO = 0;
+        }
+    }
+};
@@ -0,0 +1,150 @@
+/*
+JobSystem class
+- a pool of worker threads, which execute jobs (functions) taken from a shared queue
+- the jobs are grouped with a JobCounter: Run() increments the counter, and it is decremented when the job has been executed.
+  Wait() returns when all the jobs of a counter are done: while waiting, the calling thread executes the jobs in the queue too,
+  so it is never idle while there is work to do, and with 0 workers all the jobs are executed by Wait() on the calling thread
+- the number of workers can be changed at runtime (e.g. to measure how the frame time scales with the number of threads)
+
+N.B. 1) the jobs must not call OpenGL: the context is current only on the GL thread
+
+N.B. 2) the queue is protected by a mutex: our jobs are coarse (e.g. the preparation of a whole view), so the contention is negligible
+*/
+
+#pragma once
+
+using namespace std;
+
+// Std. Includes
+#include <vector>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+// number of jobs of a group which have not been executed yet
+struct JobCounter {
+    atomic<int> pending;
+
+    JobCounter() : pending(0) {}
+
+    bool Done() const { return this->pending.load() == 0; }
+};
+
+/////////////////// JOBSYSTEM class ///////////////////////
+class JobSystem
+{
+public:
+    JobSystem() = default;
+    JobSystem(const JobSystem& copy) = delete; //disallow copy
+    JobSystem& operator=(const JobSystem&) = delete;
+
+    ~JobSystem() noexcept
+    {
+        this->SetWorkerCount(0);
+    }
+
+    //////////////////////////////////////////
+
+    // one thread for each core, except the one of the GL thread
+    static unsigned DefaultWorkerCount()
+    {
+        unsigned cores = thread::hardware_concurrency();
+        return cores > 1 ? cores - 1 : 0;
+    }
+
+    // we stop the current workers (after they have executed all the jobs in the queue), and we start count new ones
+    void SetWorkerCount(unsigned count)
+    {
+        {
+            lock_guard<mutex> lock(this->queueMutex);
+            this->stopping = true;
+        }
+        this->wakeUp.notify_all();
+        for (unsigned i = 0; i < this->workers.size(); i++)
+            this->workers[i].join();
+        this->workers.clear();
+
+        this->stopping = false;
+        for (unsigned i = 0; i < count; i++)
+            this->workers.push_back(thread(&JobSystem::WorkerLoop, this));
+    }
+
+    unsigned WorkerCount() const { return this->workers.size(); }
+
+    // we add a job to the queue, in the group of counter
+    void Run(JobCounter& counter, const function<void()>& job)
+    {
+        counter.pending++;
+        {
+            lock_guard<mutex> lock(this->queueMutex);
+            this->queue.push_back(Job(job, &counter));
+        }
+        this->wakeUp.notify_one();
+    }
+
+    // we wait for all the jobs of the group, executing the jobs in the queue in the meantime
+    void Wait(JobCounter& counter)
+    {
+        while (!counter.Done())
+        {
+            Job job;
+            if (this->TryPop(job))
+                this->Execute(job);
+            else
+                // the last jobs of the group are being executed by the workers
+                this_thread::yield();
+        }
+    }
+
+private:
+    struct Job {
+        function<void()> work;
+        JobCounter* counter;
+        Job() : counter(NULL) {}
+        Job(const function<void()>& work, JobCounter* counter) : work(work), counter(counter) {}
+    };
+
+    vector<thread> workers;
+    deque<Job> queue;
+    mutex queueMutex;
+    condition_variable wakeUp;
+    bool stopping = false;
+
+    bool TryPop(Job& job)
+    {
+        lock_guard<mutex> lock(this->queueMutex);
+        if (this->queue.empty())
+            return false;
+        job = this->queue.front();
+        this->queue.pop_front();
+        return true;
+    }
+
+    void Execute(Job& job)
+    {
+        job.work();
+        // the decrement is sequentially consistent: who sees the counter at 0 also sees the results of the job
+        job.counter->pending--;
+    }
+
+    // the workers sleep until there is a job in the queue, and they exit only when the queue is empty
+    void WorkerLoop()
+    {
+        for (;;)
+        {
+            Job job;
+            {
+                unique_lock<mutex> lock(this->queueMutex);
+                this->wakeUp.wait(lock, [this]() { return this->stopping || !this->queue.empty(); });
+                if (this->queue.empty())
+                    return;
+                job = this->queue.front();
+                this->queue.pop_front();
+            }
+            this->Execute(job);
+        }
+    }
+};
@@ -31,6 +31,9 @@ using namespace std;
 // Std. Includes
 #include <vector>
 
+// the VAO is bound through the OpenGL state cache
+#include <utils/glstate.h>
+
 // data structure for vertices
 struct Vertex {
     // vertex coordinates
@@ -45,14 +48,41 @@ struct Vertex {
     glm::vec3 Bitangent;
 };
 
+// data structure for the per-instance data of instanced rendering
+// (see SetupInstanceAttributes and include/utils/instancing.h)
+struct InstanceData {
+    // model matrix of the instance
+    glm::mat4 ModelMatrix;
+    // inverse transpose of the model matrix, in world coordinates (the shader applies the view rotation)
+    glm::mat3 NormalMatrix;
+    // x = layer of the texture array, y = repetition of the UV coordinates (texRep)
+    glm::vec2 TexParams;
+};
+
+// first attribute location used by the instance data: locations 0-4 are used by the vertex data,
+// 5-8 by the model matrix, 9-11 by the normal matrix and 12 by the texture parameters
+const GLuint INSTANCE_ATTRIB_LOCATION = 5;
+// location of the baked ambient occlusion of the vertices (see include/utils/aobaker.h), read from its own buffer
+const GLuint OCCLUSION_ATTRIB_LOCATION = 13;
+
 /////////////////// MESH class ///////////////////////
 class Mesh {
 public:
     // data structures for vertices, and indices of vertices (for faces)
     vector<Vertex> vertices;
     vector<GLuint> indices;
+    // baked ambient occlusion of each vertex (empty if it has not been baked)
+    vector<GLfloat> occlusion;
     // VAO
     GLuint VAO;
+    // position of the mesh inside the unified geometry buffer, if it has been added to one (see include/utils/geometrybuffer.h)
+    GLuint firstIndex = 0;
+    GLint baseVertex = 0;
+    // bounding volumes in model coordinates, computed at load time: axis-aligned bounding box and bounding sphere
+    glm::vec3 aabbMin = glm::vec3(0.0f);
+    glm::vec3 aabbMax = glm::vec3(0.0f);
+    glm::vec3 sphereCenter = glm::vec3(0.0f);
+    GLfloat sphereRadius = 0.0f;
 
     // We want Mesh to be a move-only class. We delete copy constructor and copy assignment
     // see:
@@ -70,6 +100,7 @@ public:
     Mesh(vector<Vertex>& vertices, vector<GLuint>& indices) noexcept
         : vertices(std::move(vertices)), indices(std::move(indices))
     {
+        this->computeBounds();
         this->setupMesh();
     }
 
@@ -87,8 +118,10 @@ public:
     // In our case it will no longer imply ownership of the GPU resources and its vectors will be empty.
     Mesh(Mesh&& move) noexcept
         // Calls move for both vectors, which internally consists of a simple pointer swap between the new instance and the source one.
-        : vertices(std::move(move.vertices)), indices(std::move(move.indices)),
-        VAO(move.VAO), VBO(move.VBO), EBO(move.EBO)
+        : vertices(std::move(move.vertices)), indices(std::move(move.indices)), occlusion(std::move(move.occlusion)),
+        VAO(move.VAO), firstIndex(move.firstIndex), baseVertex(move.baseVertex),
+        aabbMin(move.aabbMin), aabbMax(move.aabbMax), sphereCenter(move.sphereCenter), sphereRadius(move.sphereRadius),
+        VBO(move.VBO), EBO(move.EBO), occlusionVBO(move.occlusionVBO)
     {
         move.VAO = 0; // We *could* set VBO and EBO to 0 too,
         // but since we bring all the 3 values around we can use just one of them to check ownership of the 3 resources.
@@ -104,9 +137,17 @@ public:
         {
             vertices = std::move(move.vertices);
             indices = std::move(move.indices);
+            occlusion = std::move(move.occlusion);
             VAO = move.VAO;
             VBO = move.VBO;
             EBO = move.EBO;
+            occlusionVBO = move.occlusionVBO;
+            firstIndex = move.firstIndex;
+            baseVertex = move.baseVertex;
+            aabbMin = move.aabbMin;
+            aabbMax = move.aabbMax;
+            sphereCenter = move.sphereCenter;
+            sphereRadius = move.sphereRadius;
 
             move.VAO = 0;
         }
@@ -129,18 +170,118 @@ public:
     // rendering of mesh
     void Draw()
     {
-        // VAO is made "active"
-        glBindVertexArray(this->VAO);
+        // VAO is made "active" through the state cache.
+        // We do not "detach" it after the draw: the next Draw() of the same mesh finds it already bound,
+        // and the next Draw() of another mesh simply binds its own VAO
+        GLState().BindVertexArray(this->VAO);
         // rendering of data in the VAO
         glDrawElements(GL_TRIANGLES, this->indices.size(), GL_UNSIGNED_INT, 0);
-        // VAO is "detached"
-        glBindVertexArray(0);
+    }
+
+    // instanced rendering of mesh: the per-instance data are read from the buffer set with SetupInstanceAttributes
+    void DrawInstanced(GLsizei instanceCount)
+    {
+        GLState().BindVertexArray(this->VAO);
+        glDrawElementsInstanced(GL_TRIANGLES, this->indices.size(), GL_UNSIGNED_INT, 0, instanceCount);
+    }
+
+    // we add to the VAO the per-instance attributes (see InstanceData), read from the provided buffer.
+    // The attributes advance once per instance (divisor = 1) instead of once per vertex.
+    // A non-instanced Draw() of the same mesh is still possible: the shaders read the instance attributes only if the "instanced" uniform is true
+    void SetupInstanceAttributes(GLuint instanceBuffer)
+    {
+        const GLuint loc = INSTANCE_ATTRIB_LOCATION;
+        // a mat4 attribute uses 4 consecutive locations (one for each column), a mat3 uses 3
+        const GLint components[] = {4, 4, 4, 4, 3, 3, 3, 2};
+        const GLuint offsets[] = {
+            offsetof(InstanceData, ModelMatrix), offsetof(InstanceData, ModelMatrix) + sizeof(glm::vec4),
+            offsetof(InstanceData, ModelMatrix) + 2 * sizeof(glm::vec4), offsetof(InstanceData, ModelMatrix) + 3 * sizeof(glm::vec4),
+            offsetof(InstanceData, NormalMatrix), offsetof(InstanceData, NormalMatrix) + sizeof(glm::vec3),
+            offsetof(InstanceData, NormalMatrix) + 2 * sizeof(glm::vec3), offsetof(InstanceData, TexParams)};
+
+        if (GLState().hasDSA)
+        {
+            // the instance buffer is attached to the binding point 1 of the VAO
+            glVertexArrayVertexBuffer(this->VAO, 1, instanceBuffer, 0, sizeof(InstanceData));
+            glVertexArrayBindingDivisor(this->VAO, 1, 1);
+            for (GLuint i = 0; i < 8; i++)
+            {
+                glEnableVertexArrayAttrib(this->VAO, loc + i);
+                glVertexArrayAttribFormat(this->VAO, loc + i, components[i], GL_FLOAT, GL_FALSE, offsets[i]);
+                glVertexArrayAttribBinding(this->VAO, loc + i, 1);
+            }
+            return;
+        }
+
+        GLState().BindVertexArray(this->VAO);
+        glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+        for (GLuint i = 0; i < 8; i++)
+        {
+            glEnableVertexAttribArray(loc + i);
+            glVertexAttribPointer(loc + i, components[i], GL_FLOAT, GL_FALSE, sizeof(InstanceData), (GLvoid*)(size_t)offsets[i]);
+            glVertexAttribDivisor(loc + i, 1);
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        GLState().BindVertexArray(0);
+    }
+
+    // we copy the baked occlusion in its own buffer, read by the attribute OCCLUSION_ATTRIB_LOCATION.
+    // Without it, the attribute keeps the value set with glVertexAttrib1f (1 = not occluded)
+    void SetupOcclusion()
+    {
+        if (this->occlusion.empty() || this->occlusionVBO)
+            return;
+        if (GLState().hasDSA)
+        {
+            glCreateBuffers(1, &this->occlusionVBO);
+            glNamedBufferData(this->occlusionVBO, this->occlusion.size() * sizeof(GLfloat), this->occlusion.data(), GL_STATIC_DRAW);
+            // the occlusion buffer is attached to the binding point 2 of the VAO (1 is used by the instance data)
+            glVertexArrayVertexBuffer(this->VAO, 2, this->occlusionVBO, 0, sizeof(GLfloat));
+            glEnableVertexArrayAttrib(this->VAO, OCCLUSION_ATTRIB_LOCATION);
+            glVertexArrayAttribFormat(this->VAO, OCCLUSION_ATTRIB_LOCATION, 1, GL_FLOAT, GL_FALSE, 0);
+            glVertexArrayAttribBinding(this->VAO, OCCLUSION_ATTRIB_LOCATION, 2);
+            return;
+        }
+
+        glGenBuffers(1, &this->occlusionVBO);
+        GLState().BindVertexArray(this->VAO);
+        glBindBuffer(GL_ARRAY_BUFFER, this->occlusionVBO);
+        glBufferData(GL_ARRAY_BUFFER, this->occlusion.size() * sizeof(GLfloat), this->occlusion.data(), GL_STATIC_DRAW);
+        glEnableVertexAttribArray(OCCLUSION_ATTRIB_LOCATION);
+        glVertexAttribPointer(OCCLUSION_ATTRIB_LOCATION, 1, GL_FLOAT, GL_FALSE, sizeof(GLfloat), (GLvoid*)0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        GLState().BindVertexArray(0);
     }
 
 private:
 
     // VBO and EBO
     GLuint VBO, EBO;
+    // buffer of the baked occlusion (0 if it has not been uploaded)
+    GLuint occlusionVBO = 0;
+
+    //////////////////////////////////////////
+    // we compute the AABB of the vertices, and a bounding sphere centered in the center of the AABB
+    // (it is not the minimal sphere, but it is tighter than the sphere around the AABB)
+    void computeBounds()
+    {
+        if (this->vertices.empty())
+            return;
+        this->aabbMin = this->aabbMax = this->vertices[0].Position;
+        for (GLuint i = 1; i < this->vertices.size(); i++)
+        {
+            this->aabbMin = glm::min(this->aabbMin, this->vertices[i].Position);
+            this->aabbMax = glm::max(this->aabbMax, this->vertices[i].Position);
+        }
+        this->sphereCenter = 0.5f * (this->aabbMin + this->aabbMax);
+        GLfloat radius2 = 0.0f;
+        for (GLuint i = 0; i < this->vertices.size(); i++)
+        {
+            glm::vec3 d = this->vertices[i].Position - this->sphereCenter;
+            radius2 = glm::max(radius2, glm::dot(d, d));
+        }
+        this->sphereRadius = glm::sqrt(radius2);
+    }
 
     //////////////////////////////////////////
     // buffer objects\arrays are initialized
@@ -150,13 +291,20 @@ private:
     // http://www.informit.com/articles/article.aspx?p=1377833&seqNum=8
     void setupMesh()
     {
+        // with direct state access we can create and fill the buffers, and configure the VAO, without binding anything
+        if (GLState().hasDSA)
+        {
+            this->setupMeshDSA();
+            return;
+        }
+
         // we create the buffers
         glGenVertexArrays(1, &this->VAO);
         glGenBuffers(1, &this->VBO);
         glGenBuffers(1, &this->EBO);
 
         // VAO is made "active"
-        glBindVertexArray(this->VAO);
+        GLState().BindVertexArray(this->VAO);
         // we copy data in the VBO - we must set the data dimension, and the pointer to the structure cointaining the data
         glBindBuffer(GL_ARRAY_BUFFER, this->VBO);
         glBufferData(GL_ARRAY_BUFFER, this->vertices.size() * sizeof(Vertex), &this->vertices[0], GL_STATIC_DRAW);
@@ -185,7 +333,32 @@ private:
         // Note that this is allowed, the call to glVertexAttribPointer registered VBO as the currently bound vertex buffer object so afterwards we can safely unbind
         glBindBuffer(GL_ARRAY_BUFFER, 0); 
         // Unbind VAO (it's always a good thing to unbind any buffer/array to prevent strange bugs), remember: do NOT unbind the EBO, keep it bound to this VAO
-        glBindVertexArray(0);    }
+        GLState().BindVertexArray(0);
+    }
+
+    // same setup as above, using direct state access (OpenGL 4.5 or ARB_direct_state_access)
+    void setupMeshDSA()
+    {
+        glCreateVertexArrays(1, &this->VAO);
+        glCreateBuffers(1, &this->VBO);
+        glCreateBuffers(1, &this->EBO);
+
+        glNamedBufferData(this->VBO, this->vertices.size() * sizeof(Vertex), &this->vertices[0], GL_STATIC_DRAW);
+        glNamedBufferData(this->EBO, this->indices.size() * sizeof(GLuint), &this->indices[0], GL_STATIC_DRAW);
+
+        // the VBO is attached to the binding point 0 of the VAO, and all the attributes read from it
+        glVertexArrayVertexBuffer(this->VAO, 0, this->VBO, 0, sizeof(Vertex));
+        glVertexArrayElementBuffer(this->VAO, this->EBO);
+
+        const GLint components[] = {3, 3, 2, 3, 3};
+        const GLuint offsets[] = {0, offsetof(Vertex, Normal), offsetof(Vertex, TexCoords), offsetof(Vertex, Tangent), offsetof(Vertex, Bitangent)};
+        for (GLuint i = 0; i < 5; i++)
+        {
+            glEnableVertexArrayAttrib(this->VAO, i);
+            glVertexArrayAttribFormat(this->VAO, i, components[i], GL_FLOAT, GL_FALSE, offsets[i]);
+            glVertexArrayAttribBinding(this->VAO, i, 0);
+        }
+    }
 
     //////////////////////////////////////////
 
@@ -195,9 +368,12 @@ private:
         // so there's no need for deleting.
         if (VAO)
         {
+            GLState().OnDeleteVertexArray(this->VAO);
             glDeleteVertexArrays(1, &this->VAO);
             glDeleteBuffers(1, &this->VBO);
             glDeleteBuffers(1, &this->EBO);
+            if (this->occlusionVBO)
+                glDeleteBuffers(1, &this->occlusionVBO);
         }
     }
 };
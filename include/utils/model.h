@@ -34,12 +34,24 @@ using namespace std;
 // we include the Mesh class, which manages the "OpenGL side" (= creation and allocation of VBO, VAO, EBO buffers) of the loading of models
 #include <utils/mesh.h>
 
+// triangle-level BVH of the model, for ray queries
+#include <utils/bvh.h>
+
 /////////////////// MODEL class ///////////////////////
 class Model
 {
 public:
     // at the end of loading, we will have a vector of Mesh class instances
     vector<Mesh> meshes;
+    // bounding volumes of the whole model (they enclose the bounding volumes of all the meshes)
+    glm::vec3 aabbMin = glm::vec3(0.0f);
+    glm::vec3 aabbMax = glm::vec3(0.0f);
+    glm::vec3 sphereCenter = glm::vec3(0.0f);
+    GLfloat sphereRadius = 0.0f;
+    // BVH over the triangles of all the meshes, in model coordinates (see BuildBVH)
+    TriangleBVH bvh;
+    // path of the OBJ file
+    string path;
 
     //////////////////////////////////////////
 
@@ -68,9 +80,10 @@ public:
     // to notice that Model class is not strictly following the Rules of 5
     // https://en.cppreference.com/w/cpp/language/rule_of_three
     // because we are not writing a user-defined destructor.
-    Model(const string& path)
+    Model(const string& path) : path(path)
     {
         this->loadModel(path);
+        this->computeBounds();
     }
 
     //////////////////////////////////////////
@@ -82,11 +95,53 @@ public:
             this->meshes[i].Draw();
     }
 
+    // instanced model rendering: calls the instanced rendering methods of each instance of Mesh class in the vector
+    void DrawInstanced(GLsizei instanceCount)
+    {
+        for(GLuint i = 0; i < this->meshes.size(); i++)
+            this->meshes[i].DrawInstanced(instanceCount);
+    }
+
+    // all the meshes of the model read their per-instance data from the same buffer
+    void SetupInstanceAttributes(GLuint instanceBuffer)
+    {
+        for(GLuint i = 0; i < this->meshes.size(); i++)
+            this->meshes[i].SetupInstanceAttributes(instanceBuffer);
+    }
+
+    // we build the triangle BVH, or we load it from the cache next to the OBJ file.
+    // It does not use OpenGL, so the BVHs of different models can be built in parallel on different threads
+    void BuildBVH()
+    {
+        this->bvh.Build(this->meshes, this->path + ".bvh");
+    }
+
     //////////////////////////////////////////
 
 
 private:
 
+    //////////////////////////////////////////
+    // we merge the bounding volumes of the meshes
+    void computeBounds()
+    {
+        if (this->meshes.empty())
+            return;
+        this->aabbMin = this->meshes[0].aabbMin;
+        this->aabbMax = this->meshes[0].aabbMax;
+        for (GLuint i = 1; i < this->meshes.size(); i++)
+        {
+            this->aabbMin = glm::min(this->aabbMin, this->meshes[i].aabbMin);
+            this->aabbMax = glm::max(this->aabbMax, this->meshes[i].aabbMax);
+        }
+        this->sphereCenter = 0.5f * (this->aabbMin + this->aabbMax);
+        for (GLuint i = 0; i < this->meshes.size(); i++)
+        {
+            const Mesh& mesh = this->meshes[i];
+            this->sphereRadius = glm::max(this->sphereRadius, glm::length(mesh.sphereCenter - this->sphereCenter) + mesh.sphereRadius);
+        }
+    }
+
     //////////////////////////////////////////
     // loading of the model using Assimp library. Nodes are processed to build a vector of Mesh class instances
     void loadModel(string path)
@@ -0,0 +1,184 @@
+/*
+MomentShadowMaps class
+- filterable version of the shadow cubemaps (variance shadow maps): for each cubemap we store the first two moments
+  of the distance from the light (d, d * d) instead of the distance itself. The moments can be averaged,
+  so the soft shadows come from filtering the texture (blur and trilinear filtering), and the main shader needs a single tap,
+  with the Chebyshev inequality giving an upper bound of the lit fraction
+- the moments are computed from the depth cubemaps of the shadow pool (see shadowpool.h) in two passes for each face:
+  1) the distance of the depth cubemap (the min() with the static map, if the casters are split) is converted to moments,
+     and blurred along the rows of the face, in a temporary array
+  2) the temporary array is blurred along the columns, in the face of the moment cubemap.
+     Then the mipmaps are generated, so the far and small shadows are filtered by the hardware too
+- all the moment cubemaps are in one GL_TEXTURE_CUBE_MAP_ARRAY (cube i for the shadow i) with a fixed size:
+  the blur already removes the details of the bigger depth maps
+
+N.B. 1) each face is blurred separately, as a 2D texture: the taps near the edges are clamped to the face,
+so the seams between the faces are slightly visible with a large blur radius
+
+N.B. 2) with overlapping occluders the Chebyshev bound lets some light bleed in the shadows:
+the main shader cuts the lowest part of the bound (light bleeding reduction)
+
+N.B. 3) the moments need 32 bit floats: with 16 bit, d * d loses too much precision and the shadows become noisy
+*/
+
+#pragma once
+
+using namespace std;
+
+// Std. Includes
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include <utils/glstate.h>
+#include <utils/shadowpool.h>
+
+/////////////////// MOMENTSHADOWMAPS class ///////////////////////
+class MomentShadowMaps
+{
+public:
+    MomentShadowMaps() = default;
+    MomentShadowMaps(const MomentShadowMaps& copy) = delete; //disallow copy
+    MomentShadowMaps& operator=(const MomentShadowMaps&) = delete;
+
+    ~MomentShadowMaps() noexcept
+    {
+        if (this->texture)
+        {
+            glDeleteTextures(1, &this->texture);
+            GLState().OnDeleteTexture(this->texture);
+            glDeleteTextures(1, &this->temporary);
+            GLState().OnDeleteTexture(this->temporary);
+            glDeleteFramebuffers(1, &this->framebuffer);
+            GLState().OnDeleteFramebuffer(this->framebuffer);
+            glDeleteVertexArrays(1, &this->vao);
+            GLState().OnDeleteVertexArray(this->vao);
+        }
+    }
+
+    //////////////////////////////////////////
+
+    // count cubemaps of size x size texels, with all their mipmaps
+    void Init(GLsizei size, GLuint count)
+    {
+        this->size = size;
+        this->levels = 1;
+        while ((size >> this->levels) > 0)
+            this->levels++;
+        this->valid.assign(count, false);
+
+        this->texture = NewTexture(GL_TEXTURE_CUBE_MAP_ARRAY, size, 6 * count, this->levels);
+        GLState().TextureParameteri(this->texture, GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        GLState().TextureParameteri(this->texture, GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        this->temporary = NewTexture(GL_TEXTURE_2D_ARRAY, size, 6, 1);
+        GLState().TextureParameteri(this->temporary, GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        GLState().TextureParameteri(this->temporary, GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+        // the faces are attached one at a time in Update()
+        glGenFramebuffers(1, &this->framebuffer);
+        // the full screen triangle has no vertex data (its vertices come from gl_VertexID), but the core profile needs a VAO
+        glGenVertexArrays(1, &this->vao);
+    }
+
+    GLuint Texture() const { return this->texture; }
+    GLsizei Size() const { return this->size; }
+
+    // cube i has been computed from the current depth cubemap i
+    bool IsValid(GLuint cube) const { return this->valid[cube]; }
+
+    // all the cubes will be computed again (e.g. the blur radius changed)
+    void Invalidate()
+    {
+        for (GLuint i = 0; i < this->valid.size(); i++)
+            this->valid[i] = false;
+    }
+
+    // cube will be computed again (its depth cubemap has been rendered while the moments were not updated)
+    void Invalidate(GLuint cube) { this->valid[cube] = false; }
+
+    // we compute the moments of cube from the depth cubemap in slot (and in staticSlot, if its tier is not -1),
+    // with a blur of 2 * radius + 1 texels. The programs are the two passes (shadowmoments.frag and momentblur.frag)
+    void Update(GLuint momentProgram, GLuint blurProgram, GLuint cube, const ShadowSlot& slot, const ShadowSlot& staticSlot, GLint radius)
+    {
+        GLState().BindFramebuffer(this->framebuffer);
+        glViewport(0, 0, this->size, this->size);
+        GLState().BindVertexArray(this->vao);
+
+        // 1) distance to moments, blurred along the rows
+        GLState().UseProgram(momentProgram);
+        GLState().BindTexture(0, GL_TEXTURE_CUBE_MAP_ARRAY, slot.texture);
+        glUniform1i(glGetUniformLocation(momentProgram, "shadowMap"), 0);
+        glUniform1f(glGetUniformLocation(momentProgram, "shadowLayer"), slot.slot);
+        bool split = staticSlot.tier >= 0;
+        glUniform1i(glGetUniformLocation(momentProgram, "staticShadows"), split);
+        GLState().BindTexture(1, GL_TEXTURE_CUBE_MAP_ARRAY, split ? staticSlot.texture : slot.texture);
+        glUniform1i(glGetUniformLocation(momentProgram, "staticShadowMap"), 1);
+        glUniform1f(glGetUniformLocation(momentProgram, "staticShadowLayer"), split ? staticSlot.slot : slot.slot);
+        glUniform1i(glGetUniformLocation(momentProgram, "radius"), radius);
+        glUniform1f(glGetUniformLocation(momentProgram, "size"), (GLfloat)this->size);
+        for (GLint face = 0; face < 6; face++)
+        {
+            glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, this->temporary, 0, face);
+            glUniform1i(glGetUniformLocation(momentProgram, "face"), face);
+            glDrawArrays(GL_TRIANGLES, 0, 3);
+        }
+
+        // 2) blur along the columns, in the faces of the cube
+        GLState().UseProgram(blurProgram);
+        GLState().BindTexture(0, GL_TEXTURE_2D_ARRAY, this->temporary);
+        glUniform1i(glGetUniformLocation(blurProgram, "source"), 0);
+        glUniform1i(glGetUniformLocation(blurProgram, "radius"), radius);
+        for (GLint face = 0; face < 6; face++)
+        {
+            glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, this->texture, 0, 6 * cube + face);
+            glUniform1i(glGetUniformLocation(blurProgram, "face"), face);
+            glDrawArrays(GL_TRIANGLES, 0, 3);
+        }
+        this->valid[cube] = true;
+    }
+
+    // after the updates of a frame, the mipmaps of all the cubes are generated again
+    void GenerateMipmaps()
+    {
+        if (GLState().hasDSA)
+            glGenerateTextureMipmap(this->texture);
+        else
+        {
+            GLState().BindTextureForEdit(GL_TEXTURE_CUBE_MAP_ARRAY, this->texture);
+            glGenerateMipmap(GL_TEXTURE_CUBE_MAP_ARRAY);
+        }
+    }
+
+private:
+    GLsizei size = 0;
+    GLsizei levels = 1;
+    // moments of each cube, and the rows blurred by the first pass (one layer for each face)
+    GLuint texture = 0;
+    GLuint temporary = 0;
+    GLuint framebuffer = 0;
+    GLuint vao = 0;
+    vector<bool> valid;
+
+    // a RG32F texture with layers layers of size x size texels
+    static GLuint NewTexture(GLenum target, GLsizei size, GLsizei layers, GLsizei levels)
+    {
+        GLuint texture;
+        if (GLState().hasDSA)
+        {
+            glCreateTextures(target, 1, &texture);
+            glTextureStorage3D(texture, levels, GL_RG32F, size, size, layers);
+        }
+        else
+        {
+            glGenTextures(1, &texture);
+            GLState().BindTextureForEdit(target, texture);
+            for (GLsizei level = 0; level < levels; level++)
+                glTexImage3D(target, level, GL_RG32F, glm::max(size >> level, 1), glm::max(size >> level, 1), layers, 0, GL_RG, GL_FLOAT, NULL);
+            GLState().TextureParameteri(texture, target, GL_TEXTURE_MAX_LEVEL, levels - 1);
+        }
+        GLState().TextureParameteri(texture, target, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        GLState().TextureParameteri(texture, target, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        GLState().TextureParameteri(texture, target, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+        return texture;
+    }
+};
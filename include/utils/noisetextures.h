@@ -0,0 +1,168 @@
+/*
+NoiseTextures class
+- the animated Voronoi patterns of the main shader (voronoiNoise and voronoiDiagram in fragmentShader.frag), baked at startup
+  in a 3D texture: x and y cover a tile of CELLS x CELLS cells, z covers one period of the animation
+  RGB = color of the closest cell (the voronoiDiagram pattern), A = sqrt of the squared distance from its point (the voronoiNoise value)
+- the texture repeats in all the directions: the cells of the tile are wrapped (the hash of a cell uses its coordinates modulo CELLS),
+  and the animation loops after PERIOD seconds. So the shader reads the pattern at any position and time with a single tap,
+  and the harmonics of the turbulence are taps of the same texture at different scales
+- the slices (one for each time) are baked by jobs on the worker threads (Start), then uploaded (Finish)
+
+N.B. 1) in voronoiNoise each point moves on sin(timer * hash(cell)), which never repeats. Here the speed of each point is rounded
+to a multiple of 2 PI / PERIOD, so the animation loops: the points move like in the procedural version,
+with a few speeds instead of a continuous range (with speed 0 some points stand still)
+
+N.B. 2) the linear filtering along z blends the two closest slices: a point moves less than a quarter of a cell between two slices
+
+N.B. 3) the distance is stored as its square root, so the 8 bits are spent on the dark part of the pattern, where the eye notices the steps
+*/
+
+#pragma once
+
+using namespace std;
+
+// Std. Includes
+#include <vector>
+#include <cmath>
+#include <chrono>
+
+#include <glm/glm.hpp>
+
+#include <utils/glstate.h>
+#include <utils/jobsystem.h>
+
+/////////////////// NOISETEXTURES class ///////////////////////
+class NoiseTextures
+{
+public:
+    // texels of a slice, cells of the tile (a multiple of the 16 colors, so a wrapped cell keeps its color), slices of the period
+    static const GLuint SIZE = 256;
+    static const GLuint CELLS = 16;
+    static const GLuint SLICES = 64;
+    // the speeds of the points are multiples of 2 PI / PERIOD, up to 1 (as the hash in voronoiNoise)
+    static const GLuint SPEED_STEPS = 4;
+    static constexpr GLfloat PERIOD = 2.0f * 3.14159265359f * SPEED_STEPS;
+
+    // time spent to bake the texture (milliseconds)
+    double bakeTime = 0.0;
+
+    NoiseTextures() = default;
+    NoiseTextures(const NoiseTextures& copy) = delete; //disallow copy
+    NoiseTextures& operator=(const NoiseTextures&) = delete;
+
+    ~NoiseTextures() noexcept
+    {
+        if (this->texture)
+        {
+            glDeleteTextures(1, &this->texture);
+            GLState().OnDeleteTexture(this->texture);
+        }
+    }
+
+    //////////////////////////////////////////
+
+    // we start the jobs which bake the slices (the caller waits for counter before Finish)
+    void Start(JobSystem& jobs, JobCounter& counter)
+    {
+        this->start = chrono::steady_clock::now();
+        this->texels.assign(4 * SIZE * SIZE * SLICES, 0);
+        for (GLuint slice = 0; slice < SLICES; slice++)
+            jobs.Run(counter, [this, slice]() { this->BakeSlice(slice); });
+    }
+
+    void Finish()
+    {
+        if (GLState().hasDSA)
+        {
+            glCreateTextures(GL_TEXTURE_3D, 1, &this->texture);
+            glTextureStorage3D(this->texture, 1, GL_RGBA8, SIZE, SIZE, SLICES);
+            glTextureSubImage3D(this->texture, 0, 0, 0, 0, SIZE, SIZE, SLICES, GL_RGBA, GL_UNSIGNED_BYTE, this->texels.data());
+        }
+        else
+        {
+            glGenTextures(1, &this->texture);
+            GLState().BindTextureForEdit(GL_TEXTURE_3D, this->texture);
+            glTexImage3D(GL_TEXTURE_3D, 0, GL_RGBA8, SIZE, SIZE, SLICES, 0, GL_RGBA, GL_UNSIGNED_BYTE, this->texels.data());
+            GLState().TextureParameteri(this->texture, GL_TEXTURE_3D, GL_TEXTURE_MAX_LEVEL, 0);
+        }
+        // no mipmaps: they would blend also the slices of different times
+        GLState().TextureParameteri(this->texture, GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        GLState().TextureParameteri(this->texture, GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        GLState().TextureParameteri(this->texture, GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        GLState().TextureParameteri(this->texture, GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        GLState().TextureParameteri(this->texture, GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_REPEAT);
+        this->texels = vector<GLubyte>();
+        this->bakeTime = chrono::duration<double, milli>(chrono::steady_clock::now() - this->start).count();
+    }
+
+    GLuint Texture() const { return this->texture; }
+
+private:
+    vector<GLubyte> texels;
+    GLuint texture = 0;
+    chrono::steady_clock::time_point start;
+
+    // the hash of fragmentShader.frag
+    static glm::vec2 Hash(const glm::vec2& p)
+    {
+        glm::vec2 noise = glm::vec2(glm::dot(p, glm::vec2(123.4f, 234.5f)), glm::dot(p, glm::vec2(345.6f, 456.7f)));
+        noise = glm::sin(noise) * 43758.5453f;
+        return glm::fract(noise);
+    }
+
+    // the 16 colors of setColors in fragmentShader.frag
+    static glm::vec3 CellColor(GLint x, GLint y)
+    {
+        static const GLubyte colors[16][3] = { {11, 57, 84}, {38, 84, 110}, {182, 214, 204}, {248, 156, 115},
+                                               {255, 58, 32}, {245, 205, 157}, {64, 111, 136}, {247, 181, 136},
+                                               {116, 164, 188}, {241, 254, 198}, {8, 126, 139}, {200, 29, 37},
+                                               {223, 153, 165}, {239, 122, 130}, {20, 50, 57}, {207, 184, 200} };
+        const GLubyte* color = colors[(x + y) % 16];
+        return glm::vec3(color[0], color[1], color[2]);
+    }
+
+    void BakeSlice(GLuint slice)
+    {
+        GLfloat time = PERIOD * slice / SLICES;
+        // the point of each cell of the tile in this slice (the speeds rounded to multiples of 2 PI / PERIOD)
+        glm::vec2 points[CELLS][CELLS];
+        for (GLuint y = 0; y < CELLS; y++)
+            for (GLuint x = 0; x < CELLS; x++)
+            {
+                glm::vec2 speed = glm::round(Hash(glm::vec2(x, y)) * GLfloat(SPEED_STEPS)) / GLfloat(SPEED_STEPS);
+                points[y][x] = glm::sin(time * speed) * 0.5f;
+            }
+
+        GLubyte* out = &this->texels[4 * SIZE * SIZE * slice];
+        for (GLuint ty = 0; ty < SIZE; ty++)
+            for (GLuint tx = 0; tx < SIZE; tx++)
+            {
+                // the same 3x3 search of voronoiDiagram, with the neighbours wrapped in the tile
+                glm::vec2 p = (glm::vec2(tx, ty) + 0.5f) * (GLfloat(CELLS) / SIZE);
+                glm::vec2 cell = glm::floor(p);
+                glm::vec2 uvw = p - cell;
+                GLfloat minDist = 1.0f;
+                GLint closestX = 0, closestY = 0;
+                for (GLint x = -1; x <= 1; x++)
+                    for (GLint y = -1; y <= 1; y++)
+                    {
+                        GLint cx = (GLint(cell.x) + x + (GLint)CELLS) % (GLint)CELLS;
+                        GLint cy = (GLint(cell.y) + y + (GLint)CELLS) % (GLint)CELLS;
+                        glm::vec2 diff = glm::vec2(x, y) + points[cy][cx] - uvw;
+                        GLfloat d = glm::dot(diff, diff);
+                        if (d < minDist)
+                        {
+                            minDist = d;
+                            closestX = cx;
+                            closestY = cy;
+                        }
+                    }
+                glm::vec3 color = CellColor(closestX, closestY);
+                out[0] = (GLubyte)color.r;
+                out[1] = (GLubyte)color.g;
+                out[2] = (GLubyte)color.b;
+                out[3] = (GLubyte)glm::round(glm::sqrt(minDist) * 255.0f);
+                out += 4;
+            }
+    }
+};
@@ -0,0 +1,103 @@
+/*
+OcclusionQueries class
+- a set of hardware occlusion queries (GL_ANY_SAMPLES_PASSED), one for each object we want to test (e.g. one for each portal)
+- the queries are double-buffered: in each frame we issue the queries of one set, while we can read the results
+  of the other set (issued in the last frame) without waiting for the GPU
+- the result of the current frame can be used without reading it back, with conditional rendering:
+  the draws between BeginConditional() and EndConditional() are discarded by the GPU if no sample of the query passed
+
+N.B. 1) with conditional rendering the CPU still submits all the draws, but the GPU skips them.
+With the result of the last frame the CPU can skip the submission too, but an object which becomes visible
+is drawn one frame late
+
+N.B. 2) a query which has not been issued, or whose result is not available yet, is considered visible
+*/
+
+#pragma once
+
+using namespace std;
+
+// Std. Includes
+#include <vector>
+
+#include <utils/glstate.h>
+
+/////////////////// OCCLUSIONQUERIES class ///////////////////////
+class OcclusionQueries
+{
+public:
+    OcclusionQueries() = default;
+    OcclusionQueries(const OcclusionQueries& copy) = delete; //disallow copy
+    OcclusionQueries& operator=(const OcclusionQueries&) = delete;
+
+    ~OcclusionQueries() noexcept
+    {
+        for (int set = 0; set < 2; set++)
+            if (!this->queries[set].empty())
+                glDeleteQueries(this->queries[set].size(), this->queries[set].data());
+    }
+
+    //////////////////////////////////////////
+
+    // we create two sets of count queries
+    void Init(GLuint count)
+    {
+        for (int set = 0; set < 2; set++)
+        {
+            this->queries[set].resize(count);
+            this->issued[set].assign(count, false);
+            glGenQueries(count, this->queries[set].data());
+        }
+    }
+
+    // we swap the sets: the queries issued in the last frame become the ones we read
+    void BeginFrame()
+    {
+        this->current = 1 - this->current;
+        this->issued[this->current].assign(this->issued[this->current].size(), false);
+    }
+
+    // the samples of the draws between Begin() and End() are counted in the query of the object
+    void Begin(GLuint object)
+    {
+        glBeginQuery(GL_ANY_SAMPLES_PASSED, this->queries[this->current][object]);
+        this->issued[this->current][object] = true;
+    }
+
+    void End()
+    {
+        glEndQuery(GL_ANY_SAMPLES_PASSED);
+    }
+
+    // the draws are executed by the GPU only if the query of this frame passed.
+    // GL_QUERY_WAIT makes the GPU (not the CPU) wait for the result
+    void BeginConditional(GLuint object)
+    {
+        glBeginConditionalRender(this->queries[this->current][object], GL_QUERY_WAIT);
+    }
+
+    void EndConditional()
+    {
+        glEndConditionalRender();
+    }
+
+    // result of the last frame, read without waiting
+    bool WasVisible(GLuint object) const
+    {
+        GLuint last = 1 - this->current;
+        if (!this->issued[last][object])
+            return true;
+        GLuint available = 0;
+        glGetQueryObjectuiv(this->queries[last][object], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available)
+            return true;
+        GLuint passed = 0;
+        glGetQueryObjectuiv(this->queries[last][object], GL_QUERY_RESULT, &passed);
+        return passed != 0;
+    }
+
+private:
+    vector<GLuint> queries[2];
+    vector<bool> issued[2];
+    GLuint current = 0;
+};
@@ -0,0 +1,206 @@
+/*
+RingBuffer class
+- ring allocator for the dynamic data which change every frame (vertices of the paint strokes, per-draw data and commands of the draw lists)
+- the buffer is split in NUM_SECTIONS sections (triple buffering): in each frame we write only in the section of the frame,
+  while the GPU can still read the sections of the two previous frames
+- the allocations are bump-pointer: Allocate() returns a pointer where the data must be written, and the offset of the data
+  in the buffer (to be used as first vertex, base instance, indirect offset, ...)
+- where ARB_buffer_storage (core in OpenGL 4.4) is available, the buffer is persistently and coherently mapped once.
+  At the end of each frame we insert a fence (glFenceSync) after the commands which read its section, and we test it
+  before writing again in the same section, two frames later
+
+N.B. 1) our baseline context is OpenGL 4.1, without buffer storage. In that case the data are written in a CPU-side copy of the section,
+and copied with glBufferSubData by Flush(). The buffer is orphaned at the beginning of each frame, so the driver gives us new memory
+instead of waiting for the GPU to finish with the data of the last frame
+
+N.B. 2) Flush() must be called after the data have been written and before the draw calls which read them
+(with the persistent mapping it does nothing, because the mapping is coherent)
+
+N.B. 3) with triple buffering the fence of a section is always signaled when we get back to it, unless the driver queues
+more than two frames: in that case we wait for it, and the wait is counted in fenceWaits (shown in the Performance window)
+*/
+
+#pragma once
+
+using namespace std;
+
+// Std. Includes
+#include <vector>
+#include <iostream>
+
+#include <utils/glstate.h>
+
+// a range of the ring buffer, where the data of the current frame can be written
+struct RingAllocation {
+    // pointer where the data must be written (NULL if the section of the frame is full)
+    GLvoid* ptr = NULL;
+    // offset of the data from the beginning of the buffer
+    GLintptr offset = 0;
+    GLsizeiptr size = 0;
+};
+
+/////////////////// RINGBUFFER class ///////////////////////
+class RingBuffer
+{
+public:
+    static const GLuint NUM_SECTIONS = 3;
+
+    // the buffer can be bound to any target (GL_ARRAY_BUFFER, GL_DRAW_INDIRECT_BUFFER, GL_UNIFORM_BUFFER, ...)
+    GLuint buffer = 0;
+
+    // statistics of the last frame: bytes allocated, and how many times we had to wait for a fence
+    GLsizeiptr usedBytes = 0;
+    GLuint fenceWaits = 0;
+
+    RingBuffer() = default;
+    RingBuffer(const RingBuffer& copy) = delete; //disallow copy
+    RingBuffer& operator=(const RingBuffer&) = delete;
+
+    ~RingBuffer() noexcept
+    {
+        if (this->buffer)
+        {
+            for (GLuint i = 0; i < NUM_SECTIONS; i++)
+                if (this->fences[i])
+                    glDeleteSync(this->fences[i]);
+            if (this->mapped)
+            {
+                glBindBuffer(GL_COPY_WRITE_BUFFER, this->buffer);
+                glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+            }
+            glDeleteBuffers(1, &this->buffer);
+        }
+    }
+
+    //////////////////////////////////////////
+
+    // we create the buffer, with sectionSize bytes available in each frame
+    void Init(GLsizeiptr sectionSize)
+    {
+        this->sectionSize = sectionSize;
+        this->persistent = GLState().hasBufferStorage;
+        glGenBuffers(1, &this->buffer);
+        // we use the copy target, so we do not change the bindings used by the rendering
+        glBindBuffer(GL_COPY_WRITE_BUFFER, this->buffer);
+        if (this->persistent)
+        {
+            GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            glBufferStorage(GL_COPY_WRITE_BUFFER, NUM_SECTIONS * sectionSize, NULL, flags);
+            this->mapped = (GLubyte*)glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, NUM_SECTIONS * sectionSize, flags);
+            if (!this->mapped)
+            {
+                cout << "ERROR::RINGBUFFER:: persistent mapping failed, the buffer will be orphaned" << endl;
+                // a buffer created with glBufferStorage is immutable, so we create a new one for the fallback
+                glDeleteBuffers(1, &this->buffer);
+                glGenBuffers(1, &this->buffer);
+                glBindBuffer(GL_COPY_WRITE_BUFFER, this->buffer);
+                this->persistent = false;
+            }
+        }
+        if (!this->persistent)
+        {
+            glBufferData(GL_COPY_WRITE_BUFFER, sectionSize, NULL, GL_STREAM_DRAW);
+            this->staging.resize(sectionSize);
+        }
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    }
+
+    // we move to the section of the new frame
+    void BeginFrame()
+    {
+        this->usedBytes = this->head;
+        this->head = 0;
+        this->flushed = 0;
+        this->overflow = false;
+        this->fenceWaits = 0;
+
+        if (!this->persistent)
+        {
+            // orphaning: the GPU keeps the old memory until it has finished with it
+            glBindBuffer(GL_COPY_WRITE_BUFFER, this->buffer);
+            glBufferData(GL_COPY_WRITE_BUFFER, this->sectionSize, NULL, GL_STREAM_DRAW);
+            glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+            return;
+        }
+
+        this->section = (this->section + 1) % NUM_SECTIONS;
+        GLsync& fence = this->fences[this->section];
+        if (fence)
+        {
+            // we just test the fence: it has been inserted two frames ago, so normally it is already signaled
+            GLenum result = glClientWaitSync(fence, 0, 0);
+            if (result == GL_TIMEOUT_EXPIRED)
+            {
+                this->fenceWaits++;
+                while (result == GL_TIMEOUT_EXPIRED)
+                    result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+            }
+            glDeleteSync(fence);
+            fence = 0;
+        }
+    }
+
+    // we insert the fence after all the commands of the frame which read the current section
+    void EndFrame()
+    {
+        if (this->persistent)
+            this->fences[this->section] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+
+    // we reserve size bytes in the section of the current frame. The offset is a multiple of alignment
+    // (which does not need to be a power of 2, e.g. sizeof(InstanceData) to use the offset as a base instance)
+    RingAllocation Allocate(GLsizeiptr size, GLsizeiptr alignment = 16)
+    {
+        RingAllocation allocation;
+        GLintptr sectionBase = this->persistent ? this->section * this->sectionSize : 0;
+        GLintptr offset = ((sectionBase + this->head + alignment - 1) / alignment) * alignment;
+        if (offset + size > sectionBase + this->sectionSize)
+        {
+            // we report the overflow once per frame: the caller skips the draws which needed the data
+            if (!this->overflow)
+                cout << "ERROR::RINGBUFFER:: section full, " << size << " bytes requested" << endl;
+            this->overflow = true;
+            return allocation;
+        }
+        this->head = offset + size - sectionBase;
+
+        allocation.offset = offset;
+        allocation.size = size;
+        allocation.ptr = this->persistent ? (GLvoid*)(this->mapped + offset) : (GLvoid*)(this->staging.data() + offset);
+        return allocation;
+    }
+
+    // the data written since the last Flush() are made visible to the GPU
+    void Flush()
+    {
+        if (this->persistent || this->flushed == this->head)
+            return;
+        if (GLState().hasDSA)
+            glNamedBufferSubData(this->buffer, this->flushed, this->head - this->flushed, this->staging.data() + this->flushed);
+        else
+        {
+            glBindBuffer(GL_COPY_WRITE_BUFFER, this->buffer);
+            glBufferSubData(GL_COPY_WRITE_BUFFER, this->flushed, this->head - this->flushed, this->staging.data() + this->flushed);
+            glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        }
+        this->flushed = this->head;
+    }
+
+    // true if the buffer is persistently mapped
+    bool IsPersistent() const { return this->persistent; }
+
+private:
+    GLsizeiptr sectionSize = 0;
+    // section of the current frame, and first free byte in it
+    GLuint section = 0;
+    GLsizeiptr head = 0;
+    // (fallback) first byte not yet copied in the buffer
+    GLsizeiptr flushed = 0;
+    bool overflow = false;
+
+    bool persistent = false;
+    GLubyte* mapped = NULL;
+    GLsync fences[NUM_SECTIONS] = {0, 0, 0};
+    // (fallback) CPU-side copy of the section
+    vector<GLubyte> staging;
+};
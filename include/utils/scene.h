@@ -0,0 +1,240 @@
+/*
+Scene class
+- it loads a scene description (see scenes/room.scene): one object for each line, with its kind, name, mesh,
+  texture layer, UV repetition, position, rotation (axis and angle) and scale
+- the transforms are stored as a structure of arrays: one vector for each component, indexed by the object index
+- every change of position, rotation or scale sets the dirty flag of the object. UpdateTransforms() is called once per frame,
+  and it recomputes the world matrix and the (world-space) normal matrix only of the dirty objects.
+  The matrices are then shared by all the views (main view, portals) and all the passes (shadow, render, bake)
+
+N.B. 1) the normal matrix of a view is mat3(view) * normalMatrices[i]: the view matrix is a rigid transform,
+so its inverse transpose is the matrix itself, and we do not need any inverse in the render loop
+
+N.B. 2) the objects of kind "light" follow the light: the position in the file is an offset from the light position
+
+N.B. 3) each object can have a bounding sphere in model coordinates (SetLocalBounds). The world-space spheres are updated
+together with the matrices, and they are stored as 4 separate arrays (x, y, z, radius), so the culling (see culling.h)
+can load them directly in SIMD registers
+
+N.B. 4) versions[i] counts the updates of the matrices of object i: a cache built from the transforms (e.g. a shadow map)
+can remember the versions it has seen, and compare them instead of the matrices
+*/
+
+#pragma once
+
+using namespace std;
+
+// Std. Includes
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+
+// we use GLM for the transforms
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/matrix_inverse.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+// we use the InstanceData struct for the per-draw data
+#include <utils/mesh.h>
+
+// kinds of objects in the scene file
+enum SceneObjectKind { STATIC_OBJECT, DYNAMIC_OBJECT, LIGHT_OBJECT };
+
+/////////////////// SCENE class ///////////////////////
+class Scene
+{
+public:
+    // per-object data, as a structure of arrays
+    vector<string> names;
+    vector<string> meshes;
+    vector<SceneObjectKind> kinds;
+    vector<glm::vec2> texParams;
+    vector<glm::vec3> positions;
+    vector<glm::quat> rotations;
+    vector<glm::vec3> scales;
+    vector<GLubyte> dirty;
+
+    // bounding sphere of each object in model coordinates (xyz = center, w = radius)
+    vector<glm::vec4> localSpheres;
+
+    // cached matrices and world-space bounding spheres, updated by UpdateTransforms()
+    vector<glm::mat4> worldMatrices;
+    vector<glm::mat3> normalMatrices;
+    vector<GLfloat> sphereX, sphereY, sphereZ, sphereRadius;
+
+    // number of updates of the matrices of each object
+    vector<GLuint> versions;
+
+    // number of matrices recomputed in the last update
+    GLuint updatedTransforms = 0;
+
+    Scene() = default;
+
+    Scene(const string& path)
+    {
+        this->Load(path);
+    }
+
+    //////////////////////////////////////////
+
+    // we read the scene file, and we compute the matrices of all the objects
+    void Load(const string& path)
+    {
+        ifstream file(path);
+        if (!file)
+        {
+            cout << "ERROR::SCENE:: cannot open " << path << endl;
+            return;
+        }
+
+        string line;
+        GLuint lineNumber = 0;
+        while (getline(file, line))
+        {
+            lineNumber++;
+            // we skip empty lines and comments
+            size_t first = line.find_first_not_of(" \t\r");
+            if (first == string::npos || line[first] == '#')
+                continue;
+
+            istringstream fields(line);
+            string kind, name, mesh;
+            glm::vec2 tex;
+            glm::vec3 position, axis, scale;
+            GLfloat angle;
+            fields >> kind >> name >> mesh >> tex.x >> tex.y
+                   >> position.x >> position.y >> position.z
+                   >> axis.x >> axis.y >> axis.z >> angle
+                   >> scale.x >> scale.y >> scale.z;
+            if (fields.fail() || (kind != "static" && kind != "dynamic" && kind != "light"))
+            {
+                cout << "ERROR::SCENE:: malformed object at line " << lineNumber << " of " << path << endl;
+                continue;
+            }
+
+            this->Add(kind == "static" ? STATIC_OBJECT : (kind == "dynamic" ? DYNAMIC_OBJECT : LIGHT_OBJECT),
+                      name, mesh, tex, position, glm::angleAxis(glm::radians(angle), glm::normalize(axis)), scale);
+        }
+        this->UpdateTransforms();
+        cout << "Scene " << path << ": " << this->Size() << " objects" << endl;
+    }
+
+    // we add an object at the end of the scene. It is dirty, so its matrices are computed by the next UpdateTransforms()
+    GLuint Add(SceneObjectKind kind, const string& name, const string& mesh, const glm::vec2& tex,
+               const glm::vec3& position, const glm::quat& rotation, const glm::vec3& scale)
+    {
+        this->names.push_back(name);
+        this->meshes.push_back(mesh);
+        this->kinds.push_back(kind);
+        this->texParams.push_back(tex);
+        this->positions.push_back(position);
+        this->rotations.push_back(rotation);
+        this->scales.push_back(scale);
+        this->dirty.push_back(GL_TRUE);
+        this->versions.push_back(0);
+        this->localSpheres.push_back(glm::vec4(0.0f));
+        this->worldMatrices.push_back(glm::mat4(1.0f));
+        this->normalMatrices.push_back(glm::mat3(1.0f));
+        this->sphereX.push_back(0.0f);
+        this->sphereY.push_back(0.0f);
+        this->sphereZ.push_back(0.0f);
+        this->sphereRadius.push_back(0.0f);
+        return this->Size() - 1;
+    }
+
+    // number of objects
+    GLuint Size() const { return (GLuint)this->names.size(); }
+
+    // index of the object with the given name (-1 if it does not exist)
+    GLint Find(const string& name) const
+    {
+        for (GLuint i = 0; i < this->Size(); i++)
+            if (this->names[i] == name)
+                return i;
+        cout << "ERROR::SCENE:: object " << name << " not found" << endl;
+        return -1;
+    }
+
+    // indices of all the objects of the given kind which use the given mesh
+    vector<GLuint> FindAll(const string& mesh, SceneObjectKind kind) const
+    {
+        vector<GLuint> objects;
+        for (GLuint i = 0; i < this->Size(); i++)
+            if (this->meshes[i] == mesh && this->kinds[i] == kind)
+                objects.push_back(i);
+        return objects;
+    }
+
+    // setters: the object is marked as dirty only if the value actually changes
+    void SetPosition(GLuint object, const glm::vec3& position)
+    {
+        if (this->positions[object] == position)
+            return;
+        this->positions[object] = position;
+        this->dirty[object] = GL_TRUE;
+    }
+
+    void SetRotation(GLuint object, const glm::quat& rotation)
+    {
+        if (this->rotations[object] == rotation)
+            return;
+        this->rotations[object] = rotation;
+        this->dirty[object] = GL_TRUE;
+    }
+
+    void SetScale(GLuint object, const glm::vec3& scale)
+    {
+        if (this->scales[object] == scale)
+            return;
+        this->scales[object] = scale;
+        this->dirty[object] = GL_TRUE;
+    }
+
+    // bounding sphere of the object in model coordinates (see N.B. 3)
+    void SetLocalBounds(GLuint object, const glm::vec3& center, GLfloat radius)
+    {
+        this->localSpheres[object] = glm::vec4(center, radius);
+        this->dirty[object] = GL_TRUE;
+    }
+
+    // we recompute the matrices of the dirty objects (once per frame, before the first pass)
+    GLuint UpdateTransforms()
+    {
+        this->updatedTransforms = 0;
+        for (GLuint i = 0; i < this->Size(); i++)
+        {
+            if (!this->dirty[i])
+                continue;
+            glm::mat4 world = glm::translate(glm::mat4(1.0f), this->positions[i]);
+            world = world * glm::mat4_cast(this->rotations[i]);
+            world = glm::scale(world, this->scales[i]);
+            this->worldMatrices[i] = world;
+            this->normalMatrices[i] = glm::inverseTranspose(glm::mat3(world));
+
+            // the radius is scaled by the largest scale factor, so the sphere is conservative also for non-uniform scales
+            glm::vec4 center = world * glm::vec4(glm::vec3(this->localSpheres[i]), 1.0f);
+            GLfloat maxScale = glm::max(glm::length(glm::vec3(world[0])), glm::max(glm::length(glm::vec3(world[1])), glm::length(glm::vec3(world[2]))));
+            this->sphereX[i] = center.x;
+            this->sphereY[i] = center.y;
+            this->sphereZ[i] = center.z;
+            this->sphereRadius[i] = this->localSpheres[i].w * maxScale;
+            this->dirty[i] = GL_FALSE;
+            this->versions[i]++;
+            this->updatedTransforms++;
+        }
+        return this->updatedTransforms;
+    }
+
+    // per-draw data of the object, for instance buffers and draw lists
+    InstanceData GetInstanceData(GLuint object) const
+    {
+        InstanceData data;
+        data.ModelMatrix = this->worldMatrices[object];
+        data.NormalMatrix = this->normalMatrices[object];
+        data.TexParams = this->texParams[object];
+        return data;
+    }
+};
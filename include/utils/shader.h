@@ -1,4 +1,5 @@
-// This is basically the shader.h from the lecture, but with the extension that it also loads a geometry shader
+// This is basically the shader.h from the lecture, but with the extension that it also loads a geometry shader.
+// The same sources can be compiled in different versions, with some lines of #define added after the #version line of each stage
 
 #pragma once
 
@@ -10,6 +11,9 @@ using namespace std;
 #include <sstream>
 #include <iostream>
 
+// the Shader Program is activated through the OpenGL state cache
+#include <utils/glstate.h>
+
 
 /////////////////// SHADER class ///////////////////////
 class Shader
@@ -19,8 +23,8 @@ public:
 
     //////////////////////////////////////////
 
-    //constructor
-    Shader(const GLchar* vertexPath, const GLchar* fragmentPath, const GLchar* geometryPath = NULL)
+    //constructor (defines, if not NULL, e.g. "#define GBUFFER\n", is added to all the stages)
+    Shader(const GLchar* vertexPath, const GLchar* fragmentPath, const GLchar* geometryPath = NULL, const GLchar* defines = NULL)
     {
         // Step 1: we retrieve shaders source code from provided filepaths
         string vertexCode;
@@ -44,8 +48,8 @@ public:
             vShaderFile.close();
             fShaderFile.close();
             // Convert stream into string
-            vertexCode = vShaderStream.str();
-            fragmentCode = fShaderStream.str();
+            vertexCode = AddDefines(vShaderStream.str(), defines);
+            fragmentCode = AddDefines(fShaderStream.str(), defines);
         }
         catch (ifstream::failure e)
         {
@@ -99,7 +103,7 @@ public:
                 geometryFile.close();
 
                 // Convert stream into string
-                geometryCode = geometryStream.str();
+                geometryCode = AddDefines(geometryStream.str(), defines);
             }
             catch (ifstream::failure e)
             {
@@ -139,7 +143,7 @@ public:
     //////////////////////////////////////////
 
     // We activate the Shader Program as part of the current rendering process
-    void Use() { glUseProgram(this->Program); }
+    void Use() { GLState().UseProgram(this->Program); }
 
     // We delete the Shader Program when application closes
     void Delete() { glDeleteProgram(this->Program); }
@@ -147,6 +151,18 @@ public:
 private:
     //////////////////////////////////////////
 
+    // the defines go after the #version line, which must be the first directive of the source
+    static string AddDefines(const string& code, const GLchar* defines)
+    {
+        if (defines == NULL)
+            return code;
+        size_t version = code.find("#version");
+        size_t lineEnd = version == string::npos ? string::npos : code.find('\n', version);
+        if (lineEnd == string::npos)
+            return string(defines) + code;
+        return code.substr(0, lineEnd + 1) + defines + code.substr(lineEnd + 1);
+    }
+
     // Check compilation and linking errors
     void checkCompileErrors(GLuint shader, string type)
 	{
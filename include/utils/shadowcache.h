@@ -0,0 +1,133 @@
+/*
+ShadowCache class
+- a shadow cubemap depends only on the light position and on its casters, so it can be reused until one of them changes.
+  For each cubemap we remember what it was rendered with: its allocation (the id of its slot, see shadowpool.h), the light position, and for each caster
+  the version of its transform (see Scene::versions) and the faces of the cubemap it overlapped (see shadowcube.h)
+- DirtyFaces() compares this with the current state, and it returns the mask of the faces to render again:
+  1) all the faces, if the cubemap has never been rendered, if it got a new slot or if the light moved
+  2) otherwise, for each caster which moved (or which has been added or removed), the faces it overlapped before and the ones it overlaps now:
+     in the other faces nothing changed, so they keep their content
+- Store() is called after rendering, with the same casters
+
+N.B. 1) a caster which moved inside a face does not affect the other faces, so with a moving object and a still light
+usually only 1 or 2 faces are rendered instead of 6
+
+N.B. 2) the light is compared exactly: a light which moves continuously (e.g. spinning) invalidates the cubemaps in every frame
+*/
+
+#pragma once
+
+using namespace std;
+
+// Std. Includes
+#include <vector>
+#include <algorithm>
+
+#include <glm/glm.hpp>
+
+#include <utils/shadowcube.h>
+
+// faces rendered and faces reused in the last frame
+struct ShadowCacheStats {
+    GLuint renderedFaces = 0;
+    GLuint cachedFaces = 0;
+};
+
+/////////////////// SHADOWCACHE class ///////////////////////
+class ShadowCache
+{
+public:
+    static const GLuint ALL_FACES = 0x3F;
+
+    ShadowCacheStats stats;
+
+    //////////////////////////////////////////
+
+    // we forget the content of count cubemaps: all their faces will be rendered again
+    void Init(GLuint count)
+    {
+        this->entries.assign(count, Entry());
+    }
+
+    void Invalidate()
+    {
+        for (GLuint i = 0; i < this->entries.size(); i++)
+            this->entries[i].valid = false;
+    }
+
+    void ResetStats()
+    {
+        this->stats = ShadowCacheStats();
+    }
+
+    // faces of cubemap map (bit f for face f) which must be rendered again
+    GLuint DirtyFaces(GLuint map, GLuint allocation, const glm::vec3& light, const vector<GLint>& casters,
+                      const Scene& scene, const ShadowCubeCuller& culler)
+    {
+        const Entry& entry = this->entries[map];
+        GLuint dirty = 0;
+        if (!entry.valid || entry.allocation != allocation || entry.light != light)
+            dirty = ALL_FACES;
+        else
+        {
+            // the casters are compared in order: a different object in the same position is a removed and an added caster
+            GLuint n = max(entry.casters.size(), casters.size());
+            for (GLuint i = 0; i < n; i++)
+            {
+                bool before = i < entry.casters.size();
+                bool now = i < casters.size();
+                if (before && now && entry.casters[i].object == casters[i] && entry.casters[i].version == scene.versions[casters[i]])
+                    continue;
+                if (before)
+                    dirty |= entry.casters[i].faces;
+                if (now)
+                    dirty |= culler.FaceMask(casters[i]);
+            }
+        }
+        GLuint rendered = BitCount(dirty);
+        this->stats.renderedFaces += rendered;
+        this->stats.cachedFaces += 6 - rendered;
+        return dirty;
+    }
+
+    // cubemap map has been rendered with the current light and casters
+    void Store(GLuint map, GLuint allocation, const glm::vec3& light, const vector<GLint>& casters,
+               const Scene& scene, const ShadowCubeCuller& culler)
+    {
+        Entry& entry = this->entries[map];
+        entry.valid = true;
+        entry.allocation = allocation;
+        entry.light = light;
+        entry.casters.resize(casters.size());
+        for (GLuint i = 0; i < casters.size(); i++)
+        {
+            entry.casters[i].object = casters[i];
+            entry.casters[i].version = scene.versions[casters[i]];
+            entry.casters[i].faces = culler.FaceMask(casters[i]);
+        }
+    }
+
+private:
+    struct Caster {
+        GLint object;
+        GLuint version;
+        GLuint faces;
+    };
+
+    struct Entry {
+        bool valid = false;
+        GLuint allocation = 0;
+        glm::vec3 light;
+        vector<Caster> casters;
+    };
+
+    vector<Entry> entries;
+
+    static GLuint BitCount(GLuint mask)
+    {
+        GLuint count = 0;
+        for (; mask; mask &= mask - 1)
+            count++;
+        return count;
+    }
+};
@@ -0,0 +1,63 @@
+/*
+ShadowCubeCuller class
+- the six faces of an omnidirectional shadow map are six 90 degrees frusta from the light, one for each face of the cubemap
+- we cull the bounding spheres of the objects against each of them (with the SIMD culler, see culling.h), and we keep a
+  6 bit mask for each object: bit f is set if the object overlaps face f, so a shadow caster is rendered only in those faces
+  instead of being emitted in all six by a geometry shader
+- the statistics count the face draws we submit, and the ones the geometry shader would have emitted (6 for each caster)
+
+N.B. 1) the faces are culled with the same matrices used for rendering (shadowProj * lookAt), so the near and far planes
+of the shadow projection are culled too
+
+N.B. 2) the test is conservative, like the one of the view culling: a caster near the edge between two faces is drawn in both
+*/
+
+#pragma once
+
+using namespace std;
+
+// Std. Includes
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include <utils/culling.h>
+
+// face draws submitted in the last shadow pass, and the ones of the geometry shader (6 per caster)
+struct ShadowFaceStats {
+    GLuint faceDraws = 0;
+    GLuint allFaceDraws = 0;
+};
+
+/////////////////// SHADOWCUBECULLER class ///////////////////////
+class ShadowCubeCuller
+{
+public:
+    // visibility of each object in each face
+    FrustumCuller faces[6];
+    ShadowFaceStats stats;
+
+    //////////////////////////////////////////
+
+    // transforms are the 6 projection * view matrices of the faces, in the order of the cubemap layers (+X, -X, +Y, -Y, +Z, -Z)
+    void Cull(const Scene& scene, const glm::mat4 transforms[6])
+    {
+        for (int f = 0; f < 6; f++)
+            this->faces[f].Cull(scene, Frustum::FromMatrix(transforms[f]));
+    }
+
+    // faces overlapped by the object (bit f for face f)
+    GLuint FaceMask(GLint object) const
+    {
+        GLuint mask = 0;
+        for (int f = 0; f < 6; f++)
+            if (this->faces[f].IsVisible(object))
+                mask |= 1u << f;
+        return mask;
+    }
+
+    void ResetStats()
+    {
+        this->stats = ShadowFaceStats();
+    }
+};
@@ -0,0 +1,252 @@
+/*
+ShadowPool class
+- the shadow cubemaps are slots of a few GL_TEXTURE_CUBE_MAP_ARRAY textures, one for each resolution tier (256, 512, 1024 and 2048 pixels),
+  each with a fixed number of slots: the memory of the shadows is bounded by the capacity of the tiers, and not by the number of lights
+- in every frame each shadow (a light with its casters) asks for a slot with its importance: the size in pixels of its casters on the screen.
+  The desired tier is the smallest one not smaller than the importance (scaled by qualityScale), so a shadow is rendered with about
+  one texel for each pixel it covers, and the far shadows cost less memory and fill rate
+- a shadow keeps its slot while its importance stays in the range of the tier, extended on both sides (hysteresis),
+  so a shadow at the border between two tiers does not jump between them (a new slot must be rendered again from scratch)
+- if the desired tier is full, the shadow gets a slot of a lower tier (then of a higher one): it fails only if the whole pool is full
+- the slots not requested in a frame are released by EndFrame()
+- each assignment of a slot gets a new id: the content of a slot is valid only for the shadow with the same id (see shadowcache.h)
+
+N.B. 1) face f of slot s is the layer 6 * s + f of the array texture: the shaders which render a slot write gl_Layer = layerBase + face,
+with layerBase = 6 * s, while the shaders which sample it use s as the array index of the samplerCubeArray
+
+N.B. 2) the texture of a tier is allocated the first time one of its slots is used, and it is kept until the pool is deleted
+(the frame graph caches the framebuffers which use it, see FrameGraph::ImportTexture)
+
+N.B. 3) cube map arrays are core since OpenGL 4.0
+*/
+
+#pragma once
+
+using namespace std;
+
+// Std. Includes
+#include <vector>
+#include <algorithm>
+#include <iostream>
+
+#include <utils/glstate.h>
+
+// the slot given to a shadow (tier -1 if the pool is full)
+struct ShadowSlot {
+    GLint tier = -1;
+    GLint slot = -1;
+    GLuint size = 0;
+    GLuint texture = 0;
+    // unique for each assignment of the slot
+    GLuint id = 0;
+
+    GLint LayerBase() const { return 6 * this->slot; }
+};
+
+// shadows in each tier in the last frame, and memory of the allocated tiers
+struct ShadowPoolStats {
+    GLuint shadows = 0;
+    GLuint tierShadows[4] = {0, 0, 0, 0};
+    GLuint reassigned = 0;
+    GLsizeiptr bytes = 0;
+};
+
+/////////////////// SHADOWPOOL class ///////////////////////
+class ShadowPool
+{
+public:
+    static const GLuint NUM_TIERS = 4;
+    static const GLuint MIN_SIZE = 256;
+
+    // importance multiplier (e.g. 0.5 = half resolution for all the shadows)
+    GLfloat qualityScale = 1.0f;
+    ShadowPoolStats stats;
+
+    ShadowPool() = default;
+    ShadowPool(const ShadowPool& copy) = delete; //disallow copy
+    ShadowPool& operator=(const ShadowPool&) = delete;
+
+    ~ShadowPool() noexcept
+    {
+        for (GLuint t = 0; t < NUM_TIERS; t++)
+            if (this->tiers[t].texture)
+            {
+                glDeleteTextures(1, &this->tiers[t].texture);
+                GLState().OnDeleteTexture(this->tiers[t].texture);
+            }
+    }
+
+    //////////////////////////////////////////
+
+    // capacities[t] is the number of cubemaps of tier t
+    void Init(GLenum internalFormat, const GLuint capacities[NUM_TIERS])
+    {
+        this->internalFormat = internalFormat;
+        for (GLuint t = 0; t < NUM_TIERS; t++)
+            this->tiers[t].owners.assign(capacities[t], -1);
+    }
+
+    static GLuint TierSize(GLint tier) { return MIN_SIZE << tier; }
+
+    // texture of a tier (0 if it has not been allocated yet)
+    GLuint Texture(GLint tier) const { return this->tiers[tier].texture; }
+
+    void BeginFrame()
+    {
+        for (GLuint i = 0; i < this->assignments.size(); i++)
+            this->assignments[i].requested = false;
+        GLuint reassigned = this->stats.reassigned;
+        this->stats = ShadowPoolStats();
+        this->stats.reassigned = reassigned;
+        for (GLuint t = 0; t < NUM_TIERS; t++)
+            if (this->tiers[t].texture)
+                this->stats.bytes += this->TierBytes(t);
+    }
+
+    // slot of shadow key (a small integer) in this frame. importance is the size of the shadow on the screen, in pixels
+    ShadowSlot Request(GLuint key, GLfloat importance)
+    {
+        if (key >= this->assignments.size())
+            this->assignments.resize(key + 1);
+        Assignment& assignment = this->assignments[key];
+        assignment.requested = true;
+
+        GLfloat pixels = importance * this->qualityScale;
+        GLint desired = DesiredTier(pixels);
+        if (assignment.slot.tier >= 0)
+        {
+            // we keep the slot in the range of its tier, or if the desired tier has no room for it
+            bool inRange = InRange(assignment.slot.tier, pixels);
+            if (inRange || !this->HasFreeSlot(desired))
+                return this->Keep(assignment);
+            this->Free(assignment);
+            this->stats.reassigned++;
+        }
+
+        // desired tier, then the lower ones, then the higher ones
+        for (GLint t = desired; t >= 0; t--)
+            if (this->Allocate(assignment, key, t))
+                return this->Keep(assignment);
+        for (GLint t = desired + 1; t < (GLint)NUM_TIERS; t++)
+            if (this->Allocate(assignment, key, t))
+                return this->Keep(assignment);
+        cout << "ERROR::SHADOWPOOL:: no free slot for shadow " << key << endl;
+        return ShadowSlot();
+    }
+
+    // the shadows not requested in this frame lose their slots
+    void EndFrame()
+    {
+        for (GLuint i = 0; i < this->assignments.size(); i++)
+            if (!this->assignments[i].requested && this->assignments[i].slot.tier >= 0)
+                this->Free(this->assignments[i]);
+    }
+
+private:
+    // the range of a tier is extended by this factor on both sides
+    static constexpr GLfloat HYSTERESIS = 1.25f;
+
+    struct Tier {
+        GLuint texture = 0;
+        // shadow key of each slot (-1 = free)
+        vector<GLint> owners;
+    };
+
+    struct Assignment {
+        ShadowSlot slot;
+        bool requested = false;
+    };
+
+    GLenum internalFormat = GL_DEPTH_COMPONENT24;
+    Tier tiers[NUM_TIERS];
+    vector<Assignment> assignments;
+    GLuint nextId = 1;
+
+    static GLint DesiredTier(GLfloat pixels)
+    {
+        GLint tier = 0;
+        while (tier < (GLint)NUM_TIERS - 1 && TierSize(tier) < pixels)
+            tier++;
+        return tier;
+    }
+
+    // tier t is desired for (size / 2, size]: the lowest tier has no lower bound, and the highest one no upper bound
+    static bool InRange(GLint tier, GLfloat pixels)
+    {
+        bool aboveMin = tier == 0 || pixels > TierSize(tier) * 0.5f / HYSTERESIS;
+        bool belowMax = tier == (GLint)NUM_TIERS - 1 || pixels <= TierSize(tier) * HYSTERESIS;
+        return aboveMin && belowMax;
+    }
+
+    bool HasFreeSlot(GLint tier) const
+    {
+        const vector<GLint>& owners = this->tiers[tier].owners;
+        return find(owners.begin(), owners.end(), -1) != owners.end();
+    }
+
+    bool Allocate(Assignment& assignment, GLuint key, GLint tier)
+    {
+        vector<GLint>& owners = this->tiers[tier].owners;
+        vector<GLint>::iterator free = find(owners.begin(), owners.end(), -1);
+        if (free == owners.end())
+            return false;
+        if (!this->tiers[tier].texture)
+        {
+            this->tiers[tier].texture = this->NewTexture(tier);
+            this->stats.bytes += this->TierBytes(tier);
+        }
+        *free = key;
+        assignment.slot.tier = tier;
+        assignment.slot.slot = free - owners.begin();
+        assignment.slot.size = TierSize(tier);
+        assignment.slot.texture = this->tiers[tier].texture;
+        assignment.slot.id = this->nextId++;
+        return true;
+    }
+
+    void Free(Assignment& assignment)
+    {
+        this->tiers[assignment.slot.tier].owners[assignment.slot.slot] = -1;
+        assignment.slot = ShadowSlot();
+    }
+
+    ShadowSlot Keep(const Assignment& assignment)
+    {
+        this->stats.shadows++;
+        this->stats.tierShadows[assignment.slot.tier]++;
+        return assignment.slot;
+    }
+
+    // an array with 6 layers (faces) for each slot of the tier
+    GLuint NewTexture(GLint tier)
+    {
+        GLsizei size = TierSize(tier);
+        GLsizei layers = 6 * this->tiers[tier].owners.size();
+        GLuint texture;
+        if (GLState().hasDSA)
+        {
+            glCreateTextures(GL_TEXTURE_CUBE_MAP_ARRAY, 1, &texture);
+            glTextureStorage3D(texture, 1, this->internalFormat, size, size, layers);
+        }
+        else
+        {
+            glGenTextures(1, &texture);
+            GLState().BindTextureForEdit(GL_TEXTURE_CUBE_MAP_ARRAY, texture);
+            glTexImage3D(GL_TEXTURE_CUBE_MAP_ARRAY, 0, this->internalFormat, size, size, layers, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+            GLState().TextureParameteri(texture, GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_MAX_LEVEL, 0);
+        }
+        GLState().TextureParameteri(texture, GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        GLState().TextureParameteri(texture, GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        GLState().TextureParameteri(texture, GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        GLState().TextureParameteri(texture, GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        GLState().TextureParameteri(texture, GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+        return texture;
+    }
+
+    // the depth formats are padded to 4 bytes (see FrameGraph::TextureBytes)
+    GLsizeiptr TierBytes(GLint tier) const
+    {
+        GLsizeiptr size = TierSize(tier);
+        return 4 * size * size * 6 * this->tiers[tier].owners.size();
+    }
+};
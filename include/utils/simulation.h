@@ -0,0 +1,147 @@
+/*
+TripleBuffer class
+- a lock-free single producer / single consumer channel for snapshots: the writer fills the back buffer and publishes it,
+  the reader takes the most recent published buffer, and neither of them ever waits for the other
+- the three buffers are owned one by the writer (back), one by the reader (front), and one is in the middle:
+  publishing swaps back and middle, reading swaps middle and front only if the middle buffer is newer (FRESH bit)
+
+FixedTimestepThread class
+- a thread which calls a step function at a fixed rate (e.g. 60 times per second), independently from the frame rate of the GL thread
+- the time of each step is on a clock shared with the reader (Now()), so the reader can interpolate between the last two steps
+- if the thread falls behind (e.g. the step function is too slow, or the process has been suspended) we skip the missed steps
+  instead of running them all in a burst
+
+N.B. 1) the reader always sees a complete snapshot: the writer never touches a buffer after it has been published,
+until it gets it back with a later Publish()
+
+N.B. 2) the step function runs on its own thread: it must not call OpenGL, and it must not touch the state read by the GL thread
+(the GL thread only reads the published snapshots)
+*/
+
+#pragma once
+
+using namespace std;
+
+// Std. Includes
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <functional>
+
+/////////////////// TRIPLEBUFFER class ///////////////////////
+template <typename T>
+class TripleBuffer
+{
+public:
+    // all the buffers start with the same value, so the reader sees a valid snapshot before the first Publish()
+    void Init(const T& value)
+    {
+        for (int i = 0; i < 3; i++)
+            this->buffers[i] = value;
+    }
+
+    // the buffer the writer fills
+    T& Back() { return this->buffers[this->back]; }
+
+    // the back buffer becomes the most recent one, and the writer gets the old middle buffer
+    void Publish()
+    {
+        this->back = this->middle.exchange(this->back | FRESH) & INDEX;
+    }
+
+    // the most recent published buffer (the one of the last call, if nothing has been published since)
+    const T& Front()
+    {
+        if (this->middle.load() & FRESH)
+            this->front = this->middle.exchange(this->front) & INDEX;
+        return this->buffers[this->front];
+    }
+
+private:
+    static const unsigned INDEX = 3;
+    static const unsigned FRESH = 4;
+
+    T buffers[3];
+    atomic<unsigned> middle{0};
+    unsigned back = 1;
+    unsigned front = 2;
+};
+
+/////////////////// FIXEDTIMESTEPTHREAD class ///////////////////////
+class FixedTimestepThread
+{
+public:
+    // number of steps executed, and of the steps skipped because the thread was late
+    atomic<unsigned long> ticks{0};
+    atomic<unsigned long> skippedTicks{0};
+
+    FixedTimestepThread() : origin(chrono::steady_clock::now()) {}
+    FixedTimestepThread(const FixedTimestepThread& copy) = delete; //disallow copy
+    FixedTimestepThread& operator=(const FixedTimestepThread&) = delete;
+
+    ~FixedTimestepThread() noexcept
+    {
+        this->Stop();
+    }
+
+    //////////////////////////////////////////
+
+    // we start the thread, which calls step(time) rate times per second. time is the time of the step on the clock of Now()
+    void Start(double rate, const function<void(double)>& step)
+    {
+        this->Stop();
+        this->stepLength = 1.0 / rate;
+        this->step = step;
+        this->running = true;
+        this->worker = thread(&FixedTimestepThread::Loop, this);
+    }
+
+    void Stop()
+    {
+        this->running = false;
+        if (this->worker.joinable())
+            this->worker.join();
+    }
+
+    // length of a step (seconds)
+    double StepLength() const { return this->stepLength; }
+
+    // seconds since the creation of the object (the clock of the steps)
+    double Now() const
+    {
+        return chrono::duration<double>(chrono::steady_clock::now() - this->origin).count();
+    }
+
+private:
+    // after this delay (seconds) the late steps are skipped
+    static constexpr double MAX_DELAY = 0.25;
+
+    chrono::steady_clock::time_point origin;
+    double stepLength = 1.0 / 60.0;
+    function<void(double)> step;
+    atomic<bool> running{false};
+    thread worker;
+
+    void Loop()
+    {
+        double next = this->Now();
+        while (this->running)
+        {
+            double now = this->Now();
+            if (now < next)
+            {
+                this_thread::sleep_for(chrono::duration<double>(next - now));
+                continue;
+            }
+            if (now - next > MAX_DELAY)
+            {
+                unsigned long skipped = (unsigned long)((now - next) / this->stepLength);
+                this->skippedTicks += skipped;
+                next += skipped * this->stepLength;
+            }
+            this->step(next);
+            this->ticks++;
+            next += this->stepLength;
+        }
+    }
+};
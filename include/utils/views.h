@@ -0,0 +1,140 @@
+/*
+PreparedView class
+- everything the GL thread needs to render a view (the inside view, or the view through a portal), computed by a job
+  on a worker thread (see jobsystem.h) while the GL thread renders the shadow maps:
+  1) culling: visibility of each object of the scene, with the SIMD culler or with the scene BVH (see culling.h and bvh.h)
+  2) LOD selection: the visible objects whose bounding sphere covers less than minPixels pixels on the screen are not drawn
+  3) sort keys: each visible object of an instanced group gets a 64 bit key, with the group in the high 32 bits and its depth in the view in the low ones
+  4) matrix gathering: the per-instance data of the visible objects of each group, in the order of the keys
+     (front to back, so the early depth test discards more fragments of the objects behind)
+- the GL thread only reads the results: the visibility flags (IsVisible) and the gathered instances of each group, which are submitted with a draw list
+
+N.B. 1) our models have a single level of detail, so the LOD selection can only choose between drawing an object or not (small feature culling)
+
+N.B. 2) the depth is a positive float, and the bits of positive floats have the same order of their values,
+so we use them directly as the low part of the key
+
+N.B. 3) a job reads the scene and writes only its own view: the scene must not change between the start of the jobs and JobSystem::Wait()
+*/
+
+#pragma once
+
+using namespace std;
+
+// Std. Includes
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+#include <utils/bvh.h>
+
+// parameters of a view, copied in the job when it is started
+struct ViewParams {
+    Frustum frustum;
+    glm::vec3 eye = glm::vec3(0.0f);
+    glm::vec3 forward = glm::vec3(0.0f, 0.0f, -1.0f);
+    // pixels covered by a unit length at unit distance from the eye (projection[1][1] * viewport height / 2)
+    GLfloat pixelScale = 1.0f;
+    // visible objects smaller than this (diameter of the bounding sphere, in pixels) are not drawn. 0 disables the LOD selection
+    GLfloat minPixels = 0.0f;
+    // if false, all the objects are visible
+    bool cull = true;
+    // if not NULL, the culling is done with the scene BVH
+    const SceneBVH* bvh = NULL;
+};
+
+/////////////////// PREPAREDVIEW class ///////////////////////
+class PreparedView
+{
+public:
+    // visibility of each object, and the statistics of the culling
+    FrustumCuller culler;
+    CullStats stats;
+    // visible objects which are not drawn because too small on the screen
+    GLuint lodCulled = 0;
+    // visible instances of each group, in the order of their sort keys
+    vector<vector<InstanceData>> groups;
+    // time spent by the job in Prepare() (milliseconds)
+    double prepareTime = 0.0;
+
+    //////////////////////////////////////////
+
+    // instanceGroups[g] are the objects of the scene drawn with the instanced draw of group g
+    void Prepare(const Scene& scene, const vector<vector<GLuint>>& instanceGroups, const ViewParams& params)
+    {
+        chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+
+        // 1) culling
+        this->stats = CullStats();
+        if (!params.cull)
+            this->culler.AcceptAll(scene);
+        else if (params.bvh)
+            this->stats = params.bvh->Cull(scene, params.frustum, this->culler);
+        else
+            this->stats = this->culler.Cull(scene, params.frustum);
+
+        // 2) LOD selection with the projected size of the bounding spheres (the objects which contain the eye are always drawn)
+        this->lodCulled = 0;
+        if (params.minPixels > 0.0f)
+        {
+            for (GLuint i = 0; i < scene.Size(); i++)
+            {
+                if (!this->culler.visibility[i])
+                    continue;
+                GLfloat distance = glm::length(glm::vec3(scene.sphereX[i], scene.sphereY[i], scene.sphereZ[i]) - params.eye);
+                if (distance > scene.sphereRadius[i] && 2.0f * scene.sphereRadius[i] * params.pixelScale < params.minPixels * distance)
+                {
+                    this->culler.visibility[i] = 0;
+                    this->lodCulled++;
+                }
+            }
+            if (params.cull)
+                this->stats.visible -= this->lodCulled;
+        }
+
+        // 3) sort keys of the visible instances
+        this->keys.clear();
+        for (GLuint g = 0; g < instanceGroups.size(); g++)
+        {
+            for (GLuint object : instanceGroups[g])
+            {
+                if (!this->culler.visibility[object])
+                    continue;
+                glm::vec3 center(scene.sphereX[object], scene.sphereY[object], scene.sphereZ[object]);
+                GLfloat depth = glm::max(glm::dot(center - params.eye, params.forward), 0.0f);
+                uint32_t depthBits;
+                memcpy(&depthBits, &depth, sizeof(depthBits));
+                this->keys.push_back(SortKey((uint64_t(g) << 32) | depthBits, object));
+            }
+        }
+        sort(this->keys.begin(), this->keys.end());
+
+        // 4) matrix gathering, in the order of the keys
+        this->groups.resize(instanceGroups.size());
+        for (GLuint g = 0; g < this->groups.size(); g++)
+            this->groups[g].clear();
+        for (GLuint i = 0; i < this->keys.size(); i++)
+            this->groups[this->keys[i].key >> 32].push_back(scene.GetInstanceData(this->keys[i].object));
+
+        this->prepareTime = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count();
+    }
+
+    bool IsVisible(GLint object) const
+    {
+        return this->culler.IsVisible(object);
+    }
+
+private:
+    struct SortKey {
+        uint64_t key;
+        GLuint object;
+        SortKey(uint64_t key, GLuint object) : key(key), object(object) {}
+        bool operator<(const SortKey& other) const { return this->key < other.key; }
+    };
+
+    vector<SortKey> keys;
+};
@@ -2,11 +2,14 @@
 
 layout (location = 0) in vec3 position;
 layout (location = 2) in vec2 UV;
+// per-instance model matrix, used only if instanced is true
+layout (location = 5) in mat4 instanceModelMatrix;
 
 uniform mat4 modelMatrix;
 uniform mat4 viewMatrix;
 uniform mat4 projectionMatrix;
 uniform mat4 OrthoProj;
+uniform bool instanced;
 
 out vec2 interp_UV;
 out vec4 sPos;
@@ -15,7 +18,7 @@ out vec4 sPos;
 
 void main() {
     // we need the coordinates of the vertex in screen space, so we can compare it with values in the texture 
-    sPos = projectionMatrix * viewMatrix * modelMatrix * vec4(position, 1.0);
+    sPos = projectionMatrix * viewMatrix * (instanced ? instanceModelMatrix : modelMatrix) * vec4(position, 1.0);
 
     // interpolated UV coordinates
     interp_UV = mod(UV, 1.0);
@@ -0,0 +1,59 @@
+// downsample of the bloom chain (see the post processing in RTGPProject.cpp): each level is half the size of the one above,
+// filtered with 13 bilinear taps (the pattern of Jimenez, "Next generation post processing in Call of Duty: Advanced Warfare"),
+// which cover 36 texels of the source without the aliasing of a plain 2x2 box
+#version 410 core
+
+// the level above (the HDR target for the first level), and the size of the texels of the level we write
+uniform sampler2D source;
+uniform vec2 targetTexelSize;
+// in the first level each group of taps is weighted by its brightness (Karis average):
+// a single very bright pixel does not become a flickering square in the blurred levels
+uniform bool firstLevel;
+
+out vec3 color;
+
+float KarisWeight(vec3 c)
+{
+    float luma = dot(c, vec3(0.2126, 0.7152, 0.0722));
+    return 1.0 / (1.0 + luma);
+}
+
+void main()
+{
+    vec2 uv = gl_FragCoord.xy * targetTexelSize;
+    vec2 d = 1.0 / vec2(textureSize(source, 0));
+
+    // a b c
+    //  j k
+    // d e f
+    //  l m
+    // g h i
+    vec3 a = texture(source, uv + d * vec2(-2.0, 2.0)).rgb;
+    vec3 b = texture(source, uv + d * vec2(0.0, 2.0)).rgb;
+    vec3 c = texture(source, uv + d * vec2(2.0, 2.0)).rgb;
+    vec3 dd = texture(source, uv + d * vec2(-2.0, 0.0)).rgb;
+    vec3 e = texture(source, uv).rgb;
+    vec3 f = texture(source, uv + d * vec2(2.0, 0.0)).rgb;
+    vec3 g = texture(source, uv + d * vec2(-2.0, -2.0)).rgb;
+    vec3 h = texture(source, uv + d * vec2(0.0, -2.0)).rgb;
+    vec3 i = texture(source, uv + d * vec2(2.0, -2.0)).rgb;
+    vec3 j = texture(source, uv + d * vec2(-1.0, 1.0)).rgb;
+    vec3 k = texture(source, uv + d * vec2(1.0, 1.0)).rgb;
+    vec3 l = texture(source, uv + d * vec2(-1.0, -1.0)).rgb;
+    vec3 m = texture(source, uv + d * vec2(1.0, -1.0)).rgb;
+
+    // five overlapping groups of 4 taps: the inner one weighs 0.5, the four corner ones 0.125 each
+    vec3 groups[5] = vec3[]((j + k + l + m) * 0.25, (a + b + dd + e) * 0.25, (b + c + e + f) * 0.25,
+                            (dd + e + g + h) * 0.25, (e + f + h + i) * 0.25);
+    float weights[5] = float[](0.5, 0.125, 0.125, 0.125, 0.125);
+
+    color = vec3(0.0);
+    float total = 0.0;
+    for (int n = 0; n < 5; n++)
+    {
+        float weight = firstLevel ? weights[n] * KarisWeight(groups[n]) : weights[n];
+        color += groups[n] * weight;
+        total += weight;
+    }
+    color /= total;
+}
@@ -0,0 +1,23 @@
+// upsample of the bloom chain (see the post processing in RTGPProject.cpp): the smaller level is filtered with a 3x3 tent
+// and added (with blending) to the level above, which already contains its own downsample
+#version 410 core
+
+// the smaller level, the radius of the tent in its texels, and the size of the texels of the level we write
+uniform sampler2D source;
+uniform float radius;
+uniform vec2 targetTexelSize;
+
+out vec3 color;
+
+void main()
+{
+    vec2 uv = gl_FragCoord.xy * targetTexelSize;
+    vec2 d = radius / vec2(textureSize(source, 0));
+
+    vec3 sum = texture(source, uv).rgb * 4.0;
+    sum += (texture(source, uv + vec2(-d.x, 0.0)).rgb + texture(source, uv + vec2(d.x, 0.0)).rgb +
+            texture(source, uv + vec2(0.0, -d.y)).rgb + texture(source, uv + vec2(0.0, d.y)).rgb) * 2.0;
+    sum += texture(source, uv + vec2(-d.x, -d.y)).rgb + texture(source, uv + vec2(d.x, -d.y)).rgb +
+           texture(source, uv + vec2(-d.x, d.y)).rgb + texture(source, uv + vec2(d.x, d.y)).rgb;
+    color = sum / 16.0;
+}
@@ -2,8 +2,36 @@
 
 const float PI = 3.14159265359;
 
+// this shader is compiled in three versions (see Shader): the forward shader (no define), the G-buffer fill (GBUFFER),
+// which only stores the inputs of the subroutines, and the deferred resolve (DEFERRED_RESOLVE), which reads them back
+// from the G-buffer in main() and runs the subroutines once for each pixel
+
 
 ////////////////////////////////////////////// INFORMATION FROM THE VERTEX SHADER ////////////////////////////////////////////////////////////////////
+#ifdef DEFERRED_RESOLVE
+// the same names of the inputs of the forward shader, filled by main() from the G-buffer
+vec3 vViewPosition;
+vec4 posInWorldCoords;
+vec3 lPos;
+vec3 lightDir;
+vec2 interp_UV;
+vec3 N;
+float interp_TexLayer;
+float interp_TexRep;
+float interp_Occlusion;
+vec3 colorIn;
+
+// the G-buffer: view space normal and texture layer, UV, linear depth and UV repetition, colorIn of the draw and baked occlusion
+uniform sampler2D gNormal;
+uniform sampler2D gSurface;
+uniform sampler2D gColor;
+// the uniforms of the vertex shader, to rebuild the positions
+uniform vec3 lightPos;
+uniform mat4 viewMatrix;
+uniform mat4 inverseViewMatrix;
+uniform mat4 projectionMatrix;
+uniform vec2 viewportSize;
+#else
 // Position of the Vertex and the Light in various coordinate Spaces
 in vec3 vViewPosition;
 in vec4 posInWorldCoords;
@@ -18,12 +46,22 @@ in vec2 interp_UV;
 
 // Normal of the Vertex
 in vec3 N;
+
+// layer of the enviroment texture array and repetition of the UV coordinates
+flat in float interp_TexLayer;
+flat in float interp_TexRep;
+
+// baked ambient occlusion of the vertices
+in float interp_Occlusion;
+#endif
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 
 /////////////////////////////////////////////////// DEKLARATION OF UNIFORMS //////////////////////////////////////////////////////////////////////////
 // If the Model to be rendered is supposed to be in one Color then this color gets send to colorIN
+#ifndef DEFERRED_RESOLVE
 uniform vec3 colorIn;
+#endif
 
 // Information for the light Models (Lambertian, Phong, BlinnPhong and GGX)
 uniform vec3 ambientColor;
@@ -33,26 +71,60 @@ uniform vec3 specularColor;
 uniform float Ka;
 uniform float Kd;
 uniform float Ks;
+// radiance of the emissive surfaces (Bloom subroutine)
+uniform float emission;
+// how much the baked ambient occlusion darkens the ambient light (0 = not at all)
+uniform float occlusionStrength;
 
 uniform float shininess;
 
 uniform float alpha;
 uniform float F0; 
 
+// the specular terms can be read from the precomputed tables (see brdflut.h): 0 = analytic, 1 = tables,
+// 2 = difference between the two (magnified by BRDF_DIFFERENCE_SCALE)
+uniform int brdfMode;
+// lobe table: x = sqrt(1 - cosine), y = roughness (R, GGX distribution) or shininess (G, Phong lobe)
+uniform sampler2D brdfLobe;
+// geometry table: x = cosine, y = roughness. R = Smith G1 / cosine, G = Schlick Fresnel weight
+uniform sampler2D brdfGeometry;
+const int BRDF_ANALYTIC = 0;
+const int BRDF_DIFFERENCE = 2;
+const float BRDF_DIFFERENCE_SCALE = 10.0;
+// the sizes of the tables and the range of the shininess (BRDFLookupTables)
+const vec2 BRDF_TABLE_SIZE = vec2(256.0, 64.0);
+const float BRDF_MIN_SHININESS = 1.0;
+const float BRDF_MAX_SHININESS = 128.0;
+
 // repetition of the UV coordinates for the paint texture
 uniform float uvRep;
 
-// repetition of the UV coordinates for the enviroment Models
-uniform float texRep;
-
 // how far is the far plane in the shadowMap Cubetexture
 uniform float far_plane;
 
 // uniforms for different Textures
-// shadowMap Cubetexture
-uniform samplerCube shadowMap;
-// the texture for the enviroment Models
-uniform sampler2D textureID;
+// shadowMap Cubetexture: a cube map array of the shadow pool, and the slot of our cubemap in it
+uniform samplerCubeArray shadowMap;
+uniform float shadowLayer;
+// the same cubemaps with a comparison sampler: each tap returns how much of the 2x2 texels around it is lit (hardware PCF)
+uniform samplerCubeArrayShadow shadowMapCompare;
+// the static casters can be in a separate cubemap, shared by all the models: the nearest occluder is the min() of the two maps
+uniform bool staticShadows;
+uniform samplerCubeArray staticShadowMap;
+uniform samplerCubeArrayShadow staticShadowMapCompare;
+uniform float staticShadowLayer;
+// filterable version of the cubemaps (blurred and mipmapped moments of the distance, see momentshadows.h)
+uniform samplerCubeArray momentMap;
+uniform float momentLayer;
+// the lowest part of the Chebyshev bound is cut, to reduce the light bleeding
+uniform float lightBleeding;
+// filtering of the shadows: 0 = hard (one manual tap), 1 = one hardware PCF tap, 2 = 4 taps on a rotated grid,
+// 3 = 16 taps on a Poisson disk, with a blocker search for the size of the penumbra, 4 = variance shadow map (one filtered tap)
+uniform int shadowFilter;
+// radius of the light (world units), which gives the size of the penumbra in the Poisson tier
+uniform float lightSize;
+// the textures for the enviroment Models (one layer for each texture)
+uniform sampler2DArray environmentTextures;
 // the paint texture. This is where you draw in
 uniform sampler2D bakeTexture;
 
@@ -60,9 +132,41 @@ uniform float frequency;
 uniform float power;
 uniform float timer;
 uniform float harmonics;
+
+// the Voronoi patterns baked in a tileable and looping 3D texture (see noisetextures.h), read instead of the procedural functions
+uniform bool bakedNoise;
+uniform sampler3D noiseTexture;
+// cells of a tile and period of the animation (NoiseTextures)
+const float NOISE_CELLS = 16.0;
+const float NOISE_PERIOD = 2.0 * PI * 4.0;
+
+// clustered point lights (see clusters.h), added to the main light by LambertianFunc, PhongFunc, BlinnPhongFunc and GGXFunc
+uniform bool clusteredLighting;
+// two texels for each light: view space position and radius, color
+uniform samplerBuffer clusterLights;
+// offset and count of the list of each cluster in clusterIndices, and the lists of light indices
+uniform usamplerBuffer clusterTable;
+uniform usamplerBuffer clusterIndices;
+uniform ivec3 clusterGrid;
+// clusters per pixel on the screen, and slice of a depth: log(depth) * clusterSliceScale + clusterSliceBias
+uniform vec2 clusterTileScale;
+uniform float clusterSliceScale;
+uniform float clusterSliceBias;
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+#ifdef GBUFFER
+layout(location = 0) out vec4 gNormalOut;
+layout(location = 1) out vec4 gSurfaceOut;
+layout(location = 2) out vec4 gColorOut;
+// the Lambertian subroutine shows only the painted part of the model: the other fragments are discarded already in the G-buffer
+uniform bool discardUnpainted;
+#else
+// the alpha holds the linear depth of the surface, for the motion vectors of the temporal upsampling
 out vec4 colorFrag;
+#endif
+
+// light of the clustered point lights: they have no shadows, so main() adds it after the shadow of the main light
+vec3 clusterColor = vec3(0.0);
 
 //////////////////////////////////////////////////////// DEKLARATION OF FUNCTIONS ////////////////////////////////////////////////////////////////////
 // get the Color of the texture Mesh
@@ -74,7 +178,18 @@ float calculateBrightness(float distance, float attenuation);
 // lookup in the shadowcubemap if the vertex is in shadow or not
 float Shadow(); 
 
-// calculate the brightness with the different light Models
+// the baked ambient occlusion of the fragment, scaled by occlusionStrength: it darkens only the ambient light
+float AmbientOcclusion();
+
+// fraction of the main light which reaches the fragment: the part not in shadow, plus the ambient part (0.1), darkened by the occlusion
+float ShadowedLight(float shadow);
+
+// lights of the cluster of the fragment (first index in clusterIndices and count), and radiance and direction of one of them
+int ClusterLights(out int count);
+
+vec3 ClusterLight(int index, out vec3 L);
+
+// calculate the brightness with the different light Models: the main light plus the clustered lights (in clusterColor)
 vec3 LambertianFunc(vec3 diffColor);
 
 vec3 PhongFunc(vec3 diffColor);
@@ -83,6 +198,11 @@ vec3 BlinnPhongFunc(vec3 diffColor);
 
 float G1(float angle, float alpha);
 
+// specular terms, analytic or read from the tables
+float SpecularLobe(float cosine, bool table);
+
+float GGXSpecular(float NdotL, float NdotV, float NdotH, float VdotH, bool table);
+
 vec3 GGXFunc(vec3 diffColor);
 
 // functions for random/regular patterns
@@ -92,6 +212,9 @@ float voronoiNoise(vec3 position);
 
 vec3 voronoiDiagram(vec3 position);
 
+// the same patterns read from the baked texture (RGB = voronoiDiagram, A = voronoiNoise)
+vec4 bakedVoronoi(vec2 position);
+
 vec3 setColors(vec2 cell);
 
 vec3 palette( float t ); 
@@ -132,7 +255,7 @@ subroutine(fragShaders) vec4 PhongPlusShadw()
         color = paint;
     }
     color = PhongFunc(color);
-    return vec4((1.1 - shadow) * color, 1.0f);
+    return vec4(ShadowedLight(shadow) * color, 1.0f);
 }
 
 subroutine(fragShaders) vec4 BlinnPhongPlusShadow()
@@ -145,7 +268,7 @@ subroutine(fragShaders) vec4 BlinnPhongPlusShadow()
         color = paint;
     }
     color = BlinnPhongFunc(color);
-    return vec4((1.1 - shadow) * color, 1.0f);
+    return vec4(ShadowedLight(shadow) * color, 1.0f);
 }
 
 subroutine(fragShaders) vec4 GGXPlusShadow()
@@ -158,7 +281,7 @@ subroutine(fragShaders) vec4 GGXPlusShadow()
         color = paint;
     }
     color = GGXFunc(color);
-    return vec4((1.1 - shadow) * color, 1.0f);
+    return vec4(ShadowedLight(shadow) * color, 1.0f);
 }
 
 subroutine(fragShaders)  vec4 AnimatedCellsPlusGGX()
@@ -169,7 +292,7 @@ subroutine(fragShaders)  vec4 AnimatedCellsPlusGGX()
     float value = 0.0;
     for (int i=0;i<harmonics;i++)
     {
-        value += p*voronoiNoise(vec3(interp_UV*f, timer));
+        value += p*(bakedNoise ? bakedVoronoi(interp_UV*f).a : voronoiNoise(vec3(interp_UV*f, timer)));
         p*=0.5;
         f*=2.0;
     }
@@ -185,7 +308,7 @@ subroutine(fragShaders)  vec4 AnimatedCellsPlusGGX()
     color = GGXFunc(color);
     float shadow = Shadow();
 
-    return vec4((1.1 - shadow) * color,1.0);
+    return vec4(ShadowedLight(shadow) * color,1.0);
 }
 
 subroutine(fragShaders) vec4 AnimatedColorsPlusGGX()
@@ -194,7 +317,7 @@ subroutine(fragShaders) vec4 AnimatedColorsPlusGGX()
     //float g = power*voronoiNoise(vec3(interp_UV*frequency, -0.7*timer));
     //float b = power*voronoiNoise(vec3(interp_UV*frequency, 0.8*timer));
 
-    vec3 color = voronoiDiagram(vec3(interp_UV*frequency, timer));
+    vec3 color = bakedNoise ? bakedVoronoi(interp_UV*frequency).rgb : voronoiDiagram(vec3(interp_UV*frequency, timer));
     vec3 paint = getMeshColor();
 
     if (paint.r + paint.g + paint.b > 0.0)
@@ -205,7 +328,7 @@ subroutine(fragShaders) vec4 AnimatedColorsPlusGGX()
     color = GGXFunc(color);
     float shadow = Shadow();
 
-    return vec4((1.1 - shadow) * color,1.0);
+    return vec4(ShadowedLight(shadow) * color,1.0);
     /*vec2 uv = interp_UV;
     vec2 uv0 = uv;
     vec3 finalColor = vec3(0.0);
@@ -255,7 +378,7 @@ subroutine(fragShaders) vec4 StripesSmoothstepPlusGGX()
     color = GGXFunc(color);
     float shadow = Shadow();
 
-    return vec4((1.1 - shadow) * color,1.0);
+    return vec4(ShadowedLight(shadow) * color,1.0);
 }
 
 subroutine(fragShaders) vec4 CirclesSmoothstepPlusGGX() 
@@ -274,40 +397,83 @@ subroutine(fragShaders) vec4 CirclesSmoothstepPlusGGX()
     color = GGXFunc(color);
     float shadow = Shadow();
 
-    return vec4((1.1 - shadow) * color,1.0);
+    return vec4(ShadowedLight(shadow) * color,1.0);
 }
 
 subroutine(fragShaders) vec4 FULLCOLOR()
 {
     float shadow = Shadow();
     vec3 color = calculateBrightness(length(posInWorldCoords.xyz - lPos), 0.3f) * colorIn;
-    return vec4((1.1 - shadow) * color, 1.0);
+    return vec4(ShadowedLight(shadow) * color, 1.0);
 }
 
 subroutine(fragShaders) vec4 Bloom()
 {
-    vec3 color = vec3(1.0,1.0,1.0);
-    float dist = length(lPos - (posInWorldCoords.xyz / posInWorldCoords.w));
-
-    color = (10000.0 / pow(1 + dist, 80.0)) * color;
-
-    return vec4(color, 1.0);
+    // the light source is emissive, brighter than the range of the screen: the post processing makes it bleed on its neighbours
+    return vec4(emission * vec3(1.0), 1.0);
 }
 
 subroutine(fragShaders) vec4 Texture()
 {
     float shadow = Shadow();
-    vec3 color = texture(textureID, mod(texRep * interp_UV,1.0)).rgb;
+    vec3 color = texture(environmentTextures, vec3(mod(interp_TexRep * interp_UV,1.0), interp_TexLayer)).rgb;
     color = calculateBrightness(length(posInWorldCoords.xyz - lPos), 0.3f) * color;
-    return vec4((1.1 - shadow) * color, 1.0);
+    return vec4(ShadowedLight(shadow) * color, 1.0);
 }
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 //////////////////////////////////////////////////////////////////// MAIN ////////////////////////////////////////////////////////////////////////////
+#if defined(GBUFFER)
+void main()
+{
+    if (discardUnpainted)
+    {
+        vec3 paint = getMeshColor();
+        if (paint.r + paint.g + paint.b == 0.0)
+            discard;
+    }
+    gNormalOut = vec4(normalize(N), interp_TexLayer);
+    // the depth along the view direction (vViewPosition points from the fragment to the camera)
+    gSurfaceOut = vec4(interp_UV, vViewPosition.z, interp_TexRep);
+    gColorOut = vec4(colorIn, interp_Occlusion);
+}
+#elif defined(DEFERRED_RESOLVE)
+void main()
+{
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    vec4 normal = texelFetch(gNormal, pixel, 0);
+    vec4 surface = texelFetch(gSurface, pixel, 0);
+
+    // the view space position is on the ray through the pixel, at the stored depth.
+    // The third column of the projection holds the sub-pixel jitter of the temporal upsampling: ndc = (P00 x + P20 z) / -z
+    vec2 ndc = gl_FragCoord.xy / viewportSize * 2.0 - 1.0;
+    vec2 ray = (ndc + projectionMatrix[2].xy) / vec2(projectionMatrix[0][0], projectionMatrix[1][1]);
+    vec3 position = vec3(ray, -1.0) * surface.z;
+
+    vViewPosition = -position;
+    posInWorldCoords = inverseViewMatrix * vec4(position, 1.0);
+    lPos = lightPos;
+    lightDir = (viewMatrix * vec4(lightPos, 1.0)).xyz - position;
+    interp_UV = surface.xy;
+    N = normal.xyz;
+    interp_TexLayer = normal.w;
+    interp_TexRep = surface.w;
+    vec4 color = texelFetch(gColor, pixel, 0);
+    colorIn = color.rgb;
+    interp_Occlusion = color.a;
+
+    colorFrag = FragmentShader();
+    colorFrag.rgb += clusterColor;
+    colorFrag.a = surface.z;
+}
+#else
 void main()
 {
     colorFrag = FragmentShader();
+    colorFrag.rgb += clusterColor;
+    colorFrag.a = vViewPosition.z;
 }
+#endif
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 
@@ -323,6 +489,17 @@ vec3 getMeshColor()
 }
 
 
+float AmbientOcclusion()
+{
+    return mix(1.0, interp_Occlusion, occlusionStrength);
+}
+
+float ShadowedLight(float shadow)
+{
+    return 1.0 - shadow + 0.1 * AmbientOcclusion();
+}
+
+
 float calculateBrightness(float distance, float attenuation)
 {
     const float constant = 1.0f;
@@ -335,102 +512,297 @@ float calculateBrightness(float distance, float attenuation)
     return decayedBrightness;
 }
 
+// Poisson disk in the unit circle, for the blocker search and the filtering of the soft shadows
+const vec2 poissonDisk[16] = vec2[](
+    vec2(-0.94201624, -0.39906216), vec2(0.94558609, -0.76890725), vec2(-0.09418410, -0.92938870), vec2(0.34495938, 0.29387760),
+    vec2(-0.91588581, 0.45771432), vec2(-0.81544232, -0.87912464), vec2(-0.38277543, 0.27676845), vec2(0.97484398, 0.75648379),
+    vec2(0.44323325, -0.97511554), vec2(0.53742981, -0.47373420), vec2(-0.26496911, -0.41893023), vec2(0.79197514, 0.19090188),
+    vec2(-0.24188840, 0.99706507), vec2(-0.81409955, 0.91437590), vec2(0.19984126, 0.78641367), vec2(0.14383161, -0.14100790)
+);
+
+// 4 taps on a grid rotated by about 27 degrees, in texels: each one falls on a different row and column of texels
+const vec2 rotatedGrid[4] = vec2[](vec2(-0.5, -1.5), vec2(1.5, -0.5), vec2(0.5, 1.5), vec2(-1.5, 0.5));
+
+// distance of the nearest occluder in the direction, in both the maps
+float ClosestDepth(vec3 direction)
+{
+    float depth = texture(shadowMap, vec4(direction, shadowLayer)).r;
+    if (staticShadows)
+        depth = min(depth, texture(staticShadowMap, vec4(direction, staticShadowLayer)).r);
+    return depth * far_plane;
+}
+
+// fraction of light which reaches the fragment from the direction of the tap (fragToLight + offset), with the hardware comparison.
+// A tap is lit only if it is lit in both the maps
+float LitTap(vec3 direction, float reference)
+{
+    float lit = texture(shadowMapCompare, vec4(direction, shadowLayer), reference);
+    if (staticShadows)
+        lit = min(lit, texture(staticShadowMapCompare, vec4(direction, staticShadowLayer), reference));
+    return lit;
+}
+
 float Shadow()
 {
     // get vector between fragment position and light position
     vec3 fragToLight = posInWorldCoords.xyz - lPos;
 
-    // use the light to fragment vector to sample from the depth map    
-    float closestDepth = texture(shadowMap, fragToLight).r;
-
-    // it is currently in linear range between [0,1]. Re-transform back to original value
-    closestDepth *= far_plane;
-
     // now get current linear depth as the length between the fragment and light position
     float currentDepth = length(fragToLight);
+    float bias = 0.05;
 
-    // now test for shadows
-    float bias = 0.05; 
-    float shadow = currentDepth -  bias > closestDepth ? 1.0 : 0.0;
+    // variance shadow map: the mean and the variance of the distance of the occluders around the direction give
+    // an upper bound of the lit fraction (Chebyshev inequality), with a single trilinear tap
+    if (shadowFilter == 4)
+    {
+        vec2 moments = texture(momentMap, vec4(fragToLight, momentLayer)).rg;
+        float depth = currentDepth / far_plane;
+        if (depth <= moments.x)
+            return 0.0;
+        float variance = max(moments.y - moments.x * moments.x, 0.00002);
+        float distance = depth - moments.x;
+        float lit = variance / (variance + distance * distance);
+        lit = clamp((lit - lightBleeding) / (1.0 - lightBleeding), 0.0, 1.0);
+        return 1.0 - lit;
+    }
 
-    return shadow;
-}  
+    // hard shadows: one manual tap, compared in the shader
+    if (shadowFilter == 0)
+    {
+        // use the light to fragment vector to sample from the depth map
+        float closestDepth = ClosestDepth(fragToLight);
+        return currentDepth - bias > closestDepth ? 1.0 : 0.0;
+    }
 
-vec3 LambertianFunc(vec3 diffColor)
-{
-    vec3 normal = normalize(N);
+    // the depth map stores the distance divided by far_plane, so we compare with the same value
+    float reference = (currentDepth - bias) / far_plane;
+    if (shadowFilter == 1)
+        return 1.0 - LitTap(fragToLight, reference);
 
-    vec3 L;
-    float lambertian = 0;
+    // the taps are moved on the plane perpendicular to fragToLight. A face of the cubemap covers 90 degrees,
+    // so at the distance of the fragment a texel is 2 * currentDepth / size world units wide
+    vec3 direction = fragToLight / currentDepth;
+    vec3 tangent = normalize(cross(direction, abs(direction.y) < 0.99 ? vec3(0.0, 1.0, 0.0) : vec3(1.0, 0.0, 0.0)));
+    vec3 bitangent = cross(direction, tangent);
+    float texel = 2.0 * currentDepth / float(textureSize(shadowMap, 0).x);
 
-    L = normalize(lightDir);
+    if (shadowFilter == 2)
+    {
+        float lit = 0.0;
+        for (int i = 0; i < 4; i++)
+            lit += LitTap(fragToLight + (tangent * rotatedGrid[i].x + bitangent * rotatedGrid[i].y) * texel, reference);
+        return 1.0 - lit / 4.0;
+    }
 
-    lambertian += max(dot(L,normal), 0.0);
-    
+    // the disk is rotated with a different angle for each pixel (interleaved gradient noise), so the banding becomes noise
+    float angle = 2.0 * PI * fract(52.9829189 * fract(dot(gl_FragCoord.xy, vec2(0.06711056, 0.00583715))));
+    mat2 rotation = mat2(cos(angle), sin(angle), -sin(angle), cos(angle));
 
-    // Lambert illumination model
-    return vec3(Kd * lambertian * diffColor);
-}
+    // blocker search: average distance of the occluders in the region of the light seen by the fragment
+    float searchRadius = lightSize;
+    float blockerDepth = 0.0;
+    int blockers = 0;
+    for (int i = 0; i < 16; i++)
+    {
+        vec2 offset = rotation * poissonDisk[i] * searchRadius;
+        float depth = ClosestDepth(fragToLight + tangent * offset.x + bitangent * offset.y);
+        if (depth < currentDepth - bias)
+        {
+            blockerDepth += depth;
+            blockers++;
+        }
+    }
+    if (blockers == 0)
+        return 0.0;
+    blockerDepth /= float(blockers);
+
+    // the penumbra grows with the distance between the occluders and the fragment (similar triangles), and it is at least one texel
+    float penumbra = max(lightSize * (currentDepth - blockerDepth) / blockerDepth, texel);
+    float lit = 0.0;
+    for (int i = 0; i < 16; i++)
+    {
+        vec2 offset = rotation * poissonDisk[i] * penumbra;
+        lit += LitTap(fragToLight + tangent * offset.x + bitangent * offset.y, reference);
+    }
+    return 1.0 - lit / 16.0;
+}  
 
-vec3 PhongFunc(vec3 diffColor)
+// first index of the lights of the cluster of the fragment in clusterIndices, and their number
+int ClusterLights(out int count)
 {
-    vec3 color = Ka*ambientColor;
+    count = 0;
+    if (!clusteredLighting)
+        return 0;
+    // vViewPosition points from the fragment to the camera, so its z is the depth of the fragment
+    float depth = max(vViewPosition.z, 0.0001);
+    ivec3 cluster = ivec3(ivec2(gl_FragCoord.xy * clusterTileScale), int(log(depth) * clusterSliceScale + clusterSliceBias));
+    cluster = clamp(cluster, ivec3(0), clusterGrid - 1);
+    uvec2 list = texelFetch(clusterTable, (cluster.z * clusterGrid.y + cluster.y) * clusterGrid.x + cluster.x).rg;
+    count = int(list.y);
+    return int(list.x);
+}
 
-    vec3 normal = normalize(N);
-    
+// radiance of the clustered light at position index of clusterIndices, and the direction L to it (view space)
+vec3 ClusterLight(int index, out vec3 L)
+{
+    int light = int(texelFetch(clusterIndices, index).r);
+    vec4 positionRadius = texelFetch(clusterLights, 2 * light);
+    vec3 color = texelFetch(clusterLights, 2 * light + 1).rgb;
+    // the fragment is at -vViewPosition in view space
+    vec3 toLight = positionRadius.xyz + vViewPosition;
+    float distance = length(toLight);
+    L = toLight / max(distance, 0.0001);
+    // inverse square falloff, smoothly windowed to 0 at the radius of the light (so the light can't reach clusters it was not assigned to)
+    float window = clamp(1.0 - pow(distance / positionRadius.w, 4.0), 0.0, 1.0);
+    return color * window * window / (distance * distance + 1.0);
+}
 
-    vec3 L = normalize(lightDir);
+// diffuse and specular light of a single light with direction L (the ambient term is added once, by the functions below)
+vec3 LambertianLight(vec3 L, vec3 normal, vec3 diffColor)
+{
+    float lambertian = max(dot(L,normal), 0.0);
+    return vec3(Kd * lambertian * diffColor);
+}
 
+vec3 PhongLight(vec3 L, vec3 normal, vec3 V, vec3 diffColor)
+{
+    float lambertian = max(dot(L,normal), 0.0);
+    if (lambertian <= 0.0)
+        return vec3(0.0);
+
+    vec3 R = reflect(-L, normal);
+    float specAngle = max(dot(R, V), 0.0);
+    float specular = SpecularLobe(specAngle, brdfMode != BRDF_ANALYTIC);
+    if (brdfMode == BRDF_DIFFERENCE)
+        return vec3(abs(specular - SpecularLobe(specAngle, false)) * BRDF_DIFFERENCE_SCALE);
+    return vec3(Kd * lambertian * diffColor + Ks * specular * specularColor);
+}
 
+vec3 BlinnPhongLight(vec3 L, vec3 normal, vec3 V, vec3 diffColor)
+{
     float lambertian = max(dot(L,normal), 0.0);
+    if (lambertian <= 0.0)
+        return vec3(0.0);
+
+    vec3 H = normalize(L + V);
+    float specAngle = max(dot(H, normal), 0.0);
+    float specular = SpecularLobe(specAngle, brdfMode != BRDF_ANALYTIC);
+    if (brdfMode == BRDF_DIFFERENCE)
+        return vec3(abs(specular - SpecularLobe(specAngle, false)) * BRDF_DIFFERENCE_SCALE);
+    return vec3(Kd * lambertian * diffColor + Ks * specular * specularColor);
+}
 
-    if(lambertian > 0.0)
-    {
+vec3 GGXLight(vec3 L, vec3 normal, vec3 V, vec3 diffColor)
+{
+    float NdotL = max(dot(normal, L), 0.0);
+    if (NdotL <= 0.0)
+        return vec3(0.0);
 
-        vec3 V = normalize( vViewPosition );
+    vec3 lambert = (Kd*diffColor);
+    vec3 H = normalize(L + V);
 
-        vec3 R = reflect(-L, N);
+    float NdotH = max(dot(normal, H), 0.0);
+    float NdotV = max(dot(normal, V), 0.0);
+    float VdotH = max(dot(V, H), 0.0);
 
-       
-        float specAngle = max(dot(R, V), 0.0);
+    float specular = GGXSpecular(NdotL, NdotV, NdotH, VdotH, brdfMode != BRDF_ANALYTIC);
+    if (brdfMode == BRDF_DIFFERENCE)
+        return vec3(abs(specular - GGXSpecular(NdotL, NdotV, NdotH, VdotH, false)) * NdotL * BRDF_DIFFERENCE_SCALE);
 
-        float specular = pow(specAngle, shininess);
+    return (lambert + vec3(specular)) * NdotL;
+}
 
-     
-        color += vec3( Kd * lambertian * diffColor +
-                        Ks * specular * specularColor);
-    }
-    return color;
+// texture coordinates of the values x and y of the parameters of a table: the first and the last texels are centered on 0 and 1
+vec2 BRDFTableCoords(float x, float y)
+{
+    return (clamp(vec2(x, y), 0.0, 1.0) * (BRDF_TABLE_SIZE - 1.0) + 0.5) / BRDF_TABLE_SIZE;
 }
 
-vec3 BlinnPhongFunc(vec3 diffColor)
+float SpecularLobe(float cosine, bool table)
 {
-    vec3 color = Ka*ambientColor;
+    if (!table)
+        return pow(cosine, shininess);
+    float y = (shininess - BRDF_MIN_SHININESS) / (BRDF_MAX_SHININESS - BRDF_MIN_SHININESS);
+    return texture(brdfLobe, BRDFTableCoords(sqrt(1.0 - cosine), y)).g;
+}
 
+float GGXSpecular(float NdotL, float NdotV, float NdotH, float VdotH, bool table)
+{
+    if (table)
+    {
+        // D, and the visibility G2 / (4 NdotV NdotL) as the product of the two G1 / cosine
+        float D = texture(brdfLobe, BRDFTableCoords(sqrt(1.0 - NdotH), alpha)).r;
+        float visibility = texture(brdfGeometry, BRDFTableCoords(NdotV, alpha)).r * texture(brdfGeometry, BRDFTableCoords(NdotL, alpha)).r / 4.0;
+        float F = F0 + (1.0 - F0) * texture(brdfGeometry, BRDFTableCoords(VdotH, alpha)).g;
+        return F * visibility * D;
+    }
 
-    vec3 normal = normalize(N);
-    
-   
-    vec3 L = normalize(lightDir);
+    float alpha_Squared = alpha * alpha;
+    float NdotH_Squared = NdotH * NdotH;
 
+    float G2 = G1(NdotV, alpha)*G1(NdotL, alpha);
 
-    float lambertian = max(dot(L,normal), 0.0);
+    float D = alpha_Squared;
+    float denom = (NdotH_Squared*(alpha_Squared-1.0)+1.0);
+    D /= PI*denom*denom;
+
+    float F = pow(1.0 - VdotH, 5.0);
+    F *= (1.0 - F0);
+    F += F0;
+
+    return (F * G2 * D) / (4.0 * NdotV * NdotL);
+}
 
-    if(lambertian > 0.0)
+// the main light, plus the clustered point lights in clusterColor
+vec3 LambertianFunc(vec3 diffColor)
+{
+    vec3 normal = normalize(N);
+
+    int count;
+    int first = ClusterLights(count);
+    for (int i = first; i < first + count; i++)
     {
-        vec3 V = normalize( vViewPosition );
+        vec3 L;
+        vec3 radiance = ClusterLight(i, L);
+        clusterColor += radiance * LambertianLight(L, normal, diffColor);
+    }
 
-        vec3 H = normalize(L + V);
+    // Lambert illumination model
+    return LambertianLight(normalize(lightDir), normal, diffColor);
+}
 
+vec3 PhongFunc(vec3 diffColor)
+{
+    vec3 normal = normalize(N);
+    vec3 V = normalize( vViewPosition );
 
-        float specAngle = max(dot(H, N), 0.0);
+    int count;
+    int first = ClusterLights(count);
+    for (int i = first; i < first + count; i++)
+    {
+        vec3 L;
+        vec3 radiance = ClusterLight(i, L);
+        clusterColor += radiance * PhongLight(L, normal, V, diffColor);
+    }
 
-        float specular = pow(specAngle, shininess);
+    return Ka*ambientColor*AmbientOcclusion() + PhongLight(normalize(lightDir), normal, V, diffColor);
+}
 
-        color += vec3( Kd * lambertian * diffColor +
-                        Ks * specular * specularColor);
+vec3 BlinnPhongFunc(vec3 diffColor)
+{
+    vec3 normal = normalize(N);
+    vec3 V = normalize( vViewPosition );
+
+    int count;
+    int first = ClusterLights(count);
+    for (int i = first; i < first + count; i++)
+    {
+        vec3 L;
+        vec3 radiance = ClusterLight(i, L);
+        clusterColor += radiance * BlinnPhongLight(L, normal, V, diffColor);
     }
-    return color;
+
+    return Ka*ambientColor*AmbientOcclusion() + BlinnPhongLight(normalize(lightDir), normal, V, diffColor);
 }
 
 
@@ -448,59 +820,19 @@ float G1(float angle, float alpha)
 
 vec3 GGXFunc(vec3 diffColor)
 {
-    
     vec3 normal = normalize(N);
+    vec3 V = normalize( vViewPosition );
 
-
-    vec3 lambert = (Kd*diffColor);
-
-
-    vec3 color = vec3(0.0);
-
-
-    vec3 L = normalize(lightDir);
-
-
-    float NdotL = max(dot(normal, L), 0.0);
-
-
-    vec3 specular = vec3(0.0);
-
-
-    if(NdotL > 0.0)
+    int count;
+    int first = ClusterLights(count);
+    for (int i = first; i < first + count; i++)
     {
-
-        vec3 V = normalize( vViewPosition );
-
- 
-        vec3 H = normalize(L + V);
-
-
-        float NdotH = max(dot(N, H), 0.0);
-        float NdotV = max(dot(N, V), 0.0);
-        float VdotH = max(dot(V, H), 0.0);
-        float alpha_Squared = alpha * alpha;
-        float NdotH_Squared = NdotH * NdotH;
-
-
-        float G2 = G1(NdotV, alpha)*G1(NdotL, alpha);
-
-        float D = alpha_Squared;
-        float denom = (NdotH_Squared*(alpha_Squared-1.0)+1.0);
-        D /= PI*denom*denom;
-
-  
-        vec3 F = vec3(pow(1.0 - VdotH, 5.0));
-        F *= (1.0 - F0);
-        F += F0;
-
-
-        specular = (F * G2 * D) / (4.0 * NdotV * NdotL);
-
-
-        color += (lambert + specular) * NdotL;
+        vec3 L;
+        vec3 radiance = ClusterLight(i, L);
+        clusterColor += radiance * GGXLight(L, normal, V, diffColor);
     }
-    return color;
+
+    return GGXLight(normalize(lightDir), normal, V, diffColor);
 }
 
 
@@ -588,6 +920,13 @@ vec3 voronoiDiagram(vec3 p)
    
 }
 
+vec4 bakedVoronoi(vec2 position)
+{
+    vec4 texel = texture(noiseTexture, vec3(position / NOISE_CELLS, timer / NOISE_PERIOD));
+    // the distance is stored as its square root
+    return vec4(texel.rgb, texel.a * texel.a);
+}
+
 vec3 setColors(vec2 cell)
 {
     vec3 colors[16] = vec3[](vec3(11.0, 57.0, 84.0)/255.0, vec3(38.0, 84.0, 110.0)/255.0, vec3(182.0, 214.0, 204.0)/255.0, vec3(248.0, 156.0, 115.0)/255.0,
@@ -0,0 +1,8 @@
+// a triangle which covers the whole viewport, without vertex data: the vertices come from gl_VertexID
+#version 410 core
+
+void main()
+{
+    vec2 position = vec2((gl_VertexID & 1) * 4.0 - 1.0, (gl_VertexID & 2) * 2.0 - 1.0);
+    gl_Position = vec4(position, 0.0, 1.0);
+}
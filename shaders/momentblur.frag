@@ -0,0 +1,29 @@
+// second pass of the moment shadow maps (see momentshadows.h): the moments blurred along the rows by the first pass
+// are blurred along the columns, and written in the face of the moment cubemap
+#version 410 core
+
+// the moments of the six faces, one layer for each face
+uniform sampler2DArray source;
+uniform int face;
+uniform int radius;
+
+out vec2 moments;
+
+void main()
+{
+    ivec2 texel = ivec2(gl_FragCoord.xy);
+    int size = textureSize(source, 0).y;
+
+    // the same gaussian weights of the first pass
+    float sigma = max(float(radius) * 0.5, 0.5);
+    vec2 sum = vec2(0.0);
+    float weights = 0.0;
+    for (int i = -radius; i <= radius; i++)
+    {
+        int y = clamp(texel.y + i, 0, size - 1);
+        float weight = exp(-float(i * i) / (2.0 * sigma * sigma));
+        sum += weight * texelFetch(source, ivec3(texel.x, y, face), 0).rg;
+        weights += weight;
+    }
+    moments = sum / weights;
+}
@@ -0,0 +1,31 @@
+#version 410 core
+// the layer can be written from the vertex shader only with one of these extensions:
+// if they are not supported, the macros below are not defined and the cube face is chosen with the framebuffer
+#extension GL_ARB_shader_viewport_layer_array : enable
+#extension GL_AMD_vertex_shader_layer : enable
+
+// shadow casters rendered only in the faces of the cubemap they overlap (no geometry shader):
+// the casters are always submitted with the draw list, so the model matrix is an instance attribute
+layout (location = 0) in vec3 position;
+layout (location = 5) in mat4 instanceModelMatrix;
+// in the layered mode, x is the cube face of the instance
+layout (location = 12) in vec2 instanceTexParams;
+
+uniform mat4 shadowMatrices[6];
+// if true, each instance is rendered in its own face (gl_Layer), otherwise in the face bound to the framebuffer
+uniform bool layered;
+uniform int shadowFace;
+// first layer of the cubemap in the cube map array of the shadow pool (6 * slot)
+uniform int layerBase;
+
+out vec4 FragPos;
+
+void main()
+{
+    int face = layered ? int(instanceTexParams.x) : shadowFace;
+    FragPos = instanceModelMatrix * vec4(position, 1.0f);
+    gl_Position = shadowMatrices[face] * FragPos;
+#if defined(GL_ARB_shader_viewport_layer_array) || defined(GL_AMD_vertex_shader_layer)
+    gl_Layer = layerBase + face;
+#endif
+}
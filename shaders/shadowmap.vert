@@ -2,10 +2,13 @@
 
 
 layout (location = 0) in vec3 position;
+// per-instance model matrix, used only if instanced is true
+layout (location = 5) in mat4 instanceModelMatrix;
 
 uniform mat4 modelMatrix;
+uniform bool instanced;
 
 void main()
 {
-    gl_Position = modelMatrix * vec4(position, 1.0f);
+    gl_Position = (instanced ? instanceModelMatrix : modelMatrix) * vec4(position, 1.0f);
 }
@@ -0,0 +1,52 @@
+// first pass of the moment shadow maps (see momentshadows.h): the distance stored in a face of the depth cubemap
+// is converted to moments (d, d * d), blurred along the rows of the face
+#version 410 core
+
+// the depth cubemap (and the static one, if the casters are split), with the distance from the light divided by far_plane
+uniform samplerCubeArray shadowMap;
+uniform float shadowLayer;
+uniform bool staticShadows;
+uniform samplerCubeArray staticShadowMap;
+uniform float staticShadowLayer;
+
+// face we are computing, its size in texels and the radius of the blur in texels
+uniform int face;
+uniform float size;
+uniform int radius;
+
+out vec2 moments;
+
+// direction of the point (s, t) of a face of the cubemap, both in [-1, 1] (the inverse of the selection of the face in the OpenGL specification)
+vec3 FaceDirection(int face, float s, float t)
+{
+    if (face == 0) return vec3(1.0, -t, -s);
+    if (face == 1) return vec3(-1.0, -t, s);
+    if (face == 2) return vec3(s, 1.0, t);
+    if (face == 3) return vec3(s, -1.0, -t);
+    if (face == 4) return vec3(s, -t, 1.0);
+    return vec3(-s, -t, -1.0);
+}
+
+void main()
+{
+    // the texel (x, y) of the face is at the window position (x, y) of the viewport
+    vec2 st = gl_FragCoord.xy / size * 2.0 - 1.0;
+    float texel = 2.0 / size;
+
+    // gaussian weights, with the kernel covering about 2 standard deviations on each side
+    float sigma = max(float(radius) * 0.5, 0.5);
+    vec2 sum = vec2(0.0);
+    float weights = 0.0;
+    for (int i = -radius; i <= radius; i++)
+    {
+        // the taps are clamped to the face (the blur does not cross the edges)
+        vec3 direction = FaceDirection(face, clamp(st.x + float(i) * texel, -1.0, 1.0), st.y);
+        float depth = texture(shadowMap, vec4(direction, shadowLayer)).r;
+        if (staticShadows)
+            depth = min(depth, texture(staticShadowMap, vec4(direction, staticShadowLayer)).r);
+        float weight = exp(-float(i * i) / (2.0 * sigma * sigma));
+        sum += weight * vec2(depth, depth * depth);
+        weights += weight;
+    }
+    moments = sum / weights;
+}
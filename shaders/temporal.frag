@@ -0,0 +1,79 @@
+// temporal upsampling (see the dynamic resolution in RTGPProject.cpp): the scene is rendered at a lower resolution,
+// with a different sub-pixel jitter of the projection in each frame, and each frame adds its samples to a history
+// at the resolution of the window. The history is reprojected with the motion vectors of the camera,
+// and clamped to the colors of the current neighbourhood, so the pixels which were hidden in the last frame do not leave ghosts
+#version 410 core
+
+// the scene at the render resolution: HDR color, with the linear depth of the surfaces in the alpha, and depth buffer.
+// In the pixels of a portal the depth buffer holds the portal quad (drawn again after the content): the motion vectors
+// use the alpha, which keeps the depth of what is seen through the portal. The depth buffer only tells the empty pixels
+uniform sampler2D currentColor;
+uniform sampler2D currentDepth;
+// [2][2] and [3][2] of the projection (without the jitter), to convert a linear depth to NDC
+uniform vec2 depthProjection;
+// the history of the last frame, at the output resolution (not valid in the first frame, or after a resize)
+uniform sampler2D history;
+uniform bool historyValid;
+// jitter of this frame, in pixels of the render resolution
+uniform vec2 jitter;
+// from the clip coordinates of this frame (without the jitter) to the ones of the last frame
+uniform mat4 reprojection;
+// fraction of the history replaced by a sample which falls on the center of the output pixel
+uniform float blendFactor;
+
+out vec4 color;
+
+// the colors are weighted by their tonemapped brightness, so a single very bright sample does not flicker in the history
+float Weight(vec3 c)
+{
+    return 1.0 / (1.0 + dot(c, vec3(0.2126, 0.7152, 0.0722)));
+}
+
+void main()
+{
+    vec2 outputSize = vec2(textureSize(history, 0));
+    vec2 renderSize = vec2(textureSize(currentColor, 0));
+    vec2 uv = gl_FragCoord.xy / outputSize;
+
+    // the render pixel whose jittered sample is the closest to the center of this pixel:
+    // the jitter moves the image by +jitter, so the sample of pixel p covers the point p + 0.5 - jitter
+    vec2 renderPos = uv * renderSize;
+    ivec2 center = ivec2(floor(renderPos + jitter));
+    ivec2 maxTexel = ivec2(renderSize) - 1;
+    vec2 sampleOffset = renderPos - (vec2(center) + 0.5 - jitter);
+
+    // the neighbourhood of the sample: range of its colors, and the closest depth (the motion vector
+    // of the closest surface keeps the edges of the objects in front sharp when the camera moves)
+    vec3 current = vec3(0.0);
+    vec3 minColor = vec3(1e9);
+    vec3 maxColor = vec3(-1e9);
+    float closestDepth = 1.0;
+    for (int y = -1; y <= 1; y++)
+        for (int x = -1; x <= 1; x++)
+        {
+            ivec2 texel = clamp(center + ivec2(x, y), ivec2(0), maxTexel);
+            vec4 c = texelFetch(currentColor, texel, 0);
+            if (x == 0 && y == 0)
+                current = c.rgb;
+            minColor = min(minColor, c.rgb);
+            maxColor = max(maxColor, c.rgb);
+            // NDC depth of the surface (the far plane in the empty pixels)
+            float depth = texelFetch(currentDepth, texel, 0).r < 1.0 ? depthProjection.y / c.a - depthProjection.x : 1.0;
+            closestDepth = min(closestDepth, depth);
+        }
+
+    // motion vector: the position of this pixel in the last frame
+    vec4 previous = reprojection * vec4(uv * 2.0 - 1.0, closestDepth, 1.0);
+    vec2 previousUV = previous.xy / previous.w * 0.5 + 0.5;
+    if (!historyValid || any(lessThan(previousUV, vec2(0.0))) || any(greaterThan(previousUV, vec2(1.0))))
+    {
+        color = vec4(current, 1.0);
+        return;
+    }
+    vec3 past = clamp(texture(history, previousUV).rgb, minColor, maxColor);
+
+    // a sample far from the center of the pixel contributes less: with the jitter, the samples of a few frames cover the whole pixel
+    float currentWeight = blendFactor * exp(-2.29 * dot(sampleOffset, sampleOffset)) * Weight(current);
+    float pastWeight = (1.0 - blendFactor) * Weight(past);
+    color = vec4((current * currentWeight + past * pastWeight) / (currentWeight + pastWeight), 1.0);
+}
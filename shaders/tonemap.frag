@@ -0,0 +1,37 @@
+// last pass of the frame (see the post processing in RTGPProject.cpp): the bloom is mixed with the HDR image,
+// and the result is mapped to the range of the screen
+#version 410 core
+
+uniform sampler2D hdrColor;
+// the size of the texels of the screen
+uniform vec2 targetTexelSize;
+// the biggest level of the bloom chain (half resolution), the number of levels added in it, and its fraction in the final image
+uniform sampler2D bloom;
+uniform float bloomLevels;
+uniform float bloomStrength;
+uniform float exposure;
+// 0 = clamp, 1 = Reinhard, 2 = ACES (fitted curve of Narkowicz)
+uniform int tonemapper;
+
+out vec4 colorFrag;
+
+vec3 ACESFilm(vec3 x)
+{
+    return clamp((x * (2.51 * x + 0.03)) / (x * (2.43 * x + 0.59) + 0.14), 0.0, 1.0);
+}
+
+void main()
+{
+    // the HDR image can be smaller than the screen (dynamic resolution without temporal upsampling): it is filtered bilinearly
+    vec2 uv = gl_FragCoord.xy * targetTexelSize;
+    vec3 hdr = texture(hdrColor, uv).rgb;
+    // the upsampling adds all the levels of the chain, each one with the energy of the image: we take their average,
+    // so the bloom replaces a fraction of the image, and the energy of the frame does not grow
+    vec3 color = mix(hdr, texture(bloom, uv).rgb / bloomLevels, bloomStrength) * exposure;
+
+    if (tonemapper == 1)
+        color = color / (1.0 + color);
+    else if (tonemapper == 2)
+        color = ACESFilm(color);
+    colorFrag = vec4(clamp(color, 0.0, 1.0), 1.0);
+}
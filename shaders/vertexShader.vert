@@ -7,12 +7,25 @@ layout (location = 1) in vec3 normal;
 
 layout (location = 2) in vec2 UV;
 
+// per-instance data, used only if instanced is true (see InstanceData in mesh.h)
+layout (location = 5) in mat4 instanceModelMatrix;
+layout (location = 9) in mat3 instanceNormalMatrix;
+layout (location = 12) in vec2 instanceTexParams;
+// baked ambient occlusion of the vertex (see include/utils/aobaker.h): 1 for the meshes without it
+layout (location = 13) in float occlusion;
+
 uniform vec3 lightPos;
 uniform mat4 modelMatrix;
 uniform mat4 viewMatrix;
 uniform mat4 projectionMatrix;
 uniform mat3 normalMatrix;
 
+// if true, the model matrix, the normal matrix and the texture parameters are read from the instance attributes
+uniform bool instanced;
+// layer of the enviroment texture array and repetition of the UV coordinates, for the non-instanced draws
+uniform float texLayer;
+uniform float texRep;
+
 out vec3 lPos;
 out vec4 lPosScreen;
 out vec3 lightDir;
@@ -21,16 +34,35 @@ out vec3 N;
 out vec3 vViewPosition;
 out vec4 screenPos;
 out vec4 posInWorldCoords;
+flat out float interp_TexLayer;
+flat out float interp_TexRep;
+out float interp_Occlusion;
 
 // set up a bunch of information for the different fragment shader subroutines 
 void main() 
 {
     interp_UV = UV;
-    N = normalize(normalMatrix * normal); 
+    interp_Occlusion = occlusion;
+
+    mat4 model = modelMatrix;
+    if (instanced)
+    {
+        model = instanceModelMatrix;
+        // the instance normal matrix is in world coordinates, the view matrix is a rigid transformation so we can apply its rotation directly
+        N = normalize(mat3(viewMatrix) * instanceNormalMatrix * normal);
+        interp_TexLayer = instanceTexParams.x;
+        interp_TexRep = instanceTexParams.y;
+    }
+    else
+    {
+        N = normalize(normalMatrix * normal); 
+        interp_TexLayer = texLayer;
+        interp_TexRep = texRep;
+    }
 
-    posInWorldCoords = modelMatrix * vec4(position, 1.0f);
+    posInWorldCoords = model * vec4(position, 1.0f);
 
-    vec4 posInViewCoords = viewMatrix * modelMatrix * vec4(position, 1.0f);
+    vec4 posInViewCoords = viewMatrix * posInWorldCoords;
 
     lPos = lightPos;
 